@@ -0,0 +1,248 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <check.h>
+
+#include "tls.c"
+
+static char key_file[] = "/tmp/check_tls_key.XXXXXX";
+static char cert_file[] = "/tmp/check_tls_cert.XXXXXX";
+
+static struct log_context_t test_log;
+static tls_server_ctx_t * server_ctx;
+static buffer_pool_t read_buffers;
+
+static tls_client_ctx_t * server;
+static SSL_CTX * peer_ctx;
+static SSL * peer;
+// ciphertext written by the server, read by the peer
+static BIO * from_server;
+// ciphertext written by the peer
+static BIO * to_server;
+
+static size_t octets_from_server;
+static char app_data[64];
+static size_t app_data_length;
+
+static bool write_to_network(void * data, uint8_t * buf, size_t length)
+{
+  UNUSED(data);
+
+  octets_from_server += length;
+  return BIO_write(from_server, buf, length) == (int) length;
+}
+
+static bool write_to_app(void * data, uint8_t * buf, size_t length)
+{
+  UNUSED(data);
+
+  ck_assert_uint_le(app_data_length + length, sizeof(app_data));
+  memcpy(app_data + app_data_length, buf, length);
+  app_data_length += length;
+  return true;
+}
+
+/**
+ * Writes a self signed certificate and its key to key_file and cert_file
+ */
+static bool write_certificate()
+{
+  EVP_PKEY * key = NULL;
+  EVP_PKEY_CTX * key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  bool success = key_ctx && EVP_PKEY_keygen_init(key_ctx) == 1 &&
+                 EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1) == 1 &&
+                 EVP_PKEY_keygen(key_ctx, &key) == 1;
+  EVP_PKEY_CTX_free(key_ctx);
+
+  X509 * cert = success ? X509_new() : NULL;
+
+  if (cert) {
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_NAME * name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_set_pubkey(cert, key);
+    success = X509_sign(cert, key, EVP_sha256()) > 0;
+  }
+
+  FILE * f = success ? fdopen(mkstemp(key_file), "w") : NULL;
+  success = f && PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL) == 1;
+  if (f) {
+    fclose(f);
+  }
+
+  f = success ? fdopen(mkstemp(cert_file), "w") : NULL;
+  success = f && PEM_write_X509(f, cert) == 1;
+  if (f) {
+    fclose(f);
+  }
+
+  X509_free(cert);
+  EVP_PKEY_free(key);
+
+  return success;
+}
+
+/**
+ * Passes everything the peer has written on to the server
+ */
+static bool peer_send()
+{
+  uint8_t buf[16384];
+  int length;
+
+  while ((length = BIO_read(to_server, buf, sizeof buf)) > 0) {
+    if (!tls_decrypt_data_and_pass_to_app(server, buf, length)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void handshake(int max_version)
+{
+  ck_assert_int_eq(1, SSL_set_max_proto_version(peer, max_version));
+
+  for (size_t i = 0; i < 4 && !(SSL_is_init_finished(peer) && server->handshake_complete); i++) {
+    SSL_do_handshake(peer);
+    ck_assert(peer_send());
+  }
+
+  ck_assert(SSL_is_init_finished(peer));
+  ck_assert(server->handshake_complete);
+}
+
+/**
+ * The kernel can't be given the keys here, so the server is only told that
+ * it has been - which is all tls.c sees of it
+ */
+static void fake_ktls()
+{
+  server->ktls_attempted = true;
+  server->ktls_tx = true;
+  octets_from_server = 0;
+}
+
+static void setup()
+{
+  server = tls_client_init(server_ctx, &read_buffers, NULL, write_to_network, write_to_app);
+  ck_assert(server != NULL);
+
+  peer_ctx = SSL_CTX_new(TLS_client_method());
+  peer = SSL_new(peer_ctx);
+  from_server = BIO_new(BIO_s_mem());
+  to_server = BIO_new(BIO_s_mem());
+  SSL_set_bio(peer, from_server, to_server);
+  SSL_set_connect_state(peer);
+
+  octets_from_server = 0;
+  app_data_length = 0;
+}
+
+static void teardown()
+{
+  tls_client_free(server);
+  // frees the BIOs too
+  SSL_free(peer);
+  SSL_CTX_free(peer_ctx);
+}
+
+START_TEST(test_tls_key_update_answered)
+{
+  handshake(TLS1_3_VERSION);
+
+  ck_assert_int_eq(1, SSL_key_update(peer, SSL_KEY_UPDATE_REQUESTED));
+  ck_assert_int_eq(5, SSL_write(peer, "hello", 5));
+  ck_assert(peer_send());
+  ck_assert_uint_eq(5, app_data_length);
+
+  // openssl answers with a key update of its own on the next write
+  ck_assert(tls_encrypt_data_and_pass_to_network(server, (uint8_t *) "world", 5));
+  ck_assert_uint_gt(octets_from_server, 0);
+
+  char buf[5];
+  ck_assert_int_eq(5, SSL_read(peer, buf, sizeof buf));
+  ck_assert(memcmp(buf, "world", 5) == 0);
+}
+END_TEST
+
+START_TEST(test_tls_ktls_key_update_unanswered)
+{
+  handshake(TLS1_3_VERSION);
+  fake_ktls();
+
+  // the server's answer would be written by openssl with a write key the
+  // kernel has moved on from, so it never sends one - the peer keeps using
+  // the old key to read, and the connection carries on
+  ck_assert_int_eq(1, SSL_key_update(peer, SSL_KEY_UPDATE_REQUESTED));
+  ck_assert_int_eq(5, SSL_write(peer, "hello", 5));
+  ck_assert(peer_send());
+  ck_assert_uint_eq(5, app_data_length);
+  ck_assert(memcmp(app_data, "hello", 5) == 0);
+
+  ck_assert_int_eq(5, SSL_write(peer, "again", 5));
+  ck_assert(peer_send());
+  ck_assert_uint_eq(10, app_data_length);
+
+  ck_assert_uint_eq(0, octets_from_server);
+}
+END_TEST
+
+START_TEST(test_tls_ktls_renegotiation_disconnects)
+{
+  handshake(TLS1_2_VERSION);
+  fake_ktls();
+
+  // the server's handshake messages can't be sent once the kernel encrypts
+  ck_assert_int_eq(1, SSL_renegotiate(peer));
+  SSL_do_handshake(peer);
+  ck_assert(!peer_send());
+
+  ck_assert_uint_eq(0, octets_from_server);
+}
+END_TEST
+
+Suite * suite()
+{
+  Suite * s = suite_create("tls");
+
+  TCase * tc = tcase_create("post-handshake records");
+  tcase_add_checked_fixture(tc, setup, teardown);
+
+  tcase_add_test(tc, test_tls_key_update_answered);
+  tcase_add_test(tc, test_tls_ktls_key_update_unanswered);
+  tcase_add_test(tc, test_tls_ktls_renegotiation_disconnects);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main()
+{
+  // shared by the tests
+  log_context_init(&test_log, "check_tls", stderr, LOG_FATAL, true);
+  if (!write_certificate() || !tls_init("h2") || !(server_ctx = tls_server_init(&test_log, key_file, cert_file))) {
+    fprintf(stderr, "Unable to create the server's certificate\n");
+    return EXIT_FAILURE;
+  }
+  buffer_pool_init(&read_buffers, 0x4000, 4);
+
+  Suite * s = suite();
+  SRunner * sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  tls_server_free(server_ctx);
+  buffer_pool_free(&read_buffers);
+  unlink(key_file);
+  unlink(cert_file);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
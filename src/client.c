@@ -10,23 +10,50 @@
 
 #include "client.h"
 
+// workers on different threads share these counters
+static uv_once_t client_counters_once = UV_ONCE_INIT;
+static uv_mutex_t client_counters_mutex;
 static long open_clients = 0;
 static long total_clients = 0;
 
+static void client_counters_init(void)
+{
+  if (uv_mutex_init(&client_counters_mutex)) {
+    abort();
+  }
+}
+
 bool client_init(struct client_t * client, struct worker_t * worker)
 {
+  uv_once(&client_counters_once, client_counters_init);
+
+  uv_mutex_lock(&client_counters_mutex);
   open_clients++;
   total_clients++;
-
   client->id = total_clients;
+  long open = open_clients;
+  long total = total_clients;
+  uv_mutex_unlock(&client_counters_mutex);
+
   log_append(worker->log, LOG_DEBUG, "Initializing client %zu", client->id);
   client->log = worker->log;
   client->data_log = worker->data_log;
   client->selected_protocol = false;
   client->closing = false;
   client->closed = false;
+  client->shutting_down = false;
   client->eof = false;
   client->pending_writes = 0;
+  client->queued_write = NULL;
+  client->file_write = NULL;
+  client->held_writes = NULL;
+  client->shutdown_deferred = false;
+  client->write_paused = false;
+  client->plugin_octets = 0;
+  client->memory_used = 0;
+  client->memory_limited = false;
+  client->reading_stopped = false;
+  client->timed_out = false;
   client->tls_ctx = NULL;
 
   client->plugin_invoker = malloc(sizeof(struct plugin_invoker_t));
@@ -39,7 +66,7 @@ bool client_init(struct client_t * client, struct worker_t * worker)
   client->worker = worker;
 
   log_append(client->log, LOG_DEBUG, "Initialized client %zu (%ld/%ld left)",
-      client->id, open_clients, total_clients);
+      client->id, open, total);
 
   return true;
 }
@@ -53,8 +80,13 @@ bool client_free(struct client_t * client)
 
   http_connection_free(client->connection);
 
+  uv_mutex_lock(&client_counters_mutex);
   open_clients--;
-  log_append(client->log, LOG_DEBUG, "Freed client %zu (%ld/%ld left)", client->id, open_clients, total_clients);
+  long open = open_clients;
+  long total = total_clients;
+  uv_mutex_unlock(&client_counters_mutex);
+
+  log_append(client->log, LOG_DEBUG, "Freed client %zu (%ld/%ld left)", client->id, open, total);
 
   free(client->plugin_invoker);
   free(client);
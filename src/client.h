@@ -37,8 +37,35 @@ struct client_t {
 
   size_t id;
   bool closed;
+  // set once worker_close has started shutting the connection down
+  bool shutting_down;
   uv_shutdown_t shutdown_req;
   size_t pending_writes;
+  // output that has not been handed to libuv yet
+  struct worker_write_t * queued_write;
+  // the write whose file is being sent, and the writes that have to wait
+  // for it to finish (in order)
+  struct worker_write_t * file_write;
+  struct worker_write_t * held_writes;
+  // the shutdown waits for the file too
+  bool shutdown_deferred;
+  // set between crossing the high and low write watermarks
+  bool write_paused;
+
+  // octets plugins are holding on to for the client
+  size_t plugin_octets;
+  // everything the client was holding at the last memory check
+  size_t memory_used;
+  // set while over the connection or worker memory budget
+  bool memory_limited;
+  bool reading_stopped;
+
+  // pushed back whenever anything is read or written
+  timer_wheel_timer_t idle_timer;
+  // started when part of a request (or the TLS handshake) has been read and
+  // not pushed back until the rest arrives
+  timer_wheel_timer_t header_timer;
+  bool timed_out;
 
   bool selected_protocol;
 
@@ -240,6 +240,7 @@ h1_1_t * h1_1_init(void * const data, struct log_context_t * log, bool use_tls,
 
   h1_1->plugin_invoker = plugin_invoker;
   h1_1->writer = writer;
+  h1_1->file_writer = NULL;
   h1_1->error_writer = error_writer;
   h1_1->closer = closer;
   h1_1->request_init = request_init;
@@ -252,6 +253,7 @@ h1_1_t * h1_1_init(void * const data, struct log_context_t * log, bool use_tls,
   h1_1->upgrade_to_h2 = false;
   h1_1->is_1_1 = true;
   h1_1->keep_alive = false;
+  h1_1->early_data = false;
 
   h1_1->write_buffer = binary_buffer_init(NULL, 0);
   h1_1->request = NULL;
@@ -312,8 +314,12 @@ static void h1_1_close(h1_1_t * const h1_1)
 void h1_1_finished_writes(h1_1_t * const h1_1)
 {
   log_append(h1_1->log, LOG_TRACE, "Finished write");
-  h1_1->pending_writes--;
-  if (h1_1->pending_writes == 0) {
+
+  // called once all of the connection's writes have finished, however many
+  // there were
+  h1_1->pending_writes = 0;
+
+  if (!h1_1->keep_alive && !h1_1->response) {
     h1_1_close(h1_1);
   }
 }
@@ -481,6 +487,14 @@ static int hp_headers_complete_cb(http_parser * http_parser)
     return 1; // error
   }
 
+  if (h1_1->early_data && http_parser->method != HTTP_GET && http_parser->method != HTTP_HEAD) {
+    // the client retries once the handshake is complete - the body is
+    // read and dropped
+    log_append(h1_1->log, LOG_DEBUG, "Rejecting %s request sent in early data", method_str);
+    h1_1->error_writer(h1_1, h1_1->response, 425);
+    return 0;
+  }
+
   if (!plugin_invoke(h1_1->plugin_invoker, HANDLE_REQUEST, h1_1->request, h1_1->response)) {
     http_response_free(h1_1->response);
     h1_1->response = NULL;
@@ -502,8 +516,11 @@ static int hp_body_cb(http_parser * http_parser, const char * at, size_t length)
     return 0;
   }
 
-  plugin_invoke(h1_1->plugin_invoker, HANDLE_DATA, h1_1->request, h1_1->response,
-                (uint8_t *) at, length, false, false);
+  // the request may have already been answered
+  if (h1_1->request) {
+    plugin_invoke(h1_1->plugin_invoker, HANDLE_DATA, h1_1->request, h1_1->response,
+                  (uint8_t *) at, length, false, false);
+  }
 
   return 0;
 }
@@ -566,15 +583,23 @@ static void h1_1_parse(h1_1_t * const h1_1, uint8_t * const buffer, const size_t
   }
 }
 
+void h1_1_set_early_data(h1_1_t * const h1_1, bool early_data)
+{
+  h1_1->early_data = early_data;
+}
+
+void h1_1_set_file_writer(h1_1_t * const h1_1, const h1_1_write_file_cb file_writer)
+{
+  h1_1->file_writer = file_writer;
+}
+
 /**
- * Reads the given buffer and acts on it. Caller must give up ownership of the
- * buffer.
+ * Reads the given buffer and acts on it. The buffer is only borrowed for the
+ * duration of the call.
  */
 void h1_1_read(h1_1_t * const h1_1, uint8_t * const buffer, const size_t len)
 {
   h1_1_parse(h1_1, buffer, len);
-
-  free(buffer);
 }
 
 void h1_1_eof(h1_1_t * const h1_1)
@@ -600,8 +625,12 @@ static void finish_response(h1_1_t * h1_1)
   h1_1->headers = NULL;
 }
 
-bool h1_1_response_write(h1_1_t * h1_1, http_response_t * const response, uint8_t * data, const size_t data_length,
-                         bool last)
+/**
+ * Writes the response without taking ownership of data - it's copied into the
+ * write buffer or written before this returns
+ */
+static bool h1_1_write_response(h1_1_t * h1_1, http_response_t * const response, uint8_t * data,
+                                const size_t data_length, bool last)
 {
   binary_buffer_reset(h1_1->write_buffer, 0);
 
@@ -637,7 +666,6 @@ bool h1_1_response_write(h1_1_t * h1_1, http_response_t * const response, uint8_
 
   if (data) {
     binary_buffer_write(h1_1->write_buffer, data, data_length);
-    free(data);
   }
 
   if (last) {
@@ -648,8 +676,8 @@ bool h1_1_response_write(h1_1_t * h1_1, http_response_t * const response, uint8_
   return true;
 }
 
-bool h1_1_response_write_data(h1_1_t * h1_1, http_response_t * const response, uint8_t * data, const size_t data_length,
-                              bool last)
+static bool h1_1_write_response_data(h1_1_t * h1_1, http_response_t * const response, uint8_t * data,
+                                     const size_t data_length, bool last)
 {
   if (data) {
     h1_1->pending_writes++;
@@ -662,8 +690,6 @@ bool h1_1_response_write_data(h1_1_t * h1_1, http_response_t * const response, u
     } else {
       h1_1->writer(h1_1->data, data, data_length);
     }
-
-    free(data);
   }
 
   UNUSED(response);
@@ -675,6 +701,62 @@ bool h1_1_response_write_data(h1_1_t * h1_1, http_response_t * const response, u
   return true;
 }
 
+bool h1_1_response_write(h1_1_t * h1_1, http_response_t * const response, uint8_t * data, const size_t data_length,
+                         bool last)
+{
+  bool success = h1_1_write_response(h1_1, response, data, data_length, last);
+  free(data);
+
+  return success;
+}
+
+bool h1_1_response_write_data(h1_1_t * h1_1, http_response_t * const response, uint8_t * data, const size_t data_length,
+                              bool last)
+{
+  bool success = h1_1_write_response_data(h1_1, response, data, data_length, last);
+  free(data);
+
+  return success;
+}
+
+bool h1_1_response_write_buffer(h1_1_t * h1_1, http_response_t * const response,
+                                const shared_buffer_slice_t * const slice, bool last)
+{
+  uint8_t * data = slice ? shared_buffer_slice_data(slice) : NULL;
+
+  return h1_1_write_response(h1_1, response, data, slice ? slice->length : 0, last);
+}
+
+bool h1_1_response_write_data_buffer(h1_1_t * h1_1, http_response_t * const response,
+                                     const shared_buffer_slice_t * const slice, bool last)
+{
+  uint8_t * data = slice ? shared_buffer_slice_data(slice) : NULL;
+
+  return h1_1_write_response_data(h1_1, response, data, slice ? slice->length : 0, last);
+}
+
+bool h1_1_response_write_file(h1_1_t * h1_1, http_response_t * const response, int fd, int64_t offset,
+                              size_t length, bool last, h1_1_release_cb release, void * release_data)
+{
+  h1_1->pending_writes++;
+
+  // the headers are held until the first body write
+  if (binary_buffer_size(h1_1->write_buffer) > 0) {
+    h1_1->writer(h1_1->data, binary_buffer_start(h1_1->write_buffer), binary_buffer_size(h1_1->write_buffer));
+    binary_buffer_reset(h1_1->write_buffer, 0);
+  }
+
+  bool success = h1_1->file_writer(h1_1->data, fd, offset, length, release, release_data);
+
+  UNUSED(response);
+
+  if (last) {
+    finish_response(h1_1);
+  }
+
+  return success;
+}
+
 http_request_t * h1_1_push_init(h1_1_t * h1_1, http_request_t * const original_request)
 {
   UNUSED(h1_1);
@@ -7,11 +7,20 @@
 #include "http/response.h"
 
 #include "plugin_callbacks.h"
+#include "shared_buffer.h"
 
 #include "http_parser.h"
 
 typedef bool (*h1_1_write_cb)(void * data, uint8_t * buf, size_t len);
 
+typedef void (*h1_1_release_cb)(void * data);
+
+/**
+ * Writes part of a file without reading it into userspace - see write_file_cb
+ */
+typedef bool (*h1_1_write_file_cb)(void * data, int fd, int64_t offset, size_t length, h1_1_release_cb release,
+                                   void * release_data);
+
 typedef bool (*h1_1_write_error_cb)(void * data, http_response_t * response, int http_status);
 
 typedef void (*h1_1_close_cb)(void * data);
@@ -32,6 +41,8 @@ typedef struct {
   int port;
 
   h1_1_write_cb writer;
+  // NULL unless files can be sent as they are
+  h1_1_write_file_cb file_writer;
   h1_1_write_error_cb error_writer;
   h1_1_close_cb closer;
   struct plugin_invoker_t * plugin_invoker;
@@ -54,6 +65,9 @@ typedef struct {
 
   bool keep_alive;
 
+  // set while the data being read is TLS early data
+  bool early_data;
+
   /**
    * Current request data
    */
@@ -99,12 +113,38 @@ void h1_1_shutdown(h1_1_t * const h1_1);
 
 void h1_1_finished_writes(h1_1_t * const h1_1);
 
+/**
+ * Requests other than GET and HEAD that are read while early_data is set get
+ * a 425 (Too Early) response. Their body is dropped and the connection stays
+ * open, so the client can retry once the handshake is complete.
+ */
+void h1_1_set_early_data(h1_1_t * const h1_1, bool early_data);
+
+void h1_1_set_file_writer(h1_1_t * const h1_1, const h1_1_write_file_cb file_writer);
+
 bool h1_1_response_write(h1_1_t * h1_1, http_response_t * const response, uint8_t * data, const size_t data_length,
                          bool last);
 
 bool h1_1_response_write_data(h1_1_t * h1_1, http_response_t * const response, uint8_t * data, const size_t data_length,
                               bool last);
 
+/**
+ * The buffer is borrowed: its bytes are written (or copied) before these
+ * return, so no reference is kept. slice may be NULL if there is no data.
+ */
+bool h1_1_response_write_buffer(h1_1_t * h1_1, http_response_t * const response,
+                                const shared_buffer_slice_t * const slice, bool last);
+
+bool h1_1_response_write_data_buffer(h1_1_t * h1_1, http_response_t * const response,
+                                     const shared_buffer_slice_t * const slice, bool last);
+
+/**
+ * Sends the response headers, if they haven't been yet, followed by part of
+ * the file fd. The file is released once it has been sent.
+ */
+bool h1_1_response_write_file(h1_1_t * h1_1, http_response_t * const response, int fd, int64_t offset,
+                              size_t length, bool last, h1_1_release_cb release, void * release_data);
+
 http_request_t * h1_1_push_init(h1_1_t * h1_1, http_request_t * const request);
 
 bool h1_1_push_promise(h1_1_t * h1_1, http_request_t * const request);
@@ -11,6 +11,8 @@
 #include "plugin.c"
 #include "h2_error.c"
 #include "h2_frame.c"
+#include "h2_priority.c"
+#include "h2_stream_table.c"
 
 #include "../request.c"
 #include "../response.c"
@@ -24,6 +26,19 @@
 
 #define MAX_TEST_FILES 1024
 
+// requests sent on one connection by the soak test - build with e.g.
+// -DSOAK_REQUESTS=1000000 for a longer run
+#ifndef SOAK_REQUESTS
+  #define SOAK_REQUESTS 10000
+#endif
+
+// the memory used is compared with the first request's this many times
+// during the soak test
+#define SOAK_CHECKPOINTS 10
+
+// seconds - a million requests take ~25s under address sanitizer
+#define SOAK_TIMEOUT (10 + SOAK_REQUESTS / 10000)
+
 static size_t num_test_files;
 static char * test_files[MAX_TEST_FILES];
 
@@ -57,6 +72,7 @@ static h2_t * server_h2;
 
 static bool write_called;
 static bool close_called;
+static timer_wheel_t timers;
 
 bool h2_check_write_cb(void * data, uint8_t * buf, size_t len)
 {
@@ -68,6 +84,34 @@ bool h2_check_write_cb(void * data, uint8_t * buf, size_t len)
   return true;
 }
 
+// buffers written by reference that haven't been released yet
+static size_t num_ref_writes;
+static uint8_t * ref_write_bufs[8];
+static h2_release_cb ref_write_releases[8];
+static void * ref_write_release_data[8];
+
+bool h2_check_write_ref_cb(void * data, uint8_t * buf, size_t len, h2_release_cb release,
+                           void * release_data)
+{
+  UNUSED(data);
+
+  if (num_ref_writes > 7) {
+    printf("Too many writes by reference!");
+    abort();
+  }
+
+  // the bytes are looked at straight away, the buffer is released later
+  write_called = true;
+  binary_buffer_write(server_out_bb, buf, len);
+
+  ref_write_bufs[num_ref_writes] = buf;
+  ref_write_releases[num_ref_writes] = release;
+  ref_write_release_data[num_ref_writes] = release_data;
+  num_ref_writes++;
+
+  return true;
+}
+
 void h2_check_close_cb(void * data)
 {
   UNUSED(data);
@@ -84,6 +128,16 @@ http_request_t * request_init_cb(void * data, void * user_data, header_list_t *
   return http_request_init(stream, NULL, headers);
 }
 
+// for requests that are answered without reaching the plugin - the request
+// is freed along with its handler data once the response is written
+http_request_t * detached_request_init_cb(void * data, void * user_data, header_list_t * headers)
+{
+  UNUSED(data);
+  UNUSED(user_data);
+
+  return http_request_init(NULL, NULL, headers);
+}
+
 struct client_t;
 
 bool plugin_request_handler(struct plugin_t * plugin, struct client_t * client, http_request_t * request,
@@ -235,6 +289,7 @@ void setup()
 
   write_called = false;
   close_called = false;
+  num_ref_writes = 0;
 
   server_parser.log = NULL;
   server_parser.data = NULL;
@@ -275,6 +330,12 @@ void setup()
 void teardown()
 {
   h2_free(server_h2);
+
+  // writes finish after the connection is gone
+  for (size_t i = 0; i < num_ref_writes; i++) {
+    ref_write_releases[i](ref_write_release_data[i]);
+  }
+
   binary_buffer_free(server_in_bb);
   free(server_in_bb);
   binary_buffer_free(server_out_bb);
@@ -294,14 +355,75 @@ void teardown()
   }
 }
 
+/**
+ * The last frame written ends the plugin's response on the given stream, and
+ * the stream has been freed
+ */
+static void assert_response_finished(uint32_t stream_id)
+{
+  size_t response_length = strlen("Don't forget to bring a towel");
+  size_t out_length = binary_buffer_size(server_out_bb);
+  ck_assert(out_length >= FRAME_HEADER_SIZE + response_length);
+
+  uint8_t * data = binary_buffer_start(server_out_bb) + out_length - FRAME_HEADER_SIZE - response_length;
+  ck_assert_int_eq(data[2], response_length);
+  ck_assert_int_eq(data[3], FRAME_TYPE_DATA);
+  ck_assert_int_eq(data[4], FLAG_END_STREAM);
+  ck_assert_int_eq(data[8], stream_id);
+
+  ck_assert(h2_stream_get(server_h2, stream_id) == NULL);
+  ck_assert(h2_stream_closed(server_h2, stream_id));
+}
+
+/**
+ * Sends the client connection preface and an empty SETTINGS frame
+ */
+static void start_connection()
+{
+  uint8_t preface[] = {
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+  };
+  h2_read(server_h2, preface, sizeof(preface) - 1);
+
+  uint8_t settings[] = {
+    0, 0, 0, FRAME_TYPE_SETTINGS, 0, 0, 0, 0, 0
+  };
+  h2_read(server_h2, settings, sizeof settings);
+}
+
+/**
+ * Sends a request for / on the given stream - :method is GET or POST, :scheme
+ * http and :path / all come from the static table
+ */
+static void send_request(uint32_t stream_id, const char * method, bool end_stream)
+{
+  uint8_t headers[] = {
+    0, 0, 3, FRAME_TYPE_HEADERS, FLAG_END_HEADERS, 0, 0, 0, 0,
+    0x82, 0x86, 0x84
+  };
+
+  if (end_stream) {
+    headers[4] |= FLAG_END_STREAM;
+  }
+
+  headers[5] = (stream_id >> 24) & 0x7f;
+  headers[6] = (stream_id >> 16) & 0xff;
+  headers[7] = (stream_id >> 8) & 0xff;
+  headers[8] = stream_id & 0xff;
+
+  if (strcmp(method, "POST") == 0) {
+    headers[9] = 0x83;
+  }
+
+  h2_read(server_h2, headers, sizeof headers);
+}
+
 START_TEST(test_h2_valid_connection_preface)
 {
   uint8_t buf[] = {
     "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
   };
-  uint8_t * in = malloc(sizeof buf);
-  memcpy(in, buf, sizeof buf);
-  h2_read(server_h2, in, sizeof buf);
+  h2_read(server_h2, buf, sizeof buf);
 
   ck_assert(!close_called);
 }
@@ -312,9 +434,7 @@ START_TEST(test_h2_invalid_connection_preface)
   uint8_t buf[] = {
     "PRI * HTTP/1.1\r\n\r\nSM\r\n\r\n"
   };
-  uint8_t * in = malloc(sizeof buf);
-  memcpy(in, buf, sizeof buf);
-  h2_read(server_h2, in, sizeof buf);
+  h2_read(server_h2, buf, sizeof buf);
 
   ck_assert(close_called);
 }
@@ -330,12 +450,8 @@ START_TEST(test_h2_valid_connection_preface_in_2_packets)
     "\r\n\r\nSM\r\n\r\n"
   };
   size_t in2_length = sizeof buf2 - 1;
-  uint8_t * in1 = malloc(in1_length);
-  uint8_t * in2 = malloc(in2_length);
-  memcpy(in1, buf1, in1_length);
-  memcpy(in2, buf2, in2_length);
-  h2_read(server_h2, in1, in1_length);
-  h2_read(server_h2, in2, in2_length);
+  h2_read(server_h2, buf1, in1_length);
+  h2_read(server_h2, buf2, in2_length);
 
   ck_assert(!close_called);
 }
@@ -351,17 +467,182 @@ START_TEST(test_h2_invalid_connection_preface_in_2_packets)
     "\r\n\r\nSM\r\n\r\n"
   };
   size_t in2_length = sizeof buf2 - 1;
-  uint8_t * in1 = malloc(in1_length);
-  uint8_t * in2 = malloc(in2_length);
-  memcpy(in1, buf1, in1_length);
-  memcpy(in2, buf2, in2_length);
-  h2_read(server_h2, in1, in1_length);
-  h2_read(server_h2, in2, in2_length);
+  h2_read(server_h2, buf1, in1_length);
+  h2_read(server_h2, buf2, in2_length);
+
+  ck_assert(close_called);
+}
+END_TEST
+
+START_TEST(test_h2_frame_split_across_reads)
+{
+  start_connection();
+
+  write_called = false;
+
+  // a PING split in the middle of its header and again in its payload
+  uint8_t ping[] = {
+    0, 0, 8, FRAME_TYPE_PING, 0, 0, 0, 0, 0,
+    1, 2, 3, 4, 5, 6, 7, 8
+  };
+  h2_read(server_h2, ping, 4);
+  ck_assert(!write_called);
+  h2_read(server_h2, ping + 4, 8);
+  ck_assert(!write_called);
+  h2_read(server_h2, ping + 12, sizeof(ping) - 12);
+
+  ck_assert(write_called);
+  ck_assert(!close_called);
+
+  // the last frame written is the PING ACK
+  size_t out_length = binary_buffer_size(server_out_bb);
+  ck_assert(out_length >= sizeof ping);
+  uint8_t * ack = binary_buffer_start(server_out_bb) + out_length - sizeof ping;
+  ck_assert_int_eq(ack[3], FRAME_TYPE_PING);
+  ck_assert_int_eq(ack[4], FLAG_ACK);
+  ck_assert(memcmp(ack + FRAME_HEADER_SIZE, ping + FRAME_HEADER_SIZE, 8) == 0);
+}
+END_TEST
+
+START_TEST(test_h2_oversized_frame_split_across_reads)
+{
+  start_connection();
+  ck_assert(!close_called);
+
+  // the header claims a frame larger than the max frame size - it should be
+  // rejected without waiting for the payload
+  uint8_t header[] = {
+    0, 0x80, 0, FRAME_TYPE_DATA, 0, 0, 0, 0, 1
+  };
+  h2_read(server_h2, header, 5);
+  h2_read(server_h2, header + 5, sizeof(header) - 5);
 
   ck_assert(close_called);
 }
 END_TEST
 
+START_TEST(test_h2_refuse_streams)
+{
+  start_connection();
+
+  h2_set_refuse_streams(server_h2, true);
+
+  send_request(1, "GET", true);
+
+  ck_assert(!close_called);
+  ck_assert(h2_stream_closed(server_h2, 1));
+
+  // the last frame written is RST_STREAM (REFUSED_STREAM)
+  size_t out_length = binary_buffer_size(server_out_bb);
+  ck_assert(out_length >= FRAME_HEADER_SIZE + 4);
+  uint8_t * rst = binary_buffer_start(server_out_bb) + out_length - FRAME_HEADER_SIZE - 4;
+  ck_assert_int_eq(rst[3], FRAME_TYPE_RST_STREAM);
+  ck_assert_int_eq(rst[8], 1);
+  ck_assert_int_eq(rst[12], H2_ERROR_REFUSED_STREAM);
+
+  // new streams are accepted again once the connection is back under budget
+  h2_set_refuse_streams(server_h2, false);
+
+  send_request(3, "GET", true);
+
+  ck_assert(!close_called);
+  assert_response_finished(3);
+}
+END_TEST
+
+START_TEST(test_h2_early_data_too_early)
+{
+  start_connection();
+
+  h2_set_early_data(server_h2, true);
+  server_h2->request_init = detached_request_init_cb;
+
+  send_request(1, "POST", false);
+
+  ck_assert(!close_called);
+
+  // the stream is freed along with the 425 response
+  ck_assert(h2_stream_get(server_h2, 1) == NULL);
+  ck_assert(h2_stream_closed(server_h2, 1));
+
+  // the 425 response ends with an empty DATA frame
+  size_t out_length = binary_buffer_size(server_out_bb);
+  ck_assert(out_length >= FRAME_HEADER_SIZE);
+  uint8_t * data = binary_buffer_start(server_out_bb) + out_length - FRAME_HEADER_SIZE;
+  ck_assert_int_eq(data[2], 0);
+  ck_assert_int_eq(data[3], FRAME_TYPE_DATA);
+  ck_assert_int_eq(data[4], FLAG_END_STREAM);
+  ck_assert_int_eq(data[8], 1);
+
+  // the rest of the request's body isn't passed on to plugins
+  uint8_t body[] = {
+    0, 0, 4, FRAME_TYPE_DATA, FLAG_END_STREAM, 0, 0, 0, 1,
+    'b', 'o', 'd', 'y'
+  };
+  h2_read(server_h2, body, sizeof body);
+
+  ck_assert(!close_called);
+
+  // GET / is handled
+  server_h2->request_init = request_init_cb;
+  send_request(3, "GET", true);
+
+  ck_assert(!close_called);
+  assert_response_finished(3);
+}
+END_TEST
+
+START_TEST(test_h2_settings_timeout)
+{
+  timer_wheel_init(&timers, 0);
+  h2_set_timeouts(server_h2, &timers, 5, 0);
+
+  // the client's settings arrive but ours are never acknowledged
+  start_connection();
+
+  timer_wheel_advance(&timers, 4);
+  ck_assert(!server_h2->closing);
+
+  timer_wheel_advance(&timers, 5);
+  ck_assert(server_h2->closing);
+
+  // the last frame written is GOAWAY (SETTINGS_TIMEOUT)
+  size_t out_length = binary_buffer_size(server_out_bb);
+  ck_assert(out_length >= FRAME_HEADER_SIZE + 8);
+  uint8_t * goaway = binary_buffer_start(server_out_bb) + out_length - FRAME_HEADER_SIZE - 8;
+  ck_assert_int_eq(goaway[3], FRAME_TYPE_GOAWAY);
+  ck_assert_int_eq(goaway[FRAME_HEADER_SIZE + 7], H2_ERROR_SETTINGS_TIMEOUT);
+}
+END_TEST
+
+START_TEST(test_h2_memory_used_counts_header_fragments)
+{
+  start_connection();
+
+  size_t memory_used = h2_memory_used(server_h2);
+  ck_assert_int_eq(server_h2->buffered_octets, 0);
+
+  // the header block is held until the CONTINUATION frame ends it
+  uint8_t headers[] = {
+    0, 0, 2, FRAME_TYPE_HEADERS, FLAG_END_STREAM, 0, 0, 0, 1,
+    0x82, 0x86
+  };
+  h2_read(server_h2, headers, sizeof headers);
+
+  ck_assert_int_eq(server_h2->buffered_octets, 2);
+  ck_assert_int_eq(h2_memory_used(server_h2), memory_used + 2);
+
+  uint8_t continuation[] = {
+    0, 0, 1, FRAME_TYPE_CONTINUATION, FLAG_END_HEADERS, 0, 0, 0, 1,
+    0x84
+  };
+  h2_read(server_h2, continuation, sizeof continuation);
+
+  ck_assert(!close_called);
+  ck_assert_int_eq(server_h2->buffered_octets, 0);
+}
+END_TEST
+
 bool filter_files(const char * str)
 {
   return str[0] != '.';
@@ -509,9 +790,7 @@ void test_sequence_file(const char * file_name)
   uint8_t preface[] = {
     "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
   };
-  uint8_t * client_buf = malloc(sizeof preface);
-  memcpy(client_buf, preface, sizeof preface);
-  h2_read(server_h2, client_buf, sizeof(preface) - 1);
+  h2_read(server_h2, preface, sizeof(preface) - 1);
 
   ck_assert(server_h2->received_connection_preface);
 
@@ -526,12 +805,10 @@ void test_sequence_file(const char * file_name)
           h2_frame_t * frame = curr->cmd->frame;
           h2_frame_emit(&client_parser, client_out_bb, frame);
 
-          client_buf = binary_buffer_start(client_out_bb);
+          uint8_t * client_buf = binary_buffer_start(client_out_bb);
           size_t client_buf_length = binary_buffer_size(client_out_bb);
-          uint8_t * client_buf_copy = malloc(client_buf_length);
-          memcpy(client_buf_copy, client_buf, client_buf_length);
           printf("Writing frame: %s: %zu octets\n", frame_type_to_string(frame->type), client_buf_length);
-          h2_read(server_h2, client_buf_copy, client_buf_length);
+          h2_read(server_h2, client_buf, client_buf_length);
           binary_buffer_reset(client_out_bb, 0);
         }
         break;
@@ -632,6 +909,343 @@ void find_test_files()
   }
 }
 
+START_TEST(test_h2_data_sent_in_priority_order)
+{
+  start_connection();
+
+  // hold the responses back until every request has arrived
+  h2_set_write_blocked(server_h2, true);
+
+  // GET / with a priority: stream dependency (exclusive bit first), weight
+  uint8_t headers[] = {
+    0, 0, 8, FRAME_TYPE_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM | FLAG_PRIORITY, 0, 0, 0, 1,
+    0, 0, 0, 0, 15,
+    0x82, 0x86, 0x84
+  };
+  h2_read(server_h2, headers, sizeof headers);
+
+  // #3 depends on #1
+  headers[8] = 3;
+  headers[12] = 1;
+  headers[13] = 255;
+  h2_read(server_h2, headers, sizeof headers);
+
+  // #5 depends exclusively on the root, so #1 moves below it
+  headers[8] = 5;
+  headers[9] = 0x80;
+  headers[12] = 0;
+  h2_read(server_h2, headers, sizeof headers);
+
+  ck_assert(!close_called);
+
+  size_t blocked_length = binary_buffer_size(server_out_bb);
+  h2_set_write_blocked(server_h2, false);
+
+  uint32_t order[3];
+  size_t num_data_frames = 0;
+  uint8_t * out = binary_buffer_start(server_out_bb);
+  size_t pos = blocked_length;
+
+  while (pos + FRAME_HEADER_SIZE <= binary_buffer_size(server_out_bb)) {
+    size_t length = (out[pos] << 16) | (out[pos + 1] << 8) | out[pos + 2];
+
+    if (out[pos + 3] == FRAME_TYPE_DATA) {
+      ck_assert(num_data_frames < 3);
+      order[num_data_frames++] = out[pos + 8];
+    }
+
+    pos += FRAME_HEADER_SIZE + length;
+  }
+
+  ck_assert_uint_eq(num_data_frames, 3);
+  ck_assert_uint_eq(order[0], 5);
+  ck_assert_uint_eq(order[1], 1);
+  ck_assert_uint_eq(order[2], 3);
+
+  // every stream is finished and has left the tree
+  ck_assert(h2_stream_closed(server_h2, 1));
+  ck_assert(h2_stream_closed(server_h2, 3));
+  ck_assert(h2_stream_closed(server_h2, 5));
+  ck_assert(server_h2->priority_root.children == NULL);
+}
+END_TEST
+
+START_TEST(test_h2_priority_for_idle_stream)
+{
+  start_connection();
+
+  h2_set_write_blocked(server_h2, true);
+
+  // #3 is never opened, it's only used to group other streams
+  uint8_t priority[] = {
+    0, 0, 5, FRAME_TYPE_PRIORITY, 0, 0, 0, 0, 3,
+    0, 0, 0, 0, 200
+  };
+  h2_read(server_h2, priority, sizeof priority);
+
+  uint8_t headers[] = {
+    0, 0, 8, FRAME_TYPE_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM | FLAG_PRIORITY, 0, 0, 0, 5,
+    0, 0, 0, 3, 15,
+    0x82, 0x86, 0x84
+  };
+  h2_read(server_h2, headers, sizeof headers);
+
+  ck_assert(!close_called);
+
+  h2_stream_t * group = h2_stream_get(server_h2, 3);
+  h2_stream_t * stream = h2_stream_get(server_h2, 5);
+  ck_assert(group->priority_only);
+  ck_assert_uint_eq(group->priority_node.weight, 201);
+  ck_assert(stream->priority_node.parent == &group->priority_node);
+
+  // the idle stream can't be sent DATA
+  uint8_t data[] = {
+    0, 0, 1, FRAME_TYPE_DATA, FLAG_END_STREAM, 0, 0, 0, 3,
+    'x'
+  };
+  h2_read(server_h2, data, sizeof data);
+
+  size_t out_length = binary_buffer_size(server_out_bb);
+  uint8_t * rst = binary_buffer_start(server_out_bb) + out_length - FRAME_HEADER_SIZE - 4;
+  ck_assert_int_eq(rst[3], FRAME_TYPE_RST_STREAM);
+  ck_assert_int_eq(rst[8], 3);
+
+  h2_set_write_blocked(server_h2, false);
+
+  ck_assert(h2_stream_closed(server_h2, 5));
+  ck_assert(!h2_stream_closed(server_h2, 3));
+  ck_assert(group->priority_node.children == NULL);
+}
+END_TEST
+
+START_TEST(test_h2_stream_behind_sending_parent_not_timed_out)
+{
+  timer_wheel_init(&timers, 0);
+  h2_set_timeouts(server_h2, &timers, 0, 2);
+
+  start_connection();
+
+  h2_set_write_blocked(server_h2, true);
+
+  // POST / on #1 - the plugin writes the headers and leaves the response open
+  send_request(1, "POST", true);
+
+  h2_stream_t * parent = h2_stream_get(server_h2, 1);
+  ck_assert(parent != NULL && parent->response != NULL);
+  // as the plugin's data handler does, so the stream isn't freed with the request
+  parent->request->handler_data = NULL;
+
+  // GET / on #3, which depends on #1
+  uint8_t headers[] = {
+    0, 0, 8, FRAME_TYPE_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM | FLAG_PRIORITY, 0, 0, 0, 3,
+    0, 0, 0, 1, 15,
+    0x82, 0x86, 0x84
+  };
+  h2_read(server_h2, headers, sizeof headers);
+
+  const size_t num_frames = 3;
+  size_t body_length = server_h2->max_frame_size * num_frames;
+  uint8_t * body = malloc(body_length);
+  memset(body, 'x', body_length);
+  ck_assert(h2_response_write_data(parent, parent->response, body, body_length, true));
+
+  // #1 sends one frame every 2 ticks, as the socket drains, and #3 waits
+  // behind it for longer than the stream timeout
+  for (size_t i = 0; i < num_frames; i++) {
+    timer_wheel_advance(&timers, (i + 1) * 2);
+    ck_assert(!h2_stream_closed(server_h2, 1));
+    ck_assert(!h2_stream_closed(server_h2, 3));
+    ck_assert(h2_stream_send_queued_frame(server_h2, parent));
+  }
+
+  ck_assert(!close_called);
+  ck_assert(!h2_stream_closed(server_h2, 3));
+
+  h2_set_write_blocked(server_h2, false);
+
+  ck_assert(!close_called);
+  assert_response_finished(3);
+}
+END_TEST
+
+START_TEST(test_h2_streams_reclaimed_on_long_connection)
+{
+  start_connection();
+
+  // gives back the connection window each response takes
+  uint8_t window_update[] = {
+    0, 0, 4, FRAME_TYPE_WINDOW_UPDATE, 0, 0, 0, 0, 0,
+    0, 0, 0, sizeof("Don't forget to bring a towel") - 1
+  };
+
+  size_t memory_used = 0;
+  size_t stream_allocations = 0;
+  size_t fragment_allocations = 0;
+  uint32_t i;
+
+  for (i = 0; i < SOAK_REQUESTS; i++) {
+    send_request(i * 2 + 1, "GET", true);
+    h2_read(server_h2, window_update, sizeof window_update);
+
+    // the responses aren't needed, only the memory they leave behind
+    binary_buffer_reset(server_out_bb, 0);
+
+    if (i == 0) {
+      memory_used = h2_memory_used(server_h2);
+      stream_allocations = server_h2->stream_pool.misses;
+      fragment_allocations = server_h2->header_fragment_pool.misses;
+    } else if (i % (SOAK_REQUESTS / SOAK_CHECKPOINTS + 1) == 0) {
+      // nothing builds up along the way either
+      ck_assert_uint_eq(h2_stream_table_size(&server_h2->streams), 0);
+      ck_assert_uint_eq(server_h2->stream_pool.in_use, 0);
+      ck_assert_uint_eq(server_h2->stream_pool.misses, stream_allocations);
+      ck_assert_uint_eq(server_h2->header_fragment_pool.misses, fragment_allocations);
+      ck_assert_uint_eq(h2_memory_used(server_h2), memory_used);
+    }
+  }
+
+  ck_assert(!close_called);
+  ck_assert_uint_eq(server_h2->last_stream_id, SOAK_REQUESTS * 2 - 1);
+
+  // every stream has been freed and its memory is reused for the next one
+  ck_assert_uint_eq(h2_stream_table_size(&server_h2->streams), 0);
+  ck_assert(server_h2->released_streams == NULL);
+  ck_assert_uint_eq(server_h2->streams.rings[1].capacity, H2_STREAM_TABLE_INITIAL_CAPACITY);
+  ck_assert_uint_eq(server_h2->stream_pool.in_use, 0);
+  ck_assert_uint_eq(server_h2->stream_pool.misses, stream_allocations);
+  ck_assert_uint_eq(server_h2->header_fragment_pool.misses, fragment_allocations);
+  ck_assert_uint_eq(h2_memory_used(server_h2), memory_used);
+
+  // frames for freed streams are still recognized as being for closed streams
+  uint8_t rst_stream[] = {
+    0, 0, 4, FRAME_TYPE_RST_STREAM, 0, 0, 0, 0, 1,
+    0, 0, 0, H2_ERROR_CANCEL
+  };
+  h2_read(server_h2, rst_stream, sizeof rst_stream);
+
+  ck_assert(!close_called);
+  ck_assert(!server_h2->closing);
+}
+END_TEST
+
+START_TEST(test_h2_data_written_by_reference)
+{
+  h2_set_ref_writer(server_h2, h2_check_write_ref_cb);
+
+  start_connection();
+
+  // POST / - the plugin echoes the body back
+  send_request(1, "POST", false);
+
+  const size_t body_length = H2_MIN_REFERENCED_DATA_LENGTH * 2;
+  uint8_t data[FRAME_HEADER_SIZE + body_length];
+  memset(data, 'x', sizeof data);
+  data[0] = 0;
+  data[1] = (body_length >> 8) & 0xff;
+  data[2] = body_length & 0xff;
+  data[3] = FRAME_TYPE_DATA;
+  data[4] = FLAG_END_STREAM;
+  data[5] = data[6] = data[7] = 0;
+  data[8] = 1;
+
+  size_t out_before = binary_buffer_size(server_out_bb);
+  h2_read(server_h2, data, sizeof data);
+
+  ck_assert(!close_called);
+  ck_assert_uint_eq(num_ref_writes, 1);
+
+  // the frame header was written on its own, right before the payload
+  size_t out_length = binary_buffer_size(server_out_bb);
+  ck_assert(out_length >= out_before + FRAME_HEADER_SIZE + body_length);
+  uint8_t * frame = binary_buffer_start(server_out_bb) + out_length - FRAME_HEADER_SIZE - body_length;
+  ck_assert_uint_eq((frame[1] << 8) | frame[2], body_length);
+  ck_assert_int_eq(frame[3], FRAME_TYPE_DATA);
+  ck_assert_int_eq(frame[4], FLAG_END_STREAM);
+  ck_assert_int_eq(frame[8], 1);
+  ck_assert(memcmp(frame + FRAME_HEADER_SIZE, data + FRAME_HEADER_SIZE, body_length) == 0);
+
+  // the stream is done with the buffer, the pending write still has it
+  ck_assert(h2_stream_get(server_h2, 1) == NULL);
+  shared_buffer_t * buffer = ref_write_release_data[0];
+  ck_assert(buffer->data == ref_write_bufs[0]);
+  ck_assert_uint_eq(buffer->refs, 1);
+
+  // a small payload is copied along with its frame header
+  send_request(3, "GET", true);
+
+  ck_assert(!close_called);
+  ck_assert_uint_eq(num_ref_writes, 1);
+  assert_response_finished(3);
+}
+END_TEST
+
+static size_t buffers_destroyed;
+
+static void count_destroyed_buffer(void * context, uint8_t * data, size_t length)
+{
+  UNUSED(context);
+  UNUSED(length);
+
+  free(data);
+  buffers_destroyed++;
+}
+
+START_TEST(test_h2_shared_buffer_written_on_many_streams)
+{
+  h2_set_ref_writer(server_h2, h2_check_write_ref_cb);
+  buffers_destroyed = 0;
+
+  start_connection();
+
+  // POST / on streams 1 and 3 - the plugin writes the headers and leaves the
+  // responses open
+  send_request(1, "POST", false);
+  send_request(3, "POST", false);
+
+  h2_stream_t * stream_1 = h2_stream_get(server_h2, 1);
+  h2_stream_t * stream_3 = h2_stream_get(server_h2, 3);
+  ck_assert(stream_1 != NULL && stream_1->response != NULL);
+  ck_assert(stream_3 != NULL && stream_3->response != NULL);
+
+  // as the plugin's data handler does, so the stream isn't freed with the request
+  stream_1->request->handler_data = NULL;
+  stream_3->request->handler_data = NULL;
+
+  const size_t body_length = H2_MIN_REFERENCED_DATA_LENGTH * 2;
+  uint8_t * body = malloc(body_length);
+  memset(body, 'x', body_length);
+  shared_buffer_t * buffer = shared_buffer_init(body, body_length, count_destroyed_buffer, NULL);
+
+  // the whole body on stream 1, the second half on stream 3
+  shared_buffer_slice_t slice = shared_buffer_slice(buffer, 0, body_length);
+  ck_assert(h2_response_write_data_buffer(stream_1, stream_1->response, &slice, true));
+  slice = shared_buffer_slice(buffer, H2_MIN_REFERENCED_DATA_LENGTH, body_length);
+  ck_assert(h2_response_write_data_buffer(stream_3, stream_3->response, &slice, true));
+
+  ck_assert(!close_called);
+  ck_assert(h2_stream_get(server_h2, 1) == NULL && h2_stream_closed(server_h2, 1));
+  ck_assert(h2_stream_get(server_h2, 3) == NULL && h2_stream_closed(server_h2, 3));
+
+  // both writes point into the same bytes
+  ck_assert_uint_eq(num_ref_writes, 2);
+  ck_assert(ref_write_bufs[0] == body);
+  ck_assert(ref_write_bufs[1] == body + H2_MIN_REFERENCED_DATA_LENGTH);
+  ck_assert(ref_write_release_data[0] == buffer);
+  ck_assert(ref_write_release_data[1] == buffer);
+
+  // the buffer outlives the caller's reference until both writes are done
+  shared_buffer_release(buffer);
+  ck_assert_uint_eq(buffers_destroyed, 0);
+
+  ref_write_releases[0](ref_write_release_data[0]);
+  ck_assert_uint_eq(buffers_destroyed, 0);
+  ref_write_releases[1](ref_write_release_data[1]);
+  ck_assert_uint_eq(buffers_destroyed, 1);
+
+  num_ref_writes = 0;
+}
+END_TEST
+
 START_TEST(test_h2_frame_sequences)
 {
   test_sequence_file(test_files[_i]);
@@ -649,12 +1263,30 @@ Suite * h2_suite()
   tcase_add_test(tc, test_h2_valid_connection_preface_in_2_packets);
   tcase_add_test(tc, test_h2_invalid_connection_preface);
   tcase_add_test(tc, test_h2_invalid_connection_preface_in_2_packets);
+  tcase_add_test(tc, test_h2_frame_split_across_reads);
+  tcase_add_test(tc, test_h2_oversized_frame_split_across_reads);
+  tcase_add_test(tc, test_h2_refuse_streams);
+  tcase_add_test(tc, test_h2_early_data_too_early);
+  tcase_add_test(tc, test_h2_memory_used_counts_header_fragments);
+  tcase_add_test(tc, test_h2_settings_timeout);
+  tcase_add_test(tc, test_h2_data_sent_in_priority_order);
+  tcase_add_test(tc, test_h2_priority_for_idle_stream);
+  tcase_add_test(tc, test_h2_stream_behind_sending_parent_not_timed_out);
+  tcase_add_test(tc, test_h2_data_written_by_reference);
+  tcase_add_test(tc, test_h2_shared_buffer_written_on_many_streams);
 
   find_test_files();
   tcase_add_loop_test(tc, test_h2_frame_sequences, 0, num_test_files);
 
   suite_add_tcase(s, tc);
 
+  // a raised SOAK_REQUESTS runs for longer than the default timeout allows
+  TCase * soak = tcase_create("soak");
+  tcase_add_checked_fixture(soak, setup, teardown);
+  tcase_set_timeout(soak, SOAK_TIMEOUT);
+  tcase_add_test(soak, test_h2_streams_reclaimed_on_long_connection);
+  suite_add_tcase(s, soak);
+
   return s;
 }
 
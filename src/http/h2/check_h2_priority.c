@@ -0,0 +1,271 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <check.h>
+
+#include "h2_priority.c"
+
+typedef struct {
+  h2_priority_node_t node;
+  bool ready;
+  size_t sent;
+} test_stream_t;
+
+h2_priority_node_t root;
+test_stream_t streams[8];
+
+static bool test_stream_ready(void * data)
+{
+  test_stream_t * stream = data;
+  return stream->ready;
+}
+
+/**
+ * Sends size octets at a time from whichever stream is next, count times
+ */
+static void send_frames(size_t count, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    h2_priority_node_t * next = h2_priority_next(&root, test_stream_ready);
+
+    if (!next) {
+      return;
+    }
+
+    test_stream_t * stream = next->data;
+    stream->sent += size;
+    h2_priority_charge(next, size);
+  }
+}
+
+void setup()
+{
+  size_t i;
+
+  h2_priority_init(&root, NULL);
+
+  for (i = 0; i < 8; i++) {
+    h2_priority_init(&streams[i].node, &streams[i]);
+    streams[i].ready = false;
+    streams[i].sent = 0;
+  }
+}
+
+void teardown()
+{
+}
+
+START_TEST(test_h2_priority_next_empty)
+{
+  ck_assert(h2_priority_next(&root, test_stream_ready) == NULL);
+
+  h2_priority_set(&streams[0].node, &root, 16, false);
+
+  ck_assert(h2_priority_next(&root, test_stream_ready) == NULL);
+}
+END_TEST
+
+START_TEST(test_h2_priority_siblings_share_by_weight)
+{
+  h2_priority_set(&streams[0].node, &root, 64, false);
+  h2_priority_set(&streams[1].node, &root, 16, false);
+  streams[0].ready = true;
+  streams[1].ready = true;
+
+  send_frames(100, 1000);
+
+  ck_assert_uint_eq(streams[0].sent, 80000);
+  ck_assert_uint_eq(streams[1].sent, 20000);
+}
+END_TEST
+
+START_TEST(test_h2_priority_equal_weights_take_turns)
+{
+  h2_priority_set(&streams[0].node, &root, 16, false);
+  h2_priority_set(&streams[1].node, &root, 16, false);
+  streams[0].ready = true;
+  streams[1].ready = true;
+
+  // the first stream added goes first
+  ck_assert(h2_priority_next(&root, test_stream_ready) == &streams[0].node);
+  send_frames(1, 1000);
+  ck_assert(h2_priority_next(&root, test_stream_ready) == &streams[1].node);
+  send_frames(1, 1000);
+  ck_assert(h2_priority_next(&root, test_stream_ready) == &streams[0].node);
+}
+END_TEST
+
+START_TEST(test_h2_priority_parent_before_children)
+{
+  h2_priority_set(&streams[0].node, &root, 16, false);
+  h2_priority_set(&streams[1].node, &streams[0].node, 256, false);
+  streams[0].ready = true;
+  streams[1].ready = true;
+
+  send_frames(10, 1000);
+
+  ck_assert_uint_eq(streams[0].sent, 10000);
+  ck_assert_uint_eq(streams[1].sent, 0);
+
+  // the child gets the parent's share once the parent is done
+  streams[0].ready = false;
+  ck_assert(h2_priority_next(&root, test_stream_ready) == &streams[1].node);
+}
+END_TEST
+
+START_TEST(test_h2_priority_subtrees_share_by_weight)
+{
+  // 0 (weight 16) with children 2 and 3, 1 (weight 64)
+  h2_priority_set(&streams[0].node, &root, 16, false);
+  h2_priority_set(&streams[1].node, &root, 64, false);
+  h2_priority_set(&streams[2].node, &streams[0].node, 16, false);
+  h2_priority_set(&streams[3].node, &streams[0].node, 16, false);
+  streams[1].ready = true;
+  streams[2].ready = true;
+  streams[3].ready = true;
+
+  send_frames(100, 1000);
+
+  ck_assert_uint_eq(streams[1].sent, 80000);
+  ck_assert_uint_eq(streams[2].sent, 10000);
+  ck_assert_uint_eq(streams[3].sent, 10000);
+}
+END_TEST
+
+START_TEST(test_h2_priority_idle_stream_does_not_bank_turns)
+{
+  h2_priority_set(&streams[0].node, &root, 16, false);
+  h2_priority_set(&streams[1].node, &root, 16, false);
+  streams[0].ready = true;
+
+  send_frames(10, 1000);
+  ck_assert_uint_eq(streams[0].sent, 10000);
+
+  // a stream that had nothing to send doesn't get to catch up
+  streams[1].ready = true;
+  send_frames(10, 1000);
+
+  ck_assert_uint_eq(streams[0].sent, 15000);
+  ck_assert_uint_eq(streams[1].sent, 5000);
+}
+END_TEST
+
+START_TEST(test_h2_priority_exclusive)
+{
+  h2_priority_set(&streams[0].node, &root, 16, false);
+  h2_priority_set(&streams[1].node, &root, 16, false);
+  h2_priority_set(&streams[2].node, &root, 32, true);
+
+  ck_assert(root.children == &streams[2].node);
+  ck_assert(root.children->next_sibling == NULL);
+  ck_assert(streams[0].node.parent == &streams[2].node);
+  ck_assert(streams[1].node.parent == &streams[2].node);
+  ck_assert_uint_eq(streams[2].node.weight, 32);
+}
+END_TEST
+
+START_TEST(test_h2_priority_depend_on_descendant)
+{
+  // section 5.3.3: 0 -> 1 -> 2, then 0 is made to depend on 2
+  h2_priority_set(&streams[0].node, &root, 16, false);
+  h2_priority_set(&streams[1].node, &streams[0].node, 16, false);
+  h2_priority_set(&streams[2].node, &streams[1].node, 8, false);
+
+  h2_priority_set(&streams[0].node, &streams[2].node, 16, false);
+
+  ck_assert(streams[2].node.parent == &root);
+  ck_assert_uint_eq(streams[2].node.weight, 8);
+  ck_assert(streams[0].node.parent == &streams[2].node);
+  ck_assert(streams[1].node.parent == &streams[0].node);
+}
+END_TEST
+
+START_TEST(test_h2_priority_depend_on_descendant_exclusive)
+{
+  // 0 -> (1, 2), 1 -> 3, then 0 is made to depend exclusively on 1
+  h2_priority_set(&streams[0].node, &root, 16, false);
+  h2_priority_set(&streams[1].node, &streams[0].node, 16, false);
+  h2_priority_set(&streams[2].node, &streams[0].node, 16, false);
+  h2_priority_set(&streams[3].node, &streams[1].node, 16, false);
+
+  h2_priority_set(&streams[0].node, &streams[1].node, 16, true);
+
+  ck_assert(streams[1].node.parent == &root);
+  ck_assert(streams[0].node.parent == &streams[1].node);
+  ck_assert(streams[1].node.children == &streams[0].node);
+  ck_assert(streams[0].node.next_sibling == NULL);
+  ck_assert(streams[2].node.parent == &streams[0].node);
+  ck_assert(streams[3].node.parent == &streams[0].node);
+}
+END_TEST
+
+START_TEST(test_h2_priority_remove_shares_weight)
+{
+  h2_priority_set(&streams[0].node, &root, 64, false);
+  h2_priority_set(&streams[1].node, &streams[0].node, 16, false);
+  h2_priority_set(&streams[2].node, &streams[0].node, 48, false);
+
+  h2_priority_remove(&streams[0].node);
+
+  ck_assert(!h2_priority_attached(&streams[0].node));
+  ck_assert(streams[0].node.children == NULL);
+  ck_assert(streams[1].node.parent == &root);
+  ck_assert(streams[2].node.parent == &root);
+  ck_assert_uint_eq(streams[1].node.weight, 16);
+  ck_assert_uint_eq(streams[2].node.weight, 48);
+
+  // not attached - nothing to do
+  h2_priority_remove(&streams[0].node);
+}
+END_TEST
+
+START_TEST(test_h2_priority_remove_keeps_minimum_weight)
+{
+  h2_priority_set(&streams[0].node, &root, 1, false);
+  h2_priority_set(&streams[1].node, &streams[0].node, 1, false);
+  h2_priority_set(&streams[2].node, &streams[0].node, 256, false);
+
+  h2_priority_remove(&streams[0].node);
+
+  ck_assert_uint_eq(streams[1].node.weight, 1);
+  ck_assert_uint_eq(streams[2].node.weight, 1);
+}
+END_TEST
+
+Suite * h2_priority_suite()
+{
+  Suite * s = suite_create("h2_priority");
+
+  TCase * tc = tcase_create("h2_priority");
+  tcase_add_checked_fixture(tc, setup, teardown);
+
+  tcase_add_test(tc, test_h2_priority_next_empty);
+  tcase_add_test(tc, test_h2_priority_siblings_share_by_weight);
+  tcase_add_test(tc, test_h2_priority_equal_weights_take_turns);
+  tcase_add_test(tc, test_h2_priority_parent_before_children);
+  tcase_add_test(tc, test_h2_priority_subtrees_share_by_weight);
+  tcase_add_test(tc, test_h2_priority_idle_stream_does_not_bank_turns);
+  tcase_add_test(tc, test_h2_priority_exclusive);
+  tcase_add_test(tc, test_h2_priority_depend_on_descendant);
+  tcase_add_test(tc, test_h2_priority_depend_on_descendant_exclusive);
+  tcase_add_test(tc, test_h2_priority_remove_shares_weight);
+  tcase_add_test(tc, test_h2_priority_remove_keeps_minimum_weight);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main()
+{
+  int number_failed;
+  Suite * s = h2_priority_suite();
+  SRunner * sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
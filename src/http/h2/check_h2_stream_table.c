@@ -0,0 +1,231 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <check.h>
+
+#include "util.h"
+
+#include "h2_stream_table.c"
+
+h2_stream_table_t table;
+size_t num_freed;
+int values[1024];
+
+static void count_free(void * value)
+{
+  UNUSED(value);
+  num_freed++;
+}
+
+void setup()
+{
+  num_freed = 0;
+  ck_assert(h2_stream_table_init(&table, count_free));
+}
+
+void teardown()
+{
+  h2_stream_table_free(&table);
+}
+
+START_TEST(test_h2_stream_table_get_missing)
+{
+  ck_assert(h2_stream_table_get(&table, 0) == NULL);
+  ck_assert(h2_stream_table_get(&table, 1) == NULL);
+  ck_assert(h2_stream_table_get(&table, 0x7fffffff) == NULL);
+  ck_assert(!h2_stream_table_closed(&table, 1));
+  ck_assert_uint_eq(h2_stream_table_size(&table), 0);
+}
+END_TEST
+
+START_TEST(test_h2_stream_table_put_get)
+{
+  ck_assert(h2_stream_table_put(&table, 1, &values[1]));
+  ck_assert(h2_stream_table_put(&table, 2, &values[2]));
+  ck_assert(h2_stream_table_put(&table, 3, &values[3]));
+
+  ck_assert(h2_stream_table_get(&table, 1) == &values[1]);
+  ck_assert(h2_stream_table_get(&table, 2) == &values[2]);
+  ck_assert(h2_stream_table_get(&table, 3) == &values[3]);
+  ck_assert(h2_stream_table_get(&table, 4) == NULL);
+  ck_assert_uint_eq(h2_stream_table_size(&table), 3);
+
+  // identifiers can't be used twice
+  ck_assert(!h2_stream_table_put(&table, 3, &values[0]));
+  ck_assert(h2_stream_table_get(&table, 3) == &values[3]);
+}
+END_TEST
+
+START_TEST(test_h2_stream_table_remove_leaves_tombstone)
+{
+  ck_assert(h2_stream_table_put(&table, 1, &values[1]));
+  ck_assert(h2_stream_table_put(&table, 3, &values[3]));
+
+  ck_assert(h2_stream_table_remove(&table, 3) == &values[3]);
+  ck_assert(h2_stream_table_get(&table, 3) == NULL);
+  ck_assert(h2_stream_table_closed(&table, 3));
+  ck_assert(!h2_stream_table_closed(&table, 1));
+  ck_assert(!h2_stream_table_put(&table, 3, &values[3]));
+
+  ck_assert(h2_stream_table_remove(&table, 3) == NULL);
+
+  ck_assert(h2_stream_table_remove(&table, 1) == &values[1]);
+  ck_assert(h2_stream_table_closed(&table, 1));
+  ck_assert_uint_eq(h2_stream_table_size(&table), 0);
+
+  // removed streams aren't freed along with the table
+  h2_stream_table_free(&table);
+  ck_assert_uint_eq(num_freed, 0);
+}
+END_TEST
+
+START_TEST(test_h2_stream_table_window_moves)
+{
+  uint32_t id;
+
+  // many more streams than slots, a few open at a time
+  for (id = 1; id < 2000; id += 2) {
+    ck_assert(h2_stream_table_put(&table, id, &values[id % 1024]));
+
+    if (id > 5) {
+      ck_assert(h2_stream_table_remove(&table, id - 6) == &values[(id - 6) % 1024]);
+    }
+  }
+
+  ck_assert_uint_eq(h2_stream_table_size(&table), 3);
+  ck_assert_uint_eq(table.rings[1].capacity, H2_STREAM_TABLE_INITIAL_CAPACITY);
+  ck_assert(h2_stream_table_get(&table, 1999) == &values[1999 % 1024]);
+  ck_assert(h2_stream_table_closed(&table, 1));
+  ck_assert(h2_stream_table_closed(&table, 1993));
+  ck_assert(!h2_stream_table_closed(&table, 1995));
+  ck_assert(!h2_stream_table_closed(&table, 2001));
+}
+END_TEST
+
+START_TEST(test_h2_stream_table_grows)
+{
+  uint32_t id;
+
+  for (id = 1; id < 200; id += 2) {
+    ck_assert(h2_stream_table_put(&table, id, &values[id]));
+  }
+
+  ck_assert_uint_eq(h2_stream_table_size(&table), 100);
+
+  for (id = 1; id < 200; id += 2) {
+    ck_assert(h2_stream_table_get(&table, id) == &values[id]);
+  }
+
+  h2_stream_table_free(&table);
+  ck_assert_uint_eq(num_freed, 100);
+}
+END_TEST
+
+START_TEST(test_h2_stream_table_stragglers)
+{
+  uint32_t id;
+
+  // stream #3 stays open while the others come and go
+  ck_assert(h2_stream_table_put(&table, 3, &values[3]));
+
+  for (id = 5; id < 500; id += 2) {
+    ck_assert(h2_stream_table_put(&table, id, &values[id]));
+    ck_assert(h2_stream_table_remove(&table, id) == &values[id]);
+  }
+
+  ck_assert_uint_eq(table.rings[1].capacity, H2_STREAM_TABLE_INITIAL_CAPACITY);
+  ck_assert_uint_eq(table.rings[1].stragglers_length, 1);
+  ck_assert(h2_stream_table_get(&table, 3) == &values[3]);
+  ck_assert(!h2_stream_table_closed(&table, 3));
+  ck_assert(h2_stream_table_closed(&table, 1));
+  ck_assert(h2_stream_table_closed(&table, 5));
+
+  h2_stream_table_iter_t iter;
+  h2_stream_table_iterator_init(&iter, &table);
+  ck_assert(h2_stream_table_iterate(&iter));
+  ck_assert(iter.value == &values[3]);
+  ck_assert(!h2_stream_table_iterate(&iter));
+
+  ck_assert(h2_stream_table_remove(&table, 3) == &values[3]);
+  ck_assert(h2_stream_table_closed(&table, 3));
+  ck_assert_uint_eq(h2_stream_table_size(&table), 0);
+}
+END_TEST
+
+START_TEST(test_h2_stream_table_skipped_identifiers)
+{
+  ck_assert(h2_stream_table_put(&table, 1, &values[1]));
+  ck_assert(h2_stream_table_put(&table, 7, &values[7]));
+
+  // a lower identifier can still be opened while it's in the window
+  ck_assert(!h2_stream_table_closed(&table, 5));
+  ck_assert(h2_stream_table_put(&table, 5, &values[5]));
+
+  ck_assert(h2_stream_table_remove(&table, 1) == &values[1]);
+  ck_assert(h2_stream_table_remove(&table, 5) == &values[5]);
+  ck_assert(h2_stream_table_remove(&table, 7) == &values[7]);
+
+  // once a much later stream opens, the skipped ones are closed
+  ck_assert(h2_stream_table_put(&table, 1001, &values[1001 % 1024]));
+  ck_assert(h2_stream_table_closed(&table, 3));
+  ck_assert(!h2_stream_table_put(&table, 3, &values[3]));
+}
+END_TEST
+
+START_TEST(test_h2_stream_table_iterate)
+{
+  ck_assert(h2_stream_table_put(&table, 1, &values[1]));
+  ck_assert(h2_stream_table_put(&table, 2, &values[2]));
+  ck_assert(h2_stream_table_put(&table, 5, &values[5]));
+  ck_assert(h2_stream_table_put(&table, 3, &values[3]));
+  ck_assert(h2_stream_table_remove(&table, 3) == &values[3]);
+
+  size_t count = 0;
+  int * seen[4];
+  h2_stream_table_iter_t iter;
+  h2_stream_table_iterator_init(&iter, &table);
+
+  while (h2_stream_table_iterate(&iter)) {
+    ck_assert(count < 4);
+    seen[count++] = iter.value;
+  }
+
+  ck_assert_uint_eq(count, 3);
+  ck_assert(seen[0] == &values[2]);
+  ck_assert(seen[1] == &values[1]);
+  ck_assert(seen[2] == &values[5]);
+}
+END_TEST
+
+Suite * h2_stream_table_suite()
+{
+  Suite * s = suite_create("h2_stream_table");
+
+  TCase * tc = tcase_create("h2_stream_table");
+  tcase_add_checked_fixture(tc, setup, teardown);
+
+  tcase_add_test(tc, test_h2_stream_table_get_missing);
+  tcase_add_test(tc, test_h2_stream_table_put_get);
+  tcase_add_test(tc, test_h2_stream_table_remove_leaves_tombstone);
+  tcase_add_test(tc, test_h2_stream_table_window_moves);
+  tcase_add_test(tc, test_h2_stream_table_grows);
+  tcase_add_test(tc, test_h2_stream_table_stragglers);
+  tcase_add_test(tc, test_h2_stream_table_skipped_identifiers);
+  tcase_add_test(tc, test_h2_stream_table_iterate);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main()
+{
+  int number_failed;
+  Suite * s = h2_stream_table_suite();
+  SRunner * sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -343,10 +343,34 @@ enum h2_detect_result_e h2_detect_connection(uint8_t * buffer, size_t buffer_len
   return H2_DETECT_FAILED;
 }
 
+static void h2_buffer_release(void * data)
+{
+  shared_buffer_release(data);
+}
+
+static void h2_stream_drop_queued_data(h2_stream_t * const stream)
+{
+  while (stream->queued_data_frames) {
+
+    h2_queued_frame_t * frame = stream->queued_data_frames;
+
+    stream->queued_data_frames = frame->next;
+    stream->h2->buffered_octets -= frame->buf_length;
+
+    shared_buffer_release(frame->buffer);
+    buffer_pool_put(&stream->h2->queued_frame_pool, (uint8_t *) frame);
+
+  }
+}
+
 static void h2_stream_free(void * value)
 {
   h2_stream_t * stream = value;
 
+  if (stream->h2->timers) {
+    timer_wheel_cancel(stream->h2->timers, &stream->idle_timer);
+  }
+
   if (stream->headers) {
     header_list_free(stream->headers);
   }
@@ -356,60 +380,140 @@ static void h2_stream_free(void * value)
     h2_header_fragment_t * fragment = stream->header_fragments;
 
     stream->header_fragments = fragment->next;
+    stream->h2->buffered_octets -= fragment->length;
 
     if (fragment->buffer) {
       free(fragment->buffer);
     }
 
-    free(fragment);
+    buffer_pool_put(&stream->h2->header_fragment_pool, (uint8_t *) fragment);
 
   }
 
   // Free any remaining data frames. This may need to happen
   // for streams that have been reset
-  while (stream->queued_data_frames) {
-
-    h2_queued_frame_t * frame = stream->queued_data_frames;
-
-    stream->queued_data_frames = frame->next;
-
-    if (frame->buf_begin) {
-      free(frame->buf_begin);
-    }
-
-    free(frame);
-
-  }
+  h2_stream_drop_queued_data(stream);
 
   if (stream->response) {
     http_response_free(stream->response);
     stream->response = NULL;
   }
 
-  free(stream);
+  buffer_pool_put(&stream->h2->stream_pool, (uint8_t *) stream);
 }
 
 h2_stream_t * h2_stream_get(h2_t * const h2, const uint32_t stream_id)
 {
 
-  return hash_table_get(h2->streams, &stream_id);
+  return h2_stream_table_get(&h2->streams, stream_id);
 
 }
 
-static void h2_stream_close(h2_t * const h2, h2_stream_t * const stream, bool force)
+/**
+ * Takes a closed stream out of the stream table once its response is done
+ * with. Its identifier stays closed, and the stream itself is freed by
+ * h2_reclaim_streams once whatever is processing it has returned.
+ */
+static void h2_stream_release(h2_t * const h2, h2_stream_t * const stream)
 {
-  if (stream->state == STREAM_STATE_CLOSED) {
+  if (stream->state != STREAM_STATE_CLOSED || stream->response || stream->released) {
+    return;
+  }
+
+  h2_stream_table_remove(&h2->streams, stream->id);
+
+  stream->released = true;
+  stream->next_released = h2->released_streams;
+  h2->released_streams = stream;
+}
+
+static void h2_free_released_streams(h2_t * const h2)
+{
+  while (h2->released_streams) {
+    h2_stream_t * stream = h2->released_streams;
+    h2->released_streams = stream->next_released;
+
+    h2_stream_free(stream);
+  }
+}
+
+/**
+ * Frees the streams that have been released. Frames are processed with
+ * pointers to their stream on the stack, so this only happens after a read
+ * or write has finished.
+ */
+static void h2_reclaim_streams(h2_t * const h2)
+{
+  if (h2->reading_from_client) {
     return;
   }
 
-  if (force || (stream->closing && !stream->queued_data_frames)) {
+  h2_free_released_streams(h2);
+}
+
+static void h2_stream_close(h2_t * const h2, h2_stream_t * const stream, bool force)
+{
+  if (stream->state != STREAM_STATE_CLOSED &&
+      (force || (stream->closing && !stream->queued_data_frames))) {
 
     log_append(h2->log, LOG_TRACE, "Closing stream #%u", stream->id);
 
     stream->state = STREAM_STATE_CLOSED;
 
+    if (h2->timers) {
+      timer_wheel_cancel(h2->timers, &stream->idle_timer);
+    }
+
+    // streams that depended on this one move up to its parent
+    h2_priority_remove(&stream->priority_node);
+
+    if (stream->priority_only) {
+      stream->priority_only = false;
+      h2->priority_only_streams--;
+    }
+
+  }
+
+  h2_stream_release(h2, stream);
+
+}
+
+static bool h2_stream_can_send(void * data);
+
+/**
+ * The rest of the request hasn't arrived yet, or the stream's response is
+ * held back until the peer opens a flow control window. A stream that is
+ * only waiting on the server (e.g. behind its parent in the priority tree, or
+ * for a slow plugin) isn't.
+ */
+static bool h2_stream_waiting_on_peer(h2_stream_t * const stream)
+{
+  if (stream->priority_only) {
+    return false;
+  }
+
+  if (!stream->end_stream_received) {
+    return true;
   }
 
+  return stream->queued_data_frames && !h2_stream_can_send(stream);
+}
+
+/**
+ * Pushes back the stream's idle timeout while the stream is waiting on the
+ * peer, and stops it otherwise
+ */
+static void h2_stream_touch(h2_t * const h2, h2_stream_t * const stream)
+{
+  if (!h2->timers || !h2->stream_timeout || stream->state == STREAM_STATE_CLOSED) {
+    return;
+  }
+
+  if (h2_stream_waiting_on_peer(stream)) {
+    timer_wheel_add(h2->timers, &stream->idle_timer, h2->stream_timeout);
+  } else {
+    timer_wheel_cancel(h2->timers, &stream->idle_timer);
+  }
 }
 
 bool h2_stream_closed(h2_t * const h2, const uint32_t stream_id)
@@ -421,7 +525,7 @@ bool h2_stream_closed(h2_t * const h2, const uint32_t stream_id)
     return stream->state == STREAM_STATE_CLOSED;
   }
 
-  return false;
+  return h2_stream_table_closed(&h2->streams, stream_id);
 
 }
 
@@ -454,10 +558,14 @@ static void h2_shutdown_if_finished(h2_t * const h2)
   }
 }
 
+/**
+ * Marks the stream as finished - it is closed once its queued data has been
+ * sent
+ */
 static void h2_stream_mark_closing(h2_t * const h2, h2_stream_t * const stream)
 {
 
-  if (stream->state != STREAM_STATE_CLOSED && !stream->queued_data_frames) {
+  if (stream->state != STREAM_STATE_CLOSED && !stream->closing) {
     stream->closing = true;
 
     if (stream->id % 2 == 0) {
@@ -475,6 +583,10 @@ static bool h2_parse_error_cb(void * data, uint32_t stream_id, enum h2_error_cod
 
 static bool h2_incoming_frame(void * data, const h2_frame_t * const frame);
 
+static void h2_settings_timed_out(timer_wheel_timer_t * timer);
+
+static void h2_stream_timed_out(timer_wheel_timer_t * timer);
+
 h2_t * h2_init(void * const data, struct log_context_t * log, struct log_context_t * hpack_log,
     const char * tls_version, const char * cipher, int cipher_key_size_in_bits,
     struct plugin_invoker_t * plugin_invoker, const h2_write_cb writer, const h2_close_cb closer,
@@ -488,6 +600,7 @@ h2_t * h2_init(void * const data, struct log_context_t * log, struct log_context
 
   h2->plugin_invoker = plugin_invoker;
   h2->writer = writer;
+  h2->ref_writer = NULL;
   h2->closer = closer;
   h2->request_init = request_init;
 
@@ -504,6 +617,10 @@ h2_t * h2_init(void * const data, struct log_context_t * log, struct log_context
   h2->incoming_window_size = DEFAULT_INITIAL_WINDOW_SIZE;
 
   h2->settings_pending = false;
+  h2->timers = NULL;
+  h2->settings_timeout = 0;
+  h2->stream_timeout = 0;
+  timer_wheel_timer_init(&h2->settings_timer, h2_settings_timed_out, h2);
   h2->incoming_push_enabled = true;
   h2->incoming_push_enabled_pending = false;
   h2->incoming_push_enabled_pending_value = false;
@@ -520,6 +637,11 @@ h2_t * h2_init(void * const data, struct log_context_t * log, struct log_context
   h2->buffer_position = 0;
   h2->reading_from_client = false;
 
+  h2->partial_header_length = 0;
+  h2->partial_frame = NULL;
+  h2->partial_frame_length = 0;
+  h2->partial_frame_size = 0;
+
   h2->header_table_size = DEFAULT_HEADER_TABLE_SIZE;
   h2->enable_push = DEFAULT_ENABLE_PUSH;
   h2->max_concurrent_streams = DEFAULT_MAX_CONNCURRENT_STREAMS;
@@ -533,7 +655,15 @@ h2_t * h2_init(void * const data, struct log_context_t * log, struct log_context
    */
   h2->encoding_context = NULL;
   h2->decoding_context = NULL;
-  h2->streams = NULL;
+  memset(&h2->streams, 0, sizeof(h2->streams));
+
+  h2_priority_init(&h2->priority_root, NULL);
+  h2->priority_only_streams = 0;
+
+  h2->released_streams = NULL;
+  buffer_pool_init(&h2->stream_pool, sizeof(h2_stream_t), H2_STREAM_POOL_SIZE);
+  buffer_pool_init(&h2->queued_frame_pool, sizeof(h2_queued_frame_t), H2_QUEUED_FRAME_POOL_SIZE);
+  buffer_pool_init(&h2->header_fragment_pool, sizeof(h2_header_fragment_t), H2_HEADER_FRAGMENT_POOL_SIZE);
 
   h2->frame_parser.data = h2;
   h2->frame_parser.parse_error = h2_parse_error_cb;
@@ -555,29 +685,40 @@ h2_t * h2_init(void * const data, struct log_context_t * log, struct log_context
     return NULL;
   }
 
-  h2->streams = hash_table_init_with_int_keys(NULL, h2_stream_free);
-
-  if (!h2->streams) {
+  if (!h2_stream_table_init(&h2->streams, h2_stream_free)) {
     h2_free(h2);
     return NULL;
   }
 
   binary_buffer_init(&h2->write_buffer, 0);
+  h2->write_blocked = false;
+  h2->buffered_octets = 0;
+  h2->refuse_streams = false;
+  h2->early_data = false;
 
   return h2;
 }
 
 void h2_free(h2_t * const h2)
 {
-  hash_table_free(h2->streams);
-  free(h2->streams);
+  if (h2->timers) {
+    timer_wheel_cancel(h2->timers, &h2->settings_timer);
+  }
+
+  // streams go back to the pools, so they're freed first
+  h2_stream_table_free(&h2->streams);
+  h2_free_released_streams(h2);
+  buffer_pool_free(&h2->stream_pool);
+  buffer_pool_free(&h2->queued_frame_pool);
+  buffer_pool_free(&h2->header_fragment_pool);
+
   hpack_context_free(h2->encoding_context);
   hpack_context_free(h2->decoding_context);
 
   binary_buffer_free(&h2->write_buffer);
 
-  if (h2->buffer) {
-    free(h2->buffer);
+  if (h2->partial_frame) {
+    free(h2->partial_frame);
   }
 
   free(h2);
@@ -902,108 +1043,229 @@ static bool h2_send_data_frame(const h2_t * const h2, const h2_stream_t * const
 
   log_append(h2->log, LOG_DEBUG, "Writing data frame: stream %u, %lu octets", stream->id, queued_frame->buf_length);
 
-  return h2_frame_write(h2, (h2_frame_t *) frame);
+  if (!h2->ref_writer || !queued_frame->buffer ||
+      queued_frame->buf_length < H2_MIN_REFERENCED_DATA_LENGTH) {
+    return h2_frame_write(h2, (h2_frame_t *) frame);
+  }
+
+  // the frame header goes out with anything else that's buffered, and the
+  // payload is written from where the application left it
+  binary_buffer_t * const wb = (binary_buffer_t *) &h2->write_buffer;
+  bool success = h2_frame_emit_data_without_payload(&h2->frame_parser, wb, frame);
+  free(frame);
+
+  if (!success || !h2_flush(h2, wb->capacity)) {
+    return false;
+  }
+
+  return h2->ref_writer(h2->data, queued_frame->buf, queued_frame->buf_length, h2_buffer_release,
+                        shared_buffer_retain(queued_frame->buffer));
 }
 
-static bool h2_stream_trigger_send_data(h2_t * const h2, h2_stream_t * const stream)
+/**
+ * Whether the stream's next DATA frame fits in the flow control windows
+ */
+static bool h2_stream_can_send(void * data)
 {
+  h2_stream_t * stream = data;
+  h2_queued_frame_t * frame = stream->queued_data_frames;
 
-  while (stream->queued_data_frames) {
-    log_append(h2->log, LOG_TRACE, "Sending queued data for stream: %u", stream->id);
+  if (!frame || stream->state == STREAM_STATE_CLOSED) {
+    return false;
+  }
 
-    h2_queued_frame_t * frame = stream->queued_data_frames;
-    size_t frame_payload_size = frame->buf_length;
+  long frame_payload_size = frame->buf_length;
+
+  return frame_payload_size <= stream->h2->outgoing_window_size &&
+         frame_payload_size <= stream->outgoing_window_size;
+}
 
-    bool connection_window_open = (long)frame_payload_size <= h2->outgoing_window_size;
-    bool stream_window_open = (long)frame_payload_size <= stream->outgoing_window_size;
+static bool h2_stream_send_queued_frame(h2_t * const h2, h2_stream_t * const stream)
+{
+  h2_queued_frame_t * frame = stream->queued_data_frames;
+  size_t frame_payload_size = frame->buf_length;
 
-    if (connection_window_open && stream_window_open) {
-      bool success = h2_send_data_frame(h2, stream, frame);
+  bool success = h2_send_data_frame(h2, stream, frame);
 
-      if (success) {
-        h2->outgoing_window_size -= frame_payload_size;
-        stream->outgoing_window_size -= frame_payload_size;
-      }
+  if (success) {
+    h2->outgoing_window_size -= frame_payload_size;
+    stream->outgoing_window_size -= frame_payload_size;
+    h2_stream_touch(h2, stream);
+  }
 
-      stream->queued_data_frames = frame->next;
+  h2_priority_charge(&stream->priority_node, frame_payload_size);
 
-      if (frame->buf_begin) {
-        free(frame->buf_begin);
-      }
+  stream->queued_data_frames = frame->next;
+  h2->buffered_octets -= frame_payload_size;
 
-      free(frame);
+  shared_buffer_release(frame->buffer);
+  buffer_pool_put(&h2->queued_frame_pool, (uint8_t *) frame);
 
-      if (!success) {
-        return false;
-      }
+  if (!stream->queued_data_frames) {
+    h2_stream_close(h2, stream, false);
+  }
 
-    } else {
+  return success;
+}
 
-      // make sure we dont have any queued up data that needs to be sent
-      return h2_flush(h2, 0);
+/**
+ * Sends queued DATA frames in priority order until every queue is empty,
+ * the flow control windows are closed or writes are blocked
+ */
+static bool h2_trigger_send_data(h2_t * const h2)
+{
+  log_append(h2->log, LOG_TRACE, "Sending queued data for open streams");
+
+  while (!h2->write_blocked) {
+    h2_priority_node_t * next = h2_priority_next(&h2->priority_root, h2_stream_can_send);
 
+    if (!next) {
+      break;
     }
 
+    if (!h2_stream_send_queued_frame(h2, next->data)) {
+      return false;
+    }
   }
 
-  log_append(h2->log, LOG_TRACE, "Connection window size: %ld, stream window: %ld",
-             h2->outgoing_window_size, stream->outgoing_window_size);
+  log_append(h2->log, LOG_TRACE, "Connection window size: %ld", h2->outgoing_window_size);
+
+  if (h2->buffered_octets > 0) {
+    // some data is being held back - make sure everything before it goes out
+    return h2_flush(h2, 0);
+  }
 
   return true;
 }
 
-static bool h2_trigger_send_data(h2_t * const h2, h2_stream_t * stream)
+void h2_set_write_blocked(h2_t * const h2, bool blocked)
 {
+  if (h2->write_blocked == blocked) {
+    return;
+  }
 
-  if (stream) {
+  log_append(h2->log, LOG_DEBUG, "Writes %s", blocked ? "blocked" : "unblocked");
+  h2->write_blocked = blocked;
 
-    return h2_stream_trigger_send_data(h2, stream);
+  if (!blocked && !h2->closed) {
+    if (!h2_trigger_send_data(h2)) {
+      log_append(h2->log, LOG_WARN, "Could not send queued data");
+    }
 
-  } else {
+    if (!h2_flush(h2, 0)) {
+      log_append(h2->log, LOG_WARN, "Could not flush write buffer");
+    }
 
-    log_append(h2->log, LOG_TRACE, "Sending queued data for open frames");
+    h2_reclaim_streams(h2);
+  }
+}
 
-    // loop through open streams
-    hash_table_iter_t iter;
-    h2_stream_t * prev = NULL;
-    hash_table_iterator_init(&iter, h2->streams);
+void h2_set_refuse_streams(h2_t * const h2, bool refuse)
+{
+  if (h2->refuse_streams != refuse) {
+    log_append(h2->log, LOG_DEBUG, "%s new streams", refuse ? "Refusing" : "Accepting");
+    h2->refuse_streams = refuse;
+  }
+}
 
-    while (hash_table_iterate(&iter)) {
+void h2_set_early_data(h2_t * const h2, bool early_data)
+{
+  h2->early_data = early_data;
+}
 
-      if (prev) {
-        h2_stream_close(h2, prev, false);
-        prev = NULL;
-      }
+void h2_set_ref_writer(h2_t * const h2, const h2_write_ref_cb ref_writer)
+{
+  h2->ref_writer = ref_writer;
+}
 
-      stream = iter.value;
+/**
+ * Sends a GOAWAY and closes the connection without waiting for open streams
+ */
+static void h2_goaway_and_close(h2_t * const h2, enum h2_error_code_e error_code, char * debug)
+{
+  if (!h2_send_goaway(h2, error_code, debug)) {
+    log_append(h2->log, LOG_WARN, "Unable to send goaway frame");
+  }
 
-      if (stream->state != STREAM_STATE_CLOSED) {
+  h2_mark_closing(h2);
 
-        if (!h2_stream_trigger_send_data(h2, stream)) {
-          return false;
-        }
+  if (!h2->reading_from_client) {
+    h2_flush(h2, 0);
+    h2_close(h2);
+  }
+}
 
-        prev = stream;
+void h2_enhance_your_calm(h2_t * const h2)
+{
+  if (h2->closing || h2->closed) {
+    return;
+  }
 
-      }
-    }
+  log_append(h2->log, LOG_WARN, "Closing connection holding %zu octets", h2_memory_used(h2));
 
-    if (prev) {
-      h2_stream_close(h2, prev, false);
-      prev = NULL;
-    }
+  h2_goaway_and_close(h2, H2_ERROR_ENHANCE_YOUR_CALM, "Memory limit exceeded");
+}
 
-    log_append(h2->log, LOG_TRACE, "Connection window size: %ld", h2->outgoing_window_size);
+void h2_set_timeouts(h2_t * const h2, timer_wheel_t * timers, uint64_t settings_timeout,
+                     uint64_t stream_timeout)
+{
+  h2->timers = timers;
+  h2->settings_timeout = settings_timeout;
+  h2->stream_timeout = stream_timeout;
+}
 
-    return true;
+static void h2_settings_timed_out(timer_wheel_timer_t * timer)
+{
+  h2_t * h2 = timer->data;
+
+  if (h2->closing || h2->closed) {
+    return;
+  }
+
+  log_append(h2->log, LOG_WARN, "Settings were not acknowledged in time");
+
+  h2_goaway_and_close(h2, H2_ERROR_SETTINGS_TIMEOUT, NULL);
+}
+
+static void h2_stream_timed_out(timer_wheel_timer_t * timer)
+{
+  h2_stream_t * stream = timer->data;
+  h2_t * h2 = stream->h2;
+
+  if (h2->closed || stream->state == STREAM_STATE_CLOSED) {
+    return;
   }
 
+  // e.g. a WINDOW_UPDATE on the connection let the stream's data go, but it's
+  // still queued behind other streams
+  if (!h2_stream_waiting_on_peer(stream)) {
+    return;
+  }
+
+  log_append(h2->log, LOG_DEBUG, "Stream #%u timed out", stream->id);
+
+  // anything still queued will never be sent
+  h2_stream_drop_queued_data(stream);
+  h2_stream_mark_closing(h2, stream);
+  h2_stream_close(h2, stream, true);
+
+  h2_emit_error_and_close(h2, stream->id, H2_ERROR_CANCEL, NULL);
+  h2_flush(h2, 0);
+
+  h2_reclaim_streams(h2);
+  h2_shutdown_if_finished(h2);
+}
+
+size_t h2_memory_used(const h2_t * const h2)
+{
+  return h2->buffered_octets + h2->partial_frame_size + binary_buffer_size(&h2->write_buffer) +
+         h2->encoding_context->current_size + h2->decoding_context->current_size;
 }
 
 static h2_queued_frame_t * h2_queue_data_frame(h2_stream_t * const stream, uint8_t * buf, const size_t buf_length,
-    const bool end_stream, void * const buf_begin)
+    const bool end_stream, shared_buffer_t * const buffer)
 {
-  h2_queued_frame_t * new_frame = malloc(sizeof(h2_queued_frame_t));
+  h2_queued_frame_t * new_frame = (h2_queued_frame_t *) buffer_pool_get(&stream->h2->queued_frame_pool);
 
   if (!new_frame) {
     log_append(stream->h2->log, LOG_ERROR, "Unable to allocate space for new data frame");
@@ -1013,9 +1275,11 @@ static h2_queued_frame_t * h2_queue_data_frame(h2_stream_t * const stream, uint8
   new_frame->buf = buf;
   new_frame->buf_length = buf_length;
   new_frame->end_stream = end_stream;
-  new_frame->buf_begin = buf_begin;
+  new_frame->buffer = buffer ? shared_buffer_retain(buffer) : NULL;
   new_frame->next = NULL;
 
+  stream->h2->buffered_octets += buf_length;
+
   if (!stream->queued_data_frames) {
     stream->queued_data_frames = new_frame;
   } else {
@@ -1031,63 +1295,36 @@ static h2_queued_frame_t * h2_queue_data_frame(h2_stream_t * const stream, uint8
   return new_frame;
 }
 
-static bool h2_send_data(h2_t * const h2, h2_stream_t * const stream, uint8_t * in,
-                         const size_t in_length, bool last_in)
+/**
+ * Queues DATA frames for slice, which may be NULL if there is no data. The
+ * caller holds a reference to the buffer while this runs, so each frame only
+ * needs one of its own.
+ */
+static bool h2_send_data(h2_t * const h2, h2_stream_t * const stream, const shared_buffer_slice_t * const slice,
+                         bool last_in)
 {
   // TODO support padding?
 
-  if (in_length == 0) {
-    if (!h2_queue_data_frame(stream, in, in_length, last_in, in)) {
-      free(in);
-      return false;
-    }
-
-    return h2_trigger_send_data(h2, stream);
-  }
-
-  size_t remaining_length = in_length;
-  size_t per_frame_length;
-  uint8_t * per_frame_data = in;
-  bool last_frame = false;
-
-  bool in_freed = false;
-
-  while (remaining_length > 0) {
-    if (remaining_length > h2->max_frame_size) {
-      per_frame_length = h2->max_frame_size;
-      last_frame = false;
-    } else {
-      per_frame_length = remaining_length;
-      last_frame = true;
-    }
-
-    uint8_t * curr_frame_data = per_frame_data;
-    size_t curr_frame_length = per_frame_length;
+  shared_buffer_t * buffer = slice ? slice->buffer : NULL;
+  size_t remaining_length = slice ? slice->length : 0;
+  uint8_t * per_frame_data = slice ? shared_buffer_slice_data(slice) : NULL;
 
-    uint8_t * buf_begin = last_frame ? in : NULL;
-
-    if (buf_begin == in) {
-      in_freed = true;
-    }
+  do {
+    size_t per_frame_length = remaining_length > h2->max_frame_size ? h2->max_frame_size : remaining_length;
+    remaining_length -= per_frame_length;
 
-    if (!h2_queue_data_frame(stream, curr_frame_data, curr_frame_length, last_in && last_frame, buf_begin)) {
-      free(in);
+    if (!h2_queue_data_frame(stream, per_frame_data, per_frame_length, last_in && remaining_length == 0,
+                             buffer)) {
       return false;
     }
 
-    remaining_length -= per_frame_length;
     per_frame_data += per_frame_length;
-  }
+  } while (remaining_length > 0);
 
-  bool success = h2_trigger_send_data(h2, stream);
+  // the stream only times out if the data is held back by flow control
+  h2_stream_touch(h2, stream);
 
-  // use after free possible - if a frame in the middle doesn't get compressed (possibly due to the output being bigger than the
-  // input, which is unlikely), we will free the input here, but it may be needed afterwards
-  if (!in_freed) {
-    free(in);
-  }
-
-  return success;
+  return h2_trigger_send_data(h2);
 
 }
 
@@ -1127,6 +1364,11 @@ static bool h2_send_default_settings(h2_t * const h2)
 
   h2->settings_pending = true;
   h2->incoming_push_enabled_pending = true;
+
+  if (h2->timers && h2->settings_timeout) {
+    timer_wheel_add(h2->timers, &h2->settings_timer, h2->settings_timeout);
+  }
+
   h2->incoming_push_enabled_pending_value = false;
 
   return h2_frame_write(h2, (h2_frame_t *) frame);
@@ -1175,10 +1417,10 @@ static bool h2_send_window_update(const h2_t * const h2, const uint32_t stream_i
 
 static bool h2_adjust_initial_window_size(h2_t * const h2, const long difference)
 {
-  hash_table_iter_t iter;
-  hash_table_iterator_init(&iter, h2->streams);
+  h2_stream_table_iter_t iter;
+  h2_stream_table_iterator_init(&iter, &h2->streams);
 
-  while (hash_table_iterate(&iter)) {
+  while (h2_stream_table_iterate(&iter)) {
     h2_stream_t * stream = iter.value;
 
     stream->outgoing_window_size += difference;
@@ -1263,7 +1505,13 @@ static h2_stream_t * h2_stream_init(h2_t * const h2, const uint32_t stream_id, b
     return NULL;
   }
 
-  stream = malloc(sizeof(h2_stream_t));
+  if (h2_stream_table_closed(&h2->streams, stream_id)) {
+    h2_emit_error_and_close(h2, 0, H2_ERROR_PROTOCOL_ERROR,
+                         "Tried to initialize a closed stream: %u", stream_id);
+    return NULL;
+  }
+
+  stream = (h2_stream_t *) buffer_pool_get(&h2->stream_pool);
 
   if (!stream) {
     h2_emit_error_and_close(h2, stream_id, H2_ERROR_INTERNAL_ERROR,
@@ -1273,24 +1521,20 @@ static h2_stream_t * h2_stream_init(h2_t * const h2, const uint32_t stream_id, b
 
   stream->h2 = h2;
 
-  long * stream_id_key = malloc(sizeof(long));
-
-  if (!stream_id_key) {
+  if (!h2_stream_table_put(&h2->streams, stream_id, stream)) {
     h2_emit_error_and_close(h2, stream_id, H2_ERROR_INTERNAL_ERROR,
-                         "Unable to initialize stream (stream identifier): %u", stream_id);
-    free(stream);
+                         "Unable to initialize stream (stream table): %u", stream_id);
+    buffer_pool_put(&h2->stream_pool, (uint8_t *) stream);
     return NULL;
   }
 
-  * stream_id_key = stream_id;
-  hash_table_put(h2->streams, stream_id_key, stream);
-
   stream->queued_data_frames = NULL;
 
   stream->id = stream_id;
   stream->incoming_push = incoming_push;
   stream->state = STREAM_STATE_IDLE;
   stream->closing = false;
+  stream->end_stream_received = false;
   stream->header_fragments = NULL;
   stream->headers = NULL;
 
@@ -1298,6 +1542,10 @@ static h2_stream_t * h2_stream_init(h2_t * const h2, const uint32_t stream_id, b
   stream->priority_stream_dependency = DEFAULT_PRIORITY_STREAM_DEPENDENCY;
   stream->priority_weight = DEFAULT_PRIORITY_WEIGHT;;
 
+  h2_priority_init(&stream->priority_node, stream);
+  h2_priority_set(&stream->priority_node, &h2->priority_root, DEFAULT_PRIORITY_WEIGHT, false);
+  stream->priority_only = false;
+
   stream->outgoing_window_size = h2->initial_window_size;
   stream->incoming_window_size = DEFAULT_INITIAL_WINDOW_SIZE;
 
@@ -1306,9 +1554,42 @@ static h2_stream_t * h2_stream_init(h2_t * const h2, const uint32_t stream_id, b
   stream->request = NULL;
   stream->response = NULL;
 
+  stream->released = false;
+  stream->next_released = NULL;
+
+  timer_wheel_timer_init(&stream->idle_timer, h2_stream_timed_out, stream);
+  h2_stream_touch(h2, stream);
+
   return stream;
 }
 
+/**
+ * Early data may have been replayed - only requests that can safely be
+ * repeated are handled before the handshake completes
+ */
+static bool h2_request_safe_early(const http_request_t * const request)
+{
+  const char * method = http_request_method(request);
+
+  return method && (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0);
+}
+
+static bool h2_respond_too_early(h2_t * const h2, h2_stream_t * const stream)
+{
+  log_append(h2->log, LOG_DEBUG, "Stream #%u: rejecting %s request sent in early data", stream->id,
+             http_request_method(stream->request));
+
+  http_response_t * response = stream->response;
+  http_response_status_set(response, 425);
+  http_response_header_add(response, "content-length", "0");
+
+  // the client retries once the handshake is complete. Writing the
+  // response frees the request, so the rest of its body is dropped
+  stream->request = NULL;
+
+  return h2_response_write(stream, response, NULL, 0, true);
+}
+
 static bool h2_trigger_request(h2_t * const h2, h2_stream_t * const stream)
 {
   if (!h2->request_init) {
@@ -1335,9 +1616,14 @@ static bool h2_trigger_request(h2_t * const h2, h2_stream_t * const stream)
     h2->last_stream_id = stream->id;
   }
 
+  if (h2->early_data && !h2_request_safe_early(request)) {
+    return h2_respond_too_early(h2, stream);
+  }
+
   if (!plugin_invoke(h2->plugin_invoker, HANDLE_REQUEST, request, response)) {
     http_response_free(response);
     stream->response = NULL;
+    stream->request = NULL;
 
     log_append(h2->log, LOG_ERROR, "No plugin handled this request");
     return false;
@@ -1351,6 +1637,8 @@ bool h2_request_begin(h2_t * const h2, header_list_t * headers, uint8_t * buf, s
   h2_stream_t * stream = h2_stream_init(h2, 1, false);
   ASSERT_OR_RETURN_FALSE(stream);
   stream->headers = headers;
+  // the upgraded request was read in full
+  stream->end_stream_received = true;
 
   if (!h2_trigger_request(h2, stream)) {
     return false;
@@ -1372,7 +1660,7 @@ static bool h2_incoming_frame_data(h2_t * const h2, const h2_frame_data_t * cons
 
 
   h2_stream_t * stream = h2_stream_get(h2, frame->stream_id);
-  if (!stream || h2_stream_closed(h2, frame->stream_id)) {
+  if (!stream || stream->priority_only || h2_stream_closed(h2, frame->stream_id)) {
     h2_emit_error_and_close(h2, frame->stream_id, H2_ERROR_STREAM_CLOSED,
                          "Unable to find stream #%u", frame->stream_id);
     return true;
@@ -1382,9 +1670,15 @@ static bool h2_incoming_frame_data(h2_t * const h2, const h2_frame_data_t * cons
 
   // pass on to application
   bool last_data_frame = FRAME_FLAG(frame, FLAG_END_STREAM);
+  if (last_data_frame) {
+    stream->end_stream_received = true;
+  }
 
-  plugin_invoke(h2->plugin_invoker, HANDLE_DATA, stream->request, stream->response,
-                frame->payload, frame->payload_length, last_data_frame, false);
+  // the request may have already been answered (e.g. 425 Too Early)
+  if (stream->request) {
+    plugin_invoke(h2->plugin_invoker, HANDLE_DATA, stream->request, stream->response,
+                  frame->payload, frame->payload_length, last_data_frame, false);
+  }
 
   // do we need to send WINDOW_UPDATE?
   if (h2->incoming_window_size < 0) {
@@ -1430,7 +1724,7 @@ static bool h2_incoming_frame_data(h2_t * const h2, const h2_frame_data_t * cons
 static bool h2_stream_add_header_fragment(h2_stream_t * const stream, const uint8_t * const buffer,
     const size_t length)
 {
-  h2_header_fragment_t * fragment = malloc(sizeof(h2_header_fragment_t));
+  h2_header_fragment_t * fragment = (h2_header_fragment_t *) buffer_pool_get(&stream->h2->header_fragment_pool);
 
   if (!fragment) {
     log_append(stream->h2->log, LOG_ERROR, "Unable to allocate space for header fragment");
@@ -1441,13 +1735,14 @@ static bool h2_stream_add_header_fragment(h2_stream_t * const stream, const uint
 
   if (!fragment->buffer) {
     log_append(stream->h2->log, LOG_ERROR, "Unable to allocate space for header fragment");
-    free(fragment);
+    buffer_pool_put(&stream->h2->header_fragment_pool, (uint8_t *) fragment);
     return false;
   }
 
   memcpy(fragment->buffer, buffer, length);
   fragment->length = length;
   fragment->next = NULL;
+  stream->h2->buffered_octets += length;
 
   h2_header_fragment_t * current = stream->header_fragments;
 
@@ -1490,8 +1785,9 @@ static bool h2_parse_header_fragments(h2_t * const h2, h2_stream_t * const strea
     header_appender += current->length;
     h2_header_fragment_t * prev = current;
     current = current->next;
+    h2->buffered_octets -= prev->length;
     free(prev->buffer);
-    free(prev);
+    buffer_pool_put(&h2->header_fragment_pool, (uint8_t *) prev);
   }
   stream->header_fragments = NULL;
 
@@ -1526,6 +1822,14 @@ static bool h2_received_headers(h2_t * const h2, h2_stream_t * stream)
   }
 
   if (!(h2->closing || h2->shutting_down)) {
+
+    if (h2->refuse_streams) {
+      // the headers have been decoded so the HPACK context stays in sync
+      log_append(h2->log, LOG_DEBUG, "Refusing stream #%u: over memory budget", stream->id);
+      h2_stream_close(h2, stream, true);
+      return h2_emit_error_and_close(h2, stream->id, H2_ERROR_REFUSED_STREAM, NULL);
+    }
+
     // TODO - check that the stream is in a valid state to be opened first
     stream->state = STREAM_STATE_OPEN;
     h2->incoming_concurrent_streams++;
@@ -1536,18 +1840,69 @@ static bool h2_received_headers(h2_t * const h2, h2_stream_t * stream)
   return true;
 }
 
+/**
+ * Moves the stream in the dependency tree. weight is the value sent on the
+ * wire (0 to 255).
+ */
+static void h2_stream_prioritize(h2_t * const h2, h2_stream_t * const stream, uint32_t dependency,
+                                 uint8_t weight, bool exclusive)
+{
+  stream->priority_exclusive = exclusive;
+  stream->priority_stream_dependency = dependency;
+  stream->priority_weight = weight;
+
+  h2_priority_node_t * parent = &h2->priority_root;
+  uint16_t node_weight = weight + 1;
+
+  if (dependency > 0) {
+    h2_stream_t * parent_stream = h2_stream_get(h2, dependency);
+
+    if (parent_stream && h2_priority_attached(&parent_stream->priority_node)) {
+      parent = &parent_stream->priority_node;
+    } else {
+      // section 5.3.1 - a dependency on a stream that isn't in the tree gets
+      // the default priority instead
+      log_append(h2->log, LOG_DEBUG, "Stream #%u depends on unknown stream #%u", stream->id, dependency);
+      node_weight = DEFAULT_PRIORITY_WEIGHT;
+      exclusive = false;
+    }
+  }
+
+  log_append(h2->log, LOG_TRACE, "Stream #%u depends on #%u, weight: %u, exclusive: %s", stream->id,
+             dependency, node_weight, exclusive ? "yes" : "no");
+
+  h2_priority_set(&stream->priority_node, parent, node_weight, exclusive);
+}
+
 static bool h2_incoming_frame_headers(h2_t * const h2, const h2_frame_headers_t * const frame)
 {
-  h2_stream_t * stream = h2_stream_init(h2, frame->stream_id, false);
+  h2_stream_t * stream = h2_stream_get(h2, frame->stream_id);
+
+  if (stream && stream->priority_only) {
+    // a PRIORITY frame put the stream in the tree before it was opened
+    stream->priority_only = false;
+    h2->priority_only_streams--;
+    h2_stream_touch(h2, stream);
+  } else {
+    stream = h2_stream_init(h2, frame->stream_id, false);
+  }
 
   if (!stream) {
     return false;
   }
 
+  if (FRAME_FLAG(frame, FLAG_END_STREAM)) {
+    stream->end_stream_received = true;
+  }
+
   if (FRAME_FLAG(frame, FLAG_PRIORITY)) {
-    stream->priority_exclusive = frame->priority_exclusive;
-    stream->priority_stream_dependency = frame->priority_stream_dependency;
-    stream->priority_weight = frame->priority_weight;
+    if (frame->priority_stream_dependency == stream->id) {
+      // rejected once the headers have been decoded
+      stream->priority_stream_dependency = frame->priority_stream_dependency;
+    } else {
+      h2_stream_prioritize(h2, stream, frame->priority_stream_dependency, frame->priority_weight,
+                           frame->priority_exclusive);
+    }
   }
 
   if (!h2_stream_add_header_fragment(stream, frame->header_block_fragment,
@@ -1680,6 +2035,10 @@ static bool h2_incoming_frame_settings(h2_t * const h2, const h2_frame_settings_
 
     h2->settings_pending = false;
 
+    if (h2->timers) {
+      timer_wheel_cancel(h2->timers, &h2->settings_timer);
+    }
+
     return true;
 
   } else {
@@ -1718,7 +2077,7 @@ static bool h2_increment_connection_window_size(h2_t * const h2, const uint32_t
 
   log_append(h2->log, LOG_TRACE, "Connection window size incremented to: %ld", h2->outgoing_window_size);
 
-  return h2_trigger_send_data(h2, NULL);
+  return h2_trigger_send_data(h2);
 }
 
 static bool h2_increment_stream_window_size(h2_t * const h2, const uint32_t stream_id,
@@ -1743,7 +2102,7 @@ static bool h2_increment_stream_window_size(h2_t * const h2, const uint32_t stre
 
   log_append(h2->log, LOG_TRACE, "Stream window size incremented to: %ld", stream->outgoing_window_size);
 
-  return h2_trigger_send_data(h2, stream);
+  return h2_trigger_send_data(h2);
 
 }
 
@@ -1770,6 +2129,12 @@ static bool h2_incoming_frame_rst_stream(h2_t * const h2, h2_frame_rst_stream_t
              frame->stream_id, h2_error_to_string(frame->error_code), frame->error_code);
 
   h2_stream_t * stream = h2_stream_get(h2, frame->stream_id);
+
+  if (stream == NULL && h2_stream_closed(h2, frame->stream_id)) {
+    // the stream has already been closed and freed
+    return true;
+  }
+
   if (stream == NULL) {
     h2_emit_error_and_close(h2, 0, H2_ERROR_PROTOCOL_ERROR,
                          "Received %s (0x%x) for stream in IDLE state: %u",
@@ -1784,17 +2149,46 @@ static bool h2_incoming_frame_rst_stream(h2_t * const h2, h2_frame_rst_stream_t
 
 static bool h2_incoming_frame_priority(h2_t * const h2, h2_frame_priority_t * const frame)
 {
+  if (frame->priority_stream_dependency == frame->stream_id) {
+    h2_emit_error_and_close(h2, frame->stream_id, H2_ERROR_PROTOCOL_ERROR,
+        "%s (0x%x) frame stream dependency cannot match the stream id",
+        frame_type_to_string(FRAME_TYPE_PRIORITY), FRAME_TYPE_PRIORITY);
+    return true;
+  }
+
   h2_stream_t * stream = h2_stream_get(h2, frame->stream_id);
 
   if (!stream) {
-    log_append(h2->log, LOG_DEBUG, "Unknown stream id for priority frame: %u",
-                         frame->stream_id);
+    // clients may prioritize idle streams, e.g. to use them to group others
+    bool idle = frame->stream_id % 2 == 1 && frame->stream_id > h2->last_stream_id;
+
+    if (!idle || h2->priority_only_streams >= H2_MAX_PRIORITY_ONLY_STREAMS) {
+      log_append(h2->log, LOG_DEBUG, "Ignoring priority frame for stream: %u", frame->stream_id);
+      return true;
+    }
+
+    stream = h2_stream_init(h2, frame->stream_id, false);
+
+    if (!stream) {
+      return false;
+    }
+
+    // an idle stream can't time out
+    if (h2->timers) {
+      timer_wheel_cancel(h2->timers, &stream->idle_timer);
+    }
+
+    stream->priority_only = true;
+    h2->priority_only_streams++;
+  }
+
+  if (stream->state == STREAM_STATE_CLOSED) {
+    log_append(h2->log, LOG_DEBUG, "Ignoring priority frame for closed stream: %u", frame->stream_id);
     return true;
   }
 
-  stream->priority_exclusive = frame->priority_exclusive;
-  stream->priority_stream_dependency = frame->priority_stream_dependency;
-  stream->priority_weight = frame->priority_weight;
+  h2_stream_prioritize(h2, stream, frame->priority_stream_dependency, frame->priority_weight,
+                       frame->priority_exclusive);
 
   return true;
 }
@@ -1893,6 +2287,13 @@ static bool h2_incoming_frame(void * data, const h2_frame_t * const frame)
   }
 
   if (success) {
+    if (frame->stream_id > 0) {
+      h2_stream_t * stream = h2_stream_get(h2, frame->stream_id);
+      if (stream) {
+        h2_stream_touch(h2, stream);
+      }
+    }
+
     plugin_invoke(h2->plugin_invoker, POSTPROCESS_INCOMING_FRAME, frame);
   }
 
@@ -1927,10 +2328,9 @@ bool h2_settings_apply(h2_t * const h2, char * base64)
 static bool h2_verify_tls_settings(h2_t * const h2)
 {
   if (h2->tls_version) {
-    // TODO support newer versions?
-    log_append(h2->log, LOG_TRACE, "Comparing: %s == %s", h2->tls_version, "TLSv1.2");
+    log_append(h2->log, LOG_TRACE, "Comparing: %s >= %s", h2->tls_version, "TLSv1.2");
 
-    if (strcmp(h2->tls_version, "TLSv1.2") != 0) {
+    if (strcmp(h2->tls_version, "TLSv1.2") != 0 && strcmp(h2->tls_version, "TLSv1.3") != 0) {
       return false;
     }
   }
@@ -1979,52 +2379,101 @@ static bool h2_add_from_buffer(h2_t * const h2)
   return false;
 }
 
+static void h2_partial_reset(h2_t * const h2)
+{
+  if (h2->partial_frame) {
+    free(h2->partial_frame);
+  }
+
+  h2->partial_header_length = 0;
+  h2->partial_frame = NULL;
+  h2->partial_frame_length = 0;
+  h2->partial_frame_size = 0;
+}
+
+static bool h2_partial_pending(const h2_t * const h2)
+{
+  return h2->partial_header_length > 0 || h2->partial_frame;
+}
+
 /**
- * Reads the given buffer and acts on it. Caller must give up ownership of the
- * buffer.
+ * Copies as much of the given buffer as is needed to complete the partial
+ * frame (or connection preface).
+ *
+ * Returns the number of octets used.
  */
-void h2_read(h2_t * const h2, uint8_t * const buffer, const size_t len)
+static size_t h2_partial_fill(h2_t * const h2, uint8_t * const buffer, const size_t len)
 {
-  log_append(h2->log, LOG_TRACE, "Reading from buffer: %zu", len);
+  size_t consumed = 0;
+
+  if (!h2->partial_frame) {
+    size_t needed = h2->received_connection_preface ? FRAME_HEADER_SIZE : H2_CONNECTION_PREFACE_LENGTH;
+    size_t copy_length = needed - h2->partial_header_length;
+    if (copy_length > len) {
+      copy_length = len;
+    }
+
+    memcpy(h2->partial_header + h2->partial_header_length, buffer, copy_length);
+    h2->partial_header_length += copy_length;
+    consumed += copy_length;
+
+    if (h2->partial_header_length < needed || !h2->received_connection_preface) {
+      return consumed;
+    }
 
-  size_t unprocessed_bytes = h2->buffer_length;
+    // the frame header is complete - now we know how big the frame is
+    uint32_t frame_length = get_bits32(h2->partial_header, 0xFFFFFF00) >> 8;
 
-  if (unprocessed_bytes > 0) {
-    log_append(h2->log, LOG_TRACE, "Appending new data to unprocessed bytes %zu + %zu = %zu",
-               unprocessed_bytes, len, unprocessed_bytes + len);
-    // there are still unprocessed bytes
-    h2->buffer = realloc(h2->buffer, unprocessed_bytes + len);
+    // we never advertise a larger SETTINGS_MAX_FRAME_SIZE
+    if (frame_length > DEFAULT_MAX_FRAME_SIZE) {
+      h2_emit_error_and_close(h2, 0, H2_ERROR_FRAME_SIZE_ERROR,
+          "Frame length %u exceeds the maximum frame size", frame_length);
+      // the rest of the stream can't be framed any more
+      h2_mark_closing(h2);
+      h2_partial_reset(h2);
+      return len;
+    }
+
+    h2->partial_frame_size = FRAME_HEADER_SIZE + frame_length;
+    h2->partial_frame = malloc(h2->partial_frame_size);
 
-    if (!h2->buffer) {
+    if (!h2->partial_frame) {
       h2_emit_error_and_close_with_debug_data(h2, 0, H2_ERROR_INTERNAL_ERROR,
           "Unable to allocate memory for reading full frame");
-      free(buffer);
-      h2->buffer_length = 0;
-      return;
+      h2_mark_closing(h2);
+      h2_partial_reset(h2);
+      return len;
     }
 
-    memcpy(h2->buffer + unprocessed_bytes, buffer, len);
-    h2->buffer_length = unprocessed_bytes + len;
-    free(buffer);
-  } else {
-    h2->buffer = buffer;
-    h2->buffer_length = len;
+    memcpy(h2->partial_frame, h2->partial_header, FRAME_HEADER_SIZE);
+    h2->partial_frame_length = FRAME_HEADER_SIZE;
+    h2->partial_header_length = 0;
   }
 
-  h2->buffer_position = 0;
-
-  if (!h2->verified_tls_settings) {
-    if (h2_verify_tls_settings(h2)) {
-      h2->verified_tls_settings = true;
-    } else {
-      h2_emit_error_and_close_with_debug_data(h2, 0, H2_ERROR_INADEQUATE_SECURITY, "Inadequate security");
-      free(h2->buffer);
-      h2->buffer = NULL;
-      h2->buffer_length = 0;
-      return;
-    }
+  size_t copy_length = h2->partial_frame_size - h2->partial_frame_length;
+  if (copy_length > len - consumed) {
+    copy_length = len - consumed;
   }
 
+  memcpy(h2->partial_frame + h2->partial_frame_length, buffer + consumed, copy_length);
+  h2->partial_frame_length += copy_length;
+  consumed += copy_length;
+
+  return consumed;
+}
+
+/**
+ * Processes as many complete frames from the buffer as possible. The buffer
+ * is not kept after returning.
+ *
+ * Returns the number of octets processed.
+ */
+static size_t h2_parse(h2_t * const h2, uint8_t * const buffer, const size_t len)
+{
+  h2->buffer = buffer;
+  h2->buffer_length = len;
+  h2->buffer_position = 0;
+
   if (!h2->received_connection_preface) {
     enum h2_detect_result_e result = h2_detect_connection(h2->buffer, h2->buffer_length);
     if (result == H2_DETECT_SUCCESS) {
@@ -2034,17 +2483,17 @@ void h2_read(h2_t * const h2, uint8_t * const buffer, const size_t len)
       log_append(h2->log, LOG_TRACE, "Found HTTP2 connection");
     } else if (result == H2_DETECT_NEED_MORE_DATA) {
       log_append(h2->log, LOG_WARN, "Need more data to detect connection");
-      goto handle_buffer;
-      return;
+      h2->buffer = NULL;
+      h2->buffer_length = 0;
+      return 0;
     } else {
       log_append(h2->log, LOG_WARN, "Found non-HTTP2 connection, closing connection");
-      free(h2->buffer);
       h2->buffer = NULL;
       h2->buffer_length = 0;
 
       h2_mark_closing(h2);
       h2_close(h2);
-      return;
+      return len;
     }
   }
 
@@ -2054,38 +2503,97 @@ void h2_read(h2_t * const h2, uint8_t * const buffer, const size_t len)
 
   h2->reading_from_client = false;
 
-handle_buffer:
+  size_t consumed = h2->buffer_position;
 
-  if (!h2_flush(h2, 0)) {
-    log_append(h2->log, LOG_WARN, "Could not flush write buffer");
-  }
-
-  if (h2->buffer_position > h2->buffer_length) {
+  if (consumed > len) {
     // buffer overflow
     h2_emit_error_and_close_with_debug_data(h2, 0, H2_ERROR_INTERNAL_ERROR, NULL);
-    h2->buffer = NULL;
-    h2->buffer_length = 0;
-    free(h2->buffer);
-    return;
+    consumed = len;
   }
 
-  // if there is still unprocessed data in the buffer, save it for when we
-  // get the rest of the frame
-  unprocessed_bytes = h2->buffer_length - h2->buffer_position;
+  h2->buffer = NULL;
+  h2->buffer_length = 0;
+  h2->buffer_position = 0;
 
-  if (!(h2->closing || h2->shutting_down) && unprocessed_bytes > 0) {
-    log_append(h2->log, LOG_TRACE, "Unable to process last %zu bytes", unprocessed_bytes);
-    // use memmove because it might overlap
-    memmove(h2->buffer, h2->buffer + h2->buffer_position, unprocessed_bytes);
-    h2->buffer = realloc(h2->buffer, unprocessed_bytes);
-    h2->buffer_length = unprocessed_bytes;
-    h2->buffer_position = 0;
-  } else {
-    free(h2->buffer);
-    h2->buffer = NULL;
-    h2->buffer_length = 0;
+  return consumed;
+}
+
+/**
+ * Reads the given buffer and acts on it. The buffer is only borrowed for the
+ * duration of the call.
+ *
+ * Complete frames are processed straight out of the given buffer. Only a
+ * frame that is split across reads is copied, into a buffer allocated once
+ * its header says how large it is.
+ */
+void h2_read(h2_t * const h2, uint8_t * const buffer, const size_t len)
+{
+  log_append(h2->log, LOG_TRACE, "Reading from buffer: %zu", len);
+
+  if (!h2->verified_tls_settings) {
+    if (h2_verify_tls_settings(h2)) {
+      h2->verified_tls_settings = true;
+    } else {
+      h2_emit_error_and_close_with_debug_data(h2, 0, H2_ERROR_INADEQUATE_SECURITY, "Inadequate security");
+      return;
+    }
   }
 
+  uint8_t * pos = buffer;
+  size_t remaining = len;
+
+  while (!h2->closing) {
+
+    if (h2_partial_pending(h2)) {
+      size_t consumed = h2_partial_fill(h2, pos, remaining);
+      pos += consumed;
+      remaining -= consumed;
+
+      bool complete = h2->received_connection_preface ?
+        h2->partial_frame && h2->partial_frame_length == h2->partial_frame_size :
+        h2->partial_header_length == H2_CONNECTION_PREFACE_LENGTH;
+
+      if (!complete) {
+        log_append(h2->log, LOG_TRACE, "Waiting for the rest of a partial frame");
+        break;
+      }
+
+      if (h2->partial_frame) {
+        h2_parse(h2, h2->partial_frame, h2->partial_frame_size);
+      } else {
+        h2_parse(h2, h2->partial_header, h2->partial_header_length);
+      }
+
+      h2_partial_reset(h2);
+      continue;
+    }
+
+    if (remaining == 0) {
+      break;
+    }
+
+    size_t consumed = h2_parse(h2, pos, remaining);
+    pos += consumed;
+    remaining -= consumed;
+
+    if (remaining > 0 && !h2->closing) {
+      // the rest doesn't make up a full frame - keep it for the next read
+      log_append(h2->log, LOG_TRACE, "Unable to process last %zu bytes", remaining);
+      consumed = h2_partial_fill(h2, pos, remaining);
+      pos += consumed;
+      remaining -= consumed;
+    }
+  }
+
+  if (h2->closing) {
+    h2_partial_reset(h2);
+  }
+
+  if (!h2_flush(h2, 0)) {
+    log_append(h2->log, LOG_WARN, "Could not flush write buffer");
+  }
+
+  h2_reclaim_streams(h2);
   h2_shutdown_if_finished(h2);
 }
 
@@ -2108,11 +2616,15 @@ void h2_shutdown(h2_t * const h2)
     return;
   }
 
+  if (!h2->reading_from_client) {
+    h2_flush(h2, 0);
+  }
+
   h2_shutdown_if_finished(h2);
 }
 
-bool h2_response_write(h2_stream_t * stream, http_response_t * const response, uint8_t * data, const size_t data_length,
-                       bool last)
+bool h2_response_write_buffer(h2_stream_t * stream, http_response_t * const response,
+                              const shared_buffer_slice_t * const slice, bool last)
 {
   h2_t * h2 = stream->h2;
 
@@ -2128,8 +2640,8 @@ bool h2_response_write(h2_stream_t * stream, http_response_t * const response, u
       return false;
     }
 
-    if (data || last) {
-      if (!h2_send_data(h2, stream, data, data_length, last)) {
+    if (slice || last) {
+      if (!h2_send_data(h2, stream, slice, last)) {
         h2_emit_error_and_close_with_debug_data(h2, stream->id, H2_ERROR_INTERNAL_ERROR,
             "Unable to emit data");
         return false;
@@ -2144,21 +2656,28 @@ bool h2_response_write(h2_stream_t * stream, http_response_t * const response, u
   if (last) {
     http_response_free(response);
     stream->response = NULL;
+    stream->request = NULL;
 
     h2_stream_mark_closing(h2, stream);
+    h2_stream_close(h2, stream, false);
   }
 
+  h2_reclaim_streams(h2);
+
   return true;
 }
 
-bool h2_response_write_data(h2_stream_t * stream, http_response_t * const response, uint8_t * data,
-                            const size_t data_length, bool last)
+bool h2_response_write_data_buffer(h2_stream_t * stream, http_response_t * const response,
+                                   const shared_buffer_slice_t * const slice, bool last)
 {
-
   h2_t * h2 = stream->h2;
 
-  if (data || last) {
-    if (!h2_send_data(h2, stream, data, data_length, last)) {
+  if (stream->state == STREAM_STATE_CLOSED) {
+    // the stream was reset or timed out while the response was being produced
+    log_append(h2->log, LOG_DEBUG, "Dropping %zu octets for closed stream #%u", slice ? slice->length : 0,
+               stream->id);
+  } else if (slice || last) {
+    if (!h2_send_data(h2, stream, slice, last)) {
       h2_emit_error_and_close_with_debug_data(h2, stream->id, H2_ERROR_INTERNAL_ERROR,
           "Unable to emit data");
       return false;
@@ -2172,12 +2691,61 @@ bool h2_response_write_data(h2_stream_t * stream, http_response_t * const respon
   if (last) {
     http_response_free(response);
     stream->response = NULL;
+    stream->request = NULL;
 
     h2_stream_mark_closing(h2, stream);
+    h2_stream_close(h2, stream, false);
   }
 
+  h2_reclaim_streams(h2);
+
   return true;
+}
+
+bool h2_response_write(h2_stream_t * stream, http_response_t * const response, uint8_t * data, const size_t data_length,
+                       bool last)
+{
+  if (!data) {
+    return h2_response_write_buffer(stream, response, NULL, last);
+  }
+
+  shared_buffer_t * buffer = shared_buffer_init(data, data_length, NULL, NULL);
+
+  if (!buffer) {
+    free(data);
+    h2_emit_error_and_close_with_debug_data(stream->h2, stream->id, H2_ERROR_INTERNAL_ERROR,
+        "Unable to allocate data buffer");
+    return false;
+  }
+
+  shared_buffer_slice_t slice = shared_buffer_slice(buffer, 0, data_length);
+  bool success = h2_response_write_buffer(stream, response, &slice, last);
+  shared_buffer_release(buffer);
+
+  return success;
+}
+
+bool h2_response_write_data(h2_stream_t * stream, http_response_t * const response, uint8_t * data,
+                            const size_t data_length, bool last)
+{
+  if (!data) {
+    return h2_response_write_data_buffer(stream, response, NULL, last);
+  }
+
+  shared_buffer_t * buffer = shared_buffer_init(data, data_length, NULL, NULL);
 
+  if (!buffer) {
+    free(data);
+    h2_emit_error_and_close_with_debug_data(stream->h2, stream->id, H2_ERROR_INTERNAL_ERROR,
+        "Unable to allocate data buffer");
+    return false;
+  }
+
+  shared_buffer_slice_t slice = shared_buffer_slice(buffer, 0, data_length);
+  bool success = h2_response_write_data_buffer(stream, response, &slice, last);
+  shared_buffer_release(buffer);
+
+  return success;
 }
 
 http_request_t * h2_push_init(h2_stream_t * stream, http_request_t * const original_request)
@@ -2212,10 +2780,14 @@ http_request_t * h2_push_init(h2_stream_t * stream, http_request_t * const origi
   h2->current_stream_id += 2;
 
   pushed_stream->state = STREAM_STATE_RESERVED_LOCAL;
+  pushed_stream->end_stream_received = true;
   h2->outgoing_concurrent_streams++;
 
   pushed_stream->associated_stream_id = stream->id;
 
+  // section 5.3.5 - pushed streams depend on the stream they were pushed for
+  h2_stream_prioritize(h2, pushed_stream, stream->id, DEFAULT_PRIORITY_WEIGHT - 1, false);
+
   http_request_t * pushed_request = h2->request_init(h2->data, pushed_stream, NULL);
   ASSERT_OR_RETURN_NULL(pushed_request);
 
@@ -2252,6 +2824,7 @@ bool h2_push(h2_stream_t * stream, http_request_t * const request)
   if (!plugin_invoke(h2->plugin_invoker, HANDLE_REQUEST, request, response)) {
     http_response_free(response);
     stream->response = NULL;
+    stream->request = NULL;
 
     log_append(h2->log, LOG_ERROR, "No plugin handled this pushed request");
     return false;
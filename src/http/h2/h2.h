@@ -6,6 +6,9 @@
 #include "plugin_callbacks.h"
 
 #include "hash_table.h"
+#include "buffer_pool.h"
+#include "timer_wheel.h"
+#include "shared_buffer.h"
 #include "hpack/hpack.h"
 
 #include "http/request.h"
@@ -14,11 +17,23 @@
 #include "h2_error.h"
 #include "h2_setting.h"
 #include "h2_frame.h"
+#include "h2_priority.h"
+#include "h2_stream_table.h"
 
 #define PUSH_ENABLED true
 
 typedef bool (*h2_write_cb)(void * data, uint8_t * buf, size_t len);
 
+typedef void (*h2_release_cb)(void * data);
+
+/**
+ * Writes buf without copying it. release is called with release_data once
+ * the writer no longer needs buf - after the write has finished, or straight
+ * away if it fails.
+ */
+typedef bool (*h2_write_ref_cb)(void * data, uint8_t * buf, size_t len, h2_release_cb release,
+                                void * release_data);
+
 typedef void (*h2_close_cb)(void * data);
 
 typedef http_request_t * (*h2_request_init_cb)(void * data, void * user_data, header_list_t * headers);
@@ -46,6 +61,22 @@ enum stream_state_e {
 #define DEFAULT_MAX_FRAME_SIZE 16384 // 2^14
 #define DEFAULT_MAX_HEADER_LIST_SIZE 0 // unlimited
 
+// big enough for a frame header or the connection preface
+#define H2_PARTIAL_HEADER_SIZE 24
+
+// smaller DATA payloads are copied with the frame header instead of being
+// written by reference
+#define H2_MIN_REFERENCED_DATA_LENGTH 1024
+
+// idle streams that are only kept around for their place in the priority tree
+#define H2_MAX_PRIORITY_ONLY_STREAMS 100
+
+// how many freed streams, queued DATA frames and header fragments each
+// connection keeps for reuse
+#define H2_STREAM_POOL_SIZE DEFAULT_MAX_CONNCURRENT_STREAMS
+#define H2_QUEUED_FRAME_POOL_SIZE 64
+#define H2_HEADER_FRAGMENT_POOL_SIZE 16
+
 typedef struct h2_header_fragment_s {
 
   uint8_t * buffer;
@@ -57,16 +88,14 @@ typedef struct h2_header_fragment_s {
 typedef struct h2_queued_frame_s {
   struct h2_queued_frame_s * next;
 
+  // part of buffer (if there is one)
   uint8_t * buf;
   size_t buf_length;
 
-  /**
-   * The buf may be part of a larger buffer
-   * that needs to be free'd.
-   * If the buffer should be free'd after the data
-   * is sent, this is the point to the full buffer.
-   */
-  void * buf_begin;
+  // each frame holds a reference to the application's buffer, as does each
+  // write that sends part of it without copying - which can outlive the
+  // connection
+  shared_buffer_t * buffer;
 
   bool continuation;
   bool end_stream;
@@ -75,7 +104,7 @@ typedef struct h2_queued_frame_s {
 
 struct h2_t;
 
-typedef struct {
+typedef struct h2_stream_s {
 
   struct h2_t * h2;
 
@@ -102,6 +131,9 @@ typedef struct {
 
   bool closing;
 
+  // the peer has sent END_STREAM, so the request is complete
+  bool end_stream_received;
+
   uint32_t priority;
 
   long outgoing_window_size;
@@ -126,6 +158,19 @@ typedef struct {
   uint8_t priority_weight;
   bool priority_exclusive;
 
+  // the stream's place in the dependency tree while it isn't closed
+  h2_priority_node_t priority_node;
+  // created by a PRIORITY frame for an idle stream (e.g. as a grouping node)
+  bool priority_only;
+
+  // closed and out of the stream table, waiting to be freed
+  bool released;
+  struct h2_stream_s * next_released;
+
+  // reset when nothing has been sent or received on the stream for a while
+  // and it is waiting on the peer
+  timer_wheel_timer_t idle_timer;
+
 } h2_stream_t;
 
 typedef struct h2_t {
@@ -135,6 +180,8 @@ typedef struct h2_t {
   struct log_context_t * log;
 
   h2_write_cb writer;
+  // optional - DATA payloads are copied into the write buffer without it
+  h2_write_ref_cb ref_writer;
   h2_close_cb closer;
   struct plugin_invoker_t * plugin_invoker;
   h2_request_init_cb request_init;
@@ -167,6 +214,15 @@ typedef struct h2_t {
    */
   bool settings_pending;
 
+  /**
+   * Timeouts, in ticks of the timer wheel. No timeouts are used if there is
+   * no wheel.
+   */
+  timer_wheel_t * timers;
+  uint64_t settings_timeout;
+  uint64_t stream_timeout;
+  timer_wheel_timer_t settings_timer;
+
   bool incoming_push_enabled;
   bool incoming_push_enabled_pending;
   bool incoming_push_enabled_pending_value;
@@ -191,7 +247,30 @@ typedef struct h2_t {
   size_t buffer_position;
   bool reading_from_client;
 
+  /**
+   * A frame (or the connection preface) that was split across reads. The
+   * frame header is collected first so that the rest of the frame can be
+   * copied into a buffer of exactly the right size.
+   */
+  uint8_t partial_header[H2_PARTIAL_HEADER_SIZE];
+  size_t partial_header_length;
+  uint8_t * partial_frame;
+  size_t partial_frame_length;
+  size_t partial_frame_size;
+
   binary_buffer_t write_buffer;
+  // set while the socket has too much outstanding data - queued DATA frames
+  // are held back until it drains
+  bool write_blocked;
+
+  // octets held in header fragments and queued DATA frames
+  size_t buffered_octets;
+  // set while the connection is over its memory budget - new streams are
+  // reset with REFUSED_STREAM
+  bool refuse_streams;
+
+  // set while the data being read is TLS early data
+  bool early_data;
 
   /**
    * Connection settings
@@ -203,7 +282,17 @@ typedef struct h2_t {
   size_t max_frame_size;
   size_t max_header_list_size;
 
-  hash_table_t * streams;
+  h2_stream_table_t streams;
+  // closed streams that are freed once nothing on the stack can be using them
+  h2_stream_t * released_streams;
+
+  buffer_pool_t stream_pool;
+  buffer_pool_t queued_frame_pool;
+  buffer_pool_t header_fragment_pool;
+
+  // the root of the stream dependency tree
+  h2_priority_node_t priority_root;
+  size_t priority_only_streams;
 
   hpack_context_t * encoding_context;
   hpack_context_t * decoding_context;
@@ -252,12 +341,65 @@ void h2_shutdown(h2_t * const h2);
 
 void h2_finished_writes(h2_t * const h2);
 
+/**
+ * Stops (or restarts) sending queued DATA frames. Other frames are still
+ * written while blocked.
+ */
+void h2_set_write_blocked(h2_t * const h2, bool blocked);
+
+/**
+ * Starts timing out unacknowledged SETTINGS frames and idle streams. Streams
+ * only time out while they wait on the peer, for the rest of the request or
+ * for a flow control window. Either timeout can be 0 to leave it off.
+ */
+void h2_set_timeouts(h2_t * const h2, timer_wheel_t * timers, uint64_t settings_timeout,
+                     uint64_t stream_timeout);
+
+/**
+ * Starts (or stops) refusing new streams from the client.
+ */
+void h2_set_refuse_streams(h2_t * const h2, bool refuse);
+
+/**
+ * Requests other than GET and HEAD that are read while early_data is set get
+ * a 425 (Too Early) response instead of being passed on to plugins.
+ */
+void h2_set_early_data(h2_t * const h2, bool early_data);
+
+/**
+ * Sends DATA payloads by reference through ref_writer instead of copying them
+ * into the write buffer
+ */
+void h2_set_ref_writer(h2_t * const h2, const h2_write_ref_cb ref_writer);
+
+/**
+ * Sends a GOAWAY with ENHANCE_YOUR_CALM and closes the connection.
+ */
+void h2_enhance_your_calm(h2_t * const h2);
+
+/**
+ * The number of octets the connection is holding on to: buffered frames,
+ * header fragments, queued DATA frames and the HPACK tables.
+ */
+size_t h2_memory_used(const h2_t * const h2);
+
 bool h2_response_write(h2_stream_t * stream, http_response_t * const response, uint8_t * data, const size_t data_length,
                        bool last);
 
 bool h2_response_write_data(h2_stream_t * stream, http_response_t * const response, uint8_t * data,
                             const size_t data_length, bool last);
 
+/**
+ * Like h2_response_write, but the data is borrowed from a shared buffer: the
+ * caller keeps its reference and the buffer is retained for as long as the
+ * stream needs it. slice may be NULL if there is no data.
+ */
+bool h2_response_write_buffer(h2_stream_t * stream, http_response_t * const response,
+                              const shared_buffer_slice_t * const slice, bool last);
+
+bool h2_response_write_data_buffer(h2_stream_t * stream, http_response_t * const response,
+                                   const shared_buffer_slice_t * const slice, bool last);
+
 http_request_t * h2_push_init(h2_stream_t * stream, http_request_t * const request);
 
 bool h2_push_promise(h2_stream_t * stream, http_request_t * const request);
@@ -348,7 +348,12 @@ static void h2_frame_header_write(uint8_t * const buf, h2_frame_t * frame)
   buf[pos++] = (stream_id) & 0xFF;
 }
 
-static bool h2_frame_emit_data(const h2_frame_parser_t * const parser, binary_buffer_t * const bb, h2_frame_data_t * frame)
+/**
+ * Everything that comes before the payload of a DATA frame: the frame header
+ * and the pad length
+ */
+static bool h2_frame_emit_data_header(const h2_frame_parser_t * const parser, binary_buffer_t * const bb,
+    h2_frame_data_t * frame)
 {
   bool is_padded = FRAME_FLAG(frame, FLAG_PADDED);
   size_t padding_length_field_length = 0;
@@ -377,12 +382,22 @@ static bool h2_frame_emit_data(const h2_frame_parser_t * const parser, binary_bu
     return false;
   }
 
+  return true;
+}
+
+static bool h2_frame_emit_data(const h2_frame_parser_t * const parser, binary_buffer_t * const bb, h2_frame_data_t * frame)
+{
+  if (!h2_frame_emit_data_header(parser, bb, frame)) {
+    return false;
+  }
+
   if (!binary_buffer_write(bb, frame->payload, frame->payload_length)) {
     log_append(parser->log, LOG_ERROR, "Unable to write payload");
     return false;
   }
 
-  if (is_padded) {
+  if (FRAME_FLAG(frame, FLAG_PADDED)) {
+    size_t padding_length = frame->padding_length;
     uint8_t padding_buf[padding_length];
     memset(padding_buf, 0, padding_length);
     return binary_buffer_write(bb, padding_buf, padding_length);
@@ -707,6 +722,23 @@ bool h2_frame_emit(const h2_frame_parser_t * const parser, binary_buffer_t * con
   return success;
 }
 
+bool h2_frame_emit_data_without_payload(const h2_frame_parser_t * const parser, binary_buffer_t * const bb,
+    h2_frame_data_t * frame)
+{
+  if (FRAME_FLAG(frame, FLAG_PADDED)) {
+    // the padding would have to follow the payload
+    log_append(parser->log, LOG_ERROR, "Unable to emit a padded data frame without its payload");
+    return false;
+  }
+
+  plugin_invoke(parser->plugin_invoker, OUTGOING_FRAME, frame);
+  plugin_invoke(parser->plugin_invoker, OUTGOING_FRAME_DATA, frame);
+  bool success = h2_frame_emit_data_header(parser, bb, frame);
+  plugin_invoke(parser->plugin_invoker, OUTGOING_FRAME_DATA_SENT, frame);
+
+  return success;
+}
+
 static bool strip_padding(const h2_frame_parser_t * const parser, uint8_t * padding_length, uint8_t ** payload,
     size_t * payload_length, bool padded_on)
 {
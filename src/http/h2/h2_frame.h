@@ -248,6 +248,14 @@ bool h2_frame_flag_get(const h2_frame_t * const frame, int mask);
 
 bool h2_frame_emit(const h2_frame_parser_t * const parser, binary_buffer_t * const buffer, h2_frame_t * frame);
 
+/**
+ * Emits a DATA frame without copying its payload: only the frame header is
+ * written to the buffer, and the caller sends the payload right after it.
+ * Padded frames can't be emitted this way.
+ */
+bool h2_frame_emit_data_without_payload(const h2_frame_parser_t * const parser, binary_buffer_t * const buffer,
+    h2_frame_data_t * frame);
+
 bool h2_parse_settings_payload(const h2_frame_parser_t * const parser, uint8_t * buffer, size_t buffer_length,
     size_t * num_settings, h2_setting_t * settings);
 
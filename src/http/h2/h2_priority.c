@@ -0,0 +1,193 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "h2_priority.h"
+
+void h2_priority_init(h2_priority_node_t * const node, void * const data)
+{
+  node->parent = NULL;
+  node->children = NULL;
+  node->prev_sibling = NULL;
+  node->next_sibling = NULL;
+  node->data = data;
+  node->weight = 16;
+  node->finish = 0;
+  node->virtual_time = 0;
+}
+
+bool h2_priority_attached(const h2_priority_node_t * const node)
+{
+  return node->parent != NULL;
+}
+
+static void h2_priority_detach(h2_priority_node_t * const node)
+{
+  if (!node->parent) {
+    return;
+  }
+
+  if (node->prev_sibling) {
+    node->prev_sibling->next_sibling = node->next_sibling;
+  } else {
+    node->parent->children = node->next_sibling;
+  }
+
+  if (node->next_sibling) {
+    node->next_sibling->prev_sibling = node->prev_sibling;
+  }
+
+  node->parent = NULL;
+  node->prev_sibling = NULL;
+  node->next_sibling = NULL;
+}
+
+/**
+ * Adds node as the last child of parent, so that siblings that are otherwise
+ * tied are served in the order they were added
+ */
+static void h2_priority_attach(h2_priority_node_t * const node, h2_priority_node_t * const parent)
+{
+  node->parent = parent;
+  node->next_sibling = NULL;
+  node->prev_sibling = NULL;
+
+  // a new sibling starts its turns from where its parent is now
+  node->finish = parent->virtual_time;
+
+  if (!parent->children) {
+    parent->children = node;
+    return;
+  }
+
+  h2_priority_node_t * last = parent->children;
+
+  while (last->next_sibling) {
+    last = last->next_sibling;
+  }
+
+  last->next_sibling = node;
+  node->prev_sibling = last;
+}
+
+static bool h2_priority_is_descendant(const h2_priority_node_t * node,
+                                      const h2_priority_node_t * const ancestor)
+{
+  for (node = node->parent; node; node = node->parent) {
+    if (node == ancestor) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void h2_priority_set(h2_priority_node_t * const node, h2_priority_node_t * const parent,
+                     uint16_t weight, bool exclusive)
+{
+  if (node == parent) {
+    return;
+  }
+
+  // section 5.3.3 - the new parent is moved up to take node's place first
+  if (h2_priority_is_descendant(parent, node)) {
+    h2_priority_node_t * old_parent = node->parent;
+
+    h2_priority_detach(parent);
+    h2_priority_attach(parent, old_parent);
+  }
+
+  h2_priority_detach(node);
+
+  if (exclusive) {
+    while (parent->children) {
+      h2_priority_node_t * child = parent->children;
+
+      h2_priority_detach(child);
+      h2_priority_attach(child, node);
+    }
+  }
+
+  h2_priority_attach(node, parent);
+
+  if (weight < H2_PRIORITY_MIN_WEIGHT) {
+    weight = H2_PRIORITY_MIN_WEIGHT;
+  } else if (weight > H2_PRIORITY_MAX_WEIGHT) {
+    weight = H2_PRIORITY_MAX_WEIGHT;
+  }
+
+  node->weight = weight;
+}
+
+void h2_priority_remove(h2_priority_node_t * const node)
+{
+  h2_priority_node_t * parent = node->parent;
+
+  if (!parent) {
+    return;
+  }
+
+  size_t total_weight = 0;
+  h2_priority_node_t * child;
+
+  for (child = node->children; child; child = child->next_sibling) {
+    total_weight += child->weight;
+  }
+
+  // section 5.3.4 - the children share the removed node's weight
+  while (node->children) {
+    child = node->children;
+
+    size_t weight = (size_t) node->weight * child->weight / total_weight;
+    child->weight = weight < H2_PRIORITY_MIN_WEIGHT ? H2_PRIORITY_MIN_WEIGHT : weight;
+
+    h2_priority_detach(child);
+    h2_priority_attach(child, parent);
+  }
+
+  h2_priority_detach(node);
+}
+
+static uint64_t h2_priority_start(const h2_priority_node_t * const node)
+{
+  uint64_t virtual_time = node->parent->virtual_time;
+
+  return node->finish > virtual_time ? node->finish : virtual_time;
+}
+
+h2_priority_node_t * h2_priority_next(h2_priority_node_t * const root, h2_priority_ready_cb ready)
+{
+  h2_priority_node_t * selected = NULL;
+  uint64_t selected_start = 0;
+  h2_priority_node_t * child;
+
+  for (child = root->children; child; child = child->next_sibling) {
+    uint64_t start = h2_priority_start(child);
+
+    // a later turn can't win, no need to look at the child's subtree
+    if (selected && start >= selected_start) {
+      continue;
+    }
+
+    h2_priority_node_t * candidate = ready(child->data) ? child : h2_priority_next(child, ready);
+
+    if (candidate) {
+      selected = candidate;
+      selected_start = start;
+    }
+  }
+
+  return selected;
+}
+
+void h2_priority_charge(h2_priority_node_t * node, const size_t length)
+{
+  while (node->parent) {
+    uint64_t start = h2_priority_start(node);
+
+    node->parent->virtual_time = start;
+    node->finish = start + ((uint64_t) length * H2_PRIORITY_MAX_WEIGHT) / node->weight;
+
+    node = node->parent;
+  }
+}
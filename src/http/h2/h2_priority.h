@@ -0,0 +1,79 @@
+#ifndef H2_PRIORITY_H
+#define H2_PRIORITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Stream priorities (RFC 7540 section 5.3)
+ *
+ * Streams form a dependency tree below a root node that stands for the
+ * connection. The next stream to send is picked with start-time fair queuing:
+ * siblings share their parent's turns in proportion to their weights, and a
+ * stream's dependents are only served while the stream itself can't send.
+ */
+
+#define H2_PRIORITY_MIN_WEIGHT 1
+#define H2_PRIORITY_MAX_WEIGHT 256
+
+typedef struct h2_priority_node_s {
+
+  struct h2_priority_node_s * parent;
+  struct h2_priority_node_s * children;
+  struct h2_priority_node_s * prev_sibling;
+  struct h2_priority_node_s * next_sibling;
+
+  // the stream - NULL for the root
+  void * data;
+
+  // 1 to 256
+  uint16_t weight;
+
+  // when the node's current turn ends, in its parent's virtual time
+  uint64_t finish;
+
+  // the start of the last turn given to one of the children
+  uint64_t virtual_time;
+
+} h2_priority_node_t;
+
+/**
+ * Whether the stream in data has something it can send right now
+ */
+typedef bool (*h2_priority_ready_cb)(void * data);
+
+void h2_priority_init(h2_priority_node_t * const node, void * const data);
+
+/**
+ * Whether the node is part of a tree (the root never is)
+ */
+bool h2_priority_attached(const h2_priority_node_t * const node);
+
+/**
+ * Makes node depend on parent with the given weight. If parent currently
+ * depends on node, parent is first moved up to node's old parent. An
+ * exclusive dependency makes node the only child of parent, with parent's
+ * other children moved below node.
+ */
+void h2_priority_set(h2_priority_node_t * const node, h2_priority_node_t * const parent,
+                     uint16_t weight, bool exclusive);
+
+/**
+ * Takes node out of the tree. Its children are given to its parent, sharing
+ * node's weight between them.
+ */
+void h2_priority_remove(h2_priority_node_t * const node);
+
+/**
+ * The node below root that should send next, or NULL if none is ready
+ */
+h2_priority_node_t * h2_priority_next(h2_priority_node_t * const root, h2_priority_ready_cb ready);
+
+/**
+ * Accounts for length octets sent by node, pushing back its next turn (and
+ * those of its ancestors).
+ */
+void h2_priority_charge(h2_priority_node_t * node, const size_t length);
+
+#endif
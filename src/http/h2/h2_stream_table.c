@@ -0,0 +1,322 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "h2_stream_table.h"
+
+// marks the slot of a stream that has been removed
+static const uint8_t TOMBSTONE_VALUE = 0;
+#define TOMBSTONE ((void *) &TOMBSTONE_VALUE)
+
+#define INITIAL_STRAGGLERS_CAPACITY 4
+
+static bool h2_stream_ring_init(h2_stream_ring_t * const ring)
+{
+  ring->slots = calloc(H2_STREAM_TABLE_INITIAL_CAPACITY, sizeof(void *));
+  ring->capacity = ring->slots ? H2_STREAM_TABLE_INITIAL_CAPACITY : 0;
+  ring->base = 0;
+  ring->end = 0;
+  ring->live = 0;
+
+  ring->stragglers = NULL;
+  ring->stragglers_length = 0;
+  ring->stragglers_capacity = 0;
+
+  return ring->slots != NULL;
+}
+
+static void h2_stream_ring_free(h2_stream_ring_t * const ring, h2_stream_table_free_cb free_value)
+{
+  size_t i;
+
+  if (free_value) {
+    for (i = 0; i < ring->capacity; i++) {
+      if (ring->slots[i] && ring->slots[i] != TOMBSTONE) {
+        free_value(ring->slots[i]);
+      }
+    }
+
+    for (i = 0; i < ring->stragglers_length; i++) {
+      free_value(ring->stragglers[i].value);
+    }
+  }
+
+  free(ring->slots);
+  free(ring->stragglers);
+
+  // leave the ring empty so it can be freed again
+  ring->slots = NULL;
+  ring->capacity = 0;
+  ring->live = 0;
+  ring->stragglers = NULL;
+  ring->stragglers_length = 0;
+  ring->stragglers_capacity = 0;
+}
+
+static bool h2_stream_ring_in_window(const h2_stream_ring_t * const ring, const uint32_t index)
+{
+  return index >= ring->base && index - ring->base < ring->capacity;
+}
+
+static void ** h2_stream_ring_slot(const h2_stream_ring_t * const ring, const uint32_t index)
+{
+  return &ring->slots[index & (ring->capacity - 1)];
+}
+
+static h2_stream_table_entry_t * h2_stream_ring_straggler(const h2_stream_ring_t * const ring,
+    const uint32_t index)
+{
+  size_t i;
+
+  for (i = 0; i < ring->stragglers_length; i++) {
+    if (ring->stragglers[i].index == index) {
+      return &ring->stragglers[i];
+    }
+  }
+
+  return NULL;
+}
+
+static bool h2_stream_ring_grow(h2_stream_ring_t * const ring)
+{
+  size_t capacity = ring->capacity * 2;
+  void ** slots = calloc(capacity, sizeof(void *));
+
+  if (!slots) {
+    return false;
+  }
+
+  uint32_t index;
+
+  for (index = ring->base; index < ring->end && index - ring->base < ring->capacity; index++) {
+    slots[index & (capacity - 1)] = *h2_stream_ring_slot(ring, index);
+  }
+
+  free(ring->slots);
+  ring->slots = slots;
+  ring->capacity = capacity;
+
+  return true;
+}
+
+static bool h2_stream_ring_add_straggler(h2_stream_ring_t * const ring, const uint32_t index, void * const value)
+{
+  if (ring->stragglers_length == ring->stragglers_capacity) {
+    size_t capacity = ring->stragglers_capacity ? ring->stragglers_capacity * 2 : INITIAL_STRAGGLERS_CAPACITY;
+    h2_stream_table_entry_t * stragglers = realloc(ring->stragglers, capacity * sizeof(h2_stream_table_entry_t));
+
+    if (!stragglers) {
+      return false;
+    }
+
+    ring->stragglers = stragglers;
+    ring->stragglers_capacity = capacity;
+  }
+
+  ring->stragglers[ring->stragglers_length].index = index;
+  ring->stragglers[ring->stragglers_length].value = value;
+  ring->stragglers_length++;
+
+  return true;
+}
+
+/**
+ * Moves the window up until it covers index. Slots that are left behind are
+ * either empty, closed, or (if the window is mostly empty) moved to the
+ * stragglers.
+ */
+static bool h2_stream_ring_advance(h2_stream_ring_t * const ring, const uint32_t index)
+{
+  while (!h2_stream_ring_in_window(ring, index)) {
+
+    if (ring->live == 0) {
+      memset(ring->slots, 0, ring->capacity * sizeof(void *));
+      ring->base = index;
+      break;
+    }
+
+    void ** slot = h2_stream_ring_slot(ring, ring->base);
+
+    if (*slot && *slot != TOMBSTONE) {
+
+      if (ring->live * 2 > ring->capacity) {
+        if (!h2_stream_ring_grow(ring)) {
+          return false;
+        }
+
+        continue;
+      }
+
+      if (!h2_stream_ring_add_straggler(ring, ring->base, *slot)) {
+        return false;
+      }
+
+      ring->live--;
+    }
+
+    *slot = NULL;
+    ring->base++;
+  }
+
+  return true;
+}
+
+bool h2_stream_table_init(h2_stream_table_t * const table, h2_stream_table_free_cb free_value)
+{
+  table->free_value = free_value;
+
+  bool server_ring = h2_stream_ring_init(&table->rings[0]);
+  bool client_ring = h2_stream_ring_init(&table->rings[1]);
+
+  return server_ring && client_ring;
+}
+
+void h2_stream_table_free(h2_stream_table_t * const table)
+{
+  h2_stream_ring_free(&table->rings[0], table->free_value);
+  h2_stream_ring_free(&table->rings[1], table->free_value);
+}
+
+void * h2_stream_table_get(const h2_stream_table_t * const table, const uint32_t stream_id)
+{
+  const h2_stream_ring_t * ring = &table->rings[stream_id & 1];
+  uint32_t index = stream_id >> 1;
+
+  if (h2_stream_ring_in_window(ring, index)) {
+    void * value = *h2_stream_ring_slot(ring, index);
+    return value == TOMBSTONE ? NULL : value;
+  }
+
+  if (index < ring->base && ring->stragglers_length > 0) {
+    h2_stream_table_entry_t * straggler = h2_stream_ring_straggler(ring, index);
+    return straggler ? straggler->value : NULL;
+  }
+
+  return NULL;
+}
+
+bool h2_stream_table_put(h2_stream_table_t * const table, const uint32_t stream_id, void * const value)
+{
+  h2_stream_ring_t * ring = &table->rings[stream_id & 1];
+  uint32_t index = stream_id >> 1;
+
+  if (index < ring->base) {
+    return false;
+  }
+
+  if (!h2_stream_ring_advance(ring, index)) {
+    return false;
+  }
+
+  void ** slot = h2_stream_ring_slot(ring, index);
+
+  if (*slot) {
+    return false;
+  }
+
+  *slot = value;
+  ring->live++;
+
+  if (index >= ring->end) {
+    ring->end = index + 1;
+  }
+
+  return true;
+}
+
+void * h2_stream_table_remove(h2_stream_table_t * const table, const uint32_t stream_id)
+{
+  h2_stream_ring_t * ring = &table->rings[stream_id & 1];
+  uint32_t index = stream_id >> 1;
+
+  if (h2_stream_ring_in_window(ring, index)) {
+    void ** slot = h2_stream_ring_slot(ring, index);
+    void * value = *slot;
+
+    if (!value || value == TOMBSTONE) {
+      return NULL;
+    }
+
+    *slot = TOMBSTONE;
+    ring->live--;
+
+    // closed streams at the bottom of the window don't need their slots
+    while (ring->base < ring->end && *(slot = h2_stream_ring_slot(ring, ring->base)) == TOMBSTONE) {
+      *slot = NULL;
+      ring->base++;
+    }
+
+    return value;
+  }
+
+  if (index < ring->base) {
+    h2_stream_table_entry_t * straggler = h2_stream_ring_straggler(ring, index);
+
+    if (straggler) {
+      void * value = straggler->value;
+      *straggler = ring->stragglers[--ring->stragglers_length];
+      return value;
+    }
+  }
+
+  return NULL;
+}
+
+bool h2_stream_table_closed(const h2_stream_table_t * const table, const uint32_t stream_id)
+{
+  const h2_stream_ring_t * ring = &table->rings[stream_id & 1];
+  uint32_t index = stream_id >> 1;
+
+  if (h2_stream_ring_in_window(ring, index)) {
+    return *h2_stream_ring_slot(ring, index) == TOMBSTONE;
+  }
+
+  return index < ring->base && !h2_stream_ring_straggler(ring, index);
+}
+
+size_t h2_stream_table_size(const h2_stream_table_t * const table)
+{
+  return table->rings[0].live + table->rings[0].stragglers_length +
+         table->rings[1].live + table->rings[1].stragglers_length;
+}
+
+void h2_stream_table_iterator_init(h2_stream_table_iter_t * const iter, const h2_stream_table_t * const table)
+{
+  iter->table = table;
+  iter->ring = 0;
+  iter->index = table->rings[0].base;
+  iter->straggler = 0;
+  iter->value = NULL;
+}
+
+bool h2_stream_table_iterate(h2_stream_table_iter_t * const iter)
+{
+  while (iter->ring < 2) {
+    const h2_stream_ring_t * ring = &iter->table->rings[iter->ring];
+
+    while (iter->index < ring->end && h2_stream_ring_in_window(ring, iter->index)) {
+      void * value = *h2_stream_ring_slot(ring, iter->index++);
+
+      if (value && value != TOMBSTONE) {
+        iter->value = value;
+        return true;
+      }
+    }
+
+    if (iter->straggler < ring->stragglers_length) {
+      iter->value = ring->stragglers[iter->straggler++].value;
+      return true;
+    }
+
+    iter->ring++;
+
+    if (iter->ring < 2) {
+      iter->index = iter->table->rings[iter->ring].base;
+      iter->straggler = 0;
+    }
+  }
+
+  iter->value = NULL;
+  return false;
+}
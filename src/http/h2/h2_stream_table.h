@@ -0,0 +1,113 @@
+#ifndef H2_STREAM_TABLE_H
+#define H2_STREAM_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Streams by identifier
+ *
+ * Each peer opens streams with increasing identifiers (odd for the client,
+ * even for the server), so each side gets a ring of slots indexed by
+ * id >> 1 that covers the window of identifiers that are in use. A closed
+ * stream leaves a tombstone in its slot, and everything below the window is
+ * closed. The rare stream that stays open while the window moves on (e.g. an
+ * idle stream used for grouping priorities) is kept in a short side list.
+ */
+
+#define H2_STREAM_TABLE_INITIAL_CAPACITY 16
+
+typedef void (*h2_stream_table_free_cb)(void * value);
+
+typedef struct {
+
+  uint32_t index;
+  void * value;
+
+} h2_stream_table_entry_t;
+
+typedef struct {
+
+  // index i is in slots[i & (capacity - 1)] while base <= i < base + capacity
+  void ** slots;
+  size_t capacity;
+  uint32_t base;
+
+  // one past the highest index that has been used
+  uint32_t end;
+
+  // the number of open streams in slots
+  size_t live;
+
+  // open streams below base
+  h2_stream_table_entry_t * stragglers;
+  size_t stragglers_length;
+  size_t stragglers_capacity;
+
+} h2_stream_ring_t;
+
+typedef struct {
+
+  // client initiated (odd) streams in rings[1], server initiated in rings[0]
+  h2_stream_ring_t rings[2];
+
+  h2_stream_table_free_cb free_value;
+
+} h2_stream_table_t;
+
+typedef struct {
+
+  const h2_stream_table_t * table;
+
+  size_t ring;
+  uint32_t index;
+  size_t straggler;
+
+  void * value;
+
+} h2_stream_table_iter_t;
+
+/**
+ * The table must be freed even if this fails
+ */
+bool h2_stream_table_init(h2_stream_table_t * const table, h2_stream_table_free_cb free_value);
+
+/**
+ * Frees any streams that are still in the table. A zeroed or already freed
+ * table can be freed (again).
+ */
+void h2_stream_table_free(h2_stream_table_t * const table);
+
+void * h2_stream_table_get(const h2_stream_table_t * const table, const uint32_t stream_id);
+
+/**
+ * Returns false if the identifier has already been used or can't be stored
+ */
+bool h2_stream_table_put(h2_stream_table_t * const table, const uint32_t stream_id, void * const value);
+
+/**
+ * Takes the stream out of the table and leaves a tombstone in its place. The
+ * stream is returned, not freed.
+ */
+void * h2_stream_table_remove(h2_stream_table_t * const table, const uint32_t stream_id);
+
+/**
+ * Whether the stream has been removed, or its identifier is below the window
+ * of identifiers the table keeps slots for. An identifier that was skipped
+ * but is still inside the window isn't closed and can still be opened (e.g.
+ * PRIORITY frames can put idle streams in the table before lower ones open).
+ * It only reads as closed once the window has moved past it.
+ */
+bool h2_stream_table_closed(const h2_stream_table_t * const table, const uint32_t stream_id);
+
+/**
+ * The number of streams in the table
+ */
+size_t h2_stream_table_size(const h2_stream_table_t * const table);
+
+void h2_stream_table_iterator_init(h2_stream_table_iter_t * const iter, const h2_stream_table_t * const table);
+
+bool h2_stream_table_iterate(h2_stream_table_iter_t * const iter);
+
+#endif
@@ -25,6 +25,22 @@ static bool http_internal_write_cb(void * data, uint8_t * buf, size_t len)
   return connection->writer(connection->data, buf, len);
 }
 
+static bool http_internal_write_ref_cb(void * data, uint8_t * buf, size_t len, h2_release_cb release,
+                                       void * release_data)
+{
+  http_connection_t * connection = data;
+
+  return connection->ref_writer(connection->data, buf, len, release, release_data);
+}
+
+static bool http_internal_write_file_cb(void * data, int fd, int64_t offset, size_t length, h1_1_release_cb release,
+                                        void * release_data)
+{
+  http_connection_t * connection = data;
+
+  return connection->file_writer(connection->data, fd, offset, length, release, release_data);
+}
+
 static bool http_internal_write_error_cb(void * data, http_response_t * response, int http_status)
 {
   UNUSED(data);
@@ -63,6 +79,16 @@ static void set_protocol_h2(http_connection_t * connection)
                                 connection->cipher, connection->cipher_key_size_in_bits,
                                 connection->plugin_invoker, http_internal_write_cb,
                                 http_internal_close_cb, http_internal_request_init_cb);
+
+  if (connection->handler) {
+    h2_set_timeouts((h2_t *) connection->handler, connection->timers, connection->settings_timeout,
+                    connection->stream_timeout);
+    h2_set_early_data((h2_t *) connection->handler, connection->early_data);
+
+    if (connection->ref_writer) {
+      h2_set_ref_writer((h2_t *) connection->handler, http_internal_write_ref_cb);
+    }
+  }
 }
 
 static bool send_upgrade_response(http_connection_t * connection)
@@ -118,6 +144,14 @@ static void set_protocol_h1_1(http_connection_t * connection)
                                   connection->plugin_invoker, http_internal_write_cb,
                                   http_internal_write_error_cb, http_internal_close_cb,
                                   http_internal_request_init_cb, http_internal_upgrade_cb);
+
+  if (connection->handler) {
+    h1_1_set_early_data((h1_1_t *) connection->handler, connection->early_data);
+
+    if (connection->file_writer) {
+      h1_1_set_file_writer((h1_1_t *) connection->handler, http_internal_write_file_cb);
+    }
+  }
 }
 
 http_connection_t * http_connection_init(void * const data, struct log_context_t * log,
@@ -140,17 +174,24 @@ http_connection_t * http_connection_init(void * const data, struct log_context_t
 
   connection->plugin_invoker = plugin_invoker;
   connection->writer = writer;
+  connection->ref_writer = NULL;
+  connection->file_writer = NULL;
   connection->closer = closer;
 
   connection->protocol = NOT_SELECTED;
   connection->buffer = NULL;
   connection->handler = NULL;
 
+  connection->timers = NULL;
+  connection->settings_timeout = 0;
+  connection->stream_timeout = 0;
+
   connection->tls_version = NULL;
   connection->cipher = NULL;
   connection->cipher_key_size_in_bits = -1;
 
   connection->closed = false;
+  connection->early_data = false;
 
   return connection;
 }
@@ -189,6 +230,58 @@ void http_connection_set_tls_details(http_connection_t * const connection, const
   connection->cipher_key_size_in_bits = cipher_key_size_in_bits;;
 }
 
+void http_connection_set_early_data(http_connection_t * const connection, bool early_data)
+{
+  connection->early_data = early_data;
+
+  switch (connection->protocol) {
+    case NOT_SELECTED:
+      // passed on once the protocol has been selected
+      break;
+
+    case H2:
+      h2_set_early_data((h2_t *) connection->handler, early_data);
+      break;
+
+    case H1_1:
+      h1_1_set_early_data((h1_1_t *) connection->handler, early_data);
+      break;
+
+    default:
+      abort();
+  }
+}
+
+void http_connection_set_timeouts(http_connection_t * const connection, timer_wheel_t * timers,
+                                  uint64_t settings_timeout, uint64_t stream_timeout)
+{
+  connection->timers = timers;
+  connection->settings_timeout = settings_timeout;
+  connection->stream_timeout = stream_timeout;
+
+  if (connection->protocol == H2) {
+    h2_set_timeouts((h2_t *) connection->handler, timers, settings_timeout, stream_timeout);
+  }
+}
+
+void http_connection_set_ref_writer(http_connection_t * const connection, const write_ref_cb ref_writer)
+{
+  connection->ref_writer = ref_writer;
+
+  if (connection->protocol == H2) {
+    h2_set_ref_writer((h2_t *) connection->handler, ref_writer ? http_internal_write_ref_cb : NULL);
+  }
+}
+
+void http_connection_set_file_writer(http_connection_t * const connection, const write_file_cb file_writer)
+{
+  connection->file_writer = file_writer;
+
+  if (connection->protocol == H1_1) {
+    h1_1_set_file_writer((h1_1_t *) connection->handler, file_writer ? http_internal_write_file_cb : NULL);
+  }
+}
+
 void http_connection_free(http_connection_t * const connection)
 {
   switch (connection->protocol) {
@@ -236,6 +329,127 @@ void http_finished_writes(http_connection_t * const connection)
   }
 }
 
+void http_connection_set_write_blocked(http_connection_t * const connection, bool blocked)
+{
+  switch (connection->protocol) {
+    case H2:
+      h2_set_write_blocked((h2_t *) connection->handler, blocked);
+      break;
+
+    case NOT_SELECTED:
+    case H1_1:
+      // responses are written in one go - only plugins can hold back data
+      break;
+
+    default:
+      abort();
+  }
+}
+
+size_t http_connection_active_streams(http_connection_t * const connection)
+{
+  switch (connection->protocol) {
+    case NOT_SELECTED:
+      return 0;
+
+    case H2: {
+      h2_t * h2 = connection->handler;
+      return h2->incoming_concurrent_streams + h2->outgoing_concurrent_streams;
+    }
+
+    case H1_1:
+      // http/1.1 handles one request at a time
+      return ((h1_1_t *) connection->handler)->request ? 1 : 0;
+
+    default:
+      abort();
+  }
+}
+
+bool http_connection_input_pending(http_connection_t * const connection)
+{
+  switch (connection->protocol) {
+    case NOT_SELECTED:
+      return connection->buffer && binary_buffer_size(connection->buffer) > 0;
+
+    case H2: {
+      h2_t * h2 = connection->handler;
+      return !h2->received_settings || h2->partial_header_length > 0 || h2->partial_frame ||
+             h2->continuation_stream_id != 0;
+    }
+
+    case H1_1: {
+      // between the start of a request and the end of its headers
+      h1_1_t * h1_1 = connection->handler;
+      return h1_1->headers != NULL;
+    }
+
+    default:
+      abort();
+  }
+}
+
+size_t http_connection_memory_used(http_connection_t * const connection)
+{
+  size_t used = connection->buffer ? binary_buffer_size(connection->buffer) : 0;
+
+  switch (connection->protocol) {
+    case NOT_SELECTED:
+      return used;
+
+    case H2:
+      return used + h2_memory_used((h2_t *) connection->handler);
+
+    case H1_1: {
+      h1_1_t * h1_1 = connection->handler;
+      used += h1_1->curr_header_field_length + h1_1->curr_header_value_length;
+      if (h1_1->write_buffer) {
+        used += binary_buffer_size(h1_1->write_buffer);
+      }
+      return used;
+    }
+
+    default:
+      abort();
+  }
+}
+
+void http_connection_set_refuse_streams(http_connection_t * const connection, bool refuse)
+{
+  switch (connection->protocol) {
+    case H2:
+      h2_set_refuse_streams((h2_t *) connection->handler, refuse);
+      break;
+
+    case NOT_SELECTED:
+    case H1_1:
+      // http/1.1 only reads the next request once the current one is done -
+      // not reading from the socket is enough
+      break;
+
+    default:
+      abort();
+  }
+}
+
+void http_connection_shed(http_connection_t * const connection)
+{
+  switch (connection->protocol) {
+    case H2:
+      h2_enhance_your_calm((h2_t *) connection->handler);
+      break;
+
+    case NOT_SELECTED:
+    case H1_1:
+      log_append(connection->log, LOG_WARN, "Closing connection: memory limit exceeded");
+      http_connection_close(connection);
+      break;
+
+    default:
+      abort();
+  }
+}
+
 /**
  * Detects the protocol of the data in the given buffer and Sets connection->protocol.
  *
@@ -308,8 +522,8 @@ static bool detect_protocol(http_connection_t * connection, uint8_t * const buff
 }
 
 /**
- * Reads the given buffer and acts on it. Caller must give up ownership of the
- * buffer.
+ * Reads the given buffer and acts on it. The buffer is only borrowed for the
+ * duration of the call - the caller keeps ownership of it.
  */
 void http_connection_read(http_connection_t * const connection, uint8_t * const buffer, const size_t len)
 {
@@ -320,23 +534,19 @@ void http_connection_read(http_connection_t * const connection, uint8_t * const
     // auto select protocol
     if (!detect_protocol(connection, buffer, len)) {
       log_append(connection->log, LOG_ERROR, "Unrecognized protocol");
-      free(buffer);
       http_connection_close(connection);
       return;
     } else if (connection->buffer) {
       log_append(connection->log, LOG_TRACE, "Could not detect protocol, need more data");
-      free(buffer);
 
       read_buffer_length = binary_buffer_size(connection->buffer);
-      read_buffer = malloc(read_buffer_length);
-      memcpy(read_buffer, binary_buffer_start(connection->buffer), read_buffer_length);
+      read_buffer = binary_buffer_start(connection->buffer);
     }
   }
 
   switch (connection->protocol) {
     case NOT_SELECTED:
       log_append(connection->log, LOG_TRACE, "Protocol not selected");
-      free(read_buffer);
       break;
 
     case H2:
@@ -430,6 +640,79 @@ bool http_response_write_data(http_response_t * const response, uint8_t * data,
   }
 }
 
+bool http_response_write_buffer(http_response_t * const response, const shared_buffer_slice_t * const slice,
+                                bool last)
+{
+  http_request_data_t * req_data = response->request->handler_data;
+  void * anon_data = req_data->data;
+  http_connection_t * connection = req_data->connection;
+
+  switch (connection->protocol) {
+    case H2:
+      return h2_response_write_buffer((h2_stream_t *) anon_data, response, slice, last);
+
+    case H1_1:
+      return h1_1_response_write_buffer((h1_1_t *) anon_data, response, slice, last);
+
+    default:
+      abort();
+  }
+}
+
+bool http_response_write_data_buffer(http_response_t * const response, const shared_buffer_slice_t * const slice,
+                                     bool last)
+{
+  http_request_data_t * req_data = response->request->handler_data;
+  void * anon_data = req_data->data;
+  http_connection_t * connection = req_data->connection;
+
+  switch (connection->protocol) {
+    case H2:
+      return h2_response_write_data_buffer((h2_stream_t *) anon_data, response, slice, last);
+
+    case H1_1:
+      return h1_1_response_write_data_buffer((h1_1_t *) anon_data, response, slice, last);
+
+    default:
+      abort();
+  }
+}
+
+bool http_response_can_write_file(http_response_t * const response)
+{
+  http_request_data_t * req_data = response->request->handler_data;
+  http_connection_t * connection = req_data->connection;
+
+  switch (connection->protocol) {
+    case H2:
+      // DATA frame headers would have to be interleaved with the file
+      return false;
+
+    case H1_1:
+      return ((h1_1_t *) req_data->data)->file_writer != NULL;
+
+    default:
+      abort();
+  }
+}
+
+bool http_response_write_file(http_response_t * const response, int fd, int64_t offset, size_t length, bool last,
+                              release_cb release, void * release_data)
+{
+  http_request_data_t * req_data = response->request->handler_data;
+  void * anon_data = req_data->data;
+  http_connection_t * connection = req_data->connection;
+
+  switch (connection->protocol) {
+    case H1_1:
+      return h1_1_response_write_file((h1_1_t *) anon_data, response, fd, offset, length, last, release,
+                                      release_data);
+
+    default:
+      abort();
+  }
+}
+
 bool http_response_write_error(http_response_t * const response, int code)
 {
   http_response_status_set(response, code);
@@ -4,6 +4,8 @@
 #include <stdbool.h>
 
 #include "hash_table.h"
+#include "timer_wheel.h"
+#include "shared_buffer.h"
 #include "hpack/hpack.h"
 
 #include "request.h"
@@ -19,6 +21,21 @@ enum http_protocol_e {
 
 typedef bool (*write_cb)(void * data, uint8_t * buf, size_t len);
 
+typedef void (*release_cb)(void * data);
+
+/**
+ * Writes buf without copying it - see h2_write_ref_cb
+ */
+typedef bool (*write_ref_cb)(void * data, uint8_t * buf, size_t len, release_cb release, void * release_data);
+
+/**
+ * Sends length octets of the file fd, starting at offset, without reading them
+ * into userspace. release is called once the file is no longer needed - or
+ * right away if it can't be sent.
+ */
+typedef bool (*write_file_cb)(void * data, int fd, int64_t offset, size_t length, release_cb release,
+                              void * release_data);
+
 typedef void (*close_cb)(void * data);
 
 /**
@@ -43,13 +60,23 @@ typedef struct {
   int cipher_key_size_in_bits;
 
   write_cb writer;
+  write_ref_cb ref_writer;
+  write_file_cb file_writer;
   close_cb closer;
   struct plugin_invoker_t * plugin_invoker;
 
+  // passed on to the protocol handler once it has been selected
+  timer_wheel_t * timers;
+  uint64_t settings_timeout;
+  uint64_t stream_timeout;
+
   void * handler;
 
   bool closed;
 
+  // set while the data being read is TLS early data
+  bool early_data;
+
   binary_buffer_t * buffer;
 
 } http_connection_t;
@@ -75,6 +102,33 @@ void http_connection_set_protocol(http_connection_t * const connection, const ch
 void http_connection_set_tls_details(http_connection_t * const connection, const char * tls_version,
                                      const char * cipher, const int key_size_in_bits);
 
+/**
+ * Marks the data read from now on as TLS early data (or not). Only GET and
+ * HEAD requests that arrive in early data are handled - the others get a
+ * 425 (Too Early) response, as the early data may have been replayed.
+ */
+void http_connection_set_early_data(http_connection_t * const connection, bool early_data);
+
+/**
+ * Sets the timer wheel and timeouts (in ticks of the wheel) used for
+ * unacknowledged http/2 settings and idle streams.
+ */
+void http_connection_set_timeouts(http_connection_t * const connection, timer_wheel_t * timers,
+                                  uint64_t settings_timeout, uint64_t stream_timeout);
+
+/**
+ * Lets the connection hand large response bodies to the writer by reference
+ * instead of copying them first.
+ */
+void http_connection_set_ref_writer(http_connection_t * const connection, const write_ref_cb ref_writer);
+
+/**
+ * Lets http/1.1 responses send files straight from the page cache. Only set
+ * when nothing has to be done to the octets on their way to the socket, i.e.
+ * for plaintext and kernel TLS connections.
+ */
+void http_connection_set_file_writer(http_connection_t * const connection, const write_file_cb file_writer);
+
 void http_connection_free(http_connection_t * const connection);
 
 void http_connection_read(http_connection_t * const connection, uint8_t * const buffer, const size_t len);
@@ -85,10 +139,66 @@ void http_connection_shutdown(http_connection_t * const connection);
 
 void http_finished_writes(http_connection_t * const connection);
 
+/**
+ * Called when the connection's outstanding writes cross the worker's high
+ * (blocked) or low (unblocked) watermark.
+ */
+void http_connection_set_write_blocked(http_connection_t * const connection, bool blocked);
+
+/**
+ * The number of streams (or requests) currently in progress on the connection.
+ */
+size_t http_connection_active_streams(http_connection_t * const connection);
+
+/**
+ * True if part of a request (or of an http/2 frame) has been read and the
+ * connection is waiting for the rest of it.
+ */
+bool http_connection_input_pending(http_connection_t * const connection);
+
+/**
+ * The number of octets the connection is buffering for the client.
+ */
+size_t http_connection_memory_used(http_connection_t * const connection);
+
+/**
+ * Called when the connection (or the whole worker) goes over or comes back
+ * under its memory budget. New streams are refused while over.
+ */
+void http_connection_set_refuse_streams(http_connection_t * const connection, bool refuse);
+
+/**
+ * Closes a connection that has used far more memory than it is allowed.
+ */
+void http_connection_shed(http_connection_t * const connection);
+
 bool http_response_write(http_response_t * const response, uint8_t * data, const size_t data_length, bool last);
 
 bool http_response_write_data(http_response_t * const response, uint8_t * data, const size_t data_length, bool last);
 
+/**
+ * Writes a slice of a shared buffer (or nothing, if slice is NULL) without
+ * taking the caller's reference, so the same buffer can be written on any
+ * number of responses. It's retained for as long as the write needs it.
+ */
+bool http_response_write_buffer(http_response_t * const response, const shared_buffer_slice_t * const slice,
+                                bool last);
+
+bool http_response_write_data_buffer(http_response_t * const response, const shared_buffer_slice_t * const slice,
+                                     bool last);
+
+/**
+ * True if http_response_write_file can be used for the response's body.
+ */
+bool http_response_can_write_file(http_response_t * const response);
+
+/**
+ * Writes part of a file as response data - see write_file_cb. It's an error
+ * to call this unless http_response_can_write_file is true.
+ */
+bool http_response_write_file(http_response_t * const response, int fd, int64_t offset, size_t length, bool last,
+                              release_cb release, void * release_data);
+
 bool http_response_write_error(http_response_t * const response, int code);
 
 http_request_t * http_push_init(http_request_t * const request);
@@ -35,8 +35,10 @@ void print_help(char * cmd)
   fprintf(stdout, "  -k FILE\t\tlocation of private key file (PEM)\n");
   fprintf(stdout, "  -c FILE\t\tlocation of certificate file (PEM)\n");
   fprintf(stdout, "  -w NUM_WORKERS\tspecify the number of worker threads to handle requests\n");
+  fprintf(stdout, "  -t NUM_THREADS\trun each worker process with this many event loop threads (implies -r)\n");
   fprintf(stdout, "  -L LEVEL\t\tone of: (TRACE|DEBUG|INFO|WARN|ERROR|FATAL), default: WARN\n");
   fprintf(stdout, "  -o FILE\t\tthe log file to append to\n");
+  fprintf(stdout, "  -r\t\t\teach worker accepts connections on its own SO_REUSEPORT socket\n");
   fprintf(stdout, "  -d\t\t\tstart as a daemon\n");
   fprintf(stdout, "  -h\t\t\this help message\n");
   fprintf(stdout, "  -v\t\t\tversion information\n\n");
@@ -65,8 +67,12 @@ static bool run_as_server(struct server_config_t * config)
 
 static bool run_as_worker(struct server_config_t * config)
 {
+  if (config->worker_threads > 1) {
+    return worker_run_threads(config);
+  }
+
   struct worker_t worker;
-  if (!worker_init(&worker, config)) {
+  if (!worker_init(&worker, config, 0, NULL)) {
     worker_free(&worker);
     return false;
   }
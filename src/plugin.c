@@ -1,5 +1,7 @@
 #include "config.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <uv.h>
 
 #include "worker.h"
@@ -8,6 +10,73 @@
 #include "util.h"
 #include "http/http.h"
 
+static uv_once_t plugin_shared_once = UV_ONCE_INIT;
+static uv_mutex_t plugin_shared_mutex;
+static struct plugin_shared_t * plugin_shared_list = NULL;
+
+static void plugin_shared_static_init(void)
+{
+  if (uv_mutex_init(&plugin_shared_mutex)) {
+    abort();
+  }
+}
+
+/**
+ * Finds (or creates) the shared state for the given plugin file.
+ * Must be called with plugin_shared_mutex held.
+ */
+static struct plugin_shared_t * plugin_shared_find(const char * plugin_file)
+{
+  struct plugin_shared_t * shared = plugin_shared_list;
+  while (shared) {
+    if (strcmp(shared->plugin_file, plugin_file) == 0) {
+      return shared;
+    }
+    shared = shared->next;
+  }
+
+  shared = malloc(sizeof(struct plugin_shared_t));
+  ASSERT_OR_RETURN_NULL(shared);
+
+  if (uv_mutex_init(&shared->mutex)) {
+    free(shared);
+    return NULL;
+  }
+
+  shared->plugin_file = plugin_file;
+  shared->ref_count = 0;
+  shared->data = NULL;
+  shared->free_cb = NULL;
+  shared->next = plugin_shared_list;
+  plugin_shared_list = shared;
+
+  return shared;
+}
+
+static void plugin_shared_release(struct plugin_shared_t * shared)
+{
+  uv_mutex_lock(&plugin_shared_mutex);
+
+  shared->ref_count--;
+
+  if (shared->ref_count == 0) {
+    struct plugin_shared_t ** prev = &plugin_shared_list;
+    while (*prev != shared) {
+      prev = &(*prev)->next;
+    }
+    *prev = shared->next;
+
+    if (shared->data && shared->free_cb) {
+      shared->free_cb(shared->data);
+    }
+
+    uv_mutex_destroy(&shared->mutex);
+    free(shared);
+  }
+
+  uv_mutex_unlock(&plugin_shared_mutex);
+}
+
 struct plugin_t * plugin_init(struct plugin_t * plugin, struct log_context_t * log, const char * plugin_file,
                        void * config_context, struct worker_t * worker)
 {
@@ -19,10 +88,12 @@ struct plugin_t * plugin_init(struct plugin_t * plugin, struct log_context_t * l
   }
 
   plugin->log = log;
+  plugin->plugin_file = (char *) plugin_file;
   plugin->config_context = config_context;
   plugin->handlers = malloc(sizeof(struct plugin_handlers_t));
 
   plugin->data = NULL;
+  plugin->shared = NULL;
   uv_lib_t * lib = &plugin->lib;
 
   if (uv_dlopen(plugin_file, lib)) {
@@ -75,6 +146,44 @@ bool plugin_invoke(struct plugin_invoker_t * invoker, enum plugin_callback_e cb,
   return false;
 }
 
+void * plugin_shared_get(struct plugin_t * plugin, plugin_shared_init_cb init, plugin_shared_free_cb free_cb)
+{
+  if (plugin->shared) {
+    return plugin->shared->data;
+  }
+
+  uv_once(&plugin_shared_once, plugin_shared_static_init);
+  uv_mutex_lock(&plugin_shared_mutex);
+
+  struct plugin_shared_t * shared = plugin_shared_find(plugin->plugin_file);
+  if (!shared) {
+    uv_mutex_unlock(&plugin_shared_mutex);
+    return NULL;
+  }
+
+  if (shared->ref_count == 0) {
+    shared->data = init(plugin);
+    shared->free_cb = free_cb;
+  }
+
+  shared->ref_count++;
+  plugin->shared = shared;
+
+  uv_mutex_unlock(&plugin_shared_mutex);
+
+  return shared->data;
+}
+
+void plugin_shared_lock(struct plugin_t * plugin)
+{
+  uv_mutex_lock(&plugin->shared->mutex);
+}
+
+void plugin_shared_unlock(struct plugin_t * plugin)
+{
+  uv_mutex_unlock(&plugin->shared->mutex);
+}
+
 void plugin_start(struct plugin_t * plugin)
 {
   plugin->handlers->start(plugin);
@@ -87,6 +196,10 @@ void plugin_stop(struct plugin_t * plugin)
 
 void plugin_free(struct plugin_t * plugin)
 {
+  if (plugin->shared) {
+    plugin_shared_release(plugin->shared);
+  }
+
   free(plugin->handlers);
   free(plugin);
 }
@@ -27,6 +27,31 @@ struct plugin_handlers_t {
 
 };
 
+typedef void * (*plugin_shared_init_cb)(struct plugin_t * plugin);
+
+typedef void (*plugin_shared_free_cb)(void * shared_data);
+
+/**
+ * State shared by every instance of the same plugin in a process. When
+ * workers run on several threads each thread has its own plugin_t, but they
+ * all point at the same plugin_shared_t.
+ */
+struct plugin_shared_t {
+
+  struct plugin_shared_t * next;
+
+  const char * plugin_file;
+
+  size_t ref_count;
+
+  uv_mutex_t mutex;
+
+  void * data;
+
+  plugin_shared_free_cb free_cb;
+
+};
+
 struct plugin_t {
 
   struct log_context_t * log;
@@ -41,6 +66,8 @@ struct plugin_t {
 
   void * data;
 
+  struct plugin_shared_t * shared;
+
 };
 
 struct plugin_list_t {
@@ -66,6 +93,20 @@ struct plugin_t * plugin_init(struct plugin_t * plugin, struct log_context_t * l
 
 bool plugin_handler_va(struct plugin_t * plugin, struct client_t * client, enum plugin_callback_e cb, va_list args);
 
+/**
+ * Returns the data shared between all instances of this plugin, calling init
+ * to create it the first time. free_cb is called when the last instance is
+ * freed.
+ *
+ * Shared data may be accessed from several threads at once - anything that is
+ * modified after init must be guarded with plugin_shared_lock/unlock.
+ */
+void * plugin_shared_get(struct plugin_t * plugin, plugin_shared_init_cb init, plugin_shared_free_cb free_cb);
+
+void plugin_shared_lock(struct plugin_t * plugin);
+
+void plugin_shared_unlock(struct plugin_t * plugin);
+
 void plugin_start(struct plugin_t * plugin);
 
 void plugin_stop(struct plugin_t * plugin);
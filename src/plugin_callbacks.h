@@ -4,6 +4,11 @@
 enum plugin_callback_e {
   HANDLE_REQUEST,
   HANDLE_DATA,
+  // the client has too much unsent data (or is holding too much memory) -
+  // stop producing more until resumed
+  HANDLE_WRITE_PAUSE,
+  HANDLE_WRITE_RESUME,
+  HANDLE_CLIENT_CLOSED,
   INCOMING_FRAME,
   INCOMING_FRAME_DATA,
   INCOMING_FRAME_HEADERS,
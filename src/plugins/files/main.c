@@ -72,6 +72,25 @@ struct open_file_t {
 
   struct file_server_t * fs;
 
+  // where fd came from - NULL if it couldn't be shared
+  struct shared_file_t * shared_file;
+
+};
+
+/**
+ * A file descriptor shared by the file servers of every worker thread. Reads
+ * are made at an offset, so several loops can read it at once.
+ */
+struct shared_file_t {
+
+  // also the key in file_server_shared_t's files
+  char * path;
+
+  uv_file fd;
+
+  // the open_file_t's using fd
+  size_t refs;
+
 };
 
 struct accept_param_t {
@@ -106,13 +125,17 @@ struct accept_type_t {
 
 };
 
-struct file_server_t {
+/**
+ * Shared by the file servers of every worker thread in the process.
+ * Apart from files, none of this changes after it is initialized, so it
+ * can be read without locking.
+ */
+struct file_server_shared_t {
 
   struct log_context_t * log;
 
-  struct worker_t * worker;
-
-  struct plugin_t * plugin;
+  // open files by path, guarded by plugin_shared_lock
+  hash_table_t files;
 
   hash_table_t push_files;
 
@@ -123,9 +146,26 @@ struct file_server_t {
   char * cwd;
   size_t cwd_length;
 
+};
+
+struct file_server_t {
+
+  struct log_context_t * log;
+
+  struct worker_t * worker;
+
+  struct plugin_t * plugin;
+
+  struct file_server_shared_t * shared;
+
+  // each loop tracks the files its requests use (their close timers
+  // run on it), the descriptors themselves are shared
   hash_table_t open_files;
   size_t open_files_count;
 
+  // requests waiting for their client's writes to resume
+  struct file_server_request_t * paused_requests;
+
   bool closing;
 
 };
@@ -142,6 +182,8 @@ struct file_server_request_t {
 
   uv_buf_t buf[NUM_READ_BUFS];
   size_t bufs_allocated;
+  // counted against the client's memory budget while the read is in progress
+  size_t bufs_length;
 
   uv_fs_t read_req;
 
@@ -153,11 +195,15 @@ struct file_server_request_t {
   http_request_t * request;
   http_response_t * response;
 
+  struct file_server_request_t * next_paused;
+
 } file_server_request_t;
 
 static void files_plugin_request_handler(struct plugin_t * plugin, struct client_t * client,
     http_request_t * req, http_response_t * resp);
 
+static void file_server_finish_request(struct file_server_request_t * fs_request);
+
 static struct content_type_t * register_content_type(multimap_t * m,
     char * extension, char * type, char * subtype)
 {
@@ -172,7 +218,7 @@ static struct content_type_t * register_content_type(multimap_t * m,
   return t;
 }
 
-static void files_plugin_init_type_map(struct file_server_t * fs)
+static void files_plugin_init_type_map(struct file_server_shared_t * fs)
 {
   fs->type_map = multimap_init_with_string_keys();
 
@@ -198,7 +244,6 @@ static void files_plugin_init_type_map(struct file_server_t * fs)
 static void file_server_free(struct file_server_t * file_server)
 {
   if (file_server->closing && file_server->open_files_count == 0) {
-    free(file_server->cwd);
     free(file_server);
   }
 }
@@ -240,6 +285,84 @@ static void file_server_open_file_timer_closed(uv_handle_t * handle)
   file_server_open_file_close_finished(open_file);
 }
 
+/**
+ * Takes a reference to the descriptor a worker thread already has open for
+ * path, if there is one
+ */
+static struct shared_file_t * shared_file_retain(struct file_server_t * fs, char * path)
+{
+  plugin_shared_lock(fs->plugin);
+
+  struct shared_file_t * shared_file = hash_table_get(&fs->shared->files, path);
+  if (shared_file) {
+    shared_file->refs++;
+  }
+
+  plugin_shared_unlock(fs->plugin);
+
+  return shared_file;
+}
+
+/**
+ * Shares a newly opened descriptor. If another worker thread opened the same
+ * file in the meantime, fd is closed and theirs is used instead. Returns NULL
+ * if fd can't be shared.
+ */
+static struct shared_file_t * shared_file_add(struct file_server_t * fs, char * path, uv_file fd)
+{
+  plugin_shared_lock(fs->plugin);
+
+  struct shared_file_t * shared_file = hash_table_get(&fs->shared->files, path);
+
+  if (shared_file) {
+    shared_file->refs++;
+    plugin_shared_unlock(fs->plugin);
+
+    uv_fs_t close_req;
+    uv_fs_close(&fs->worker->loop, &close_req, fd, NULL);
+    uv_fs_req_cleanup(&close_req);
+
+    return shared_file;
+  }
+
+  shared_file = malloc(sizeof(struct shared_file_t));
+  char * key = strdup(path);
+
+  if (!shared_file || !key || !hash_table_put(&fs->shared->files, key, shared_file)) {
+    plugin_shared_unlock(fs->plugin);
+    log_append(fs->log, LOG_WARN, "Unable to share opened file: %s", path);
+    free(shared_file);
+    free(key);
+    return NULL;
+  }
+
+  shared_file->path = key;
+  shared_file->fd = fd;
+  shared_file->refs = 1;
+
+  plugin_shared_unlock(fs->plugin);
+
+  return shared_file;
+}
+
+/**
+ * Returns true if that was the last reference, and the descriptor should be
+ * closed
+ */
+static bool shared_file_release(struct file_server_t * fs, struct shared_file_t * shared_file)
+{
+  plugin_shared_lock(fs->plugin);
+
+  bool last = --shared_file->refs == 0;
+  if (last) {
+    hash_table_remove(&fs->shared->files, shared_file->path);
+  }
+
+  plugin_shared_unlock(fs->plugin);
+
+  return last;
+}
+
 static void open_file_removed_from_hash(void * of)
 {
   //path has been free'd at this point
@@ -249,11 +372,16 @@ static void open_file_removed_from_hash(void * of)
     return;
   }
 
-  log_append(open_file->fs->log, LOG_DEBUG, "Closing file: %d", open_file->fd);
   open_file->closing = true;
 
-  uv_fs_close(&open_file->fs->worker->loop, &open_file->close_req, open_file->fd,
-      file_server_open_file_closed);
+  if (!open_file->shared_file || shared_file_release(open_file->fs, open_file->shared_file)) {
+    log_append(open_file->fs->log, LOG_DEBUG, "Closing file: %d", open_file->fd);
+    uv_fs_close(&open_file->fs->worker->loop, &open_file->close_req, open_file->fd,
+        file_server_open_file_closed);
+  } else {
+    // another worker thread is still using it
+    open_file->file_closed = true;
+  }
 
   uv_timer_stop(&open_file->timer);
   uv_close((uv_handle_t *) &open_file->timer, file_server_open_file_timer_closed);
@@ -287,7 +415,7 @@ static void file_server_try_close_file(struct open_file_t * open_file)
 
 static void init_push_file(void * context, const char * key, void * value_context)
 {
-  struct file_server_t * fs = context;
+  struct file_server_shared_t * fs = context;
   hash_table_t * ht = &fs->push_files;
   struct string_list_t * values = server_config_plugin_get_strings(value_context);
 
@@ -303,9 +431,24 @@ static void init_push_file(void * context, const char * key, void * value_contex
   }
 }
 
-static void files_plugin_start(struct plugin_t * plugin)
+static void noop(void * v)
 {
-  struct file_server_t * file_server = plugin->data;
+  UNUSED(v);
+}
+
+static void string_list_free(void * p)
+{
+  struct string_list_t * string_list = p;
+  free(string_list->strings);
+  free(string_list);
+}
+
+static void * files_plugin_shared_init(struct plugin_t * plugin)
+{
+  struct file_server_shared_t * shared = malloc(sizeof(struct file_server_shared_t));
+  ASSERT_OR_RETURN_NULL(shared);
+
+  shared->log = plugin->log;
 
   size_t cwd_capacity = 256;
   char * cwd = malloc(cwd_capacity);
@@ -325,23 +468,41 @@ static void files_plugin_start(struct plugin_t * plugin)
   cwd[cwd_length - 1] = '/';
   cwd[cwd_length] = 0;
 
-  file_server->cwd = cwd;
-  file_server->cwd_length = cwd_length;
+  shared->cwd = cwd;
+  shared->cwd_length = cwd_length;
 
-  hash_table_init_with_string_keys(&file_server->open_files, open_file_removed_from_hash);
-  file_server->open_files_count = 0;
+  files_plugin_init_type_map(shared);
+
+  hash_table_init_with_string_keys(&shared->push_files, string_list_free);
+  hash_table_init_with_string_keys(&shared->files, free);
 
   void * root = server_config_plugin_get(plugin->config_context, "push_files");
   if (root) {
-    server_config_plugin_each(file_server, root, init_push_file);
+    server_config_plugin_each(shared, root, init_push_file);
   }
 
-  log_append(plugin->log, LOG_INFO, "Files plugin started");
+  return shared;
 }
 
-static void noop(void * v)
+static void files_plugin_shared_free(void * data)
 {
-  UNUSED(v);
+  struct file_server_shared_t * shared = data;
+
+  multimap_free(shared->type_map, noop, free);
+  hash_table_free(&shared->push_files);
+  hash_table_free(&shared->files);
+  free(shared->cwd);
+  free(shared);
+}
+
+static void files_plugin_start(struct plugin_t * plugin)
+{
+  struct file_server_t * file_server = plugin->data;
+
+  hash_table_init_with_string_keys(&file_server->open_files, open_file_removed_from_hash);
+  file_server->open_files_count = 0;
+
+  log_append(plugin->log, LOG_INFO, "Files plugin started");
 }
 
 static void files_plugin_stop(struct plugin_t * plugin)
@@ -351,8 +512,11 @@ static void files_plugin_stop(struct plugin_t * plugin)
   struct file_server_t * file_server = plugin->data;
   file_server->closing = true;
 
-  multimap_free(file_server->type_map, noop, free);
-  hash_table_free(&file_server->push_files);
+  while (file_server->paused_requests) {
+    struct file_server_request_t * fs_request = file_server->paused_requests;
+    file_server->paused_requests = fs_request->next_paused;
+    file_server_finish_request(fs_request);
+  }
 
   if (hash_table_size(&file_server->open_files) > 0) {
     hash_table_free(&file_server->open_files);
@@ -382,6 +546,10 @@ static void file_server_uv_read_cb(uv_fs_t * req)
   ssize_t nread = req->result;
   uv_fs_req_cleanup(req);
 
+  // the buffers are either handed over with the response data or dropped
+  fs_request->client->plugin_octets -= fs_request->bufs_length;
+  fs_request->bufs_length = 0;
+
   http_response_t * response = fs_request->response;
 
   if (nread == UV_EOF || nread <= 0) {
@@ -410,12 +578,40 @@ static void file_server_uv_read_cb(uv_fs_t * req)
       log_append(fs_request->file_server->log, LOG_DEBUG, "Finished reading file: %s",
           fs_request->open_file->path);
       file_server_finish_request(fs_request);
+    } else if (fs_request->client->write_paused || fs_request->client->memory_limited) {
+      // don't read any more of the file until the client catches up
+      struct file_server_t * file_server = fs_request->file_server;
+      log_append(file_server->log, LOG_DEBUG, "Pausing read of file: %s", fs_request->open_file->path);
+      fs_request->next_paused = file_server->paused_requests;
+      file_server->paused_requests = fs_request;
     } else {
       file_server_read_file(fs_request, fs_request->bytes_read);
     }
   }
 }
 
+static void file_server_file_sent(void * data)
+{
+  struct file_server_request_t * fs_request = data;
+
+  log_append(fs_request->file_server->log, LOG_DEBUG, "Finished sending file: %s", fs_request->open_file->path);
+  file_server_finish_request(fs_request);
+}
+
+/**
+ * Hands the whole file to the connection, which sends it without reading it
+ * into userspace. The request is finished once the file has been sent.
+ */
+static void file_server_send_file(struct file_server_request_t * fs_request)
+{
+  log_append(fs_request->file_server->log, LOG_DEBUG, "Sending file: %s", fs_request->open_file->path);
+
+  if (!http_response_write_file(fs_request->response, fs_request->open_file->fd, 0, fs_request->content_length,
+                                true, file_server_file_sent, fs_request)) {
+    log_append(fs_request->file_server->log, LOG_ERROR, "Unable to send file: %s", fs_request->open_file->path);
+  }
+}
+
 static int integer_divide_ceiling(size_t x, size_t y)
 {
   return 1 + ((x - 1) / y);
@@ -440,6 +636,8 @@ static void file_server_allocate(struct file_server_request_t * fs_request, ssiz
   }
 
   fs_request->bufs_allocated = num_chunks;
+  fs_request->bufs_length = fs_request->content_length - offset - left_to_read;
+  fs_request->client->plugin_octets += fs_request->bufs_length;
 }
 
 static void file_server_read_file(struct file_server_request_t * fs_request, ssize_t offset)
@@ -449,6 +647,8 @@ static void file_server_read_file(struct file_server_request_t * fs_request, ssi
   file_server_allocate(fs_request, offset);
   if (uv_fs_read(fs_request->loop, &fs_request->read_req, fs_request->open_file->fd,
         fs_request->buf, fs_request->bufs_allocated, offset, file_server_uv_read_cb)) {
+    fs_request->client->plugin_octets -= fs_request->bufs_length;
+    fs_request->bufs_length = 0;
     http_response_write_error(fs_request->response, 500);
     file_server_finish_request(fs_request);
   }
@@ -514,7 +714,7 @@ static struct accept_type_t * parse_accept_type(char * begin, char * end)
 static struct content_type_t * content_type_for_path(
     struct file_server_t * fs, char * path, char * accept_header)
 {
-  multimap_t * type_map = fs->type_map;
+  multimap_t * type_map = fs->shared->type_map;
   char * extension = file_extension(path);
 
   log_append(fs->log, LOG_TRACE, "Got extension: %s", extension);
@@ -586,7 +786,7 @@ static struct content_type_t * content_type_for_path(
     }
   } else {
     // no extension?
-    struct content_type_t * content_type = fs->default_content_type;
+    struct content_type_t * content_type = fs->shared->default_content_type;
     struct accept_type_t * current_accept_type = head;
 
     while (!match && current_accept_type) {
@@ -685,12 +885,16 @@ static void file_server_uv_stat_cb(uv_fs_t * req)
       http_response_header_add(response, "date", date);
     }
 
+    // checked while the response is still ours - it's finished once the file
+    // has been handed over
+    bool send_file = fs_request->content_length > 0 && http_response_can_write_file(response);
+
     http_response_write(response, NULL, 0, false);
 
     size_t pushed_requests_length = 0;
     http_request_t * pushed_requests[1024];
 
-    struct string_list_t * file_list = hash_table_get(&fs_request->file_server->push_files,
+    struct string_list_t * file_list = hash_table_get(&fs_request->file_server->shared->push_files,
         fs_request->open_file->path);
     for (size_t i = 0; file_list && i < file_list->num_strings; i++) {
       http_request_t * request = fs_request->request;
@@ -717,7 +921,11 @@ static void file_server_uv_stat_cb(uv_fs_t * req)
       }
     }
 
-    file_server_read_file(fs_request, 0);
+    if (send_file) {
+      file_server_send_file(fs_request);
+    } else {
+      file_server_read_file(fs_request, 0);
+    }
 
     for (size_t i = 0 ; i < pushed_requests_length; i++) {
       http_push(pushed_requests[i]);
@@ -745,9 +953,11 @@ static void file_server_uv_open_cb(uv_fs_t * req)
   struct file_server_t * fs = fs_request->file_server;
 
   if (req->result != -1) {
-    fs_request->open_file->fd = req->result;
+    struct open_file_t * open_file = fs_request->open_file;
+    open_file->shared_file = shared_file_add(fs, open_file->path, req->result);
+    open_file->fd = open_file->shared_file ? open_file->shared_file->fd : req->result;
 
-    fs_request->open_file->opened = true;
+    open_file->opened = true;
 
     bool valid = true;
     bool handled = false;
@@ -796,6 +1006,8 @@ static void files_plugin_request_handler(struct plugin_t * plugin, struct client
   fs_request->read_req.data = fs_request;
   fs_request->open_file = NULL;
   fs_request->bufs_allocated = 0;
+  fs_request->next_paused = NULL;
+  fs_request->bufs_length = 0;
 
   request->data = fs_request;
 
@@ -836,9 +1048,10 @@ static void files_plugin_request_handler(struct plugin_t * plugin, struct client
   size_t path_length = strlen(path);
 
   // check to make sure the file is in the current directory
-  if (path_length < file_server->cwd_length || memcmp(file_server->cwd, path, file_server->cwd_length) != 0) {
-    log_append(file_server->log, LOG_ERROR, "%s (%zu) not in %s (%zu)", path, path_length, file_server->cwd,
-               file_server->cwd_length);
+  struct file_server_shared_t * shared = file_server->shared;
+  if (path_length < shared->cwd_length || memcmp(shared->cwd, path, shared->cwd_length) != 0) {
+    log_append(file_server->log, LOG_ERROR, "%s (%zu) not in %s (%zu)", path, path_length, shared->cwd,
+               shared->cwd_length);
     http_response_write_error(response, 404);
     file_server_finish_request(fs_request);
     free(path);
@@ -877,6 +1090,7 @@ static void files_plugin_request_handler(struct plugin_t * plugin, struct client
     open_file->timer_closed = false;
     open_file->list = NULL;
     open_file->fs = file_server;
+    open_file->shared_file = NULL;
 
     fs_request->open_file = open_file;
 
@@ -888,8 +1102,17 @@ static void files_plugin_request_handler(struct plugin_t * plugin, struct client
       file_server_finish_request(fs_request);
     } else {
       file_server->open_files_count++;
-      uv_fs_open(fs_request->loop, &open_file->open_req, path,
-          O_RDONLY, 0644, file_server_uv_open_cb);
+      open_file->shared_file = shared_file_retain(file_server, path);
+
+      if (open_file->shared_file) {
+        // another worker thread has it open already
+        open_file->fd = open_file->shared_file->fd;
+        open_file->opened = true;
+        file_server_use_opened_file(fs_request);
+      } else {
+        uv_fs_open(fs_request->loop, &open_file->open_req, path,
+            O_RDONLY, 0644, file_server_uv_open_cb);
+      }
     }
   }
 }
@@ -911,6 +1134,35 @@ static void files_plugin_data_handler(struct plugin_t * plugin, struct client_t
 
 }
 
+/**
+ * Removes the client's paused requests from the paused list and either
+ * continues reading them or drops them if the client has gone away
+ */
+static void files_plugin_paused_requests_handler(struct plugin_t * plugin, struct client_t * client, bool resume)
+{
+  struct file_server_t * file_server = plugin->data;
+  struct file_server_request_t ** curr = &file_server->paused_requests;
+
+  while (*curr) {
+    struct file_server_request_t * fs_request = *curr;
+
+    if (fs_request->client != client) {
+      curr = &fs_request->next_paused;
+      continue;
+    }
+
+    *curr = fs_request->next_paused;
+    fs_request->next_paused = NULL;
+
+    if (resume) {
+      log_append(file_server->log, LOG_DEBUG, "Resuming read of file: %s", fs_request->open_file->path);
+      file_server_read_file(fs_request, fs_request->bytes_read);
+    } else {
+      file_server_finish_request(fs_request);
+    }
+  }
+}
+
 static bool files_plugin_handler(struct plugin_t * plugin, struct client_t * client, enum plugin_callback_e cb, va_list args)
 {
   switch (cb) {
@@ -934,18 +1186,21 @@ static bool files_plugin_handler(struct plugin_t * plugin, struct client_t * cli
         return true;
       }
 
+    // reads are paused lazily when the next chunk is due - other plugins
+    // still need to see these so don't claim them
+    case HANDLE_WRITE_RESUME:
+      files_plugin_paused_requests_handler(plugin, client, true);
+      return false;
+
+    case HANDLE_CLIENT_CLOSED:
+      files_plugin_paused_requests_handler(plugin, client, false);
+      return false;
+
     default:
       return false;
   }
 }
 
-static void string_list_free(void * p)
-{
-  struct string_list_t * string_list = p;
-  free(string_list->strings);
-  free(string_list);
-}
-
 void plugin_initialize(struct plugin_t * plugin, struct worker_t * worker)
 {
   plugin->handlers->start = files_plugin_start;
@@ -955,14 +1210,13 @@ void plugin_initialize(struct plugin_t * plugin, struct worker_t * worker)
   struct file_server_t * file_server = malloc(sizeof(struct file_server_t));
   file_server->log = &worker->config->plugin_log;
   file_server->closing = false;
+  file_server->paused_requests = NULL;
 
   plugin->data = file_server;
 
   file_server->plugin = plugin;
   file_server->worker = worker;
 
-  files_plugin_init_type_map(file_server);
-
-  hash_table_init_with_string_keys(&file_server->push_files, string_list_free);
+  file_server->shared = plugin_shared_get(plugin, files_plugin_shared_init, files_plugin_shared_free);
 }
 
@@ -4,8 +4,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <uv.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "util.h"
 #include "server.h"
@@ -13,12 +18,30 @@
 
 #define LISTEN_BACKLOG 128
 #define PATH_SIZE 1024
+// don't starve the rest of the loop while draining the accept queue
+#define MAX_ACCEPTS_PER_EVENT 256
 
+/**
+ * Used to pass a single connection to a worker through libuv when the
+ * worker's pipe is full
+ */
 struct server_client_t {
   struct server_t * server;
   uv_tcp_t client;
   uv_write_t req;
   uv_buf_t buf;
+  char index;
+};
+
+/**
+ * The index octets that a short sendmsg didn't get to. The file descriptors
+ * went out with the first octet, so only these are left to write.
+ */
+struct server_pending_indexes_t {
+  struct server_t * server;
+  uv_write_t req;
+  uv_buf_t buf;
+  char indexes[SERVER_FD_BATCH_SIZE];
 };
 
 static void server_sigpipe_handler(uv_signal_t * sigpipe_handler, int signum)
@@ -75,8 +98,10 @@ static void worker_pipe_closed(uv_handle_t * handle)
 
 static void tcp_listener_closed(uv_handle_t * handle)
 {
-  struct listen_address_t * addr = handle->data;
-  struct server_t * server = addr->data;
+  struct tcp_list_t * tcp_list = handle->data;
+  struct server_t * server = tcp_list->address->data;
+
+  close(tcp_list->fd);
 
   server->active_listeners--;
 
@@ -122,50 +147,396 @@ void on_write_complete(uv_write_t * req, int status)
   uv_close((uv_handle_t *) &server_client->client, client_handle_closed);
 }
 
-static void server_on_new_connection(uv_stream_t * uv_stream, int status)
+static void alloc_load_buffer(uv_handle_t * handle, size_t suggested_size, uv_buf_t * buf)
 {
-  struct listen_address_t * addr = uv_stream->data;
-  struct server_t * server = addr->data;
+  UNUSED(suggested_size);
 
-  if (status == -1) {
-    log_append(server->log, LOG_ERROR, "Error getting new connection: %s\n", uv_err_name(status));
+  struct worker_process_t * worker = handle->data;
+
+  // read directly into the worker's report buffer, a report may arrive in pieces
+  buf->base = (char *) worker->load_buf + worker->load_buf_length;
+  buf->len = sizeof(worker->load_buf) - worker->load_buf_length;
+}
+
+static void server_on_load_report(uv_stream_t * pipe, ssize_t nread, const uv_buf_t * buf)
+{
+  UNUSED(buf);
+
+  struct worker_process_t * worker = pipe->data;
+  struct server_t * server = worker->server;
+
+  if (nread < 0) {
+    if (nread != UV_EOF) {
+      log_append(server->log, LOG_ERROR, "Error reading load from worker %d: %s", worker->req.pid,
+          uv_err_name(nread));
+    }
+    uv_read_stop(pipe);
     return;
   }
 
+  worker->load_buf_length += nread;
+  if (worker->load_buf_length == sizeof(worker->load_buf)) {
+    memcpy(&worker->load, worker->load_buf, sizeof(worker->load));
+    worker->load_buf_length = 0;
+
+    log_append(server->log, LOG_TRACE, "Worker %d load: %" PRIu32 " clients, %" PRIu32 " streams, "
+        "%" PRIu32 " pending writes, %" PRIu32 "ms lag", worker->req.pid, worker->load.open_clients,
+        worker->load.active_streams, worker->load.pending_writes, worker->load.loop_lag);
+  }
+}
+
+static uint64_t worker_load_score(struct worker_process_t * worker)
+{
+  struct worker_load_report_t * load = &worker->load;
+
+  // idle connections are cheap - weight the work that is actually in progress
+  return (uint64_t) load->open_clients + load->active_streams * 4 + load->pending_writes * 2 +
+         load->loop_lag * 8;
+}
+
+/**
+ * Picks the worker for a new connection. With least loaded dispatch the next
+ * worker in round robin order is compared against a random one and the less
+ * loaded of the two wins, so equally loaded workers still share connections
+ * evenly.
+ */
+static struct worker_process_t * server_select_worker(struct server_t * server)
+{
+  size_t num_workers = server->config->num_workers;
+  struct worker_process_t * worker = server->workers[server->round_robin_counter];
+  server->round_robin_counter = (server->round_robin_counter + 1) % num_workers;
+
+  if (server->least_loaded_dispatch && num_workers > 1) {
+    struct worker_process_t * other = server->workers[rand() % num_workers];
+    if (worker_load_score(other) < worker_load_score(worker)) {
+      worker = other;
+    }
+  }
+
+  // account for the new connection until the worker's next report
+  worker->load.open_clients++;
+
+  return worker;
+}
+
+static void server_send_fd_queued(struct server_t * server, struct worker_process_t * worker, int fd,
+                                  char index)
+{
   struct server_client_t * server_client = malloc(sizeof(struct server_client_t));
+  if (!server_client) {
+    close(fd);
+    return;
+  }
   server_client->server = server;
   uv_tcp_t * client = &server_client->client;
   uv_tcp_init(&server->loop, client);
-  uv_tcp_nodelay(client, true);
   client->data = server_client;
 
-  if (uv_accept(uv_stream, (uv_stream_t *) client) == 0) {
+  if (uv_tcp_open(client, fd)) {
+    close(fd);
+    uv_close((uv_handle_t *) client, client_handle_closed);
+    return;
+  }
+
+  uv_write_t * write_req = &server_client->req;
+  write_req->data = server_client;
+
+  // send the index of the listen_address_t that accepted this
+  // connection to the worker
+  server_client->index = index;
+  server_client->buf = uv_buf_init(&server_client->index, 1);
+
+  uv_write2(write_req, (uv_stream_t *) &worker->pipe, &server_client->buf, 1,
+      (uv_stream_t *) client, on_write_complete);
+}
 
-    uv_write_t * write_req = &server_client->req;
-    write_req->data = server_client;
+static void on_indexes_written(uv_write_t * req, int status)
+{
+  struct server_pending_indexes_t * pending = req->data;
+
+  if (status) {
+    log_append(pending->server->log, LOG_ERROR, "Error passing address indexes to worker: %s",
+        uv_err_name(status));
+  }
+
+  free(pending);
+}
+
+static void server_send_indexes_queued(struct server_t * server, struct worker_process_t * worker,
+                                       const char * indexes, size_t count)
+{
+  struct server_pending_indexes_t * pending = malloc(sizeof(struct server_pending_indexes_t));
+  if (!pending) {
+    log_append(server->log, LOG_ERROR, "Unable to queue %zu address indexes for worker %d", count,
+        worker->req.pid);
+    return;
+  }
+
+  pending->server = server;
+  pending->req.data = pending;
+  memcpy(pending->indexes, indexes, count);
+  pending->buf = uv_buf_init(pending->indexes, count);
+
+  uv_write(&pending->req, (uv_stream_t *) &worker->pipe, &pending->buf, 1, on_indexes_written);
+}
+
+/**
+ * Passes every pending connection to the worker in a single message. Each
+ * file descriptor is accompanied by one byte: the index of the
+ * listen_address_t that accepted it. The message is only sent directly while
+ * libuv has nothing queued on the pipe, so connections reach the worker in
+ * the order they were accepted.
+ */
+static void server_flush_fds(struct server_t * server, struct worker_process_t * worker)
+{
+  size_t count = worker->pending_count;
+  if (count == 0) {
+    return;
+  }
+  worker->pending_count = 0;
+
+  uv_os_fd_t pipe_fd;
+  int r = uv_fileno((uv_handle_t *) &worker->pipe, &pipe_fd);
+
+  if (r == 0 && worker->pipe.write_queue_size > 0) {
+    // earlier connections are still waiting for the pipe to drain
+    r = UV_EAGAIN;
+  }
+
+  if (r == 0) {
+    union {
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int) * SERVER_FD_BATCH_SIZE)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = worker->pending_indexes;
+    iov.iov_len = count;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), worker->pending_fds, sizeof(int) * count);
+
+    ssize_t sent;
+    do {
+      sent = sendmsg(pipe_fd, &msg, 0);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent >= 0) {
+      log_append(server->log, LOG_DEBUG, "Server %d: Passed %zu connections to worker %d",
+          getpid(), count, worker->req.pid);
+
+      // the worker has its own copies now
+      for (size_t i = 0; i < count; i++) {
+        close(worker->pending_fds[i]);
+      }
+
+      if ((size_t) sent < count) {
+        // the rest has to go out before anything else libuv writes to the pipe
+        server_send_indexes_queued(server, worker, worker->pending_indexes + sent, count - sent);
+      }
+      return;
+    }
+
+    r = uv_translate_sys_error(errno);
+  }
+
+  if (r == UV_EAGAIN) {
+    // the worker's pipe is full (or libuv is already queueing for it) - let
+    // libuv queue the connections until it drains
+    for (size_t i = 0; i < count; i++) {
+      server_send_fd_queued(server, worker, worker->pending_fds[i], worker->pending_indexes[i]);
+    }
+  } else {
+    log_append(server->log, LOG_ERROR, "Error passing file descriptors to worker %d: %s",
+        worker->req.pid, uv_err_name(r));
+    for (size_t i = 0; i < count; i++) {
+      close(worker->pending_fds[i]);
+    }
+  }
+}
+
+static void server_on_new_connections(uv_poll_t * poll, int status, int events)
+{
+  UNUSED(events);
+
+  struct tcp_list_t * tcp_list = poll->data;
+  struct listen_address_t * addr = tcp_list->address;
+  struct server_t * server = addr->data;
+
+  if (status < 0) {
+    log_append(server->log, LOG_ERROR, "Error getting new connection: %s\n", uv_err_name(status));
+    return;
+  }
 
-    uv_buf_t * buf = &server_client->buf;
+  // drain the accept queue, batching the connections for each worker
+  for (size_t accepted = 0; accepted < MAX_ACCEPTS_PER_EVENT; accepted++) {
+    int fd = accept4(tcp_list->fd, NULL, NULL, SOCK_CLOEXEC);
 
-    // send the index of the listen_address_t that accepted this
-    // connection to the worker
-    char index_encoded = addr->index;
-    buf->base = &index_encoded;
-    buf->len = 1;
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+        log_append(server->log, LOG_ERROR, "Error accepting connection: %s", strerror(errno));
+      }
+      break;
+    }
 
-    struct worker_process_t * worker = server->workers[server->round_robin_counter];
+    struct worker_process_t * worker = server_select_worker(server);
 
     log_append(server->log, LOG_DEBUG, "Server %d: Accepted file %d for worker %d\n",
-        getpid(), client->io_watcher.fd, worker->req.pid);
+        getpid(), fd, worker->req.pid);
 
-    uv_write2(write_req, (uv_stream_t *) &worker->pipe, buf, 1,
-        (uv_stream_t *) client, on_write_complete);
-    server->round_robin_counter = (server->round_robin_counter + 1) %
-      server->config->num_workers;
+    worker->pending_fds[worker->pending_count] = fd;
+    worker->pending_indexes[worker->pending_count] = addr->index;
+    worker->pending_count++;
+
+    if (worker->pending_count == SERVER_FD_BATCH_SIZE) {
+      server_flush_fds(server, worker);
+    }
+  }
+
+  for (size_t i = 0; i < server->config->num_workers; i++) {
+    server_flush_fds(server, server->workers[i]);
+  }
+}
+
+/**
+ * Creates a non-blocking listening socket for the given address
+ */
+static int server_listen_socket(struct sockaddr_in * bind_addr)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return uv_translate_sys_error(errno);
+  }
+
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+      bind(fd, (const struct sockaddr *) bind_addr, sizeof(struct sockaddr_in)) != 0 ||
+      listen(fd, LISTEN_BACKLOG) != 0) {
+    int r = uv_translate_sys_error(errno);
+    close(fd);
+    return r;
+  }
+
+  return fd;
+}
+
+static bool server_ocsp_fetch_certificate(struct server_t * server, const char * cert_file,
+    uint64_t * next_update)
+{
+  uint64_t expires;
+
+  if (!tls_ocsp_fetch(server->log, cert_file, server->config->tls_ocsp_responder, &expires)) {
+    return false;
+  }
 
+  if (expires < *next_update) {
+    *next_update = expires;
+  }
+
+  return true;
+}
+
+/**
+ * Runs on the thread pool - the responders may be slow or unreachable
+ */
+static void server_ocsp_fetch(uv_work_t * req)
+{
+  struct server_t * server = req->data;
+  struct server_config_t * config = server->config;
+
+  uint64_t next_update = UINT64_MAX;
+  bool success = server_ocsp_fetch_certificate(server, config->certificate_path, &next_update);
+
+  for (struct tls_certificate_config_t * cert = config->tls_certificates; cert; cert = cert->next) {
+    // certificates with several hostnames are listed once for each
+    bool fetched = strcmp(cert->certificate_path, config->certificate_path) == 0;
+    for (struct tls_certificate_config_t * prev = config->tls_certificates; prev != cert && !fetched;
+         prev = prev->next) {
+      fetched = strcmp(cert->certificate_path, prev->certificate_path) == 0;
+    }
+
+    if (!fetched && !server_ocsp_fetch_certificate(server, cert->certificate_path, &next_update)) {
+      success = false;
+    }
+  }
+
+  server->ocsp_success = success;
+  server->ocsp_next_update = next_update;
+}
+
+static void server_ocsp_refresh(uv_timer_t * timer);
+
+static void server_ocsp_fetched(uv_work_t * req, int status)
+{
+  struct server_t * server = req->data;
+
+  server->ocsp_fetching = false;
+  server->active_handlers--;
+
+  if (server->stopping || status) {
+    server_stop_continue(server);
+    return;
+  }
+
+  // the workers keep stapling the cached responses in the meantime
+  uint64_t delay = TLS_OCSP_RETRY_INTERVAL;
+
+  if (server->ocsp_success) {
+    uint64_t now = time(NULL);
+    // refresh half way through the validity of the first response to expire
+    // at the latest, so there is time to retry
+    uint64_t half_life = server->ocsp_next_update > now ? (server->ocsp_next_update - now) * 1000 / 2 : 0;
+
+    delay = server->config->tls_ocsp_refresh_interval;
+    if (delay == 0 || half_life < delay) {
+      delay = half_life;
+    }
+    if (delay < TLS_OCSP_RETRY_INTERVAL) {
+      delay = TLS_OCSP_RETRY_INTERVAL;
+    }
   } else {
-    free(server_client);
-    uv_close((uv_handle_t *) client, NULL);
+    log_append(server->log, LOG_WARN, "Unable to refresh every OCSP response, retrying");
+  }
+
+  log_append(server->log, LOG_DEBUG, "Refreshing OCSP responses in %" PRIu64 "s", delay / 1000);
+
+  uv_timer_start(&server->ocsp_timer, server_ocsp_refresh, delay, 0);
+}
+
+static void server_ocsp_refresh(uv_timer_t * timer)
+{
+  struct server_t * server = timer->data;
+
+  if (server->ocsp_fetching) {
+    return;
+  }
+
+  server->ocsp_work.data = server;
+
+  int r = uv_queue_work(&server->loop, &server->ocsp_work, server_ocsp_fetch, server_ocsp_fetched);
+  if (r) {
+    log_append(server->log, LOG_ERROR, "Unable to fetch OCSP responses: %s", uv_err_name(r));
+    uv_timer_start(&server->ocsp_timer, server_ocsp_refresh, TLS_OCSP_RETRY_INTERVAL, 0);
+    return;
   }
+
+  // the loop isn't stopped while a fetch is running
+  server->ocsp_fetching = true;
+  server->active_handlers++;
 }
 
 static bool setup_workers(struct server_t * server)
@@ -174,15 +545,26 @@ static bool setup_workers(struct server_t * server)
   char worker_path[PATH_SIZE];
   uv_exepath(worker_path, &path_size);
 
+  if (worker_use_tls(server->config)) {
+    server->tls_session_cache_fd = tls_session_cache_create(server->config->tls_session_cache_size);
+    if (server->tls_session_cache_fd < 0) {
+      log_append(server->log, LOG_WARN, "Unable to create the shared TLS session cache: %s", strerror(errno));
+    }
+  }
+
   // copy the existing arguments, but add "-a" as the second to start the child
-  // process as a worker
-  char * args[server->config->argc + 2];
-  args[0] = worker_path;
-  args[1] = "-a"; // run as a worker
+  // process as a worker - and "-s" if it's passed the session cache
+  char * args[server->config->argc + 3];
+  int num_args = 0;
+  args[num_args++] = worker_path;
+  args[num_args++] = "-a"; // run as a worker
+  if (server->tls_session_cache_fd >= 0) {
+    args[num_args++] = "-s";
+  }
   for (int i = 1; i < server->config->argc; i++) {
-    args[i+1] = server->config->argv[i];
+    args[num_args++] = server->config->argv[i];
   }
-  args[server->config->argc+1] = NULL;
+  args[num_args] = NULL;
 
   int num_workers = server->config->num_workers;
 
@@ -196,8 +578,9 @@ static bool setup_workers(struct server_t * server)
     uv_pipe_init(&server->loop, &worker->pipe, 1);
     worker->pipe.data = worker;
 
-    uv_stdio_container_t child_stdio[3];
-    child_stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE;
+    uv_stdio_container_t child_stdio[4];
+    // the worker reads connections from the pipe and writes load reports back
+    child_stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE;
     child_stdio[0].data.stream = (uv_stream_t *) &worker->pipe;
     child_stdio[1].flags = UV_INHERIT_FD;
     child_stdio[1].data.fd = 1;
@@ -207,6 +590,13 @@ static bool setup_workers(struct server_t * server)
     worker->options.stdio = child_stdio;
     worker->options.stdio_count = 3;
 
+    if (server->tls_session_cache_fd >= 0) {
+      // shared TLS session state - see TLS_SESSION_CACHE_FD
+      child_stdio[3].flags = UV_INHERIT_FD;
+      child_stdio[3].data.fd = server->tls_session_cache_fd;
+      worker->options.stdio_count = 4;
+    }
+
     worker->options.exit_cb = close_process_handle;
     worker->options.file = args[0];
     worker->options.args = args;
@@ -219,6 +609,10 @@ static bool setup_workers(struct server_t * server)
       return false;
     }
     server->active_workers++;
+
+    if (!server->config->reuse_port) {
+      uv_read_start((uv_stream_t *) &worker->pipe, alloc_load_buffer, server_on_load_report);
+    }
   }
   return true;
 }
@@ -238,19 +632,24 @@ bool server_run(struct server_t * server)
   uv_signal_start(&server->sigint_handler, server_sigint_handler, SIGINT);
   uv_signal_start(&server->sigterm_handler, server_sigterm_handler, SIGTERM);
 
+  if (worker_use_tls(server->config) && server->config->tls_ocsp_stapling) {
+    // workers staple whatever responses are cached until this has finished
+    uv_timer_start(&server->ocsp_timer, server_ocsp_refresh, 0, 0);
+  }
+
+  if (server->config->reuse_port) {
+    // the workers bind their own listeners - the server only supervises them
+    log_append(server->log, LOG_INFO, "Workers accepting connections with SO_REUSEPORT");
+    uv_run(&server->loop, UV_RUN_DEFAULT);
+    return true;
+  }
+
   size_t index = 0;
   struct listen_address_t * curr = server->config->address_list;
   while (curr) {
-    struct tcp_list_t * tcp_list = malloc(sizeof(struct tcp_list_t));
-    uv_tcp_t * tcp = &tcp_list->uv_server;
-    uv_tcp_init(&server->loop, tcp);
-    tcp->data = curr;
     curr->data = server;
     curr->index = index;
 
-    tcp_list->next = server->tcp_list;
-    server->tcp_list = tcp_list;
-
     struct sockaddr_in bind_addr;
     int r;
     if ((r = uv_ip4_addr(curr->hostname, curr->port, &bind_addr))) {
@@ -258,8 +657,25 @@ bool server_run(struct server_t * server)
           curr->use_tls ? "https" : "http", curr->hostname, curr->port, uv_err_name(r));
       return false;
     }
-    uv_tcp_bind(tcp, (const struct sockaddr *)&bind_addr, 0);
-    if ((r = uv_listen((uv_stream_t *) tcp, LISTEN_BACKLOG, server_on_new_connection))) {
+
+    // the listening socket is polled directly rather than through uv_listen so
+    // that all pending connections can be accepted and passed on in batches
+    int fd = server_listen_socket(&bind_addr);
+    if (fd < 0) {
+      r = fd;
+    } else {
+      struct tcp_list_t * tcp_list = malloc(sizeof(struct tcp_list_t));
+      tcp_list->fd = fd;
+      tcp_list->address = curr;
+      tcp_list->poll.data = tcp_list;
+      tcp_list->next = server->tcp_list;
+      server->tcp_list = tcp_list;
+      server->active_listeners++;
+
+      uv_poll_init_socket(&server->loop, &tcp_list->poll, fd);
+      r = uv_poll_start(&tcp_list->poll, UV_READABLE, server_on_new_connections);
+    }
+    if (r) {
       log_append(server->log, LOG_FATAL, "Listening on %s://%s:%ld failed: %s",
           curr->use_tls ? "https" : "http", curr->hostname, curr->port, uv_err_name(r));
       return false;
@@ -270,7 +686,6 @@ bool server_run(struct server_t * server)
     curr = curr->next;
     index++;
   }
-  server->active_listeners = index;
 
   uv_run(&server->loop, UV_RUN_DEFAULT);
 
@@ -290,9 +705,17 @@ void server_stop(struct server_t * server)
     uv_close((uv_handle_t *) &server->sigint_handler, handler_closed);
     uv_close((uv_handle_t *) &server->sigterm_handler, handler_closed);
 
+    if (server->ocsp_fetching) {
+      // only possible if it hasn't started yet
+      uv_cancel((uv_req_t *) &server->ocsp_work);
+    }
+    uv_timer_stop(&server->ocsp_timer);
+    uv_close((uv_handle_t *) &server->ocsp_timer, handler_closed);
+
     struct tcp_list_t * tcp_list = server->tcp_list;
     while (tcp_list) {
-      uv_close((uv_handle_t *) &tcp_list->uv_server, tcp_listener_closed);
+      uv_poll_stop(&tcp_list->poll);
+      uv_close((uv_handle_t *) &tcp_list->poll, tcp_listener_closed);
       tcp_list = tcp_list->next;
     }
 
@@ -324,6 +747,8 @@ void server_init(struct server_t * server, struct server_config_t * config)
 
   server->stopping = false;
   server->round_robin_counter = 0;
+  server->least_loaded_dispatch = config->least_loaded_dispatch;
+  srand(uv_hrtime());
   server->active_handlers = 0;
 
   uv_signal_init(&server->loop, &server->sigpipe_handler);
@@ -334,8 +759,16 @@ void server_init(struct server_t * server, struct server_config_t * config)
   server->sigterm_handler.data = server;
   server->active_handlers += 3;
 
+  uv_timer_init(&server->loop, &server->ocsp_timer);
+  server->ocsp_timer.data = server;
+  server->active_handlers++;
+  server->ocsp_fetching = false;
+  server->ocsp_success = false;
+  server->ocsp_next_update = 0;
+
   server->active_listeners = 0;
   server->active_workers = 0;
+  server->tls_session_cache_fd = -1;
 }
 
 void server_free(struct server_t * server)
@@ -344,6 +777,10 @@ void server_free(struct server_t * server)
 
   free(server->workers);
 
+  if (server->tls_session_cache_fd >= 0) {
+    close(server->tls_session_cache_fd);
+  }
+
   while (server->tcp_list) {
     struct tcp_list_t * tcp_list = server->tcp_list;
     server->tcp_list = server->tcp_list->next;
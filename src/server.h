@@ -13,16 +13,33 @@
 #include "plugin.h"
 #include "server_config.h"
 
+/**
+ * The maximum number of connections passed to a worker in one message
+ */
+#define SERVER_FD_BATCH_SIZE 64
+
 struct worker_process_t {
   struct server_t * server;
   uv_process_t req;
   uv_process_options_t options;
   uv_pipe_t pipe;
   bool stopped;
+
+  // the most recent load reported by the worker
+  struct worker_load_report_t load;
+  uint8_t load_buf[sizeof(struct worker_load_report_t)];
+  size_t load_buf_length;
+
+  // accepted connections waiting to be passed to the worker
+  int pending_fds[SERVER_FD_BATCH_SIZE];
+  char pending_indexes[SERVER_FD_BATCH_SIZE];
+  size_t pending_count;
 };
 
 struct tcp_list_t {
-  uv_tcp_t uv_server;
+  uv_poll_t poll;
+  uv_os_sock_t fd;
+  struct listen_address_t * address;
   struct tcp_list_t * next;
 };
 
@@ -47,6 +64,19 @@ struct server_t {
   struct worker_process_t ** workers;
   size_t active_workers;
   size_t round_robin_counter;
+  bool least_loaded_dispatch;
+
+  // passed on to every worker - see tls_session_cache_create
+  int tls_session_cache_fd;
+
+  // fetches the OCSP responses that workers staple - see tls_ocsp_fetch
+  uv_timer_t ocsp_timer;
+  uv_work_t ocsp_work;
+  bool ocsp_fetching;
+  // results of the last fetch, set on the thread pool
+  bool ocsp_success;
+  // seconds since the epoch - when the first of the responses expires
+  uint64_t ocsp_next_update;
 
 };
 
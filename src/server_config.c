@@ -25,6 +25,22 @@ static void append_address(struct server_config_t * config, struct listen_addres
   }
 }
 
+static void append_certificate(struct server_config_t * config, const char * hostname,
+                               const char * certificate_path, const char * private_key_path)
+{
+  struct tls_certificate_config_t * cert = malloc(sizeof(struct tls_certificate_config_t));
+  cert->hostname = hostname;
+  cert->certificate_path = certificate_path;
+  cert->private_key_path = private_key_path;
+  cert->next = NULL;
+
+  struct tls_certificate_config_t ** curr = &config->tls_certificates;
+  while (*curr) {
+    curr = &(*curr)->next;
+  }
+  *curr = cert;
+}
+
 static bool starts_with(char * s, char * pre)
 {
   size_t lenpre = strlen(pre);
@@ -102,6 +118,22 @@ static const int get_int(json_t * root, char * key, int def)
   return def;
 }
 
+static bool get_timeout(json_t * root, char * key, uint64_t * timeout)
+{
+  json_t * timeout_j = json_object_get(root, key);
+  if (timeout_j) {
+    // configured in seconds
+    double timeout_s = json_number_value(timeout_j);
+    if (timeout_s < 0) {
+      fprintf(stderr, "Invalid %s: %f\n", key, timeout_s);
+      return false;
+    }
+    *timeout = timeout_s * 1000 + 0.5;
+  }
+
+  return true;
+}
+
 static bool parse_config_file(struct server_config_t * config)
 {
   json_t * root;
@@ -130,8 +162,125 @@ static bool parse_config_file(struct server_config_t * config)
     config->num_workers_set = true;
   }
 
+  json_t * worker_threads_j = json_object_get(root, "worker_threads");
+  if (worker_threads_j) {
+    int worker_threads = get_int(root, "worker_threads", 1);
+    if (worker_threads < 1) {
+      fprintf(stderr, "Invalid number of worker threads: %d\n", worker_threads);
+      return false;
+    }
+    config->worker_threads = worker_threads;
+  }
+
+  json_t * connection_memory_limit_j = json_object_get(root, "connection_memory_limit");
+  if (connection_memory_limit_j) {
+    double limit = json_number_value(connection_memory_limit_j);
+    if (limit < 0) {
+      fprintf(stderr, "Invalid connection memory limit: %.0f\n", limit);
+      return false;
+    }
+    config->connection_memory_limit = limit;
+  }
+
+  json_t * worker_memory_limit_j = json_object_get(root, "worker_memory_limit");
+  if (worker_memory_limit_j) {
+    double limit = json_number_value(worker_memory_limit_j);
+    if (limit < 0) {
+      fprintf(stderr, "Invalid worker memory limit: %.0f\n", limit);
+      return false;
+    }
+    config->worker_memory_limit = limit;
+  }
+
+  if (!get_timeout(root, "idle_timeout", &config->idle_timeout) ||
+      !get_timeout(root, "header_timeout", &config->header_timeout) ||
+      !get_timeout(root, "stream_timeout", &config->stream_timeout) ||
+      !get_timeout(root, "tls_session_timeout", &config->tls_session_timeout) ||
+      !get_timeout(root, "tls_ticket_key_lifetime", &config->tls_ticket_key_lifetime) ||
+      !get_timeout(root, "tls_record_idle_timeout", &config->tls_record_idle_timeout) ||
+      !get_timeout(root, "tls_ocsp_refresh_interval", &config->tls_ocsp_refresh_interval)) {
+    return false;
+  }
+
+  json_t * tls_session_tickets_j = json_object_get(root, "tls_session_tickets");
+  if (tls_session_tickets_j) {
+    config->tls_session_tickets = json_is_true(tls_session_tickets_j);
+  }
+
+  json_t * tls_session_cache_size_j = json_object_get(root, "tls_session_cache_size");
+  if (tls_session_cache_size_j) {
+    double size = json_number_value(tls_session_cache_size_j);
+    if (size < 0) {
+      fprintf(stderr, "Invalid TLS session cache size: %.0f\n", size);
+      return false;
+    }
+    config->tls_session_cache_size = size;
+  }
+
+  json_t * ktls_j = json_object_get(root, "ktls");
+  if (ktls_j) {
+    config->ktls = json_is_true(ktls_j);
+  }
+
+  json_t * tls_async_handshakes_j = json_object_get(root, "tls_async_handshakes");
+  if (tls_async_handshakes_j) {
+    config->tls_async_handshakes = json_is_true(tls_async_handshakes_j);
+  }
+
+  json_t * tls_max_early_data_j = json_object_get(root, "tls_max_early_data");
+  if (tls_max_early_data_j) {
+    double size = json_number_value(tls_max_early_data_j);
+    if (size < 0 || size > UINT32_MAX) {
+      fprintf(stderr, "Invalid TLS max early data: %.0f\n", size);
+      return false;
+    }
+    config->tls_max_early_data = size;
+  }
+
+  json_t * tls_ocsp_stapling_j = json_object_get(root, "tls_ocsp_stapling");
+  if (tls_ocsp_stapling_j) {
+    config->tls_ocsp_stapling = json_is_true(tls_ocsp_stapling_j);
+  }
+
+  json_t * tls_small_record_size_j = json_object_get(root, "tls_small_record_size");
+  if (tls_small_record_size_j) {
+    double size = json_number_value(tls_small_record_size_j);
+    if (size < 0 || size > SSL3_RT_MAX_PLAIN_LENGTH) {
+      fprintf(stderr, "Invalid TLS small record size: %.0f\n", size);
+      return false;
+    }
+    config->tls_small_record_size = size;
+  }
+
+  json_t * tls_record_boost_threshold_j = json_object_get(root, "tls_record_boost_threshold");
+  if (tls_record_boost_threshold_j) {
+    double threshold = json_number_value(tls_record_boost_threshold_j);
+    if (threshold < 0) {
+      fprintf(stderr, "Invalid TLS record boost threshold: %.0f\n", threshold);
+      return false;
+    }
+    config->tls_record_boost_threshold = threshold;
+  }
+
+  json_t * reuse_port_j = json_object_get(root, "reuse_port");
+  if (reuse_port_j) {
+    config->reuse_port = json_is_true(reuse_port_j);
+  }
+
   const char * value;
 
+  value = get_string(root, "dispatch", NULL);
+  if (value) {
+    if (strcmp(value, "least_loaded") == 0) {
+      config->least_loaded_dispatch = true;
+    } else if (strcmp(value, "round_robin") == 0) {
+      config->least_loaded_dispatch = false;
+    } else {
+      fprintf(stderr, "Invalid dispatch (least_loaded|round_robin): %s\n", value);
+      return false;
+    }
+  }
+
   value = get_string(root, "h2_protocol_version_string", NULL);
   if (value) config->h2_protocol_version_string = value;
 
@@ -144,6 +293,41 @@ static bool parse_config_file(struct server_config_t * config)
   value = get_string(root, "certificate_path", NULL);
   if (value) config->certificate_path = value;
 
+  json_t * certificates_j = json_object_get(root, "certificates");
+  for (size_t i = 0; i < json_array_size(certificates_j); i++) {
+    json_t * certificate_j = json_array_get(certificates_j, i);
+    if (!json_is_object(certificate_j)) {
+      fprintf(stderr, "Certificate %lu must be a JSON object\n", i + 1);
+      return false;
+    }
+
+    const char * certificate_path = get_string(certificate_j, "certificate_path", NULL);
+    const char * private_key_path = get_string(certificate_j, "private_key_path", NULL);
+    if (!certificate_path || !private_key_path) {
+      fprintf(stderr, "Certificate %lu must have a certificate_path and a private_key_path\n", i + 1);
+      return false;
+    }
+
+    json_t * hostnames_j = json_object_get(certificate_j, "hostnames");
+    if (!hostnames_j) {
+      append_certificate(config, NULL, certificate_path, private_key_path);
+      continue;
+    }
+
+    for (size_t j = 0; j < json_array_size(hostnames_j); j++) {
+      const char * hostname = json_string_value(json_array_get(hostnames_j, j));
+      if (!hostname) {
+        fprintf(stderr, "Hostname %lu of certificate %lu must be a string\n", j + 1, i + 1);
+        return false;
+      }
+
+      append_certificate(config, hostname, certificate_path, private_key_path);
+    }
+  }
+
+  value = get_string(root, "tls_ocsp_responder", NULL);
+  if (value) config->tls_ocsp_responder = value;
+
   value = get_string(root, "log_path", NULL);
   if (value) config->log_path = value;
 
@@ -222,11 +406,34 @@ void server_config_args_parse(struct server_config_t * config, int argc, char **
   config->address_list = NULL;
   config->num_workers_set = false;
   config->num_workers = 0;
+  config->reuse_port = false;
+  config->worker_threads = 1;
+  config->least_loaded_dispatch = true;
+  config->connection_memory_limit = DEFAULT_CONNECTION_MEMORY_LIMIT;
+  config->worker_memory_limit = DEFAULT_WORKER_MEMORY_LIMIT;
+  config->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  config->header_timeout = DEFAULT_HEADER_TIMEOUT;
+  config->stream_timeout = DEFAULT_STREAM_TIMEOUT;
+  config->tls_session_tickets = true;
+  config->tls_session_cache_size = DEFAULT_TLS_SESSION_CACHE_SIZE;
+  config->tls_session_timeout = DEFAULT_TLS_SESSION_TIMEOUT;
+  config->tls_ticket_key_lifetime = DEFAULT_TLS_TICKET_KEY_LIFETIME;
+  config->tls_small_record_size = DEFAULT_TLS_SMALL_RECORD_SIZE;
+  config->tls_record_boost_threshold = DEFAULT_TLS_RECORD_BOOST_THRESHOLD;
+  config->tls_record_idle_timeout = DEFAULT_TLS_RECORD_IDLE_TIMEOUT;
+  config->ktls = false;
+  config->tls_async_handshakes = true;
+  config->tls_max_early_data = 0;
+  config->tls_ocsp_stapling = false;
+  config->tls_ocsp_responder = NULL;
+  config->tls_ocsp_refresh_interval = DEFAULT_TLS_OCSP_REFRESH_INTERVAL;
   config->private_key_path = PRIVATE_KEY_FILE_NAME;
   config->certificate_path = CERTIFICATE_FILE_NAME;
+  config->tls_certificates = NULL;
   config->last_plugin = NULL;
   config->plugin_configs = NULL;
   config->start_worker = false;
+  config->tls_session_cache_inherited = false;
   config->start_daemon = false;
   config->print_help = false;
   config->print_version = false;
@@ -239,7 +446,7 @@ void server_config_args_parse(struct server_config_t * config, int argc, char **
 
   opterr = 0;
 
-  while ((c = getopt(argc, argv, "f:l:p:k:c:w:L:o:adhv")) != -1) {
+  while ((c = getopt(argc, argv, "f:l:p:k:c:w:t:L:o:rasdhv")) != -1) {
 
     switch (c) {
       case 'f': {
@@ -302,6 +509,17 @@ void server_config_args_parse(struct server_config_t * config, int argc, char **
         break;
       }
 
+      case 't': { // worker threads per process
+        char * endptr = NULL;
+        long worker_threads = strtol(optarg, &endptr, 10);
+        if (*endptr != '\0' || errno == ERANGE || worker_threads < 1) {
+          fprintf(stderr, "Invalid number of worker threads: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        config->worker_threads = worker_threads;
+        break;
+      }
+
       case 'L': { // log level
         config->log_level_string = optarg;
         break;
@@ -312,10 +530,18 @@ void server_config_args_parse(struct server_config_t * config, int argc, char **
         break;
       }
 
+      case 'r': // each worker listens with SO_REUSEPORT
+        config->reuse_port = true;
+        break;
+
       case 'a': // accept (start a worker process)
         config->start_worker = true;
         break;
 
+      case 's': // the worker was passed the shared TLS session cache
+        config->tls_session_cache_inherited = true;
+        break;
+
       case 'd': // daemon (start a daemon process)
         config->start_daemon = true;
         break;
@@ -330,7 +556,7 @@ void server_config_args_parse(struct server_config_t * config, int argc, char **
 
       case '?':
         if (optopt == 'l' || optopt == 'p' || optopt == 'k' || optopt == 'c' ||
-            optopt == 'w' || optopt == 'o' || optopt == 'L' || optopt == 'f') {
+            optopt == 'w' || optopt == 't' || optopt == 'o' || optopt == 'L' || optopt == 'f') {
           fprintf(stderr, "Option -%c requires an argument.\n", optopt);
           exit(EXIT_FAILURE);
         } else if (isprint(optopt)) {
@@ -382,6 +608,17 @@ void server_config_args_parse(struct server_config_t * config, int argc, char **
     config->default_log_level = DEFAULT_LOG_LEVEL;
   }
 
+  if (config->worker_threads > 1) {
+    // only one thread can read connections from the server's pipe, so
+    // every thread accepts on its own SO_REUSEPORT listener instead
+    config->reuse_port = true;
+
+    if (!config->num_workers_set) {
+      config->num_workers = 1;
+      config->num_workers_set = true;
+    }
+  }
+
   if (!config->num_workers_set) {
     // set default number of workers to the number of cpus
     uv_cpu_info_t * cpu_infos;
@@ -469,6 +706,12 @@ void server_config_plugin_each(void * context, void * config_context, plugin_con
 
 void server_config_free(struct server_config_t * config)
 {
+  while (config->tls_certificates) {
+    struct tls_certificate_config_t * next = config->tls_certificates->next;
+    free(config->tls_certificates);
+    config->tls_certificates = next;
+  }
+
 #ifdef JANSSON_FOUND
   if (config->json_root) {
     json_decref(config->json_root);
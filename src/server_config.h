@@ -19,6 +19,19 @@
 #define DEFAULT_LOG_LEVEL LOG_WARN
 #define PRIVATE_KEY_FILE_NAME "key.pem"
 #define CERTIFICATE_FILE_NAME "cert.pem"
+#define DEFAULT_CONNECTION_MEMORY_LIMIT 0x1000000 // 16MiB
+#define DEFAULT_WORKER_MEMORY_LIMIT 0x40000000 // 1GiB
+#define DEFAULT_IDLE_TIMEOUT 60000 // ms
+#define DEFAULT_HEADER_TIMEOUT 10000 // ms
+#define DEFAULT_STREAM_TIMEOUT 60000 // ms
+#define DEFAULT_TLS_SESSION_CACHE_SIZE 4096
+#define DEFAULT_TLS_SESSION_TIMEOUT 300000 // ms
+#define DEFAULT_TLS_TICKET_KEY_LIFETIME 3600000 // ms
+// fits in one 1500 octet packet along with the IP, TCP and TLS overhead
+#define DEFAULT_TLS_SMALL_RECORD_SIZE 1300
+#define DEFAULT_TLS_RECORD_BOOST_THRESHOLD 0x100000 // 1MiB
+#define DEFAULT_TLS_RECORD_IDLE_TIMEOUT 1000 // ms
+#define DEFAULT_TLS_OCSP_REFRESH_INTERVAL 3600000 // ms
 
 struct plugin_config_t {
 
@@ -30,6 +43,18 @@ struct plugin_config_t {
 
 };
 
+struct tls_certificate_config_t {
+
+  // NULL for the default certificates
+  const char * hostname;
+
+  const char * certificate_path;
+  const char * private_key_path;
+
+  struct tls_certificate_config_t * next;
+
+};
+
 struct listen_address_t {
 
   struct listen_address_t * next;
@@ -59,6 +84,8 @@ struct server_config_t {
   struct listen_address_t * address_list;
 
   bool start_worker;
+  // set for workers that were passed the shared session cache on TLS_SESSION_CACHE_FD
+  bool tls_session_cache_inherited;
   bool start_daemon;
   bool print_help;
   bool print_version;
@@ -66,9 +93,69 @@ struct server_config_t {
   bool num_workers_set;
   size_t num_workers;
 
+  // each worker binds its own SO_REUSEPORT listeners instead of
+  // receiving accepted connections from the server process
+  bool reuse_port;
+
+  // the number of event loop threads in each worker process
+  size_t worker_threads;
+
+  // dispatch new connections to the least loaded of two workers instead
+  // of strictly round robin
+  bool least_loaded_dispatch;
+
+  // how many octets a single connection and all of a worker thread's
+  // connections may hold before load is shed - 0 for no limit
+  size_t connection_memory_limit;
+  size_t worker_memory_limit;
+
+  // timeouts in milliseconds - 0 for no timeout
+  // a connection with no requests in progress
+  uint64_t idle_timeout;
+  // finishing the TLS handshake, the http/2 connection preface and settings,
+  // or a request's headers
+  uint64_t header_timeout;
+  // an http/2 stream with no frames sent or received
+  uint64_t stream_timeout;
+
+  // TLS session resumption, shared by every worker
+  bool tls_session_tickets;
+  // the number of sessions kept by id - 0 to only use tickets
+  size_t tls_session_cache_size;
+  // in milliseconds
+  uint64_t tls_session_timeout;
+  uint64_t tls_ticket_key_lifetime;
+
+  // TLS records are kept small (0 to disable) until this many octets have
+  // been written, and again after the connection has been idle
+  size_t tls_small_record_size;
+  size_t tls_record_boost_threshold;
+  uint64_t tls_record_idle_timeout;
+
+  // move TLS encryption of outgoing data into the kernel (Linux only)
+  bool ktls;
+
+  // run handshakes (and their private key operations) on the thread pool
+  bool tls_async_handshakes;
+
+  // octets of TLS 1.3 early data accepted from resuming clients - 0 to
+  // disable it
+  size_t tls_max_early_data;
+
+  // staple OCSP responses, which the server process fetches every refresh
+  // interval (ms) - from the responder named in each certificate unless
+  // tls_ocsp_responder is set
+  bool tls_ocsp_stapling;
+  const char * tls_ocsp_responder;
+  uint64_t tls_ocsp_refresh_interval;
+
   const char * certificate_path;
   const char * private_key_path;
 
+  // certificates for particular SNI hostnames, and any extra defaults
+  // (e.g. an ECDSA certificate alongside an RSA one)
+  struct tls_certificate_config_t * tls_certificates;
+
   struct plugin_config_t * plugin_configs;
   struct plugin_config_t * last_plugin;
 
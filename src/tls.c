@@ -3,10 +3,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <openssl/ssl.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/kdf.h>
+#include <openssl/pem.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+#ifdef HAVE_KTLS
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
 
 #include <uv.h>
 
@@ -14,12 +42,10 @@
 #include "util/hash_table.h"
 #include "tls.h"
 
-#define TLS_BUF_LENGTH 0x100000 // 2^20
-
-SSL_CTX * global_ssl_ctx;
 
+// ECDSA first - signing is much cheaper than RSA when the client supports it
 static const char * const DEFAULT_CIPHERS =
-  "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES256-GCM-SHA384:DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128:AES256:AES:DES-CBC3-SHA:HIGH:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK";
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES256-SHA384:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:DHE-RSA-AES128-SHA256:DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128:AES256:AES:DES-CBC3-SHA:HIGH:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK";
 
 static const char * http2_protocol_version_string;
 static int http2_protocol_version_string_length;
@@ -31,6 +57,7 @@ static unsigned char * supported_protocols;
 unsigned char supported_protocols_length;
 
 static int ssl_ctx_app_data_index;
+static int ssl_client_data_index;
 
 static void tls_prepare_supported_protocols(const char * h2_string, const char * h1_1_string)
 {
@@ -64,6 +91,7 @@ bool tls_init(const char * h2_protocol_version_string)
   OpenSSL_add_all_algorithms();
 
   ssl_ctx_app_data_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+  ssl_client_data_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 
   tls_prepare_supported_protocols(h2_protocol_version_string, "http/1.1");
 
@@ -155,6 +183,36 @@ static bool tls_debug_error(const SSL * const ssl, int retval, char * prefix)
   return true;
 }
 
+/**
+ * Finds the context with the certificates for the given name - an exact
+ * match or a wildcard for its parent domain
+ */
+static SSL_CTX * tls_server_find_ssl_ctx(tls_server_ctx_t * tls_ctx, const char * hostname)
+{
+  char name[TLS_MAX_HOSTNAME_LENGTH + 1];
+  size_t length = strlen(hostname);
+
+  if (length == 0 || length > TLS_MAX_HOSTNAME_LENGTH) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i <= length; i++) {
+    name[i] = tolower((unsigned char) hostname[i]);
+  }
+
+  SSL_CTX * ssl_ctx = hash_table_get(&tls_ctx->host_ssl_ctxs, name);
+
+  char * parent = strchr(name, '.');
+
+  if (!ssl_ctx && parent && parent > name) {
+    // "*.example.com" matches "www.example.com" but not "example.com"
+    parent[-1] = '*';
+    ssl_ctx = hash_table_get(&tls_ctx->host_ssl_ctxs, parent - 1);
+  }
+
+  return ssl_ctx;
+}
+
 int servername_callback(SSL * ssl, int * al, void * arg)
 {
   UNUSED(al);
@@ -167,11 +225,13 @@ int servername_callback(SSL * ssl, int * al, void * arg)
   if (hostname) {
     log_append(tls_ctx->log, LOG_TRACE, "SNI hostname: %s", hostname);
 
-    if (!global_ssl_ctx) {
-      log_append(tls_ctx->log, LOG_TRACE, "Could not set SSL CTX");
-    }
+    SSL_CTX * ssl_ctx = tls_server_find_ssl_ctx(tls_ctx, hostname);
 
-    SSL_set_SSL_CTX(ssl, global_ssl_ctx);
+    if (ssl_ctx) {
+      SSL_set_SSL_CTX(ssl, ssl_ctx);
+    } else {
+      log_append(tls_ctx->log, LOG_TRACE, "No certificates for %s, using the defaults", hostname);
+    }
   } else {
     log_append(tls_ctx->log, LOG_TRACE, "SNI hostname: null");
   }
@@ -281,11 +341,18 @@ static void tls_thread_cleanup(void)
 
 #endif
 
-tls_server_ctx_t * tls_server_init(struct log_context_t * log, const char * key_file, const char * cert_file)
+/**
+ * Sets up everything but the certificates - each set of certificates gets
+ * its own context, which a connection switches to once its SNI name is known
+ */
+static SSL_CTX * tls_ssl_ctx_init(struct log_context_t * log)
 {
   SSL_CTX * ssl_ctx = SSL_CTX_new(SSLv23_server_method());
 
-  global_ssl_ctx = ssl_ctx;
+  if (!ssl_ctx) {
+    log_append(log, LOG_FATAL, "SSL_CTX_new failed: %s", ERR_error_string(ERR_get_error(), NULL));
+    return NULL;
+  }
 
   SSL_CTX_set_options(ssl_ctx,
                       SSL_OP_NO_SSLv2 |
@@ -315,6 +382,7 @@ tls_server_ctx_t * tls_server_init(struct log_context_t * log, const char * key_
 
   if (ecdh == NULL) {
     log_append(log, LOG_FATAL, "EC_KEY_new_by_curve_name failed: %s", ERR_error_string(ERR_get_error(), NULL));
+    SSL_CTX_free(ssl_ctx);
     return NULL;
   }
 
@@ -332,15 +400,77 @@ tls_server_ctx_t * tls_server_init(struct log_context_t * log, const char * key_
   SSL_CTX_set_alpn_select_cb(ssl_ctx, alpn_callback, NULL);
 #endif
 
-  // set certificates
-  if (SSL_CTX_use_certificate_file(ssl_ctx, cert_file, SSL_FILETYPE_PEM) != 1) {
+#ifdef HAVE_CERT_COMPRESSION
+  // smallest output first - algorithms openssl was built without are skipped
+  int cert_comp_algs[] = { TLSEXT_comp_cert_brotli, TLSEXT_comp_cert_zstd, TLSEXT_comp_cert_zlib };
+  SSL_CTX_set1_cert_comp_preference(ssl_ctx, cert_comp_algs, sizeof(cert_comp_algs) / sizeof(int));
+#endif
+
+  return ssl_ctx;
+}
+
+/**
+ * Adds a certificate (and its chain) and private key - a context holds one
+ * of each key type and openssl picks whichever the client supports
+ */
+static bool tls_ssl_ctx_use_certificate(struct log_context_t * log, SSL_CTX * ssl_ctx, const char * key_file,
+                                        const char * cert_file)
+{
+  if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1) {
     log_append(log, LOG_FATAL, "Failed setting certificate file: %s, error: %s",
         cert_file, ERR_error_string(ERR_get_error(), NULL));
-    return NULL;
+    return false;
   }
+
   if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1) {
     log_append(log, LOG_FATAL, "Failed setting private key file: %s, error: %s",
         key_file, ERR_error_string(ERR_get_error(), NULL));
+    return false;
+  }
+
+  if (SSL_CTX_check_private_key(ssl_ctx) != 1) {
+    log_append(log, LOG_FATAL, "Private key %s does not match certificate %s", key_file, cert_file);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Compresses the context's certificates once up front, rather than in every
+ * full handshake. Returns false if openssl can't compress them.
+ */
+static bool tls_ssl_ctx_compress_certificates(struct log_context_t * log, SSL_CTX * ssl_ctx)
+{
+#ifdef HAVE_CERT_COMPRESSION
+  // 0 for every algorithm the client may pick
+  if (SSL_CTX_compress_certs(ssl_ctx, 0) == 1) {
+    return true;
+  }
+
+  log_append(log, LOG_DEBUG, "Certificates not compressed: %s", ERR_error_string(ERR_get_error(), NULL));
+#else
+  UNUSED(ssl_ctx);
+
+  log_append(log, LOG_DEBUG, "Certificate compression is not supported by this build of openssl");
+#endif
+
+  return false;
+}
+
+static void tls_ssl_ctx_free(void * ssl_ctx)
+{
+  SSL_CTX_free(ssl_ctx);
+}
+
+tls_server_ctx_t * tls_server_init(struct log_context_t * log, const char * key_file, const char * cert_file)
+{
+  SSL_CTX * ssl_ctx = tls_ssl_ctx_init(log);
+  ASSERT_OR_RETURN_NULL(ssl_ctx);
+
+  // set certificates
+  if (!tls_ssl_ctx_use_certificate(log, ssl_ctx, key_file, cert_file)) {
+    SSL_CTX_free(ssl_ctx);
     return NULL;
   }
 
@@ -348,259 +478,1477 @@ tls_server_ctx_t * tls_server_init(struct log_context_t * log, const char * key_
 
   tls_server_ctx_t * tls_server_ctx = malloc(sizeof(tls_server_ctx_t));
   tls_server_ctx->ssl_ctx = ssl_ctx;
+  hash_table_init_with_string_keys(&tls_server_ctx->host_ssl_ctxs, tls_ssl_ctx_free);
   tls_server_ctx->log = log;
+  tls_server_ctx->session_cache = NULL;
+  tls_server_ctx->session_timeout = 0;
+  tls_server_ctx->ticket_key_lifetime = 0;
+  tls_server_ctx->session_tickets = false;
+  tls_server_ctx->small_record_size = 0;
+  tls_server_ctx->record_boost_threshold = 0;
+  tls_server_ctx->record_idle_timeout = 0;
+  tls_server_ctx->ktls = false;
+  tls_server_ctx->max_early_data = 0;
+  tls_server_ctx->certificate_compression = tls_ssl_ctx_compress_certificates(log, ssl_ctx);
+  tls_server_ctx->compressed_certificates = 0;
+  tls_server_ctx->uncompressed_certificates = 0;
+  tls_server_ctx->records_written = 0;
+  tls_server_ctx->record_octets_written = 0;
+  tls_server_ctx->ocsp_staples = NULL;
+  uv_mutex_init(&tls_server_ctx->ocsp_mutex);
 
   return tls_server_ctx;
 }
 
-bool tls_server_free(tls_server_ctx_t * server_ctx)
+static bool tls_server_use_certificate(tls_server_ctx_t * server_ctx, SSL_CTX * ssl_ctx, const char * key_file,
+                                       const char * cert_file)
 {
-  tls_thread_cleanup();
+  if (!tls_ssl_ctx_use_certificate(server_ctx->log, ssl_ctx, key_file, cert_file)) {
+    return false;
+  }
 
-  if (server_ctx->ssl_ctx) {
-    SSL_CTX_free(server_ctx->ssl_ctx);
-    free(server_ctx);
+  if (server_ctx->certificate_compression) {
+    tls_ssl_ctx_compress_certificates(server_ctx->log, ssl_ctx);
   }
 
   return true;
 }
 
-tls_client_ctx_t * tls_client_init(tls_server_ctx_t * server_ctx, void * data,
-                                   tls_write_to_network_cb write_to_network, tls_write_to_app_cb write_to_app)
+bool tls_server_add_certificate(tls_server_ctx_t * server_ctx, const char * hostname, const char * key_file,
+                                const char * cert_file)
 {
+  if (!hostname) {
+    return tls_server_use_certificate(server_ctx, server_ctx->ssl_ctx, key_file, cert_file);
+  }
 
-  tls_client_ctx_t * tls_client_ctx = malloc(sizeof(tls_client_ctx_t));
-  ASSERT_OR_RETURN_NULL(tls_client_ctx);
-  tls_client_ctx->log = server_ctx->log;
-  tls_client_ctx->selected_protocol = NULL;
-  tls_client_ctx->handshake_complete = false;
-  tls_client_ctx->writing_to_app = false;
-  tls_client_ctx->data = data;
-  tls_client_ctx->write_to_network = write_to_network;
-  tls_client_ctx->write_to_app = write_to_app;
-  tls_client_ctx->ssl = NULL;
-  tls_client_ctx->app_bio = NULL;
-  tls_client_ctx->network_bio = NULL;
+  size_t length = strlen(hostname);
 
-  SSL * ssl = SSL_new(server_ctx->ssl_ctx);
+  if (length == 0 || length > TLS_MAX_HOSTNAME_LENGTH) {
+    log_append(server_ctx->log, LOG_FATAL, "Invalid certificate hostname: \"%s\"", hostname);
+    return false;
+  }
 
-  if (!ssl) {
-    tls_client_free(tls_client_ctx);
-    return NULL;
+  char * name = strdup(hostname);
+  ASSERT_OR_RETURN_FALSE(name);
+
+  for (size_t i = 0; i < length; i++) {
+    name[i] = tolower((unsigned char) name[i]);
   }
 
-  SSL_set_ex_data(ssl, ssl_ctx_app_data_index, server_ctx);
+  SSL_CTX * ssl_ctx = hash_table_get(&server_ctx->host_ssl_ctxs, name);
 
-  tls_client_ctx->ssl = ssl;
+  if (!ssl_ctx) {
+    ssl_ctx = tls_ssl_ctx_init(server_ctx->log);
 
-  // TODO - test with small bio buffer sizes
-  int err = BIO_new_bio_pair(&tls_client_ctx->app_bio, 0, &tls_client_ctx->network_bio, 0); // 0 for default size
+    if (!ssl_ctx || !hash_table_put(&server_ctx->host_ssl_ctxs, name, ssl_ctx)) {
+      free(name);
+      return false;
+    }
 
-  if (err != 1) {
-    log_append(server_ctx->log, LOG_ERROR, "Unable to create BIO pair");
-    tls_client_free(tls_client_ctx);
-    return NULL;
+    log_append(server_ctx->log, LOG_DEBUG, "Added TLS context for %s", name);
+  } else {
+    free(name);
   }
 
-  SSL_set_bio(ssl, tls_client_ctx->app_bio, tls_client_ctx->app_bio); // "cannot fail"
+  return tls_server_use_certificate(server_ctx, ssl_ctx, key_file, cert_file);
+}
 
-  SSL_set_accept_state(tls_client_ctx->ssl); // no return
+typedef void (*tls_ssl_ctx_cb)(tls_server_ctx_t * server_ctx, SSL_CTX * ssl_ctx);
 
-  return tls_client_ctx;
+/**
+ * Settings that openssl reads from the context a connection has switched to
+ * have to be made on every context
+ */
+static void tls_server_each_ssl_ctx(tls_server_ctx_t * server_ctx, tls_ssl_ctx_cb cb)
+{
+  cb(server_ctx, server_ctx->ssl_ctx);
+
+  hash_table_iter_t iter;
+  hash_table_iterator_init(&iter, &server_ctx->host_ssl_ctxs);
 
+  while (hash_table_iterate(&iter)) {
+    cb(server_ctx, iter.value);
+  }
 }
 
-static bool tls_read_decrypted_data_and_pass_to_app(tls_client_ctx_t * client_ctx)
+/**
+ * Picks the key a new ticket is encrypted with (and its IV), or finds the one
+ * an existing ticket was encrypted with. Returns what the ticket key
+ * callback should: -1 on error, 0 if the key is unknown, 2 if the ticket
+ * should be renewed and 1 otherwise.
+ */
+static int tls_ticket_key_find(tls_server_ctx_t * tls_ctx, unsigned char * key_name, unsigned char * iv,
+                               tls_ticket_key_t * key, int enc)
 {
-  if (client_ctx->writing_to_app) {
-    // we're already in the process of writing to the app -
-    // don't do it again until we're finished
-    return true;
+  tls_session_cache_t * cache = tls_ctx->session_cache;
+
+  if (enc) {
+    if (!tls_session_cache_current_key(cache, tls_ctx->ticket_key_lifetime, key) ||
+        RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+      log_append(tls_ctx->log, LOG_ERROR, "Unable to prepare session ticket key");
+      return -1;
+    }
+
+    memcpy(key_name, key->name, TLS_TICKET_KEY_NAME_LENGTH);
+
+    return 1;
   }
 
-  log_append(client_ctx->log, LOG_TRACE, "Reading decrypted data from app BIO and passing to app");
+  bool current;
 
-  while (true) {
-    // read decrypted data
-    uint8_t * read_buf = malloc(sizeof(uint8_t) * TLS_BUF_LENGTH);
-    int retval = SSL_read(client_ctx->ssl, read_buf, TLS_BUF_LENGTH);
+  if (!tls_session_cache_find_key(cache, key_name, key, &current)) {
+    // rotated out (or from another server) - fall back to a full handshake
+    log_append(tls_ctx->log, LOG_TRACE, "Session ticket key not found");
+    TLS_SESSION_STATS_INCREMENT(cache, ticket_key_misses);
+    return 0;
+  }
 
-    if (retval > 0) {
-      log_append(client_ctx->log, LOG_TRACE, "SSL_read returned %d", retval);
+  // tickets encrypted with an older key are replaced with a new one
+  return current ? 1 : 2;
+}
 
-      client_ctx->writing_to_app = true;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_key_callback(SSL * ssl, unsigned char * key_name, unsigned char * iv,
+                                   EVP_CIPHER_CTX * cipher_ctx, EVP_MAC_CTX * mac_ctx, int enc)
+#else
+static int tls_ticket_key_callback(SSL * ssl, unsigned char * key_name, unsigned char * iv,
+                                   EVP_CIPHER_CTX * cipher_ctx, HMAC_CTX * hmac_ctx, int enc)
+#endif
+{
+  tls_server_ctx_t * tls_ctx = SSL_get_ex_data(ssl, ssl_ctx_app_data_index);
+  tls_ticket_key_t key;
 
-      if (!client_ctx->write_to_app(client_ctx->data, read_buf, retval)) {
-        log_append(client_ctx->log, LOG_ERROR, "Could not write decrypted data to application");
-        return false;
-      }
+  int result = tls_ticket_key_find(tls_ctx, key_name, iv, &key, enc);
 
-      client_ctx->writing_to_app = false;
-    } else if (tls_ssl_wants_read(client_ctx->ssl, retval)) {
-      log_append(client_ctx->log, LOG_TRACE, "SSL_read: wants read");
-      free(read_buf);
-      break; // continue
-    } else if (tls_ssl_wants_write(client_ctx->ssl, retval)) {
-      log_append(client_ctx->log, LOG_TRACE, "SSL_read: wants write");
-      free(read_buf);
-      break; // continue
-    } else if (tls_ssl_zero_return(client_ctx->ssl, retval)) {
-      log_append(client_ctx->log, LOG_TRACE, "SSL_read: eof");
-      free(read_buf);
-      break; // continue
-    } else {
-      free(read_buf);
-      tls_debug_error(client_ctx->ssl, retval, "SSL_read");
-      return false;
-    }
+  if (result <= 0) {
+    return result;
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, TLS_TICKET_KEY_LENGTH),
+    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+    OSSL_PARAM_construct_end()
+  };
 
+  if (!EVP_MAC_CTX_set_params(mac_ctx, params)) {
+    log_append(tls_ctx->log, LOG_ERROR, "Unable to set session ticket MAC key");
+    return -1;
   }
+#else
+  HMAC_Init_ex(hmac_ctx, key.hmac_key, TLS_TICKET_KEY_LENGTH, EVP_sha256(), NULL);
+#endif
 
-  return true;
+  if (enc) {
+    EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv);
+  } else {
+    EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv);
+  }
 
+  return result;
 }
 
-static bool tls_read_encrypted_data_and_pass_to_network(tls_client_ctx_t * client_ctx)
+static int tls_new_session_callback(SSL * ssl, SSL_SESSION * session)
 {
-  do {
-    // read encrypted data from network bio, write to socket
-    uint8_t * read_buf = malloc(sizeof(uint8_t) * TLS_BUF_LENGTH);
-    log_append(client_ctx->log, LOG_TRACE, "Reading encrypted data from network BIO");
-    int retval = BIO_read(client_ctx->network_bio, read_buf, TLS_BUF_LENGTH);
+  tls_server_ctx_t * tls_ctx = SSL_get_ex_data(ssl, ssl_ctx_app_data_index);
 
-    if (retval > 0) {
-      log_append(client_ctx->log, LOG_TRACE, "BIO read: %d", retval);
+  unsigned int id_length;
+  const unsigned char * id = SSL_SESSION_get_id(session, &id_length);
 
-      if (!client_ctx->write_to_network(client_ctx->data, read_buf, retval)) {
-        return false;
-      }
+  int session_length = i2d_SSL_SESSION(session, NULL);
+  if (session_length <= 0 || session_length > TLS_SESSION_MAX_LENGTH) {
+    log_append(tls_ctx->log, LOG_DEBUG, "Not caching session of %d octets", session_length);
+    return 0;
+  }
 
-      free(read_buf);
-
-      // try to BIO_read again
-    } else if (BIO_should_read(client_ctx->network_bio)) {
-      log_append(client_ctx->log, LOG_TRACE, "Network BIO: should read");
-      free(read_buf);
-      break; // continue
-    } else if (BIO_should_write(client_ctx->network_bio)) {
-      log_append(client_ctx->log, LOG_TRACE, "Network BIO: should write");
-      free(read_buf);
-      break; // continue
-    } else {
-      free(read_buf);
-      return tls_debug_error(client_ctx->ssl, retval, "Network BIO read failed");
-    }
-  } while (true);
+  uint8_t buf[TLS_SESSION_MAX_LENGTH];
+  unsigned char * p = buf;
+  i2d_SSL_SESSION(session, &p);
 
-  return true;
+  uint64_t expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+  tls_session_cache_store(tls_ctx->session_cache, id, id_length, buf, session_length, expires);
+
+  // the session was copied - openssl keeps ownership
+  return 0;
 }
 
-static bool tls_update(tls_client_ctx_t * client_ctx)
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION * tls_get_session_callback(SSL * ssl, const unsigned char * id, int id_length, int * copy)
+#else
+static SSL_SESSION * tls_get_session_callback(SSL * ssl, unsigned char * id, int id_length, int * copy)
+#endif
 {
+  tls_server_ctx_t * tls_ctx = SSL_get_ex_data(ssl, ssl_ctx_app_data_index);
 
-  if (!tls_read_decrypted_data_and_pass_to_app(client_ctx)) {
-    return false;
-  }
+  *copy = 0;
 
-  if (!tls_read_encrypted_data_and_pass_to_network(client_ctx)) {
-    return false;
+  uint8_t buf[TLS_SESSION_MAX_LENGTH];
+  size_t session_length = tls_session_cache_lookup(tls_ctx->session_cache, id, id_length, buf);
+
+  if (session_length == 0) {
+    TLS_SESSION_STATS_INCREMENT(tls_ctx->session_cache, cache_misses);
+    return NULL;
   }
 
-  return true;
+  const unsigned char * p = buf;
+  SSL_SESSION * session = d2i_SSL_SESSION(NULL, &p, session_length);
+
+  if (session) {
+    TLS_SESSION_STATS_INCREMENT(tls_ctx->session_cache, cache_hits);
+  }
 
+  return session;
 }
 
-bool tls_set_version(tls_client_ctx_t * client_ctx)
+static void tls_remove_session_callback(SSL_CTX * ssl_ctx, SSL_SESSION * session)
 {
-  client_ctx->selected_tls_version = SSL_get_version(client_ctx->ssl);
-  client_ctx->selected_cipher = SSL_get_cipher_name(client_ctx->ssl);
-  client_ctx->cipher_key_size_in_bits = SSL_get_cipher_bits(client_ctx->ssl, NULL);
+  tls_server_ctx_t * tls_ctx = SSL_CTX_get_app_data(ssl_ctx);
 
-  log_append(client_ctx->log, LOG_DEBUG, "SSL version: %s", client_ctx->selected_tls_version);
-  log_append(client_ctx->log, LOG_DEBUG, "SSL cipher: %s, %d", client_ctx->selected_cipher,
-             client_ctx->cipher_key_size_in_bits);
+  unsigned int id_length;
+  const unsigned char * id = SSL_SESSION_get_id(session, &id_length);
 
-  return true;
+  tls_session_cache_remove(tls_ctx->session_cache, id, id_length);
 }
 
-bool tls_set_protocol(tls_client_ctx_t * client_ctx)
+static void tls_ssl_ctx_enable_resumption(tls_server_ctx_t * server_ctx, SSL_CTX * ssl_ctx)
 {
-  const unsigned char * proto = NULL;
-  unsigned int proto_len;
-  // Check the negotiated protocol in NPN or ALPN
-  SSL_get0_next_proto_negotiated(client_ctx->ssl, &proto, &proto_len);
+  SSL_CTX_set_app_data(ssl_ctx, server_ctx);
 
-  if (proto) {
+  static const unsigned char session_id_context[] = "prism";
+  SSL_CTX_set_session_id_context(ssl_ctx, session_id_context, sizeof(session_id_context) - 1);
+  SSL_CTX_set_timeout(ssl_ctx, server_ctx->session_timeout);
 
-    if (proto_len == http2_protocol_version_string_length &&
-        memcmp(http2_protocol_version_string, proto, proto_len) == 0) {
-      log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through NPN): %s",
-          http2_protocol_version_string);
-      client_ctx->selected_protocol = http2_protocol_version_string;
-      return true;
-    }
+  if (server_ctx->session_tickets) {
+    SSL_CTX_clear_options(ssl_ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, tls_ticket_key_callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, tls_ticket_key_callback);
+#endif
+  }
 
-    if (proto_len == http1_1_protocol_version_string_length &&
-        memcmp(http1_1_protocol_version_string, proto, proto_len) == 0) {
-      log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through NPN): %s",
-          http1_1_protocol_version_string);
-      client_ctx->selected_protocol = http1_1_protocol_version_string;
-      return true;
-    }
+  if (server_ctx->session_cache->num_entries > 0) {
+    // the shared cache is the only one - openssl's own is per process
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, tls_new_session_callback);
+    SSL_CTX_sess_set_get_cb(ssl_ctx, tls_get_session_callback);
+    SSL_CTX_sess_set_remove_cb(ssl_ctx, tls_remove_session_callback);
   } else {
-#ifdef HAVE_ALPN
-    SSL_get0_alpn_selected(client_ctx->ssl, &proto, &proto_len);
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+  }
+}
 
-    if (proto) {
+bool tls_server_enable_resumption(tls_server_ctx_t * server_ctx, tls_session_cache_t * cache,
+                                  uint64_t session_timeout, uint64_t ticket_key_lifetime, bool tickets)
+{
+  server_ctx->session_cache = cache;
+  server_ctx->session_timeout = session_timeout;
+  server_ctx->ticket_key_lifetime = ticket_key_lifetime;
+  server_ctx->session_tickets = tickets;
 
-      if (proto_len == http2_protocol_version_string_length &&
-          memcmp(http2_protocol_version_string, proto, proto_len) == 0) {
-        log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through ALPN): %s",
-            http2_protocol_version_string);
-        client_ctx->selected_protocol = http2_protocol_version_string;
-        return true;
-      }
+  tls_server_each_ssl_ctx(server_ctx, tls_ssl_ctx_enable_resumption);
 
-      if (proto_len == http1_1_protocol_version_string_length &&
-          memcmp(http1_1_protocol_version_string, proto, proto_len) == 0) {
-        log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through ALPN): %s",
-            http1_1_protocol_version_string);
-        client_ctx->selected_protocol = http1_1_protocol_version_string;
-        return true;
-      }
-    }
+  log_append(server_ctx->log, LOG_DEBUG, "Session resumption enabled: tickets %s, %zu cached sessions",
+      tickets ? "on" : "off", cache->num_entries);
 
-#endif
-  }
+  return true;
+}
 
-  log_append(client_ctx->log, LOG_DEBUG, "Did not negotiate protocol");
-  return false;
+void tls_server_set_record_sizing(tls_server_ctx_t * server_ctx, size_t small_record_size,
+                                  size_t boost_threshold, uint64_t idle_timeout)
+{
+  server_ctx->small_record_size = small_record_size;
+  server_ctx->record_boost_threshold = boost_threshold;
+  server_ctx->record_idle_timeout = idle_timeout;
 }
 
+#ifdef HAVE_EARLY_DATA
+
 /**
- * Returns false if the handshake fails or TLS handling cannot continue.
+ * Called for resumed sessions that openssl would otherwise accept early data
+ * with
  */
-bool tls_decrypt_data_and_pass_to_app(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length)
+static int tls_allow_early_data_callback(SSL * ssl, void * arg)
 {
-  log_append(client_ctx->log, LOG_TRACE, "Writing encrypted data to network BIO");
+  UNUSED(arg);
 
-  size_t written = 0;
+  tls_server_ctx_t * tls_ctx = SSL_get_ex_data(ssl, ssl_ctx_app_data_index);
 
-  do {
-    int retval = BIO_write(client_ctx->network_bio, buf + written, length - written);
+  uint8_t client_random[TLS_CLIENT_RANDOM_LENGTH];
+  SSL_get_client_random(ssl, client_random, TLS_CLIENT_RANDOM_LENGTH);
 
-    if (retval > 0) {
-      log_append(client_ctx->log, LOG_TRACE, "Wrote %d/%zu octets of encrypted data to network BIO for decryption",
-          retval, length);
-      written += retval;
-    } else if (BIO_should_retry(client_ctx->network_bio)) {
+  if (!tls_session_cache_early_data_fresh(tls_ctx->session_cache, client_random)) {
+    log_append(tls_ctx->log, LOG_DEBUG, "Rejecting early data: ClientHello may have been replayed");
+    TLS_SESSION_STATS_INCREMENT(tls_ctx->session_cache, early_data_rejected);
+    return 0;
+  }
+
+  TLS_SESSION_STATS_INCREMENT(tls_ctx->session_cache, early_data_accepted);
+
+  return 1;
+}
+
+static void tls_ssl_ctx_enable_early_data(tls_server_ctx_t * server_ctx, SSL_CTX * ssl_ctx)
+{
+  SSL_CTX_set_max_early_data(ssl_ctx, server_ctx->max_early_data);
+
+  // openssl's own replay protection only covers sessions in its internal
+  // cache - tickets are checked against the shared window instead
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_ANTI_REPLAY);
+  SSL_CTX_set_allow_early_data_cb(ssl_ctx, tls_allow_early_data_callback, NULL);
+}
+
+bool tls_server_enable_early_data(tls_server_ctx_t * server_ctx, size_t max_early_data)
+{
+  if (!server_ctx->session_cache) {
+    log_append(server_ctx->log, LOG_WARN, "Early data needs session resumption to be enabled");
+    return false;
+  }
+
+  server_ctx->max_early_data = max_early_data;
+  tls_server_each_ssl_ctx(server_ctx, tls_ssl_ctx_enable_early_data);
+
+  log_append(server_ctx->log, LOG_DEBUG, "Early data enabled: up to %zu octets", max_early_data);
+
+  return true;
+}
+
+#else
+
+bool tls_server_enable_early_data(tls_server_ctx_t * server_ctx, size_t max_early_data)
+{
+  UNUSED(max_early_data);
+
+  log_append(server_ctx->log, LOG_WARN, "Early data is not supported by this version of OpenSSL");
+
+  return false;
+}
+
+#endif
+
+#ifndef OPENSSL_NO_OCSP
+
+static int tls_ocsp_status_callback(SSL * ssl, void * arg)
+{
+  UNUSED(arg);
+
+  tls_server_ctx_t * tls_ctx = SSL_get_ex_data(ssl, ssl_ctx_app_data_index);
+  // the certificate openssl picked for this client
+  X509 * certificate = SSL_get_certificate(ssl);
+
+  uint64_t now = time(NULL);
+  unsigned char * response = NULL;
+  size_t response_length = 0;
+
+  uv_mutex_lock(&tls_ctx->ocsp_mutex);
+
+  for (tls_ocsp_staple_t * staple = tls_ctx->ocsp_staples; staple && certificate; staple = staple->next) {
+    if (X509_cmp(staple->certificate, certificate) == 0) {
+      if (staple->response && staple->expires > now) {
+        // openssl frees the copy along with the connection
+        response = OPENSSL_malloc(staple->response_length);
+        if (response) {
+          memcpy(response, staple->response, staple->response_length);
+          response_length = staple->response_length;
+        }
+      }
+      break;
+    }
+  }
+
+  uv_mutex_unlock(&tls_ctx->ocsp_mutex);
+
+  if (!response) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+
+  SSL_set_tlsext_status_ocsp_resp(ssl, response, response_length);
+
+  log_append(tls_ctx->log, LOG_TRACE, "Stapled OCSP response: %zu octets", response_length);
+
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static void tls_ssl_ctx_enable_ocsp_stapling(tls_server_ctx_t * server_ctx, SSL_CTX * ssl_ctx)
+{
+  UNUSED(server_ctx);
+
+  SSL_CTX_set_tlsext_status_cb(ssl_ctx, tls_ocsp_status_callback);
+}
+
+/**
+ * Reads the staple's response again if the file has changed or the response
+ * has expired
+ */
+static void tls_ocsp_staple_reload(tls_server_ctx_t * server_ctx, tls_ocsp_staple_t * staple)
+{
+  struct stat st;
+  bool exists = stat(staple->response_path, &st) == 0;
+  ino_t inode = exists ? st.st_ino : 0;
+  time_t modified = exists ? st.st_mtime : 0;
+
+  bool changed = inode != staple->inode || modified != staple->modified;
+  bool expired = staple->response && staple->expires <= (uint64_t) time(NULL);
+
+  if (!changed && !expired) {
+    return;
+  }
+
+  staple->inode = inode;
+  staple->modified = modified;
+
+  size_t response_length = 0;
+  uint64_t expires = 0;
+  uint8_t * response = exists ? tls_ocsp_response_load(staple->response_path, &response_length, &expires) : NULL;
+
+  if (response) {
+    log_append(server_ctx->log, LOG_DEBUG, "Stapling OCSP response from %s, valid for %" PRIu64 "s",
+        staple->response_path, expires - time(NULL));
+  } else if (staple->response || changed) {
+    log_append(server_ctx->log, LOG_WARN, "No valid OCSP response in %s", staple->response_path);
+  }
+
+  uv_mutex_lock(&server_ctx->ocsp_mutex);
+
+  uint8_t * old_response = staple->response;
+  staple->response = response;
+  staple->response_length = response_length;
+  staple->expires = expires;
+
+  uv_mutex_unlock(&server_ctx->ocsp_mutex);
+
+  free(old_response);
+}
+
+bool tls_server_add_ocsp_staple(tls_server_ctx_t * server_ctx, const char * cert_file)
+{
+  for (tls_ocsp_staple_t * staple = server_ctx->ocsp_staples; staple; staple = staple->next) {
+    if (strcmp(staple->cert_file, cert_file) == 0) {
+      // the same certificate is often used for several hostnames
+      return true;
+    }
+  }
+
+  BIO * file = BIO_new_file(cert_file, "r");
+  X509 * certificate = file ? PEM_read_bio_X509(file, NULL, NULL, NULL) : NULL;
+  BIO_free(file);
+
+  if (!certificate) {
+    log_append(server_ctx->log, LOG_ERROR, "Unable to read certificate for OCSP stapling: %s", cert_file);
+    return false;
+  }
+
+  tls_ocsp_staple_t * staple = calloc(1, sizeof(tls_ocsp_staple_t));
+  char * copy = strdup(cert_file);
+  char * response_path = tls_ocsp_response_path(cert_file);
+
+  if (!staple || !copy || !response_path) {
+    X509_free(certificate);
+    free(staple);
+    free(copy);
+    free(response_path);
+    return false;
+  }
+
+  staple->certificate = certificate;
+  staple->cert_file = copy;
+  staple->response_path = response_path;
+
+  tls_ocsp_staple_reload(server_ctx, staple);
+
+  // handshakes haven't started yet
+  staple->next = server_ctx->ocsp_staples;
+  server_ctx->ocsp_staples = staple;
+
+  tls_server_each_ssl_ctx(server_ctx, tls_ssl_ctx_enable_ocsp_stapling);
+
+  return true;
+}
+
+void tls_server_reload_ocsp_staples(tls_server_ctx_t * server_ctx)
+{
+  for (tls_ocsp_staple_t * staple = server_ctx->ocsp_staples; staple; staple = staple->next) {
+    tls_ocsp_staple_reload(server_ctx, staple);
+  }
+}
+
+#else
+
+bool tls_server_add_ocsp_staple(tls_server_ctx_t * server_ctx, const char * cert_file)
+{
+  UNUSED(cert_file);
+
+  log_append(server_ctx->log, LOG_WARN, "OCSP stapling is not supported by this build of openssl");
+
+  return false;
+}
+
+void tls_server_reload_ocsp_staples(tls_server_ctx_t * server_ctx)
+{
+  UNUSED(server_ctx);
+}
+
+#endif
+
+static void tls_server_free_ocsp_staples(tls_server_ctx_t * server_ctx)
+{
+  while (server_ctx->ocsp_staples) {
+    tls_ocsp_staple_t * staple = server_ctx->ocsp_staples;
+    server_ctx->ocsp_staples = staple->next;
+
+    X509_free(staple->certificate);
+    free(staple->cert_file);
+    free(staple->response_path);
+    free(staple->response);
+    free(staple);
+  }
+
+  uv_mutex_destroy(&server_ctx->ocsp_mutex);
+}
+
+bool tls_server_free(tls_server_ctx_t * server_ctx)
+{
+  tls_thread_cleanup();
+
+  if (server_ctx->session_cache) {
+    tls_session_stats_t * stats = &server_ctx->session_cache->stats;
+
+    // the counts are shared by every worker
+    log_append(server_ctx->log, LOG_DEBUG, "Sessions: %zu of %zu handshakes resumed, "
+        "%zu/%zu session cache hits/misses, %zu unknown ticket keys, %zu/%zu early data accepted/rejected",
+        stats->resumed, stats->handshakes, stats->cache_hits, stats->cache_misses, stats->ticket_key_misses,
+        stats->early_data_accepted, stats->early_data_rejected);
+  }
+
+  log_append(server_ctx->log, LOG_DEBUG, "Records: %zu written with %zu octets of application data",
+      server_ctx->records_written, server_ctx->record_octets_written);
+
+  if (server_ctx->certificate_compression) {
+    log_append(server_ctx->log, LOG_DEBUG, "Certificates: %zu compressed, %zu uncompressed",
+        server_ctx->compressed_certificates, server_ctx->uncompressed_certificates);
+  }
+
+  tls_session_cache_t * session_cache = server_ctx->session_cache;
+
+  if (server_ctx->ssl_ctx) {
+    tls_server_free_ocsp_staples(server_ctx);
+    hash_table_free(&server_ctx->host_ssl_ctxs);
+    SSL_CTX_free(server_ctx->ssl_ctx);
+    free(server_ctx);
+  }
+
+  // freeing the SSL_CTXs may still remove sessions from the cache
+  if (session_cache) {
+    tls_session_cache_free(session_cache);
+  }
+
+  return true;
+}
+
+#ifdef HAVE_KTLS
+
+/**
+ * Counts the records written with the current write key - the kernel has to
+ * carry on from the same sequence number
+ */
+static void tls_ktls_msg_callback(int write_p, int version, int content_type, const void * buf, size_t len,
+                                  SSL * ssl, void * arg)
+{
+  UNUSED(ssl);
+
+  tls_client_ctx_t * client_ctx = arg;
+
+  if (!write_p || client_ctx->ktls_tx) {
+    return;
+  }
+
+  if (content_type == SSL3_RT_HEADER) {
+    client_ctx->write_seq++;
+  } else if (version == TLS1_3_VERSION) {
+    // the application keys are used for everything after our Finished
+    if (content_type == SSL3_RT_HANDSHAKE && len > 0 && ((const uint8_t *) buf)[0] == SSL3_MT_FINISHED) {
+      client_ctx->write_seq = 0;
+    }
+  } else if (content_type == SSL3_RT_CHANGE_CIPHER_SPEC) {
+    client_ctx->write_seq = 0;
+  }
+}
+
+static size_t tls_hex_decode(const char * hex, uint8_t * out, size_t out_length)
+{
+  size_t length = 0;
+
+  while (length < out_length && isxdigit((unsigned char) hex[0]) && isxdigit((unsigned char) hex[1])) {
+    unsigned int octet;
+    sscanf(hex, "%2x", &octet);
+    out[length++] = octet;
+    hex += 2;
+  }
+
+  return length;
+}
+
+/**
+ * OpenSSL has no other way to get at the TLS 1.3 traffic secrets
+ */
+static void tls_keylog_callback(const SSL * ssl, const char * line)
+{
+  static const char label[] = "SERVER_TRAFFIC_SECRET_0 ";
+
+  if (strncmp(line, label, sizeof(label) - 1) != 0) {
+    return;
+  }
+
+  tls_client_ctx_t * client_ctx = SSL_get_ex_data(ssl, ssl_client_data_index);
+
+  // skip the client random
+  const char * secret = strchr(line + sizeof(label) - 1, ' ');
+
+  if (client_ctx && secret) {
+    client_ctx->traffic_secret_length = tls_hex_decode(secret + 1, client_ctx->traffic_secret,
+                                        sizeof(client_ctx->traffic_secret));
+  }
+}
+
+static void tls_ssl_ctx_enable_ktls(tls_server_ctx_t * server_ctx, SSL_CTX * ssl_ctx)
+{
+  UNUSED(server_ctx);
+
+  SSL_CTX_set_keylog_callback(ssl_ctx, tls_keylog_callback);
+}
+
+bool tls_server_enable_ktls(tls_server_ctx_t * server_ctx)
+{
+  server_ctx->ktls = true;
+  tls_server_each_ssl_ctx(server_ctx, tls_ssl_ctx_enable_ktls);
+
+  return true;
+}
+
+/**
+ * HKDF-Expand-Label from RFC 8446 section 7.1, with an empty context
+ */
+static bool tls13_expand_label(const EVP_MD * md, const uint8_t * secret, size_t secret_length,
+                               const char * label, uint8_t * out, size_t out_length)
+{
+  uint8_t info[2 + 1 + 255 + 1];
+  size_t label_length = strlen(label);
+
+  info[0] = out_length >> 8;
+  info[1] = out_length & 0xff;
+  info[2] = 6 + label_length;
+  memcpy(info + 3, "tls13 ", 6);
+  memcpy(info + 9, label, label_length);
+  info[9 + label_length] = 0;
+
+  EVP_PKEY_CTX * pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+
+  bool success = pctx &&
+                 EVP_PKEY_derive_init(pctx) > 0 &&
+                 EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+                 EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+                 EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_length) > 0 &&
+                 EVP_PKEY_CTX_add1_hkdf_info(pctx, info, 10 + label_length) > 0 &&
+                 EVP_PKEY_derive(pctx, out, &out_length) > 0;
+
+  EVP_PKEY_CTX_free(pctx);
+
+  return success;
+}
+
+/**
+ * The TLS 1.2 key block from RFC 5246 section 6.3
+ */
+static bool tls12_key_block(const SSL * ssl, const EVP_MD * md, uint8_t * out, size_t out_length)
+{
+  uint8_t master_key[SSL_MAX_MASTER_KEY_LENGTH];
+  size_t master_key_length = SSL_SESSION_get_master_key(SSL_get_session(ssl), master_key, sizeof(master_key));
+
+  uint8_t seed[2 * SSL3_RANDOM_SIZE];
+  SSL_get_server_random(ssl, seed, SSL3_RANDOM_SIZE);
+  SSL_get_client_random(ssl, seed + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+
+  static const char label[] = "key expansion";
+
+  EVP_PKEY_CTX * pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, NULL);
+
+  bool success = pctx &&
+                 EVP_PKEY_derive_init(pctx) > 0 &&
+                 EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+                 EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master_key, master_key_length) > 0 &&
+                 EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, (const unsigned char *) label, sizeof(label) - 1) > 0 &&
+                 EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, seed, sizeof(seed)) > 0 &&
+                 EVP_PKEY_derive(pctx, out, &out_length) > 0;
+
+  EVP_PKEY_CTX_free(pctx);
+  OPENSSL_cleanse(master_key, sizeof(master_key));
+
+  return success;
+}
+
+/**
+ * The server's write key and IV (the 4 octet salt followed by the rest)
+ */
+static bool tls_server_write_key(tls_client_ctx_t * client_ctx, size_t key_length, uint8_t * key,
+                                 uint8_t * iv)
+{
+  const SSL_CIPHER * cipher = SSL_get_current_cipher(client_ctx->ssl);
+  const EVP_MD * md = SSL_CIPHER_get_handshake_digest(cipher);
+
+  if (!md) {
+    return false;
+  }
+
+  if (SSL_version(client_ctx->ssl) == TLS1_3_VERSION) {
+    return client_ctx->traffic_secret_length > 0 &&
+           tls13_expand_label(md, client_ctx->traffic_secret, client_ctx->traffic_secret_length, "key",
+                              key, key_length) &&
+           tls13_expand_label(md, client_ctx->traffic_secret, client_ctx->traffic_secret_length, "iv",
+                              iv, 12);
+  }
+
+  // client key, server key, client salt, server salt
+  uint8_t key_block[2 * 32 + 2 * 4];
+  size_t key_block_length = 2 * key_length + 2 * 4;
+
+  if (!tls12_key_block(client_ctx->ssl, md, key_block, key_block_length)) {
+    return false;
+  }
+
+  memcpy(key, key_block + key_length, key_length);
+  memcpy(iv, key_block + 2 * key_length + 4, 4);
+  // the explicit part of the nonce just has to be unique - the kernel
+  // increments it with every record
+  for (size_t i = 0; i < 8; i++) {
+    iv[4 + i] = client_ctx->write_seq >> (8 * (7 - i));
+  }
+
+  OPENSSL_cleanse(key_block, sizeof(key_block));
+
+  return true;
+}
+
+bool tls_client_enable_ktls(tls_client_ctx_t * client_ctx, int fd)
+{
+  if (client_ctx->ktls_attempted || !client_ctx->handshake_complete || client_ctx->write_buf_length > 0) {
+    return false;
+  }
+
+  client_ctx->ktls_attempted = true;
+
+  int version = SSL_version(client_ctx->ssl);
+  int cipher_nid = SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(client_ctx->ssl));
+  bool success = false;
+
+  union {
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+  } crypto_info;
+  size_t crypto_info_length;
+
+  uint8_t key[32];
+  uint8_t iv[12];
+  uint8_t rec_seq[8];
+
+  for (size_t i = 0; i < 8; i++) {
+    rec_seq[i] = client_ctx->write_seq >> (8 * (7 - i));
+  }
+
+  memset(&crypto_info, 0, sizeof(crypto_info));
+
+  if ((version != TLS1_2_VERSION && version != TLS1_3_VERSION) ||
+      BIO_ctrl_pending(client_ctx->network_bio) > 0) {
+    goto done;
+  }
+
+  if (cipher_nid == NID_aes_128_gcm) {
+    struct tls12_crypto_info_aes_gcm_128 * info = &crypto_info.aes_gcm_128;
+
+    if (!tls_server_write_key(client_ctx, TLS_CIPHER_AES_GCM_128_KEY_SIZE, key, iv)) {
+      goto done;
+    }
+
+    info->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(info->key, key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+    memcpy(info->salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+    memcpy(info->iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+    memcpy(info->rec_seq, rec_seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+    crypto_info_length = sizeof(*info);
+  } else if (cipher_nid == NID_aes_256_gcm) {
+    struct tls12_crypto_info_aes_gcm_256 * info = &crypto_info.aes_gcm_256;
+
+    if (!tls_server_write_key(client_ctx, TLS_CIPHER_AES_GCM_256_KEY_SIZE, key, iv)) {
+      goto done;
+    }
+
+    info->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy(info->key, key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+    memcpy(info->salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+    memcpy(info->iv, iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+    memcpy(info->rec_seq, rec_seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+    crypto_info_length = sizeof(*info);
+  } else {
+    log_append(client_ctx->log, LOG_DEBUG, "Kernel TLS not used for cipher: %s", client_ctx->selected_cipher);
+    goto done;
+  }
+
+  // the version is the first field of every crypto_info
+  crypto_info.aes_gcm_128.info.version = version == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+    log_append(client_ctx->log, LOG_DEBUG, "Kernel TLS not available: %s", strerror(errno));
+    goto done;
+  }
+
+  if (setsockopt(fd, SOL_TLS, TLS_TX, &crypto_info, crypto_info_length) != 0) {
+    log_append(client_ctx->log, LOG_DEBUG, "Unable to set kernel TLS keys: %s", strerror(errno));
+    goto done;
+  }
+
+  log_append(client_ctx->log, LOG_DEBUG, "Kernel TLS enabled after %" PRIu64 " records", client_ctx->write_seq);
+  client_ctx->ktls_tx = true;
+  success = true;
+
+done:
+  OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+  OPENSSL_cleanse(key, sizeof(key));
+  OPENSSL_cleanse(iv, sizeof(iv));
+  OPENSSL_cleanse(client_ctx->traffic_secret, sizeof(client_ctx->traffic_secret));
+  client_ctx->traffic_secret_length = 0;
+
+  return success;
+}
+
+#else
+
+bool tls_server_enable_ktls(tls_server_ctx_t * server_ctx)
+{
+  log_append(server_ctx->log, LOG_WARN, "Kernel TLS is not supported on this platform");
+
+  return false;
+}
+
+bool tls_client_enable_ktls(tls_client_ctx_t * client_ctx, int fd)
+{
+  UNUSED(fd);
+
+  client_ctx->ktls_attempted = true;
+
+  return false;
+}
+
+#endif
+
+/**
+ * Counts the certificates we send in full handshakes by whether they were
+ * compressed
+ */
+static void tls_count_certificates(SSL * ssl, int write_p, int content_type, const void * buf, size_t len)
+{
+  if (!write_p || content_type != SSL3_RT_HANDSHAKE || len == 0) {
+    return;
+  }
+
+  tls_server_ctx_t * tls_ctx = SSL_get_ex_data(ssl, ssl_ctx_app_data_index);
+  uint8_t type = ((const uint8_t *) buf)[0];
+
+#ifdef SSL3_MT_COMPRESSED_CERTIFICATE
+  if (type == SSL3_MT_COMPRESSED_CERTIFICATE) {
+    __sync_fetch_and_add(&tls_ctx->compressed_certificates, 1);
+    return;
+  }
+#endif
+
+  if (type == SSL3_MT_CERTIFICATE) {
+    __sync_fetch_and_add(&tls_ctx->uncompressed_certificates, 1);
+  }
+}
+
+static void tls_msg_callback(int write_p, int version, int content_type, const void * buf, size_t len,
+                             SSL * ssl, void * arg)
+{
+  tls_client_ctx_t * client_ctx = arg;
+
+  if (!client_ctx->handshake_complete) {
+    tls_count_certificates(ssl, write_p, content_type, buf, len);
+  }
+
+#ifdef HAVE_KTLS
+  tls_ktls_msg_callback(write_p, version, content_type, buf, len, ssl, arg);
+#else
+  UNUSED(version);
+#endif
+}
+
+tls_client_ctx_t * tls_client_init(tls_server_ctx_t * server_ctx, buffer_pool_t * read_buffers, void * data,
+                                   tls_write_to_network_cb write_to_network, tls_write_to_app_cb write_to_app)
+{
+
+  tls_client_ctx_t * tls_client_ctx = malloc(sizeof(tls_client_ctx_t));
+  ASSERT_OR_RETURN_NULL(tls_client_ctx);
+  tls_client_ctx->log = server_ctx->log;
+  tls_client_ctx->selected_protocol = NULL;
+  tls_client_ctx->handshake_complete = false;
+  tls_client_ctx->writing_to_app = false;
+  tls_client_ctx->reading_early_data = server_ctx->max_early_data > 0;
+  tls_client_ctx->early_data_buf = NULL;
+  tls_client_ctx->early_data_length = 0;
+  tls_client_ctx->early_data = false;
+  tls_client_ctx->early_output = NULL;
+  tls_client_ctx->early_output_length = 0;
+  tls_client_ctx->loop = NULL;
+  tls_client_ctx->handshake_cb = NULL;
+  tls_client_ctx->handshake_in_progress = false;
+  tls_client_ctx->free_pending = false;
+  tls_client_ctx->pending_input = NULL;
+  tls_client_ctx->pending_input_length = 0;
+  tls_client_ctx->burst_octets = 0;
+  tls_client_ctx->last_write = uv_hrtime() / 1000000;
+  tls_client_ctx->ktls_tx = false;
+  tls_client_ctx->ktls_attempted = !server_ctx->ktls;
+  tls_client_ctx->write_seq = 0;
+  tls_client_ctx->traffic_secret_length = 0;
+  tls_client_ctx->data = data;
+  tls_client_ctx->read_buffers = read_buffers;
+  tls_client_ctx->write_buf = NULL;
+  tls_client_ctx->write_buf_length = 0;
+  tls_client_ctx->write_to_network = write_to_network;
+  tls_client_ctx->write_to_app = write_to_app;
+  tls_client_ctx->ssl = NULL;
+  tls_client_ctx->app_bio = NULL;
+  tls_client_ctx->network_bio = NULL;
+
+  SSL * ssl = SSL_new(server_ctx->ssl_ctx);
+
+  if (!ssl) {
+    tls_client_free(tls_client_ctx);
+    return NULL;
+  }
+
+  SSL_set_ex_data(ssl, ssl_ctx_app_data_index, server_ctx);
+  SSL_set_ex_data(ssl, ssl_client_data_index, tls_client_ctx);
+
+  if (server_ctx->ktls || server_ctx->certificate_compression) {
+    SSL_set_msg_callback(ssl, tls_msg_callback);
+    SSL_set_msg_callback_arg(ssl, tls_client_ctx);
+  }
+
+  tls_client_ctx->ssl = ssl;
+
+  // TODO - test with small bio buffer sizes
+  int err = BIO_new_bio_pair(&tls_client_ctx->app_bio, 0, &tls_client_ctx->network_bio, 0); // 0 for default size
+
+  if (err != 1) {
+    log_append(server_ctx->log, LOG_ERROR, "Unable to create BIO pair");
+    tls_client_free(tls_client_ctx);
+    return NULL;
+  }
+
+  SSL_set_bio(ssl, tls_client_ctx->app_bio, tls_client_ctx->app_bio); // "cannot fail"
+
+  SSL_set_accept_state(tls_client_ctx->ssl); // no return
+
+  return tls_client_ctx;
+
+}
+
+/**
+ * Passes the decrypted data collected so far on to the app
+ */
+static bool tls_pass_to_app(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length)
+{
+  if (length == 0) {
+    return true;
+  }
+
+  client_ctx->writing_to_app = true;
+  bool success = client_ctx->write_to_app(client_ctx->data, buf, length);
+  client_ctx->writing_to_app = false;
+
+  if (!success) {
+    log_append(client_ctx->log, LOG_ERROR, "Could not write decrypted data to application");
+  }
+
+  return success;
+}
+
+static bool tls_read_decrypted_data_and_pass_to_app(tls_client_ctx_t * client_ctx)
+{
+  if (client_ctx->writing_to_app) {
+    // we're already in the process of writing to the app -
+    // don't do it again until we're finished
+    return true;
+  }
+
+  if (client_ctx->reading_early_data) {
+    // openssl doesn't allow SSL_read until the early data has been read
+    return true;
+  }
+
+  log_append(client_ctx->log, LOG_TRACE, "Reading decrypted data from app BIO and passing to app");
+
+  // the app only borrows the decrypted data, so it is read into one of the
+  // worker's read buffers - as many records as fit are passed on at once
+  buffer_pool_t * pool = client_ctx->read_buffers;
+  uint8_t * read_buf = buffer_pool_get(pool);
+  size_t read_length = 0;
+
+  if (!read_buf) {
+    log_append(client_ctx->log, LOG_ERROR, "Could not allocate buffer for decrypted data");
+    return false;
+  }
+
+  bool success = true;
+
+  while (true) {
+    // read decrypted data
+    int retval = SSL_read(client_ctx->ssl, read_buf + read_length, pool->buffer_size - read_length);
+
+    if (retval > 0) {
+      log_append(client_ctx->log, LOG_TRACE, "SSL_read returned %d", retval);
+
+      read_length += retval;
+
+      if (read_length == pool->buffer_size) {
+        success = tls_pass_to_app(client_ctx, read_buf, read_length);
+        read_length = 0;
+
+        if (!success) {
+          break;
+        }
+      }
+    } else {
+      if (tls_ssl_wants_read(client_ctx->ssl, retval)) {
+        log_append(client_ctx->log, LOG_TRACE, "SSL_read: wants read");
+      } else if (tls_ssl_wants_write(client_ctx->ssl, retval)) {
+        log_append(client_ctx->log, LOG_TRACE, "SSL_read: wants write");
+      } else if (tls_ssl_zero_return(client_ctx->ssl, retval)) {
+        log_append(client_ctx->log, LOG_TRACE, "SSL_read: eof");
+      } else {
+        tls_debug_error(client_ctx->ssl, retval, "SSL_read");
+        success = false;
+      }
+
+      if (success) {
+        success = tls_pass_to_app(client_ctx, read_buf, read_length);
+      }
+
+      break;
+    }
+
+  }
+
+  buffer_pool_put(pool, read_buf);
+
+  return success;
+
+}
+
+static bool tls_read_encrypted_data_and_pass_to_network(tls_client_ctx_t * client_ctx)
+{
+  log_append(client_ctx->log, LOG_TRACE, "Reading encrypted data from network BIO");
+
+  if (client_ctx->ktls_tx && BIO_ctrl_pending(client_ctx->network_bio) > 0) {
+    // openssl's write state is stale now that the kernel encrypts, so its
+    // records can't be sent. Only a renegotiation (or an alert for a
+    // connection that is failing anyway) gets here - openssl answers a key
+    // update request on its next write, and nothing is written through it.
+    log_append(client_ctx->log, LOG_WARN, "Unable to send TLS record with kernel TLS enabled");
+    return false;
+  }
+
+  // the network side only copies the data it is given, so it can read
+  // straight out of the BIO pair's buffer
+  while (BIO_ctrl_pending(client_ctx->network_bio) > 0) {
+    char * buf;
+    int retval = BIO_nread0(client_ctx->network_bio, &buf);
+
+    if (retval <= 0) {
+      return tls_debug_error(client_ctx->ssl, retval, "Network BIO read failed");
+    }
+
+    log_append(client_ctx->log, LOG_TRACE, "BIO read: %d", retval);
+
+    if (!client_ctx->write_to_network(client_ctx->data, (uint8_t *) buf, retval)) {
+      return false;
+    }
+
+    BIO_nread(client_ctx->network_bio, &buf, retval);
+  }
+
+  return true;
+}
+
+static bool tls_update(tls_client_ctx_t * client_ctx)
+{
+
+  if (!tls_read_decrypted_data_and_pass_to_app(client_ctx)) {
+    return false;
+  }
+
+  if (!tls_read_encrypted_data_and_pass_to_network(client_ctx)) {
+    return false;
+  }
+
+  return true;
+
+}
+
+bool tls_set_version(tls_client_ctx_t * client_ctx)
+{
+  client_ctx->selected_tls_version = SSL_get_version(client_ctx->ssl);
+  client_ctx->selected_cipher = SSL_get_cipher_name(client_ctx->ssl);
+  client_ctx->cipher_key_size_in_bits = SSL_get_cipher_bits(client_ctx->ssl, NULL);
+
+  log_append(client_ctx->log, LOG_DEBUG, "SSL version: %s", client_ctx->selected_tls_version);
+  log_append(client_ctx->log, LOG_DEBUG, "SSL cipher: %s, %d", client_ctx->selected_cipher,
+             client_ctx->cipher_key_size_in_bits);
+
+  return true;
+}
+
+bool tls_set_protocol(tls_client_ctx_t * client_ctx)
+{
+  const unsigned char * proto = NULL;
+  unsigned int proto_len;
+  // Check the negotiated protocol in NPN or ALPN
+  SSL_get0_next_proto_negotiated(client_ctx->ssl, &proto, &proto_len);
+
+  if (proto) {
+
+    if (proto_len == http2_protocol_version_string_length &&
+        memcmp(http2_protocol_version_string, proto, proto_len) == 0) {
+      log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through NPN): %s",
+          http2_protocol_version_string);
+      client_ctx->selected_protocol = http2_protocol_version_string;
+      return true;
+    }
+
+    if (proto_len == http1_1_protocol_version_string_length &&
+        memcmp(http1_1_protocol_version_string, proto, proto_len) == 0) {
+      log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through NPN): %s",
+          http1_1_protocol_version_string);
+      client_ctx->selected_protocol = http1_1_protocol_version_string;
+      return true;
+    }
+  } else {
+#ifdef HAVE_ALPN
+    SSL_get0_alpn_selected(client_ctx->ssl, &proto, &proto_len);
+
+    if (proto) {
+
+      if (proto_len == http2_protocol_version_string_length &&
+          memcmp(http2_protocol_version_string, proto, proto_len) == 0) {
+        log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through ALPN): %s",
+            http2_protocol_version_string);
+        client_ctx->selected_protocol = http2_protocol_version_string;
+        return true;
+      }
+
+      if (proto_len == http1_1_protocol_version_string_length &&
+          memcmp(http1_1_protocol_version_string, proto, proto_len) == 0) {
+        log_append(client_ctx->log, LOG_DEBUG, "Using protocol (through ALPN): %s",
+            http1_1_protocol_version_string);
+        client_ctx->selected_protocol = http1_1_protocol_version_string;
+        return true;
+      }
+    }
+
+#endif
+  }
+
+  log_append(client_ctx->log, LOG_DEBUG, "Did not negotiate protocol");
+  return false;
+}
+
+/**
+ * Handles the outcome of SSL_do_handshake. ssl_error and error_code must have
+ * been collected on the thread that made the call.
+ */
+static bool tls_handshake_result(tls_client_ctx_t * client_ctx, int retval, int ssl_error,
+                                 unsigned long error_code)
+{
+  if (retval == 1) {
+
+    if (!tls_set_version(client_ctx)) {
+      log_append(client_ctx->log, LOG_WARN, "Handshake complete, blacklisted cipher: %s",
+          client_ctx->selected_cipher);
+      return false;
+    }
+
+    tls_set_protocol(client_ctx);
+
+    tls_server_ctx_t * tls_ctx = SSL_get_ex_data(client_ctx->ssl, ssl_ctx_app_data_index);
+    if (tls_ctx->session_cache) {
+      TLS_SESSION_STATS_INCREMENT(tls_ctx->session_cache, handshakes);
+
+      if (SSL_session_reused(client_ctx->ssl)) {
+        log_append(client_ctx->log, LOG_TRACE, "Resumed session");
+        TLS_SESSION_STATS_INCREMENT(tls_ctx->session_cache, resumed);
+      }
+    }
+
+    if (!tls_ctx->ktls) {
+      // only kernel TLS needs to see the records that follow
+      SSL_set_msg_callback(client_ctx->ssl, NULL);
+    }
+
+    // success
+    client_ctx->handshake_complete = true;
+    log_append(client_ctx->log, LOG_TRACE, "Handshake complete");
+
+    return true;
+  }
+
+  switch (ssl_error) {
+    case SSL_ERROR_WANT_READ:
+      log_append(client_ctx->log, LOG_TRACE, "Handshake not yet complete, should read");
+      return true;
+
+    case SSL_ERROR_WANT_WRITE:
+      log_append(client_ctx->log, LOG_TRACE, "Handshake not yet complete, should write");
+      return true;
+  }
+
+  char error_string[256] = "no error";
+  if (error_code) {
+    ERR_error_string_n(error_code, error_string, sizeof(error_string));
+  }
+
+  log_append(client_ctx->log, LOG_ERROR, "Handshake failed: %d: %s", ssl_error, error_string);
+
+  return false;
+}
+
+/**
+ * SSL_do_handshake - along with reading the early data the client sent (if
+ * any) into early_data_buf. Safe to run on the thread pool.
+ */
+static int tls_do_handshake(tls_client_ctx_t * client_ctx)
+{
+#ifdef HAVE_EARLY_DATA
+  while (client_ctx->reading_early_data) {
+    tls_server_ctx_t * tls_ctx = SSL_get_ex_data(client_ctx->ssl, ssl_ctx_app_data_index);
+    // openssl never returns more than max_early_data octets - the spare octet
+    // leaves room for the read that finds the end of the early data
+    size_t capacity = tls_ctx->max_early_data + 1;
+
+    if (!client_ctx->early_data_buf) {
+      client_ctx->early_data_buf = malloc(capacity);
+
+      if (!client_ctx->early_data_buf) {
+        return -1;
+      }
+    }
+
+    size_t read_length = 0;
+    int status = SSL_read_early_data(client_ctx->ssl, client_ctx->early_data_buf + client_ctx->early_data_length,
+                                     capacity - client_ctx->early_data_length, &read_length);
+
+    if (status == SSL_READ_EARLY_DATA_ERROR) {
+      // SSL_get_error tells whether more data is needed
+      return -1;
+    }
+
+    client_ctx->early_data_length += read_length;
+
+    if (status == SSL_READ_EARLY_DATA_FINISH) {
+      client_ctx->reading_early_data = false;
+    }
+  }
+#endif
+
+  return SSL_do_handshake(client_ctx->ssl);
+}
+
+/**
+ * After a handshake step: sends the app's output once the handshake is
+ * complete and passes on the early data read during the step
+ */
+static bool tls_handshake_progress(tls_client_ctx_t * client_ctx)
+{
+  if (client_ctx->handshake_complete && client_ctx->early_output) {
+    uint8_t * output = client_ctx->early_output;
+    size_t output_length = client_ctx->early_output_length;
+    client_ctx->early_output = NULL;
+    client_ctx->early_output_length = 0;
+
+    bool success = tls_encrypt_data_and_pass_to_network(client_ctx, output, output_length);
+
+    free(output);
+
+    if (!success) {
+      return false;
+    }
+  }
+
+  if (client_ctx->early_data_length > 0) {
+    if (!client_ctx->selected_tls_version) {
+      // both are known once the ClientHello has been handled
+      tls_set_version(client_ctx);
+      tls_set_protocol(client_ctx);
+    }
+
+    log_append(client_ctx->log, LOG_TRACE, "Passing %zu octets of early data to app", client_ctx->early_data_length);
+
+    client_ctx->early_data = true;
+    bool success = tls_pass_to_app(client_ctx, client_ctx->early_data_buf, client_ctx->early_data_length);
+    client_ctx->early_data = false;
+    client_ctx->early_data_length = 0;
+
+    if (!success) {
+      return false;
+    }
+  }
+
+  if (!client_ctx->reading_early_data && client_ctx->early_data_buf) {
+    free(client_ctx->early_data_buf);
+    client_ctx->early_data_buf = NULL;
+  }
+
+  return true;
+}
+
+static bool tls_pass_pending_input(tls_client_ctx_t * client_ctx);
+
+/**
+ * Runs on the thread pool - nothing but the SSL object (and its BIO pair)
+ * may be touched until tls_handshake_step_finished runs
+ */
+static void tls_handshake_step(uv_work_t * req)
+{
+  tls_client_ctx_t * client_ctx = req->data;
+
+  ERR_clear_error();
+
+  int retval = tls_do_handshake(client_ctx);
+
+  client_ctx->handshake_retval = retval;
+  client_ctx->handshake_error = SSL_get_error(client_ctx->ssl, retval);
+  client_ctx->handshake_error_code = retval == 1 ? 0 : ERR_get_error();
+
+  // the error queue belongs to this thread, not the connection
+  ERR_clear_error();
+}
+
+static void tls_handshake_step_finished(uv_work_t * req, int status)
+{
+  tls_client_ctx_t * client_ctx = req->data;
+
+  client_ctx->handshake_in_progress = false;
+
+  if (client_ctx->free_pending) {
+    tls_client_free(client_ctx);
+    return;
+  }
+
+  bool success = status == 0 && tls_handshake_result(client_ctx, client_ctx->handshake_retval,
+                 client_ctx->handshake_error, client_ctx->handshake_error_code) &&
+                 tls_handshake_progress(client_ctx) && tls_update(client_ctx) &&
+                 tls_pass_pending_input(client_ctx);
+
+  client_ctx->handshake_cb(client_ctx->data, success);
+}
+
+void tls_client_enable_async_handshake(tls_client_ctx_t * client_ctx, uv_loop_t * loop, tls_handshake_cb cb)
+{
+  client_ctx->loop = loop;
+  client_ctx->handshake_cb = cb;
+  client_ctx->handshake_work.data = client_ctx;
+}
+
+static bool tls_queue_handshake_step(tls_client_ctx_t * client_ctx)
+{
+  log_append(client_ctx->log, LOG_TRACE, "Queueing handshake step");
+
+  int err = uv_queue_work(client_ctx->loop, &client_ctx->handshake_work, tls_handshake_step,
+                          tls_handshake_step_finished);
+
+  if (err != 0) {
+    log_append(client_ctx->log, LOG_ERROR, "Could not queue handshake step: %s", uv_strerror(err));
+    return false;
+  }
+
+  client_ctx->handshake_in_progress = true;
+
+  return true;
+}
+
+/**
+ * Keeps data that can't be handled until a handshake step has finished -
+ * encrypted input, or the app's output
+ */
+static bool tls_hold(tls_client_ctx_t * client_ctx, uint8_t ** held, size_t * held_length, uint8_t * buf,
+                     size_t length)
+{
+  uint8_t * data = realloc(*held, *held_length + length);
+
+  if (!data) {
+    log_append(client_ctx->log, LOG_ERROR, "Could not hold %zu octets of data", length);
+    return false;
+  }
+
+  memcpy(data + *held_length, buf, length);
+  *held = data;
+  *held_length += length;
+
+  return true;
+}
+
+static bool tls_pass_pending_input(tls_client_ctx_t * client_ctx)
+{
+  if (client_ctx->pending_input_length == 0) {
+    return true;
+  }
+
+  // this may start another step, which collects its own pending input
+  uint8_t * input = client_ctx->pending_input;
+  size_t input_length = client_ctx->pending_input_length;
+  client_ctx->pending_input = NULL;
+  client_ctx->pending_input_length = 0;
+
+  bool success = tls_decrypt_data_and_pass_to_app(client_ctx, input, input_length);
+
+  free(input);
+
+  return success;
+}
+
+/**
+ * Returns false if the handshake fails or TLS handling cannot continue.
+ */
+bool tls_decrypt_data_and_pass_to_app(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length)
+{
+  if (client_ctx->handshake_in_progress) {
+    return tls_hold(client_ctx, &client_ctx->pending_input, &client_ctx->pending_input_length, buf, length);
+  }
+
+  log_append(client_ctx->log, LOG_TRACE, "Writing encrypted data to network BIO");
+
+  size_t written = 0;
+
+  do {
+    int retval = BIO_write(client_ctx->network_bio, buf + written, length - written);
+
+    if (retval > 0) {
+      log_append(client_ctx->log, LOG_TRACE, "Wrote %d/%zu octets of encrypted data to network BIO for decryption",
+          retval, length);
+      written += retval;
+    } else if (BIO_should_retry(client_ctx->network_bio) && client_ctx->reading_early_data) {
+      // SSL_read can't make room yet - the handshake step takes what is in
+      // the BIO and the rest is passed on after it
+      if (!tls_hold(client_ctx, &client_ctx->pending_input, &client_ctx->pending_input_length, buf + written,
+                    length - written)) {
+        return false;
+      }
+
+      break;
+    } else if (BIO_should_retry(client_ctx->network_bio)) {
       // the network BIO buffer maybe full - try freeing some space by
       // reading from it and passing it on to the app
       if (!tls_read_decrypted_data_and_pass_to_app(client_ctx)) {
         log_append(client_ctx->log, LOG_ERROR,
                    "Could not write encrypted data to network BIO for decryption: %d (should retry)", retval);
-        free(buf);
-
         return true;
       }
 
@@ -608,45 +1956,29 @@ bool tls_decrypt_data_and_pass_to_app(tls_client_ctx_t * client_ctx, uint8_t * b
     } else {
       // fatal error
       log_append(client_ctx->log, LOG_ERROR, "Could not write encrypted data to network BIO for decryption: %d", retval);
-      free(buf);
-
       return false;
     }
   } while (written < length);
 
-  free(buf);
-
   if (!client_ctx->handshake_complete) {
 
-    log_append(client_ctx->log, LOG_TRACE, "Attempting handshake");
-    int retval = SSL_do_handshake(client_ctx->ssl);
-
-    if (retval == 1) {
-
-      if (!tls_set_version(client_ctx)) {
-        log_append(client_ctx->log, LOG_WARN, "Handshake complete, blacklisted cipher: %s",
-            client_ctx->selected_cipher);
-        return false;
-      }
-
-      tls_set_protocol(client_ctx);
+    if (client_ctx->loop) {
+      // the rest happens once the step has finished
+      return tls_queue_handshake_step(client_ctx);
+    }
 
-      // success
-      client_ctx->handshake_complete = true;
-      log_append(client_ctx->log, LOG_TRACE, "Handshake complete");
+    log_append(client_ctx->log, LOG_TRACE, "Attempting handshake");
+    int retval = tls_do_handshake(client_ctx);
+    int ssl_error = SSL_get_error(client_ctx->ssl, retval);
 
-    } else if (tls_ssl_wants_read(client_ctx->ssl, retval)) {
-      log_append(client_ctx->log, LOG_TRACE, "Handshake not yet complete, should read");
-    } else if (tls_ssl_wants_write(client_ctx->ssl, retval)) {
-      log_append(client_ctx->log, LOG_TRACE, "Handshake not yet complete, should write");
-    } else {
-      tls_debug_error(client_ctx->ssl, retval, "Handshake failed");
+    if (!tls_handshake_result(client_ctx, retval, ssl_error, retval == 1 ? 0 : ERR_get_error()) ||
+        !tls_handshake_progress(client_ctx)) {
       return false;
     }
 
   }
 
-  return tls_update(client_ctx);
+  return tls_update(client_ctx) && tls_pass_pending_input(client_ctx);
 }
 
 bool tls_encrypt_data_and_pass_to_network(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length)
@@ -654,15 +1986,53 @@ bool tls_encrypt_data_and_pass_to_network(tls_client_ctx_t * client_ctx, uint8_t
 
   log_append(client_ctx->log, LOG_TRACE, "Encrypting %zu octets of data from application", length);
 
+  if (client_ctx->ktls_tx) {
+    log_append(client_ctx->log, LOG_ERROR, "Data passed to OpenSSL after kernel TLS was enabled");
+    return false;
+  }
+
+  if (!client_ctx->handshake_complete) {
+    // e.g. responses to requests that arrived as early data - sent once the
+    // handshake is complete
+    log_append(client_ctx->log, LOG_TRACE, "Holding %zu octets until the handshake is complete", length);
+    return tls_hold(client_ctx, &client_ctx->early_output, &client_ctx->early_output_length, buf, length);
+  }
+
+  tls_server_ctx_t * tls_ctx = SSL_get_ex_data(client_ctx->ssl, ssl_ctx_app_data_index);
+  uint64_t now = uv_hrtime() / 1000000;
+
+  if (now - client_ctx->last_write >= tls_ctx->record_idle_timeout) {
+    // the congestion window has probably shrunk again
+    client_ctx->burst_octets = 0;
+  }
+
+  client_ctx->last_write = now;
+
   size_t written = 0;
   size_t remaining_length = length;
 
   do {
-    int retval = SSL_write(client_ctx->ssl, buf + written, length - written);
+    // one record per SSL_write
+    size_t record_length = length - written;
+    if (record_length > SSL3_RT_MAX_PLAIN_LENGTH) {
+      record_length = SSL3_RT_MAX_PLAIN_LENGTH;
+    }
+
+    if (tls_ctx->small_record_size && client_ctx->burst_octets < tls_ctx->record_boost_threshold &&
+        record_length > tls_ctx->small_record_size) {
+      // the client can decrypt (and start using) each small record as soon
+      // as its segment arrives
+      record_length = tls_ctx->small_record_size;
+    }
+
+    int retval = SSL_write(client_ctx->ssl, buf + written, record_length);
 
     if (retval > 0) {
       log_append(client_ctx->log, LOG_TRACE, "SSL_write returned: %d", retval);
       written += retval;
+      client_ctx->burst_octets += retval;
+      __sync_fetch_and_add(&tls_ctx->records_written, 1);
+      __sync_fetch_and_add(&tls_ctx->record_octets_written, retval);
     } else if (tls_ssl_wants_read(client_ctx->ssl, retval)) {
       log_append(client_ctx->log, LOG_TRACE, "SSL_write: wants read with %zu bytes remaining", remaining_length);
 
@@ -690,9 +2060,99 @@ bool tls_encrypt_data_and_pass_to_network(tls_client_ctx_t * client_ctx, uint8_t
   return tls_update(client_ctx);
 }
 
+bool tls_client_write(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length)
+{
+  buffer_pool_t * pool = client_ctx->read_buffers;
+
+  while (length > 0) {
+    if (client_ctx->write_buf_length == 0 && length >= pool->buffer_size) {
+      // nothing to gain from copying a whole buffer's worth
+      return tls_encrypt_data_and_pass_to_network(client_ctx, buf, length);
+    }
+
+    if (!client_ctx->write_buf) {
+      client_ctx->write_buf = buffer_pool_get(pool);
+
+      if (!client_ctx->write_buf) {
+        log_append(client_ctx->log, LOG_ERROR, "Could not allocate buffer for data to encrypt");
+        return false;
+      }
+    }
+
+    size_t copy_length = pool->buffer_size - client_ctx->write_buf_length;
+    if (copy_length > length) {
+      copy_length = length;
+    }
+
+    memcpy(client_ctx->write_buf + client_ctx->write_buf_length, buf, copy_length);
+    client_ctx->write_buf_length += copy_length;
+    buf += copy_length;
+    length -= copy_length;
+
+    if (client_ctx->write_buf_length == pool->buffer_size && !tls_client_flush(client_ctx)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool tls_client_flush(tls_client_ctx_t * client_ctx)
+{
+  uint8_t * buf = client_ctx->write_buf;
+  size_t length = client_ctx->write_buf_length;
+
+  if (!buf) {
+    return true;
+  }
+
+  client_ctx->write_buf = NULL;
+  client_ctx->write_buf_length = 0;
+
+  bool success = length == 0 || tls_encrypt_data_and_pass_to_network(client_ctx, buf, length);
+
+  buffer_pool_put(client_ctx->read_buffers, buf);
+
+  return success;
+}
+
+size_t tls_client_memory_used(tls_client_ctx_t * client_ctx)
+{
+  size_t used = client_ctx->pending_input_length + client_ctx->early_output_length +
+                client_ctx->write_buf_length;
+
+  if (client_ctx->handshake_in_progress) {
+    // the BIO pair can't be looked at until the step has finished
+    return used;
+  }
+
+  if (client_ctx->app_bio) {
+    used += BIO_ctrl_pending(client_ctx->app_bio);
+  }
+
+  if (client_ctx->network_bio) {
+    used += BIO_ctrl_pending(client_ctx->network_bio);
+  }
+
+  return used;
+}
+
 bool tls_client_free(tls_client_ctx_t * client_ctx)
 {
+  if (client_ctx->handshake_in_progress) {
+    // the thread pool is still using the SSL object - it's freed once the
+    // step has finished
+    client_ctx->free_pending = true;
+    return true;
+  }
+
   if (client_ctx->ssl) {
+    if (client_ctx->handshake_complete) {
+      // connections are closed without a close_notify - don't let openssl
+      // treat that as a failure and drop the session from the cache
+      SSL_set_shutdown(client_ctx->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+
     SSL_free(client_ctx->ssl);
   }
 
@@ -700,6 +2160,13 @@ bool tls_client_free(tls_client_ctx_t * client_ctx)
     BIO_free(client_ctx->network_bio);
   }
 
+  if (client_ctx->write_buf) {
+    buffer_pool_put(client_ctx->read_buffers, client_ctx->write_buf);
+  }
+
+  free(client_ctx->pending_input);
+  free(client_ctx->early_data_buf);
+  free(client_ctx->early_output);
   free(client_ctx);
 
   return true;
@@ -4,11 +4,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 #include <openssl/ssl.h>
 #include <openssl/bio.h>
 
+#include <uv.h>
+
 #include "log.h"
+#include "util/buffer_pool.h"
+#include "util/hash_table.h"
+#include "tls_session.h"
+#include "tls_ocsp.h"
 
 /**
  * Here is the basic flow:
@@ -24,13 +31,79 @@
 
 typedef bool (*tls_write_to_network_cb)(void * data, uint8_t * buf, size_t length);
 typedef bool (*tls_write_to_app_cb)(void * data, uint8_t * buf, size_t length);
+typedef void (*tls_handshake_cb)(void * data, bool success);
+
+// the longest name a client can ask for with SNI
+#define TLS_MAX_HOSTNAME_LENGTH 255
+
+/**
+ * The cached OCSP response for one of the certificates
+ */
+typedef struct tls_ocsp_staple_t {
+
+  X509 * certificate;
+  char * cert_file;
+  char * response_path;
+
+  // identify the file the response was read from - it is replaced (not
+  // rewritten) when a new response is fetched
+  ino_t inode;
+  time_t modified;
+
+  // DER encoded, NULL if there isn't a valid response
+  uint8_t * response;
+  size_t response_length;
+  // seconds since the epoch
+  uint64_t expires;
+
+  struct tls_ocsp_staple_t * next;
+
+} tls_ocsp_staple_t;
 
 typedef struct {
 
+  // has the default certificates - used until the client's SNI name is known
+  // and for names that don't have their own
   SSL_CTX * ssl_ctx;
+  // lower case hostname (or "*.parent.domain") -> SSL_CTX
+  hash_table_t host_ssl_ctxs;
 
   struct log_context_t * log;
 
+  // NULL unless session resumption is enabled
+  tls_session_cache_t * session_cache;
+  // seconds
+  uint64_t session_timeout;
+  uint64_t ticket_key_lifetime;
+  bool session_tickets;
+
+  // dynamic record sizing - 0 to always write full records
+  size_t small_record_size;
+  size_t record_boost_threshold;
+  // milliseconds
+  uint64_t record_idle_timeout;
+
+  // hand encryption of outgoing data to the kernel after the handshake
+  bool ktls;
+
+  // octets of TLS 1.3 early data accepted per connection - 0 for none
+  size_t max_early_data;
+
+  // certificates are sent compressed (RFC 8879) to clients that support it
+  bool certificate_compression;
+  // full handshakes, by whether the certificate was compressed
+  size_t compressed_certificates;
+  size_t uncompressed_certificates;
+
+  // application data records written with openssl, and the octets in them
+  size_t records_written;
+  size_t record_octets_written;
+
+  // responses are replaced by one thread while handshakes on the others
+  // (or the thread pool) staple them
+  tls_ocsp_staple_t * ocsp_staples;
+  uv_mutex_t ocsp_mutex;
+
 } tls_server_ctx_t;
 
 typedef struct {
@@ -44,6 +117,14 @@ typedef struct {
   const char * selected_cipher;
   int cipher_key_size_in_bits;
 
+  // decrypted data is read into these before it is passed on to the app
+  buffer_pool_t * read_buffers;
+
+  // the app's output collected by tls_client_write (in one of the read
+  // buffers) until it is encrypted
+  uint8_t * write_buf;
+  size_t write_buf_length;
+
   SSL * ssl;
   BIO * app_bio;
   BIO * network_bio;
@@ -51,6 +132,47 @@ typedef struct {
   bool handshake_complete;
   bool writing_to_app;
 
+  // TLS 1.3 early data, read along with the handshake
+  bool reading_early_data;
+  uint8_t * early_data_buf;
+  size_t early_data_length;
+  // set while the data passed to write_to_app is early data that arrived
+  // before the handshake completed - it may have been replayed
+  bool early_data;
+  // the app's output is held until the handshake completes
+  uint8_t * early_output;
+  size_t early_output_length;
+
+  // when loop is set, handshake steps (and the private key operations in
+  // them) run on the loop's thread pool
+  uv_loop_t * loop;
+  uv_work_t handshake_work;
+  tls_handshake_cb handshake_cb;
+  // the SSL object belongs to the thread pool until the step finishes
+  bool handshake_in_progress;
+  bool free_pending;
+  int handshake_retval;
+  int handshake_error;
+  unsigned long handshake_error_code;
+  // encrypted data that arrived while a handshake step was running
+  uint8_t * pending_input;
+  size_t pending_input_length;
+
+  // octets written since the connection started or was last idle
+  size_t burst_octets;
+  // milliseconds, uv_hrtime based
+  uint64_t last_write;
+
+  // kernel TLS - once ktls_tx is set the kernel encrypts everything written
+  // to the socket and tls_encrypt_data_and_pass_to_network must not be used
+  bool ktls_tx;
+  bool ktls_attempted;
+  // records written with the current write key
+  uint64_t write_seq;
+  // TLS 1.3 only, captured when the application keys are derived
+  uint8_t traffic_secret[EVP_MAX_MD_SIZE];
+  size_t traffic_secret_length;
+
   tls_write_to_network_cb write_to_network;
   tls_write_to_app_cb write_to_app;
 
@@ -58,24 +180,138 @@ typedef struct {
 
 bool tls_init(const char * h2_protocol_version_string);
 
+/**
+ * Certificates are compressed (RFC 8879) with whichever of brotli, zstd and
+ * zlib the linked openssl supports, for clients that ask for it.
+ */
 tls_server_ctx_t * tls_server_init(struct log_context_t * log, const char * key_file, const char * cert_file);
 
+/**
+ * Adds a certificate for clients that ask for hostname with SNI - or to the
+ * default certificates if hostname is NULL. Hostnames may start with a "*."
+ * wildcard. A hostname can have one certificate of each key type (e.g. ECDSA
+ * and RSA) and the client gets the one it supports, preferring ECDSA.
+ *
+ * Must be called before any of the other tls_server_ functions.
+ */
+bool tls_server_add_certificate(tls_server_ctx_t * server_ctx, const char * hostname, const char * key_file,
+                                const char * cert_file);
+
+/**
+ * Lets clients resume their sessions with session tickets (if tickets is true)
+ * and the session ids kept in cache. Ticket keys are shared through the cache
+ * and replaced every ticket_key_lifetime seconds. The server context takes
+ * ownership of the cache.
+ */
+bool tls_server_enable_resumption(tls_server_ctx_t * server_ctx, tls_session_cache_t * cache,
+                                  uint64_t session_timeout, uint64_t ticket_key_lifetime, bool tickets);
+
+/**
+ * Writes records of at most small_record_size octets (so that each one fits
+ * in a single TCP segment) until boost_threshold octets have been written,
+ * then full size records. Small records are used again after nothing has
+ * been written for idle_timeout milliseconds.
+ */
+void tls_server_set_record_sizing(tls_server_ctx_t * server_ctx, size_t small_record_size,
+                                  size_t boost_threshold, uint64_t idle_timeout);
+
+/**
+ * Lets clients move to kernel TLS (see tls_client_enable_ktls). Returns false
+ * if the server wasn't built with kernel TLS support.
+ *
+ * Once a client has moved, http/1.1 responses can send static files with
+ * sendfile. http/2 responses are still written from userspace buffers.
+ *
+ * OpenSSL keeps decrypting, but it can't write any more records: a peer's
+ * KeyUpdate request goes unanswered (the peer keeps reading with its old
+ * key), and a peer that renegotiates a TLS 1.2 connection is disconnected.
+ */
+bool tls_server_enable_ktls(tls_server_ctx_t * server_ctx);
+
+/**
+ * Accepts up to max_early_data octets of TLS 1.3 early data from clients
+ * resuming a session with a ticket. Each ClientHello is only accepted once
+ * within the anti-replay window kept in the session cache, so resumption
+ * must have been enabled first. Returns false if openssl doesn't support
+ * early data.
+ */
+bool tls_server_enable_early_data(tls_server_ctx_t * server_ctx, size_t max_early_data);
+
+/**
+ * Staples the cached OCSP response for the (first) certificate in cert_file
+ * to the handshakes that use it, if the client asks for it. The response is
+ * read from tls_ocsp_response_path(cert_file).
+ */
+bool tls_server_add_ocsp_staple(tls_server_ctx_t * server_ctx, const char * cert_file);
+
+/**
+ * Picks up OCSP responses that have been replaced since they were read and
+ * drops the ones that have expired
+ */
+void tls_server_reload_ocsp_staples(tls_server_ctx_t * server_ctx);
+
 bool tls_server_free(tls_server_ctx_t * server_ctx);
 
-tls_client_ctx_t * tls_client_init(tls_server_ctx_t * server_ctx, void * data,
+/**
+ * Both callbacks only borrow the buffers they are given for the duration of
+ * the call.
+ */
+tls_client_ctx_t * tls_client_init(tls_server_ctx_t * server_ctx, buffer_pool_t * read_buffers, void * data,
                                    tls_write_to_network_cb write_to_network, tls_write_to_app_cb write_to_app);
 
+/**
+ * Runs handshake steps on the loop's thread pool so that private key
+ * operations don't hold up the other connections. Once a step has finished,
+ * its output has been passed on and the decrypted data that followed it (if
+ * any) has been passed to the app, cb is called - with success false if the
+ * connection can't continue. cb isn't called after tls_client_free.
+ */
+void tls_client_enable_async_handshake(tls_client_ctx_t * client_ctx, uv_loop_t * loop, tls_handshake_cb cb);
+
 /**
  * Called when data has been read from the network and the caller wants to decrypt
- * that data and pass it on to the application
+ * that data and pass it on to the application. The buffer is only borrowed for
+ * the duration of the call, as is the buffer passed on to write_to_app.
  */
 bool tls_decrypt_data_and_pass_to_app(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length);
 
 /**
- * Called when data has been read from the application
+ * Called when data has been read from the application. Data written before
+ * the handshake is complete (e.g. responses to early data) is held until it
+ * is.
  */
 bool tls_encrypt_data_and_pass_to_network(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length);
 
+/**
+ * Collects data from the application to be encrypted by tls_client_flush, so
+ * that everything the app writes in one loop iteration goes out in as few
+ * full size records as possible. Full buffers are encrypted right away. The
+ * buffer is only borrowed for the duration of the call.
+ */
+bool tls_client_write(tls_client_ctx_t * client_ctx, uint8_t * buf, size_t length);
+
+/**
+ * Encrypts the data collected by tls_client_write and passes it on to the
+ * network
+ */
+bool tls_client_flush(tls_client_ctx_t * client_ctx);
+
+/**
+ * The number of octets waiting in the BIO pair in either direction, waiting
+ * for a handshake step to finish or waiting to be encrypted
+ */
+size_t tls_client_memory_used(tls_client_ctx_t * client_ctx);
+
+/**
+ * Installs the negotiated write keys in the socket so that the kernel
+ * encrypts everything written to it from now on. Must only be called once
+ * every octet produced by tls_encrypt_data_and_pass_to_network has been
+ * handed to the socket. Only tried once per connection - if the kernel or
+ * the negotiated cipher suite doesn't support it, the connection keeps
+ * using OpenSSL and false is returned.
+ */
+bool tls_client_enable_ktls(tls_client_ctx_t * client_ctx, int fd);
+
 bool tls_client_free(tls_client_ctx_t * client_ctx);
 
 #endif
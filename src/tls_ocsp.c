@@ -0,0 +1,364 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "util/util.h"
+#include "tls_ocsp.h"
+
+char * tls_ocsp_response_path(const char * cert_file)
+{
+  size_t length = strlen(cert_file);
+  char * path = malloc(length + sizeof(TLS_OCSP_RESPONSE_SUFFIX));
+  ASSERT_OR_RETURN_NULL(path);
+
+  memcpy(path, cert_file, length);
+  memcpy(path + length, TLS_OCSP_RESPONSE_SUFFIX, sizeof(TLS_OCSP_RESPONSE_SUFFIX));
+
+  return path;
+}
+
+/**
+ * When a response with the given update times stops being valid (seconds
+ * since the epoch). Responses without a next update don't say - they are
+ * treated as good for TLS_OCSP_DEFAULT_VALIDITY.
+ */
+static uint64_t tls_ocsp_expires(ASN1_GENERALIZEDTIME * this_update, ASN1_GENERALIZEDTIME * next_update)
+{
+  ASN1_GENERALIZEDTIME * from = next_update ? next_update : this_update;
+  int days, seconds;
+
+  if (!from || !ASN1_TIME_diff(&days, &seconds, NULL, from)) {
+    return 0;
+  }
+
+  int64_t expires = (int64_t) time(NULL) + (int64_t) days * 86400 + seconds;
+
+  if (!next_update) {
+    expires += TLS_OCSP_DEFAULT_VALIDITY;
+  }
+
+  return expires > 0 ? expires : 0;
+}
+
+/**
+ * Waits until the responder's socket is ready for whatever the BIO is
+ * waiting on
+ */
+static bool tls_ocsp_wait(BIO * bio, time_t deadline)
+{
+  int fd;
+  time_t now = time(NULL);
+
+  if (BIO_get_fd(bio, &fd) < 0 || now >= deadline) {
+    return false;
+  }
+
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = BIO_should_read(bio) ? POLLIN : POLLOUT;
+
+  int r;
+  do {
+    r = poll(&pfd, 1, (deadline - now) * 1000);
+  } while (r < 0 && errno == EINTR);
+
+  return r > 0;
+}
+
+static OCSP_RESPONSE * tls_ocsp_query(struct log_context_t * log, const char * host, const char * port,
+                                      const char * path, OCSP_REQUEST * request)
+{
+  BIO * bio = BIO_new_connect(host);
+  ASSERT_OR_RETURN_NULL(bio);
+
+  BIO_set_conn_port(bio, port);
+  BIO_set_nbio(bio, 1);
+
+  time_t deadline = time(NULL) + TLS_OCSP_TIMEOUT;
+
+  int r = BIO_do_connect(bio);
+  if (r <= 0 && !BIO_should_retry(bio)) {
+    log_append(log, LOG_WARN, "Unable to connect to OCSP responder %s:%s: %s", host, port,
+        ERR_error_string(ERR_get_error(), NULL));
+    BIO_free_all(bio);
+    return NULL;
+  }
+
+  OCSP_RESPONSE * response = NULL;
+  OCSP_REQ_CTX * ctx = OCSP_sendreq_new(bio, path, NULL, -1);
+
+  if (ctx && OCSP_REQ_CTX_add1_header(ctx, "Host", host) && OCSP_REQ_CTX_set1_req(ctx, request)) {
+    OCSP_set_max_response_length(ctx, TLS_OCSP_MAX_RESPONSE_LENGTH);
+
+    // the connect finishes along with the first write
+    while ((r = OCSP_sendreq_nbio(&response, ctx)) == -1 && tls_ocsp_wait(bio, deadline));
+
+    if (r == -1) {
+      log_append(log, LOG_WARN, "OCSP responder %s:%s timed out", host, port);
+    } else if (r == 0) {
+      log_append(log, LOG_WARN, "OCSP request to %s:%s failed: %s", host, port,
+          ERR_error_string(ERR_get_error(), NULL));
+    }
+  }
+
+  if (ctx) {
+    OCSP_REQ_CTX_free(ctx);
+  }
+  BIO_free_all(bio);
+
+  return response;
+}
+
+/**
+ * Checks that the response is signed by (or on behalf of) the issuer and that
+ * the certificate is good. Returns when the response expires or 0 if it can't
+ * be stapled.
+ */
+static uint64_t tls_ocsp_verify(struct log_context_t * log, const char * cert_file, OCSP_RESPONSE * response,
+                                X509 * issuer, OCSP_CERTID * id)
+{
+  int response_status = OCSP_response_status(response);
+  if (response_status != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+    log_append(log, LOG_WARN, "OCSP responder error for %s: %s", cert_file,
+        OCSP_response_status_str(response_status));
+    return 0;
+  }
+
+  OCSP_BASICRESP * basic = OCSP_response_get1_basic(response);
+  STACK_OF(X509) * certs = sk_X509_new_null();
+  X509_STORE * store = X509_STORE_new();
+
+  if (!basic || !certs || !store || !sk_X509_push(certs, issuer) || !X509_STORE_add_cert(store, issuer)) {
+    log_append(log, LOG_WARN, "Unable to check OCSP response for %s", cert_file);
+    OCSP_BASICRESP_free(basic);
+    sk_X509_free(certs);
+    X509_STORE_free(store);
+    return 0;
+  }
+
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+  // the issuer is usually an intermediate - it is trusted without its root
+  X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+#endif
+
+  int status, reason;
+  ASN1_GENERALIZEDTIME * revoked_at;
+  ASN1_GENERALIZEDTIME * this_update;
+  ASN1_GENERALIZEDTIME * next_update;
+  uint64_t expires = 0;
+
+  if (OCSP_basic_verify(basic, certs, store, OCSP_TRUSTOTHER) <= 0) {
+    log_append(log, LOG_WARN, "OCSP response for %s failed verification: %s", cert_file,
+        ERR_error_string(ERR_get_error(), NULL));
+  } else if (!OCSP_resp_find_status(basic, id, &status, &reason, &revoked_at, &this_update, &next_update)) {
+    log_append(log, LOG_WARN, "OCSP response does not cover %s", cert_file);
+  } else if (status != V_OCSP_CERTSTATUS_GOOD) {
+    log_append(log, LOG_ERROR, "OCSP status for %s is %s", cert_file, OCSP_cert_status_str(status));
+  } else if (!OCSP_check_validity(this_update, next_update, TLS_OCSP_MAX_CLOCK_SKEW, -1)) {
+    log_append(log, LOG_WARN, "OCSP response for %s is out of date", cert_file);
+  } else {
+    expires = tls_ocsp_expires(this_update, next_update);
+  }
+
+  OCSP_BASICRESP_free(basic);
+  sk_X509_free(certs);
+  X509_STORE_free(store);
+
+  return expires;
+}
+
+static bool tls_ocsp_save(const char * path, OCSP_RESPONSE * response)
+{
+  unsigned char * der = NULL;
+  int length = i2d_OCSP_RESPONSE(response, &der);
+
+  if (length <= 0) {
+    return false;
+  }
+
+  char tmp_path[strlen(path) + sizeof(".tmp")];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE * file = fopen(tmp_path, "wb");
+  bool success = file && fwrite(der, 1, length, file) == (size_t) length;
+
+  if (file && fclose(file) != 0) {
+    success = false;
+  }
+
+  // workers only ever see a whole response
+  success = success && rename(tmp_path, path) == 0;
+
+  if (!success) {
+    unlink(tmp_path);
+  }
+
+  OPENSSL_free(der);
+
+  return success;
+}
+
+static OCSP_RESPONSE * tls_ocsp_request(struct log_context_t * log, const char * cert_file, X509 * certificate,
+                                        const char * responder, OCSP_CERTID * id)
+{
+  STACK_OF(OPENSSL_STRING) * urls = NULL;
+  const char * url = responder;
+
+  if (!url) {
+    urls = X509_get1_ocsp(certificate);
+    url = urls && sk_OPENSSL_STRING_num(urls) > 0 ? sk_OPENSSL_STRING_value(urls, 0) : NULL;
+  }
+
+  char * host = NULL;
+  char * port = NULL;
+  char * path = NULL;
+  int use_ssl = 0;
+  OCSP_RESPONSE * response = NULL;
+
+  if (!url) {
+    log_append(log, LOG_WARN, "No OCSP responder for %s", cert_file);
+  } else if (!OCSP_parse_url(url, &host, &port, &path, &use_ssl)) {
+    log_append(log, LOG_WARN, "Invalid OCSP responder URL for %s: %s", cert_file, url);
+  } else if (use_ssl) {
+    log_append(log, LOG_WARN, "OCSP responders are only reached over http: %s", url);
+  } else {
+    OCSP_REQUEST * request = OCSP_REQUEST_new();
+    OCSP_CERTID * request_id = OCSP_CERTID_dup(id);
+
+    if (request && request_id && OCSP_request_add0_id(request, request_id)) {
+      request_id = NULL;
+      log_append(log, LOG_DEBUG, "Requesting OCSP status of %s from %s", cert_file, url);
+      response = tls_ocsp_query(log, host, port, path, request);
+    }
+
+    OCSP_CERTID_free(request_id);
+    OCSP_REQUEST_free(request);
+  }
+
+  OPENSSL_free(host);
+  OPENSSL_free(port);
+  OPENSSL_free(path);
+
+  if (urls) {
+    X509_email_free(urls);
+  }
+
+  return response;
+}
+
+bool tls_ocsp_fetch(struct log_context_t * log, const char * cert_file, const char * responder,
+                    uint64_t * next_update)
+{
+  BIO * file = BIO_new_file(cert_file, "r");
+
+  if (!file) {
+    log_append(log, LOG_WARN, "Unable to read certificate for OCSP: %s", cert_file);
+    return false;
+  }
+
+  X509 * certificate = PEM_read_bio_X509(file, NULL, NULL, NULL);
+  X509 * issuer = certificate ? PEM_read_bio_X509(file, NULL, NULL, NULL) : NULL;
+  BIO_free(file);
+
+  if (!issuer) {
+    log_append(log, LOG_WARN, "OCSP stapling needs the issuer after the certificate in %s", cert_file);
+    X509_free(certificate);
+    return false;
+  }
+
+  bool success = false;
+  OCSP_CERTID * id = OCSP_cert_to_id(NULL, certificate, issuer);
+  OCSP_RESPONSE * response = id ? tls_ocsp_request(log, cert_file, certificate, responder, id) : NULL;
+  uint64_t expires = response ? tls_ocsp_verify(log, cert_file, response, issuer, id) : 0;
+
+  if (expires > 0) {
+    char * path = tls_ocsp_response_path(cert_file);
+    success = path && tls_ocsp_save(path, response);
+
+    if (success) {
+      *next_update = expires;
+      log_append(log, LOG_DEBUG, "Saved OCSP response for %s, valid for %" PRIu64 "s", cert_file,
+          expires - time(NULL));
+    } else {
+      log_append(log, LOG_ERROR, "Unable to save OCSP response for %s: %s", cert_file, strerror(errno));
+    }
+
+    free(path);
+  }
+
+  OCSP_RESPONSE_free(response);
+  OCSP_CERTID_free(id);
+  X509_free(certificate);
+  X509_free(issuer);
+
+  return success;
+}
+
+/**
+ * When the first status in the response expires - the file was written by
+ * tls_ocsp_fetch, which has already checked it
+ */
+static uint64_t tls_ocsp_response_expires(OCSP_RESPONSE * response)
+{
+  if (OCSP_response_status(response) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+    return 0;
+  }
+
+  OCSP_BASICRESP * basic = OCSP_response_get1_basic(response);
+  OCSP_SINGLERESP * single = basic ? OCSP_resp_get0(basic, 0) : NULL;
+  uint64_t expires = 0;
+
+  if (single) {
+    int reason;
+    ASN1_GENERALIZEDTIME * revoked_at;
+    ASN1_GENERALIZEDTIME * this_update;
+    ASN1_GENERALIZEDTIME * next_update;
+
+    int status = OCSP_single_get0_status(single, &reason, &revoked_at, &this_update, &next_update);
+    if (status == V_OCSP_CERTSTATUS_GOOD) {
+      expires = tls_ocsp_expires(this_update, next_update);
+    }
+  }
+
+  OCSP_BASICRESP_free(basic);
+
+  return expires;
+}
+
+uint8_t * tls_ocsp_response_load(const char * path, size_t * length, uint64_t * next_update)
+{
+  FILE * file = fopen(path, "rb");
+  ASSERT_OR_RETURN_NULL(file);
+
+  uint8_t * buf = malloc(TLS_OCSP_MAX_RESPONSE_LENGTH);
+  size_t buf_length = buf ? fread(buf, 1, TLS_OCSP_MAX_RESPONSE_LENGTH, file) : 0;
+  fclose(file);
+
+  const unsigned char * der = buf;
+  OCSP_RESPONSE * response = buf_length > 0 ? d2i_OCSP_RESPONSE(NULL, &der, buf_length) : NULL;
+  uint64_t expires = response ? tls_ocsp_response_expires(response) : 0;
+  OCSP_RESPONSE_free(response);
+
+  if (expires <= (uint64_t) time(NULL)) {
+    free(buf);
+    return NULL;
+  }
+
+  *length = buf_length;
+  *next_update = expires;
+
+  return buf;
+}
@@ -0,0 +1,55 @@
+#ifndef HTTP_TLS_OCSP_H
+#define HTTP_TLS_OCSP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "util/log.h"
+
+/**
+ * OCSP responses for stapling.
+ *
+ * The server process fetches a response for each certificate in the
+ * background and writes it next to the certificate (see
+ * tls_ocsp_response_path). Workers staple whatever is in that file for as
+ * long as it is valid, so stapling carries on from the last good response
+ * while the responder can't be reached.
+ */
+#define TLS_OCSP_RESPONSE_SUFFIX ".ocsp"
+
+// how long a responder has to answer
+#define TLS_OCSP_TIMEOUT 10 // seconds
+#define TLS_OCSP_MAX_RESPONSE_LENGTH 0x10000
+// allowed difference between our clock and the responder's
+#define TLS_OCSP_MAX_CLOCK_SKEW 300 // seconds
+// how long a response without a next update is stapled for
+#define TLS_OCSP_DEFAULT_VALIDITY 3600 // seconds
+// how soon to try again after a fetch fails
+#define TLS_OCSP_RETRY_INTERVAL 60000 // ms
+
+/**
+ * The file the response for the certificate in cert_file is kept in. The
+ * returned string must be freed.
+ */
+char * tls_ocsp_response_path(const char * cert_file);
+
+/**
+ * Asks the responder for the status of the first certificate in cert_file,
+ * which must be followed by its issuer. responder overrides the URL from the
+ * certificate (e.g. "http://127.0.0.1:8888" for a local `openssl ocsp`).
+ *
+ * A good, verified response replaces the cached one and next_update is set to
+ * when it expires (seconds since the epoch). This blocks - it is meant to be
+ * run on the thread pool.
+ */
+bool tls_ocsp_fetch(struct log_context_t * log, const char * cert_file, const char * responder,
+                    uint64_t * next_update);
+
+/**
+ * Reads the cached response from path. Returns NULL if there isn't one or it
+ * has expired. The DER encoded response must be freed.
+ */
+uint8_t * tls_ocsp_response_load(const char * path, size_t * length, uint64_t * next_update);
+
+#endif
@@ -0,0 +1,327 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/rand.h>
+
+#include "util/util.h"
+#include "tls_session.h"
+
+static size_t tls_session_cache_size(size_t num_entries)
+{
+  return sizeof(tls_session_cache_t) + sizeof(tls_session_entry_t) * num_entries;
+}
+
+static bool tls_session_cache_setup(tls_session_cache_t * cache, size_t num_entries)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef PTHREAD_MUTEX_ROBUST
+  // a worker that dies holding the lock shouldn't stall the others
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+
+  int r = pthread_mutex_init(&cache->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  if (r != 0) {
+    return false;
+  }
+
+  cache->num_keys = 0;
+  memset(&cache->stats, 0, sizeof(tls_session_stats_t));
+  memset(cache->early_data_window, 0, sizeof(cache->early_data_window));
+  cache->num_entries = num_entries;
+  cache->magic = TLS_SESSION_CACHE_MAGIC;
+
+  return true;
+}
+
+int tls_session_cache_create(size_t num_entries)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/prism-sessions-%ld", (long) getpid());
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // only the descriptor is needed from here on
+  shm_unlink(name);
+
+  size_t size = tls_session_cache_size(num_entries);
+
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  tls_session_cache_t * cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (cache == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  bool success = tls_session_cache_setup(cache, num_entries);
+  munmap(cache, size);
+
+  if (!success) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static tls_session_cache_t * tls_session_cache_map(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(tls_session_cache_t)) {
+    return NULL;
+  }
+
+  tls_session_cache_t * cache = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (cache == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (cache->magic != TLS_SESSION_CACHE_MAGIC ||
+      tls_session_cache_size(cache->num_entries) != (size_t) st.st_size) {
+    munmap(cache, st.st_size);
+    return NULL;
+  }
+
+  return cache;
+}
+
+tls_session_cache_t * tls_session_cache_init(int fd, size_t num_entries)
+{
+  if (fd >= 0) {
+    tls_session_cache_t * cache = tls_session_cache_map(fd);
+    close(fd);
+
+    if (cache) {
+      return cache;
+    }
+  }
+
+  size_t size = tls_session_cache_size(num_entries);
+  tls_session_cache_t * cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (cache == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (!tls_session_cache_setup(cache, num_entries)) {
+    munmap(cache, size);
+    return NULL;
+  }
+
+  return cache;
+}
+
+static void tls_session_cache_lock(tls_session_cache_t * cache)
+{
+  int r = pthread_mutex_lock(&cache->mutex);
+
+#ifdef PTHREAD_MUTEX_ROBUST
+  if (r == EOWNERDEAD) {
+    // the worst that can have happened is one half written entry or key,
+    // which fails to decode or authenticate
+    pthread_mutex_consistent(&cache->mutex);
+  }
+#else
+  UNUSED(r);
+#endif
+}
+
+static void tls_session_cache_unlock(tls_session_cache_t * cache)
+{
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+static bool tls_session_cache_rotate_key(tls_session_cache_t * cache, uint64_t now)
+{
+  tls_ticket_key_t key;
+
+  if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+      RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+      RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+    return false;
+  }
+
+  key.created = now;
+
+  if (cache->num_keys < TLS_TICKET_KEYS) {
+    cache->num_keys++;
+  }
+
+  memmove(&cache->keys[1], &cache->keys[0], sizeof(tls_ticket_key_t) * (cache->num_keys - 1));
+  cache->keys[0] = key;
+
+  return true;
+}
+
+bool tls_session_cache_current_key(tls_session_cache_t * cache, uint64_t key_lifetime, tls_ticket_key_t * key)
+{
+  uint64_t now = time(NULL);
+  bool success = true;
+
+  tls_session_cache_lock(cache);
+
+  if (cache->num_keys == 0 || (key_lifetime > 0 && now >= cache->keys[0].created + key_lifetime)) {
+    // whichever worker notices first rotates the key for everyone
+    success = tls_session_cache_rotate_key(cache, now);
+  }
+
+  if (success && cache->num_keys > 0) {
+    *key = cache->keys[0];
+  }
+
+  success = success && cache->num_keys > 0;
+
+  tls_session_cache_unlock(cache);
+
+  return success;
+}
+
+bool tls_session_cache_find_key(tls_session_cache_t * cache, const uint8_t * name, tls_ticket_key_t * key,
+                                bool * current)
+{
+  bool found = false;
+
+  tls_session_cache_lock(cache);
+
+  for (size_t i = 0; i < cache->num_keys; i++) {
+    if (memcmp(cache->keys[i].name, name, TLS_TICKET_KEY_NAME_LENGTH) == 0) {
+      *key = cache->keys[i];
+      *current = i == 0;
+      found = true;
+      break;
+    }
+  }
+
+  tls_session_cache_unlock(cache);
+
+  return found;
+}
+
+static tls_session_entry_t * tls_session_cache_entry(tls_session_cache_t * cache, const uint8_t * id,
+    size_t id_length)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < id_length; i++) {
+    hash ^= id[i];
+    hash *= 16777619u;
+  }
+
+  return &cache->entries[hash % cache->num_entries];
+}
+
+void tls_session_cache_store(tls_session_cache_t * cache, const uint8_t * id, size_t id_length,
+                             const uint8_t * session, size_t session_length, uint64_t expires)
+{
+  if (cache->num_entries == 0 || id_length > TLS_SESSION_ID_MAX_LENGTH ||
+      session_length > TLS_SESSION_MAX_LENGTH) {
+    return;
+  }
+
+  tls_session_cache_lock(cache);
+
+  // each id has exactly one slot - a newer session replaces whatever was there
+  tls_session_entry_t * entry = tls_session_cache_entry(cache, id, id_length);
+  memcpy(entry->id, id, id_length);
+  entry->id_length = id_length;
+  memcpy(entry->session, session, session_length);
+  entry->session_length = session_length;
+  entry->expires = expires;
+
+  tls_session_cache_unlock(cache);
+}
+
+size_t tls_session_cache_lookup(tls_session_cache_t * cache, const uint8_t * id, size_t id_length,
+                                uint8_t * session)
+{
+  if (cache->num_entries == 0 || id_length > TLS_SESSION_ID_MAX_LENGTH) {
+    return 0;
+  }
+
+  uint64_t now = time(NULL);
+  size_t session_length = 0;
+
+  tls_session_cache_lock(cache);
+
+  tls_session_entry_t * entry = tls_session_cache_entry(cache, id, id_length);
+
+  if (entry->id_length == id_length && memcmp(entry->id, id, id_length) == 0) {
+    if (entry->expires > now) {
+      session_length = entry->session_length;
+      memcpy(session, entry->session, session_length);
+    } else {
+      entry->id_length = 0;
+    }
+  }
+
+  tls_session_cache_unlock(cache);
+
+  return session_length;
+}
+
+void tls_session_cache_remove(tls_session_cache_t * cache, const uint8_t * id, size_t id_length)
+{
+  if (cache->num_entries == 0 || id_length > TLS_SESSION_ID_MAX_LENGTH) {
+    return;
+  }
+
+  tls_session_cache_lock(cache);
+
+  tls_session_entry_t * entry = tls_session_cache_entry(cache, id, id_length);
+
+  if (entry->id_length == id_length && memcmp(entry->id, id, id_length) == 0) {
+    entry->id_length = 0;
+  }
+
+  tls_session_cache_unlock(cache);
+}
+
+bool tls_session_cache_early_data_fresh(tls_session_cache_t * cache, const uint8_t * client_random)
+{
+  uint64_t now = time(NULL);
+  bool fresh = false;
+
+  // the client random is random already
+  uint32_t hash;
+  memcpy(&hash, client_random, sizeof(hash));
+
+  tls_session_cache_lock(cache);
+
+  uint64_t * expires = &cache->early_data_window[hash % TLS_EARLY_DATA_WINDOW_SLOTS];
+
+  // a replay always lands on its original's slot - and a slot that is
+  // still taken by another ClientHello can't be handed over without
+  // forgetting that one, so both are rejected
+  if (*expires <= now) {
+    *expires = now + TLS_EARLY_DATA_WINDOW;
+    fresh = true;
+  }
+
+  tls_session_cache_unlock(cache);
+
+  return fresh;
+}
+
+void tls_session_cache_free(tls_session_cache_t * cache)
+{
+  munmap(cache, tls_session_cache_size(cache->num_entries));
+}
@@ -0,0 +1,152 @@
+#ifndef HTTP_TLS_SESSION_H
+#define HTTP_TLS_SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+/**
+ * State for TLS session resumption that is shared by every worker.
+ *
+ * The server process creates the shared memory segment and passes it to each
+ * worker process on this descriptor so that a client can resume its session
+ * on any worker. Workers are started with "-s" when it has been passed.
+ */
+#define TLS_SESSION_CACHE_FD 3
+
+#define TLS_SESSION_CACHE_MAGIC 0x70727373 // "prss"
+
+// the current ticket key plus the ones before it, which are still accepted
+#define TLS_TICKET_KEYS 3
+#define TLS_TICKET_KEY_NAME_LENGTH 16
+#define TLS_TICKET_KEY_LENGTH 32
+
+#define TLS_SESSION_ID_MAX_LENGTH 32
+// sessions that don't fit in an entry aren't cached
+#define TLS_SESSION_MAX_LENGTH 1024
+
+// the ClientHellos that early data was accepted with. openssl rejects early
+// data when the ticket age is more than 10 seconds off, so a replay can only
+// succeed within that long of the original in either direction
+#define TLS_EARLY_DATA_WINDOW 30 // seconds
+#define TLS_EARLY_DATA_WINDOW_SLOTS 0x10000
+#define TLS_CLIENT_RANDOM_LENGTH 32
+
+typedef struct {
+
+  uint8_t name[TLS_TICKET_KEY_NAME_LENGTH];
+  uint8_t aes_key[TLS_TICKET_KEY_LENGTH];
+  uint8_t hmac_key[TLS_TICKET_KEY_LENGTH];
+
+  // seconds since the epoch
+  uint64_t created;
+
+} tls_ticket_key_t;
+
+typedef struct {
+
+  uint8_t id[TLS_SESSION_ID_MAX_LENGTH];
+  uint32_t id_length;
+
+  // the DER encoded session
+  uint8_t session[TLS_SESSION_MAX_LENGTH];
+  uint32_t session_length;
+
+  // seconds since the epoch
+  uint64_t expires;
+
+} tls_session_entry_t;
+
+typedef struct {
+
+  size_t handshakes;
+  size_t resumed;
+
+  size_t ticket_key_misses;
+
+  size_t cache_hits;
+  size_t cache_misses;
+
+  size_t early_data_accepted;
+  // replays, or the window was too busy to tell
+  size_t early_data_rejected;
+
+} tls_session_stats_t;
+
+typedef struct {
+
+  uint32_t magic;
+
+  pthread_mutex_t mutex;
+
+  // keys[0] is used for new tickets
+  tls_ticket_key_t keys[TLS_TICKET_KEYS];
+  size_t num_keys;
+
+  tls_session_stats_t stats;
+
+  // indexed by client random, when each slot can be used again (seconds
+  // since the epoch)
+  uint64_t early_data_window[TLS_EARLY_DATA_WINDOW_SLOTS];
+
+  size_t num_entries;
+  tls_session_entry_t entries[];
+
+} tls_session_cache_t;
+
+/**
+ * Creates the shared memory segment with room for the given number of
+ * sessions. Returns a descriptor for the segment or -1 on error.
+ */
+int tls_session_cache_create(size_t num_entries);
+
+/**
+ * Maps the segment behind fd. If fd is -1 (or does not refer to a session
+ * cache) a cache is created that is only shared by this process' threads.
+ */
+tls_session_cache_t * tls_session_cache_init(int fd, size_t num_entries);
+
+/**
+ * Copies the key that new tickets should be encrypted with, generating a new
+ * one first if the current key is older than key_lifetime seconds.
+ */
+bool tls_session_cache_current_key(tls_session_cache_t * cache, uint64_t key_lifetime, tls_ticket_key_t * key);
+
+/**
+ * Copies the key with the given name. Sets current if it is the key that new
+ * tickets are encrypted with.
+ */
+bool tls_session_cache_find_key(tls_session_cache_t * cache, const uint8_t * name, tls_ticket_key_t * key,
+                                bool * current);
+
+void tls_session_cache_store(tls_session_cache_t * cache, const uint8_t * id, size_t id_length,
+                             const uint8_t * session, size_t session_length, uint64_t expires);
+
+/**
+ * Copies the session with the given id into session (which must hold
+ * TLS_SESSION_MAX_LENGTH octets). Returns its length or 0 if it isn't cached.
+ */
+size_t tls_session_cache_lookup(tls_session_cache_t * cache, const uint8_t * id, size_t id_length,
+                                uint8_t * session);
+
+void tls_session_cache_remove(tls_session_cache_t * cache, const uint8_t * id, size_t id_length);
+
+/**
+ * Records the client random of a ClientHello that carries early data.
+ * Returns false (and the early data must be rejected) if it may have been
+ * seen within the window - either it has been, or another ClientHello
+ * occupies its slot.
+ */
+bool tls_session_cache_early_data_fresh(tls_session_cache_t * cache, const uint8_t * client_random);
+
+/**
+ * Adds to one of the counters in the shared stats
+ */
+#define TLS_SESSION_STATS_INCREMENT(cache, counter) \
+  __sync_fetch_and_add(&(cache)->stats.counter, 1)
+
+void tls_session_cache_free(tls_session_cache_t * cache);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "buffer_pool.h"
+
+/**
+ * Idle buffers are linked together through their own first bytes
+ */
+struct buffer_pool_idle_s {
+  buffer_pool_idle_t * next;
+};
+
+buffer_pool_t * buffer_pool_init(buffer_pool_t * pool, size_t buffer_size, size_t max_idle)
+{
+  if (!pool) {
+    pool = malloc(sizeof(buffer_pool_t));
+    ASSERT_OR_RETURN_NULL(pool);
+  }
+
+  if (buffer_size < sizeof(buffer_pool_idle_t)) {
+    buffer_size = sizeof(buffer_pool_idle_t);
+  }
+
+  pool->buffer_size = buffer_size;
+  pool->max_idle = max_idle;
+  pool->idle = NULL;
+  pool->idle_count = 0;
+  pool->in_use = 0;
+  pool->high_water_mark = 0;
+  pool->hits = 0;
+  pool->misses = 0;
+
+  return pool;
+}
+
+uint8_t * buffer_pool_get(buffer_pool_t * pool)
+{
+  uint8_t * buffer;
+
+  if (pool->idle) {
+    buffer_pool_idle_t * idle = pool->idle;
+    pool->idle = idle->next;
+    pool->idle_count--;
+    pool->hits++;
+    buffer = (uint8_t *) idle;
+  } else {
+    buffer = malloc(pool->buffer_size);
+    ASSERT_OR_RETURN_NULL(buffer);
+    pool->misses++;
+  }
+
+  pool->in_use++;
+
+  if (pool->in_use > pool->high_water_mark) {
+    pool->high_water_mark = pool->in_use;
+  }
+
+  return buffer;
+}
+
+void buffer_pool_put(buffer_pool_t * pool, uint8_t * buffer)
+{
+  if (!buffer) {
+    return;
+  }
+
+  pool->in_use--;
+
+  if (pool->idle_count >= pool->max_idle) {
+    free(buffer);
+    return;
+  }
+
+  buffer_pool_idle_t * idle = (buffer_pool_idle_t *) buffer;
+  idle->next = pool->idle;
+  pool->idle = idle;
+  pool->idle_count++;
+}
+
+void buffer_pool_free(buffer_pool_t * pool)
+{
+  while (pool->idle) {
+    buffer_pool_idle_t * idle = pool->idle;
+    pool->idle = idle->next;
+    free(idle);
+  }
+
+  pool->idle_count = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef HTTP_BUFFER_POOL_H
+#define HTTP_BUFFER_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * A pool of fixed size buffers. Buffers that are returned to the pool are
+ * kept (up to max_idle of them) and handed out again instead of being
+ * free'd and malloc'd.
+ */
+typedef struct buffer_pool_idle_s buffer_pool_idle_t;
+
+typedef struct {
+
+  size_t buffer_size;
+
+  size_t max_idle;
+
+  // buffers that have been returned to the pool
+  buffer_pool_idle_t * idle;
+  size_t idle_count;
+
+  /**
+   * Counters
+   */
+  // the number of buffers currently handed out
+  size_t in_use;
+  // the most buffers that have been handed out at one time
+  size_t high_water_mark;
+  // gets that were served from the idle buffers
+  size_t hits;
+  // gets that had to allocate a new buffer
+  size_t misses;
+
+} buffer_pool_t;
+
+buffer_pool_t * buffer_pool_init(buffer_pool_t * pool, size_t buffer_size, size_t max_idle);
+
+uint8_t * buffer_pool_get(buffer_pool_t * pool);
+
+/**
+ * Returns a buffer that was retrieved with buffer_pool_get
+ */
+void buffer_pool_put(buffer_pool_t * pool, uint8_t * buffer);
+
+void buffer_pool_free(buffer_pool_t * pool);
+
+#endif
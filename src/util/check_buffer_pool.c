@@ -0,0 +1,121 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <check.h>
+
+#include "buffer_pool.c"
+
+buffer_pool_t pool;
+
+void setup()
+{
+  buffer_pool_init(&pool, 64, 2);
+}
+
+void teardown()
+{
+  buffer_pool_free(&pool);
+}
+
+START_TEST(test_get_allocates)
+{
+  uint8_t * buffer = buffer_pool_get(&pool);
+  ck_assert(buffer != NULL);
+  ck_assert_uint_eq(1, pool.misses);
+  ck_assert_uint_eq(0, pool.hits);
+  ck_assert_uint_eq(1, pool.in_use);
+
+  buffer_pool_put(&pool, buffer);
+  ck_assert_uint_eq(0, pool.in_use);
+  ck_assert_uint_eq(1, pool.idle_count);
+}
+END_TEST
+
+START_TEST(test_get_reuses_returned_buffer)
+{
+  uint8_t * buffer1 = buffer_pool_get(&pool);
+  buffer_pool_put(&pool, buffer1);
+
+  uint8_t * buffer2 = buffer_pool_get(&pool);
+  ck_assert(buffer1 == buffer2);
+  ck_assert_uint_eq(1, pool.misses);
+  ck_assert_uint_eq(1, pool.hits);
+  ck_assert_uint_eq(0, pool.idle_count);
+
+  buffer_pool_put(&pool, buffer2);
+}
+END_TEST
+
+START_TEST(test_high_water_mark)
+{
+  uint8_t * buffer1 = buffer_pool_get(&pool);
+  uint8_t * buffer2 = buffer_pool_get(&pool);
+  uint8_t * buffer3 = buffer_pool_get(&pool);
+  ck_assert_uint_eq(3, pool.high_water_mark);
+
+  buffer_pool_put(&pool, buffer1);
+  buffer_pool_put(&pool, buffer2);
+  buffer_pool_put(&pool, buffer3);
+  ck_assert_uint_eq(3, pool.high_water_mark);
+  ck_assert_uint_eq(0, pool.in_use);
+}
+END_TEST
+
+START_TEST(test_max_idle)
+{
+  uint8_t * buffer1 = buffer_pool_get(&pool);
+  uint8_t * buffer2 = buffer_pool_get(&pool);
+  uint8_t * buffer3 = buffer_pool_get(&pool);
+
+  buffer_pool_put(&pool, buffer1);
+  buffer_pool_put(&pool, buffer2);
+  buffer_pool_put(&pool, buffer3);
+
+  // only 2 buffers are kept, the third is free'd
+  ck_assert_uint_eq(2, pool.idle_count);
+}
+END_TEST
+
+START_TEST(test_small_buffer_size)
+{
+  buffer_pool_t small_pool;
+  buffer_pool_init(&small_pool, 1, 1);
+  ck_assert_uint_eq(sizeof(void *), small_pool.buffer_size);
+
+  uint8_t * buffer = buffer_pool_get(&small_pool);
+  buffer_pool_put(&small_pool, buffer);
+  ck_assert(buffer == buffer_pool_get(&small_pool));
+  buffer_pool_put(&small_pool, buffer);
+
+  buffer_pool_free(&small_pool);
+}
+END_TEST
+
+Suite * suite()
+{
+  Suite * s = suite_create("buffer pool");
+
+  TCase * tc = tcase_create("buffer pool");
+  tcase_add_checked_fixture(tc, setup, teardown);
+
+  tcase_add_test(tc, test_get_allocates);
+  tcase_add_test(tc, test_get_reuses_returned_buffer);
+  tcase_add_test(tc, test_high_water_mark);
+  tcase_add_test(tc, test_max_idle);
+  tcase_add_test(tc, test_small_buffer_size);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main()
+{
+  Suite * s = suite();
+  SRunner * sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,127 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <check.h>
+
+#include "shared_buffer.c"
+
+static size_t destroyed;
+static uint8_t * destroyed_data;
+static size_t destroyed_length;
+
+static void count_destroyed(void * context, uint8_t * data, size_t length)
+{
+  size_t * count = context;
+  (*count)++;
+
+  destroyed_data = data;
+  destroyed_length = length;
+}
+
+void setup()
+{
+  destroyed = 0;
+  destroyed_data = NULL;
+  destroyed_length = 0;
+}
+
+void teardown()
+{
+}
+
+START_TEST(test_release_destroys)
+{
+  uint8_t data[] = "hello";
+  shared_buffer_t * buffer = shared_buffer_init(data, 5, count_destroyed, &destroyed);
+  ck_assert(buffer != NULL);
+
+  shared_buffer_release(buffer);
+
+  ck_assert_uint_eq(1, destroyed);
+  ck_assert(destroyed_data == data);
+  ck_assert_uint_eq(5, destroyed_length);
+}
+END_TEST
+
+START_TEST(test_retained_until_last_release)
+{
+  uint8_t data[] = "hello";
+  shared_buffer_t * buffer = shared_buffer_init(data, 5, count_destroyed, &destroyed);
+
+  ck_assert(shared_buffer_retain(buffer) == buffer);
+  shared_buffer_retain(buffer);
+
+  shared_buffer_release(buffer);
+  shared_buffer_release(buffer);
+  ck_assert_uint_eq(0, destroyed);
+
+  shared_buffer_release(buffer);
+  ck_assert_uint_eq(1, destroyed);
+}
+END_TEST
+
+START_TEST(test_default_destructor_frees)
+{
+  // checked by the leak sanitizer
+  shared_buffer_t * buffer = shared_buffer_init((uint8_t *) strdup("hello"), 5, NULL, NULL);
+  shared_buffer_release(buffer);
+
+  // nothing to release
+  shared_buffer_release(NULL);
+}
+END_TEST
+
+START_TEST(test_slice)
+{
+  uint8_t data[] = "hello world";
+  shared_buffer_t * buffer = shared_buffer_init(data, 11, count_destroyed, &destroyed);
+
+  shared_buffer_slice_t slice = shared_buffer_slice(buffer, 6, 5);
+  ck_assert(slice.buffer == buffer);
+  ck_assert_uint_eq(6, slice.offset);
+  ck_assert_uint_eq(5, slice.length);
+  ck_assert(memcmp(shared_buffer_slice_data(&slice), "world", 5) == 0);
+
+  // slices are cut short at the end of the buffer
+  slice = shared_buffer_slice(buffer, 6, 100);
+  ck_assert_uint_eq(5, slice.length);
+
+  slice = shared_buffer_slice(buffer, 100, 1);
+  ck_assert_uint_eq(11, slice.offset);
+  ck_assert_uint_eq(0, slice.length);
+
+  // slices don't hold references
+  shared_buffer_release(buffer);
+  ck_assert_uint_eq(1, destroyed);
+}
+END_TEST
+
+Suite * shared_buffer_suite()
+{
+  Suite * s = suite_create("shared_buffer");
+
+  TCase * tc = tcase_create("shared_buffer");
+  tcase_add_checked_fixture(tc, setup, teardown);
+
+  tcase_add_test(tc, test_release_destroys);
+  tcase_add_test(tc, test_retained_until_last_release);
+  tcase_add_test(tc, test_default_destructor_frees);
+  tcase_add_test(tc, test_slice);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main()
+{
+  int number_failed;
+  Suite * s = shared_buffer_suite();
+  SRunner * sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,269 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <check.h>
+
+#include "timer_wheel.c"
+
+#define NUM_RANDOM_TIMERS 1000
+
+timer_wheel_t wheel;
+
+typedef struct {
+  timer_wheel_timer_t timer;
+  size_t calls;
+  uint64_t fired_at;
+  // re-added this many ticks out when it fires
+  uint64_t repeat;
+  // cancelled when this timer fires
+  timer_wheel_timer_t * cancel;
+} test_timer_t;
+
+static void test_timer_cb(timer_wheel_timer_t * timer)
+{
+  test_timer_t * t = timer->data;
+  t->calls++;
+  t->fired_at = wheel.now;
+
+  if (t->repeat) {
+    timer_wheel_add(&wheel, timer, t->repeat);
+  }
+
+  if (t->cancel) {
+    timer_wheel_cancel(&wheel, t->cancel);
+  }
+}
+
+static void test_timer_init(test_timer_t * t)
+{
+  timer_wheel_timer_init(&t->timer, test_timer_cb, t);
+  t->calls = 0;
+  t->fired_at = 0;
+  t->repeat = 0;
+  t->cancel = NULL;
+}
+
+void setup()
+{
+  timer_wheel_init(&wheel, 1000);
+}
+
+void teardown()
+{
+  timer_wheel_free(&wheel);
+}
+
+START_TEST(test_fires_when_expired)
+{
+  test_timer_t t;
+  test_timer_init(&t);
+
+  timer_wheel_add(&wheel, &t.timer, 5);
+  ck_assert(timer_wheel_timer_active(&t.timer));
+  ck_assert_uint_eq(1, wheel.count);
+
+  timer_wheel_advance(&wheel, 1004);
+  ck_assert_uint_eq(0, t.calls);
+
+  timer_wheel_advance(&wheel, 1005);
+  ck_assert_uint_eq(1, t.calls);
+  ck_assert_uint_eq(1005, t.fired_at);
+  ck_assert(!timer_wheel_timer_active(&t.timer));
+  ck_assert_uint_eq(0, wheel.count);
+}
+END_TEST
+
+START_TEST(test_zero_ticks_fires_on_next_tick)
+{
+  test_timer_t t;
+  test_timer_init(&t);
+
+  timer_wheel_add(&wheel, &t.timer, 0);
+  timer_wheel_advance(&wheel, 1000);
+  ck_assert_uint_eq(0, t.calls);
+
+  timer_wheel_advance(&wheel, 1001);
+  ck_assert_uint_eq(1, t.calls);
+}
+END_TEST
+
+START_TEST(test_cancel)
+{
+  test_timer_t t;
+  test_timer_init(&t);
+
+  timer_wheel_add(&wheel, &t.timer, 5);
+  timer_wheel_cancel(&wheel, &t.timer);
+  ck_assert(!timer_wheel_timer_active(&t.timer));
+  ck_assert_uint_eq(0, wheel.count);
+
+  // cancelling twice is harmless
+  timer_wheel_cancel(&wheel, &t.timer);
+
+  timer_wheel_advance(&wheel, 1100);
+  ck_assert_uint_eq(0, t.calls);
+}
+END_TEST
+
+START_TEST(test_add_again_moves_timer)
+{
+  test_timer_t t;
+  test_timer_init(&t);
+
+  timer_wheel_add(&wheel, &t.timer, 5);
+  timer_wheel_add(&wheel, &t.timer, 100);
+  ck_assert_uint_eq(1, wheel.count);
+
+  timer_wheel_advance(&wheel, 1099);
+  ck_assert_uint_eq(0, t.calls);
+
+  timer_wheel_advance(&wheel, 1100);
+  ck_assert_uint_eq(1, t.calls);
+  ck_assert_uint_eq(1100, t.fired_at);
+}
+END_TEST
+
+START_TEST(test_higher_levels)
+{
+  uint64_t ticks[] = { 63, 64, 65, 4095, 4096, 5000, 262143, 262144, 300000, TIMER_WHEEL_MAX_TICKS };
+  size_t num_timers = sizeof(ticks) / sizeof(ticks[0]);
+  test_timer_t t[num_timers];
+
+  for (size_t i = 0; i < num_timers; i++) {
+    test_timer_init(&t[i]);
+    timer_wheel_add(&wheel, &t[i].timer, ticks[i]);
+  }
+
+  timer_wheel_advance(&wheel, 1000 + TIMER_WHEEL_MAX_TICKS);
+
+  for (size_t i = 0; i < num_timers; i++) {
+    ck_assert_uint_eq(1, t[i].calls);
+    ck_assert_uint_eq(1000 + ticks[i], t[i].fired_at);
+  }
+}
+END_TEST
+
+START_TEST(test_beyond_range)
+{
+  test_timer_t t;
+  test_timer_init(&t);
+
+  uint64_t ticks = TIMER_WHEEL_MAX_TICKS + 1000;
+  timer_wheel_add(&wheel, &t.timer, ticks);
+
+  timer_wheel_advance(&wheel, 1000 + ticks - 1);
+  ck_assert_uint_eq(0, t.calls);
+
+  timer_wheel_advance(&wheel, 1000 + ticks);
+  ck_assert_uint_eq(1, t.calls);
+  ck_assert_uint_eq(1000 + ticks, t.fired_at);
+}
+END_TEST
+
+START_TEST(test_callback_adds_and_cancels)
+{
+  test_timer_t repeating;
+  test_timer_init(&repeating);
+  repeating.repeat = 10;
+
+  test_timer_t first;
+  test_timer_t second;
+  test_timer_init(&first);
+  test_timer_init(&second);
+  first.cancel = &second.timer;
+  second.cancel = &first.timer;
+
+  timer_wheel_add(&wheel, &repeating.timer, 10);
+  // both expire on the same tick - whichever fires first cancels the other
+  timer_wheel_add(&wheel, &first.timer, 20);
+  timer_wheel_add(&wheel, &second.timer, 20);
+
+  timer_wheel_advance(&wheel, 1100);
+
+  ck_assert_uint_eq(10, repeating.calls);
+  ck_assert_uint_eq(1100, repeating.fired_at);
+  ck_assert_uint_eq(1, first.calls + second.calls);
+  ck_assert_uint_eq(1, wheel.count);
+}
+END_TEST
+
+START_TEST(test_idle_wheel_skips_ahead)
+{
+  timer_wheel_advance(&wheel, 1000000000);
+  ck_assert_uint_eq(1000000000, wheel.now);
+
+  test_timer_t t;
+  test_timer_init(&t);
+  timer_wheel_add(&wheel, &t.timer, 1);
+  timer_wheel_advance(&wheel, 1000000001);
+  ck_assert_uint_eq(1, t.calls);
+}
+END_TEST
+
+START_TEST(test_random_timers)
+{
+  test_timer_t * t = malloc(sizeof(test_timer_t) * NUM_RANDOM_TIMERS);
+  uint64_t * expires = malloc(sizeof(uint64_t) * NUM_RANDOM_TIMERS);
+  srand(42);
+
+  uint64_t now = 1000;
+
+  for (size_t i = 0; i < NUM_RANDOM_TIMERS; i++) {
+    // advance in small random steps so timers are added from many positions
+    now += rand() % 50;
+    timer_wheel_advance(&wheel, now);
+
+    uint64_t ticks = 1 + rand() % 100000;
+    test_timer_init(&t[i]);
+    timer_wheel_add(&wheel, &t[i].timer, ticks);
+    expires[i] = now + ticks;
+  }
+
+  // advance in uneven steps
+  while (wheel.count > 0) {
+    now += 1 + rand() % 1000;
+    timer_wheel_advance(&wheel, now);
+  }
+
+  for (size_t i = 0; i < NUM_RANDOM_TIMERS; i++) {
+    ck_assert_uint_eq(1, t[i].calls);
+    ck_assert_uint_eq(expires[i], t[i].fired_at);
+  }
+
+  free(t);
+  free(expires);
+}
+END_TEST
+
+Suite * suite()
+{
+  Suite * s = suite_create("timer wheel");
+
+  TCase * tc = tcase_create("timer wheel");
+  tcase_add_checked_fixture(tc, setup, teardown);
+
+  tcase_add_test(tc, test_fires_when_expired);
+  tcase_add_test(tc, test_zero_ticks_fires_on_next_tick);
+  tcase_add_test(tc, test_cancel);
+  tcase_add_test(tc, test_add_again_moves_timer);
+  tcase_add_test(tc, test_higher_levels);
+  tcase_add_test(tc, test_beyond_range);
+  tcase_add_test(tc, test_callback_adds_and_cancels);
+  tcase_add_test(tc, test_idle_wheel_skips_ahead);
+  tcase_add_test(tc, test_random_timers);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main()
+{
+  Suite * s = suite();
+  SRunner * sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
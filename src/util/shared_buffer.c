@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "shared_buffer.h"
+
+shared_buffer_t * shared_buffer_init(uint8_t * data, size_t length, shared_buffer_destructor_cb destructor,
+                                     void * context)
+{
+  shared_buffer_t * buffer = malloc(sizeof(shared_buffer_t));
+  ASSERT_OR_RETURN_NULL(buffer);
+
+  buffer->data = data;
+  buffer->length = length;
+  buffer->destructor = destructor;
+  buffer->context = context;
+  buffer->refs = 1;
+
+  return buffer;
+}
+
+shared_buffer_t * shared_buffer_retain(shared_buffer_t * buffer)
+{
+  buffer->refs++;
+
+  return buffer;
+}
+
+void shared_buffer_release(shared_buffer_t * buffer)
+{
+  if (!buffer || --buffer->refs > 0) {
+    return;
+  }
+
+  if (buffer->destructor) {
+    buffer->destructor(buffer->context, buffer->data, buffer->length);
+  } else {
+    free(buffer->data);
+  }
+
+  free(buffer);
+}
+
+shared_buffer_slice_t shared_buffer_slice(shared_buffer_t * buffer, size_t offset, size_t length)
+{
+  shared_buffer_slice_t slice;
+
+  if (offset > buffer->length) {
+    offset = buffer->length;
+  }
+
+  if (length > buffer->length - offset) {
+    length = buffer->length - offset;
+  }
+
+  slice.buffer = buffer;
+  slice.offset = offset;
+  slice.length = length;
+
+  return slice;
+}
+
+uint8_t * shared_buffer_slice_data(const shared_buffer_slice_t * slice)
+{
+  return slice->buffer->data ? slice->buffer->data + slice->offset : NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef HTTP_SHARED_BUFFER_H
+#define HTTP_SHARED_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * An immutable, reference counted buffer. The same bytes (or slices of them)
+ * can be written on any number of streams without being copied - each write
+ * holds its own reference for as long as it needs the bytes, and the buffer
+ * is destroyed once the last reference is released.
+ *
+ * Buffers belong to one worker loop: references aren't taken or released
+ * from other threads, so the count isn't atomic.
+ */
+typedef void (*shared_buffer_destructor_cb)(void * context, uint8_t * data, size_t length);
+
+typedef struct {
+
+  // not modified once the buffer has been created
+  uint8_t * data;
+  size_t length;
+
+  size_t refs;
+
+  shared_buffer_destructor_cb destructor;
+  void * context;
+
+} shared_buffer_t;
+
+/**
+ * Part of a buffer. A slice doesn't hold a reference of its own.
+ */
+typedef struct {
+
+  shared_buffer_t * buffer;
+  size_t offset;
+  size_t length;
+
+} shared_buffer_slice_t;
+
+/**
+ * Takes ownership of data, which is passed to the destructor once the last
+ * reference is released - or free'd if there is no destructor. The caller
+ * holds the first reference.
+ */
+shared_buffer_t * shared_buffer_init(uint8_t * data, size_t length, shared_buffer_destructor_cb destructor,
+                                     void * context);
+
+shared_buffer_t * shared_buffer_retain(shared_buffer_t * buffer);
+
+void shared_buffer_release(shared_buffer_t * buffer);
+
+/**
+ * A slice of up to length octets from offset, cut short at the end of the
+ * buffer
+ */
+shared_buffer_slice_t shared_buffer_slice(shared_buffer_t * buffer, size_t offset, size_t length);
+
+uint8_t * shared_buffer_slice_data(const shared_buffer_slice_t * slice);
+
+#endif
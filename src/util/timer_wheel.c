@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static void timer_wheel_link_init(timer_wheel_link_t * head)
+{
+  head->prev = head;
+  head->next = head;
+}
+
+static void timer_wheel_link_append(timer_wheel_link_t * head, timer_wheel_link_t * link)
+{
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+static void timer_wheel_link_remove(timer_wheel_link_t * link)
+{
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->prev = NULL;
+  link->next = NULL;
+}
+
+/**
+ * Moves everything in the given slot to the (empty) list dest
+ */
+static void timer_wheel_link_take(timer_wheel_link_t * slot, timer_wheel_link_t * dest)
+{
+  if (slot->next == slot) {
+    timer_wheel_link_init(dest);
+    return;
+  }
+
+  dest->next = slot->next;
+  dest->prev = slot->prev;
+  dest->next->prev = dest;
+  dest->prev->next = dest;
+
+  timer_wheel_link_init(slot);
+}
+
+timer_wheel_t * timer_wheel_init(timer_wheel_t * wheel, uint64_t now)
+{
+  if (!wheel) {
+    wheel = malloc(sizeof(timer_wheel_t));
+    ASSERT_OR_RETURN_NULL(wheel);
+  }
+
+  wheel->now = now;
+  wheel->count = 0;
+
+  for (size_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      timer_wheel_link_init(&wheel->slots[level][slot]);
+    }
+  }
+
+  return wheel;
+}
+
+void timer_wheel_timer_init(timer_wheel_timer_t * timer, timer_wheel_cb cb, void * data)
+{
+  timer->link.prev = NULL;
+  timer->link.next = NULL;
+  timer->expires = 0;
+  timer->cb = cb;
+  timer->data = data;
+}
+
+bool timer_wheel_timer_active(const timer_wheel_timer_t * const timer)
+{
+  return timer->link.next != NULL;
+}
+
+/**
+ * Puts the timer in the slot for its expiry relative to the next tick that
+ * will be processed
+ */
+static void timer_wheel_insert(timer_wheel_t * wheel, timer_wheel_timer_t * timer)
+{
+  uint64_t base = wheel->now + 1;
+  uint64_t expires = timer->expires > base ? timer->expires : base;
+  uint64_t delta = expires - base;
+
+  if (delta > TIMER_WHEEL_MAX_TICKS) {
+    delta = TIMER_WHEEL_MAX_TICKS;
+    expires = base + delta;
+  }
+
+  size_t level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+
+  size_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+  timer_wheel_link_append(&wheel->slots[level][slot], &timer->link);
+}
+
+void timer_wheel_add(timer_wheel_t * wheel, timer_wheel_timer_t * timer, uint64_t ticks)
+{
+  if (timer_wheel_timer_active(timer)) {
+    timer_wheel_link_remove(&timer->link);
+  } else {
+    wheel->count++;
+  }
+
+  timer->expires = wheel->now + (ticks > 0 ? ticks : 1);
+  timer_wheel_insert(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t * wheel, timer_wheel_timer_t * timer)
+{
+  if (timer_wheel_timer_active(timer)) {
+    timer_wheel_link_remove(&timer->link);
+    wheel->count--;
+  }
+}
+
+/**
+ * Re-inserts the timers of a higher level slot - they end up in lower levels
+ * now that their expiry is closer
+ */
+static size_t timer_wheel_cascade(timer_wheel_t * wheel, size_t level, uint64_t tick)
+{
+  size_t slot = (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+  timer_wheel_link_t list;
+  timer_wheel_link_take(&wheel->slots[level][slot], &list);
+
+  while (list.next != &list) {
+    timer_wheel_link_t * link = list.next;
+    timer_wheel_link_remove(link);
+    timer_wheel_insert(wheel, (timer_wheel_timer_t *) link);
+  }
+
+  return slot;
+}
+
+void timer_wheel_advance(timer_wheel_t * wheel, uint64_t now)
+{
+  if (wheel->count == 0 && now > wheel->now) {
+    // nothing to expire - skip straight to now
+    wheel->now = now;
+    return;
+  }
+
+  while (wheel->now < now) {
+    uint64_t tick = wheel->now + 1;
+
+    // cascading happens relative to the tick that is about to be processed
+    if ((tick & TIMER_WHEEL_MASK) == 0) {
+      for (size_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (timer_wheel_cascade(wheel, level, tick) != 0) {
+          break;
+        }
+      }
+    }
+
+    wheel->now = tick;
+
+    timer_wheel_link_t expired;
+    timer_wheel_link_take(&wheel->slots[0][tick & TIMER_WHEEL_MASK], &expired);
+
+    while (expired.next != &expired) {
+      timer_wheel_timer_t * timer = (timer_wheel_timer_t *) expired.next;
+      timer_wheel_link_remove(&timer->link);
+
+      if (timer->expires > tick) {
+        // it was further out than the wheel reaches
+        timer_wheel_insert(wheel, timer);
+        continue;
+      }
+
+      wheel->count--;
+
+      timer->cb(timer);
+    }
+
+    if (wheel->count == 0) {
+      wheel->now = now;
+    }
+  }
+}
+
+void timer_wheel_free(timer_wheel_t * wheel)
+{
+  for (size_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      timer_wheel_link_t * head = &wheel->slots[level][slot];
+
+      while (head->next != head) {
+        timer_wheel_link_remove(head->next);
+      }
+    }
+  }
+
+  wheel->count = 0;
+}
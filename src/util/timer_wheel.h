@@ -0,0 +1,89 @@
+#ifndef HTTP_TIMER_WHEEL_H
+#define HTTP_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * A hierarchical timer wheel. Time is measured in ticks - the owner decides
+ * how long a tick is and calls timer_wheel_advance as time passes.
+ *
+ * Each level has TIMER_WHEEL_SLOTS slots and covers TIMER_WHEEL_SLOTS times
+ * the span of the level below it. Timers are moved down a level as their
+ * expiry gets closer. Adding, re-adding and cancelling a timer are all O(1).
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+// timers further out than this are expired this far out and re-added
+#define TIMER_WHEEL_MAX_TICKS ((1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef struct timer_wheel_timer_s timer_wheel_timer_t;
+
+typedef void (*timer_wheel_cb)(timer_wheel_timer_t * timer);
+
+/**
+ * Slots are circular lists so a timer can be unlinked without knowing which
+ * slot it is in
+ */
+typedef struct timer_wheel_link_s {
+
+  struct timer_wheel_link_s * prev;
+  struct timer_wheel_link_s * next;
+
+} timer_wheel_link_t;
+
+struct timer_wheel_timer_s {
+
+  timer_wheel_link_t link;
+
+  uint64_t expires;
+
+  timer_wheel_cb cb;
+
+  void * data;
+
+};
+
+typedef struct {
+
+  // the last tick that has been processed
+  uint64_t now;
+
+  timer_wheel_link_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+  // the number of timers that are waiting to expire
+  size_t count;
+
+} timer_wheel_t;
+
+timer_wheel_t * timer_wheel_init(timer_wheel_t * wheel, uint64_t now);
+
+void timer_wheel_timer_init(timer_wheel_timer_t * timer, timer_wheel_cb cb, void * data);
+
+bool timer_wheel_timer_active(const timer_wheel_timer_t * const timer);
+
+/**
+ * Starts the timer so that it expires the given number of ticks from now
+ * (at least 1). If the timer was already running it is moved.
+ */
+void timer_wheel_add(timer_wheel_t * wheel, timer_wheel_timer_t * timer, uint64_t ticks);
+
+/**
+ * Stops the timer. Does nothing if the timer isn't running.
+ */
+void timer_wheel_cancel(timer_wheel_t * wheel, timer_wheel_timer_t * timer);
+
+/**
+ * Processes every tick up to and including now, calling the callbacks of the
+ * timers that expire. Callbacks may add or cancel any timer.
+ */
+void timer_wheel_advance(timer_wheel_t * wheel, uint64_t now);
+
+/**
+ * Cancels any remaining timers without calling them.
+ */
+void timer_wheel_free(timer_wheel_t * wheel);
+
+#endif
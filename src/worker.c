@@ -5,8 +5,17 @@
 #include <string.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <inttypes.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #include <uv.h>
 
@@ -18,6 +27,8 @@
 #include "worker.h"
 #include "client.h"
 
+#define LISTEN_BACKLOG 128
+
 static void worker_sigpipe_handler(uv_signal_t * sigpipe_handler, int signum)
 {
   struct worker_t * worker = sigpipe_handler->data;
@@ -40,9 +51,17 @@ static void worker_sigterm_handler(uv_signal_t * sigterm_handler, int signum)
 
 static void worker_stop_continue(struct worker_t * worker)
 {
-  if (!worker->active_queue && worker->active_handlers < 1 && worker->open_clients == NULL) {
+  if (!worker->active_queue && worker->active_handlers < 1 && worker->active_listeners < 1 &&
+      !worker->active_load_report_timer && !worker->active_memory_check_timer &&
+      !worker->active_timer_tick && !worker->active_ocsp_reload_timer && worker->open_clients == NULL) {
     log_append(worker->log, LOG_TRACE, "Closed worker handles...");
 
+    if (worker->active_write_flush) {
+      uv_close((uv_handle_t *) &worker->write_check, NULL);
+      uv_close((uv_handle_t *) &worker->write_prepare, NULL);
+      worker->active_write_flush = false;
+    }
+
     struct plugin_list_t * current = worker->plugins;
     while (current) {
       plugin_stop(current->plugin);
@@ -69,6 +88,113 @@ static void worker_queue_closed(uv_handle_t * handle)
   worker_stop_continue(worker);
 }
 
+static void worker_listener_closed(uv_handle_t * handle)
+{
+  struct worker_listener_t * listener = handle->data;
+  struct worker_t * worker = listener->worker;
+
+  worker->active_listeners--;
+
+  worker_stop_continue(worker);
+}
+
+static void worker_load_report_timer_closed(uv_handle_t * handle)
+{
+  struct worker_t * worker = handle->data;
+
+  worker->active_load_report_timer = false;
+
+  worker_stop_continue(worker);
+}
+
+static void worker_memory_check_timer_closed(uv_handle_t * handle)
+{
+  struct worker_t * worker = handle->data;
+
+  worker->active_memory_check_timer = false;
+
+  worker_stop_continue(worker);
+}
+
+static void worker_ocsp_reload_timer_closed(uv_handle_t * handle)
+{
+  struct worker_t * worker = handle->data;
+
+  worker->active_ocsp_reload_timer = false;
+
+  worker_stop_continue(worker);
+}
+
+static void worker_timer_tick_closed(uv_handle_t * handle)
+{
+  struct worker_t * worker = handle->data;
+
+  worker->active_timer_tick = false;
+
+  worker_stop_continue(worker);
+}
+
+static void worker_timer_tick(uv_timer_t * timer)
+{
+  struct worker_t * worker = timer->data;
+
+  timer_wheel_advance(&worker->timers, uv_now(&worker->loop) / WORKER_TIMER_TICK);
+}
+
+static uint64_t worker_ticks(uint64_t ms)
+{
+  return (ms + WORKER_TIMER_TICK - 1) / WORKER_TIMER_TICK;
+}
+
+static void worker_load_report_written(uv_write_t * req, int status)
+{
+  struct worker_t * worker = req->data;
+
+  if (status) {
+    log_append(worker->log, LOG_WARN, "Error reporting load to server: %s", uv_err_name(status));
+  }
+
+  worker->load_report_pending = false;
+}
+
+static void worker_report_load(uv_timer_t * timer)
+{
+  struct worker_t * worker = timer->data;
+
+  uint64_t now = uv_now(&worker->loop);
+  uint64_t lag = now > worker->load_report_due ? now - worker->load_report_due : 0;
+  worker->load_report_due = now + WORKER_LOAD_REPORT_INTERVAL;
+
+  // don't queue up reports if the server isn't reading them
+  if (worker->load_report_pending || !worker->active_queue || worker->stopping) {
+    return;
+  }
+
+  struct worker_load_report_t * report = &worker->load_report;
+  report->open_clients = 0;
+  report->pending_writes = 0;
+  report->active_streams = 0;
+  report->loop_lag = lag;
+
+  struct client_t * client = worker->open_clients;
+  while (client) {
+    report->open_clients++;
+    report->pending_writes += client->pending_writes;
+    report->active_streams += http_connection_active_streams(client->connection);
+    client = client->next;
+  }
+
+  uv_buf_t buf = uv_buf_init((char *) report, sizeof(struct worker_load_report_t));
+  worker->load_report_req.data = worker;
+  int r = uv_write(&worker->load_report_req, (uv_stream_t *) &worker->queue, &buf, 1,
+                   worker_load_report_written);
+  if (r < 0) {
+    log_append(worker->log, LOG_WARN, "Failed to report load to server: %s", uv_err_name(r));
+  } else {
+    worker->load_report_pending = true;
+  }
+}
+
 static void alloc_pipe_read_buffer(uv_handle_t * handle, size_t suggested_size, uv_buf_t * buf)
 {
   UNUSED(handle);
@@ -79,44 +205,627 @@ static void alloc_pipe_read_buffer(uv_handle_t * handle, size_t suggested_size,
 
 static void alloc_buffer(uv_handle_t * handle, size_t suggested_size, uv_buf_t * buf)
 {
-  UNUSED(handle);
+  UNUSED(suggested_size);
 
-  buf->base = malloc(suggested_size);
-  buf->len = suggested_size;
+  struct client_t * client = handle->data;
+  buffer_pool_t * pool = &client->worker->read_buffers;
+
+  buf->base = (char *) buffer_pool_get(pool);
+  buf->len = buf->base ? pool->buffer_size : 0;
 }
 
-static void app_write_finished(uv_write_t * req, int status)
+static struct worker_write_t * worker_write_get(struct worker_t * worker, struct client_t * client)
 {
-  struct client_t * client = req->data;
-  struct worker_t * worker = client->worker;
+  struct worker_write_t * write = worker->idle_writes;
 
-  if (status) {
-    log_append(worker->log, LOG_ERROR, "Write error: %s", uv_err_name(status));
+  if (write) {
+    worker->idle_writes = write->next;
+    worker->idle_write_count--;
   } else {
-    log_append(worker->log, LOG_TRACE, "Write finished: #%zu", client->id);
+    write = malloc(sizeof(struct worker_write_t));
+    if (!write) {
+      return NULL;
+    }
+    write->bufs = NULL;
+    write->refs = NULL;
+    write->buf_capacity = 0;
+  }
+
+  write->req.data = write;
+  write->client = client;
+  write->buf_count = 0;
+  write->length = 0;
+  write->file_fd = -1;
+  write->file_offset = 0;
+  write->file_length = 0;
+  write->file_ref.release = NULL;
+  write->file_ref.release_data = NULL;
+  write->file_poll = NULL;
+  write->next = NULL;
+
+  return write;
+}
+
+static void worker_file_poll_closed(uv_handle_t * handle)
+{
+  struct worker_file_poll_t * file_poll = handle->data;
+
+  close(file_poll->fd);
+  free(file_poll);
+}
+
+static void worker_write_release(struct worker_t * worker, struct worker_write_t * write)
+{
+  buffer_pool_t * chunks = &worker->write_chunks;
+
+  if (write->file_ref.release) {
+    write->file_ref.release(write->file_ref.release_data);
+    write->file_ref.release = NULL;
   }
 
+  if (write->file_poll) {
+    uv_close((uv_handle_t *) &write->file_poll->poll, worker_file_poll_closed);
+    write->file_poll = NULL;
+  }
+
+  for (size_t i = 0; i < write->buf_count; i++) {
+    uv_buf_t * buf = &write->bufs[i];
+    struct worker_write_ref_t * ref = &write->refs[i];
+
+    if (ref->release) {
+      ref->release(ref->release_data);
+    } else if (buf->len <= chunks->buffer_size) {
+      // anything that fit in a chunk came from the pool
+      buffer_pool_put(chunks, (uint8_t *) buf->base);
+    } else {
+      free(buf->base);
+    }
+  }
+  write->buf_count = 0;
+
+  if (worker->idle_write_count < WORKER_WRITE_REQ_MAX_IDLE) {
+    write->next = worker->idle_writes;
+    worker->idle_writes = write;
+    worker->idle_write_count++;
+  } else {
+    free(write->bufs);
+    free(write->refs);
+    free(write);
+  }
+}
+
+/**
+ * The output that hasn't been handed to libuv yet, including any that is
+ * waiting for a file to be sent
+ */
+static size_t worker_unsent_length(struct client_t * client)
+{
+  size_t length = client->queued_write ? client->queued_write->length : 0;
+
+  for (struct worker_write_t * write = client->held_writes; write; write = write->next) {
+    length += write->length;
+  }
+
+  return length;
+}
+
+/**
+ * Pauses or resumes data production for the client based on how much of its
+ * output is still waiting to be sent
+ */
+static void worker_update_write_pressure(struct client_t * client)
+{
+  size_t outstanding = uv_stream_get_write_queue_size((uv_stream_t *) &client->tcp) +
+                       worker_unsent_length(client);
+
+  if (!client->write_paused && outstanding > WORKER_WRITE_HIGH_WATERMARK) {
+    log_append(client->log, LOG_DEBUG, "Pausing writes for client #%zu: %zu octets outstanding",
+        client->id, outstanding);
+    client->write_paused = true;
+    http_connection_set_write_blocked(client->connection, true);
+    plugin_invoke(client->plugin_invoker, HANDLE_WRITE_PAUSE);
+  } else if (client->write_paused && outstanding <= WORKER_WRITE_LOW_WATERMARK &&
+             !uv_is_closing((uv_handle_t *) &client->tcp)) {
+    log_append(client->log, LOG_DEBUG, "Resuming writes for client #%zu: %zu octets outstanding",
+        client->id, outstanding);
+    client->write_paused = false;
+    http_connection_set_write_blocked(client->connection, false);
+    if (!client->memory_limited) {
+      plugin_invoke(client->plugin_invoker, HANDLE_WRITE_RESUME);
+    }
+  }
+}
+
+static void worker_update_memory_pressure(struct client_t * client);
+
+static void worker_update_timeouts(struct client_t * client);
+
+static void worker_enable_file_writes(struct client_t * client);
+
+/**
+ * Moves the client to kernel TLS once all of the data encrypted by OpenSSL
+ * has been written to the socket
+ */
+static void worker_try_ktls(struct client_t * client)
+{
+  tls_client_ctx_t * tls_ctx = client->tls_ctx;
+
+  if (!tls_ctx || tls_ctx->ktls_attempted || !tls_ctx->handshake_complete || client->pending_writes > 0 ||
+      uv_is_closing((uv_handle_t *) &client->tcp)) {
+    return;
+  }
+
+  uv_os_fd_t fd;
+  if (uv_fileno((uv_handle_t *) &client->tcp, &fd) == 0 && tls_client_enable_ktls(tls_ctx, fd)) {
+    worker_enable_file_writes(client);
+  }
+}
+
+static void worker_close(struct client_t * client);
+
+/**
+ * A handshake step that ran on the thread pool has finished and its output
+ * has been passed on
+ */
+static void worker_tls_handshake_finished(void * data, bool success)
+{
+  struct client_t * client = data;
+
+  if (!success) {
+    worker_close(client);
+    return;
+  }
+
+  worker_update_memory_pressure(client);
+  worker_update_timeouts(client);
+  worker_try_ktls(client);
+}
+
+/**
+ * Accounts for a write that has finished - or that had nothing to send
+ */
+static void worker_write_done(struct client_t * client)
+{
+  // resuming may queue more output, so do it before checking whether all
+  // writes have finished
   client->pending_writes--;
+  worker_update_write_pressure(client);
+  worker_update_memory_pressure(client);
+  worker_update_timeouts(client);
+
   if (client->pending_writes == 0) {
+    worker_try_ktls(client);
+
     http_connection_t * connection = client->connection;
     http_finished_writes(connection);
   }
+}
+
+static void worker_send_write(struct worker_t * worker, struct worker_write_t * write);
+
+static void worker_shutdown(struct client_t * client);
+
+/**
+ * The client's file has been sent (or given up on), so the writes held back
+ * behind it can go
+ */
+static void worker_file_write_done(struct client_t * client)
+{
+  client->file_write = NULL;
+
+  while (client->held_writes && !client->file_write) {
+    struct worker_write_t * write = client->held_writes;
+    client->held_writes = write->next;
+    write->next = NULL;
+
+    worker_send_write(client->worker, write);
+  }
+
+  if (client->shutdown_deferred && !client->file_write && !uv_is_closing((uv_handle_t *) &client->tcp)) {
+    client->shutdown_deferred = false;
+    worker_shutdown(client);
+  }
+}
+
+static void worker_write_complete(struct worker_write_t * write, int status)
+{
+  struct client_t * client = write->client;
+  struct worker_t * worker = client->worker;
+  bool file = write == client->file_write;
+
+  if (status) {
+    log_append(worker->log, LOG_ERROR, "Write error: %s", uv_err_name(status));
+  } else {
+    log_append(worker->log, LOG_TRACE, "Write finished: #%zu (%zu octets in %zu buffers)",
+        client->id, write->length, write->buf_count);
+  }
+
+  worker_write_release(worker, write);
+
+  if (file) {
+    worker_file_write_done(client);
+  }
+
+  worker_write_done(client);
+}
+
+static void worker_send_file(struct worker_write_t * write);
+
+static void worker_file_writable(uv_poll_t * handle, int status, int events)
+{
+  UNUSED(events);
+
+  struct worker_file_poll_t * file_poll = handle->data;
+
+  if (status < 0) {
+    worker_write_complete(file_poll->write, status);
+  } else {
+    worker_send_file(file_poll->write);
+  }
+}
+
+/**
+ * Calls worker_send_file whenever the client's socket has room for more of
+ * the file
+ */
+static int worker_file_poll_start(struct worker_write_t * write)
+{
+  if (write->file_poll) {
+    return 0;
+  }
+
+  uv_os_fd_t socket;
+  int r = uv_fileno((uv_handle_t *) &write->client->tcp, &socket);
+  if (r < 0) {
+    return r;
+  }
+
+  struct worker_file_poll_t * file_poll = malloc(sizeof(struct worker_file_poll_t));
+  if (!file_poll) {
+    return UV_ENOMEM;
+  }
+
+  file_poll->fd = dup(socket);
+  if (file_poll->fd < 0) {
+    free(file_poll);
+    return uv_translate_sys_error(errno);
+  }
+
+  r = uv_poll_init_socket(&write->client->worker->loop, &file_poll->poll, file_poll->fd);
+  if (r < 0) {
+    close(file_poll->fd);
+    free(file_poll);
+    return r;
+  }
+
+  file_poll->poll.data = file_poll;
+  file_poll->write = write;
+  write->file_poll = file_poll;
+
+  return uv_poll_start(&file_poll->poll, UV_WRITABLE, worker_file_writable);
+}
+
+/**
+ * Sends the next chunk of the write's file. The file goes from the page cache
+ * to the socket (and through kernel TLS) without being copied into the
+ * worker, but reading a file that isn't cached blocks the loop.
+ */
+static void worker_send_file(struct worker_write_t * write)
+{
+  int r = 0;
+
+#ifdef HAVE_SENDFILE
+  uv_os_fd_t socket;
+  r = uv_fileno((uv_handle_t *) &write->client->tcp, &socket);
+
+  if (r == 0) {
+    off_t offset = write->file_offset;
+    size_t length = write->file_length < WORKER_SENDFILE_CHUNK_SIZE ? write->file_length : WORKER_SENDFILE_CHUNK_SIZE;
+    ssize_t sent;
+
+    do {
+      sent = sendfile(socket, write->file_fd, &offset, length);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent > 0) {
+      write->file_offset = offset;
+      write->file_length -= sent;
+    } else if (sent == 0) {
+      // the file has been truncated since the response started
+      r = UV_EOF;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      r = uv_translate_sys_error(errno);
+    }
+  }
+#else
+  r = UV_ENOSYS;
+#endif
+
+  if (r == 0 && write->file_length > 0) {
+    r = worker_file_poll_start(write);
+
+    if (r == 0) {
+      return;
+    }
+  }
 
-  free(req);
+  worker_write_complete(write, r);
 }
 
+static void worker_write_finished(uv_write_t * req, int status)
+{
+  struct worker_write_t * write = req->data;
+
+  if (status == 0 && write == write->client->file_write) {
+    // the buffers ahead of the file have been written
+    worker_send_file(write);
+  } else {
+    worker_write_complete(write, status);
+  }
+}
+
+/**
+ * Hands the write to libuv - or holds on to it until the file being sent
+ * ahead of it has been
+ */
+static void worker_send_write(struct worker_t * worker, struct worker_write_t * write)
+{
+  struct client_t * client = write->client;
+
+  if (client->file_write) {
+    struct worker_write_t ** tail = &client->held_writes;
+    while (*tail) {
+      tail = &(*tail)->next;
+    }
+    *tail = write;
+    return;
+  }
+
+  bool file = write->file_ref.release != NULL;
+
+  if (write->buf_count == 0 && !file) {
+    // e.g. the output is held until the handshake is complete
+    worker_write_release(worker, write);
+    worker_write_done(client);
+    return;
+  }
+
+  if (uv_is_closing((uv_handle_t *) &client->tcp)) {
+    log_append(worker->log, LOG_DEBUG, "Dropping %zu octets for closing client #%zu",
+        write->length + write->file_length, client->id);
+    worker_write_release(worker, write);
+    client->pending_writes--;
+    return;
+  }
+
+  if (file) {
+    client->file_write = write;
+
+    if (write->buf_count == 0) {
+      worker_send_file(write);
+      return;
+    }
+  }
+
+  int r = uv_write(&write->req, (uv_stream_t *) &client->tcp, write->bufs, write->buf_count,
+                   worker_write_finished);
+  if (r < 0) {
+    log_append(worker->log, LOG_ERROR, "Write client #%zu (%zu octets) failed: %s",
+        client->id, write->length, uv_err_name(r));
+    client->file_write = NULL;
+    worker_write_release(worker, write);
+    client->pending_writes--;
+    return;
+  }
+
+  worker->writes_submitted++;
+  worker->write_buffers_submitted += write->buf_count;
+}
+
+static void worker_submit_write(struct worker_t * worker, struct worker_write_t * write)
+{
+  struct client_t * client = write->client;
+
+  // everything the app wrote this iteration is encrypted together - the
+  // records are added to this write
+  bool encrypted = !client->tls_ctx || tls_client_flush(client->tls_ctx);
+
+  client->queued_write = NULL;
+
+  if (!encrypted) {
+    // the plaintext that couldn't be encrypted is lost, so the stream can't
+    // carry on
+    log_append(worker->log, LOG_ERROR, "Unable to encrypt output for client #%zu", client->id);
+    worker_write_release(worker, write);
+    client->pending_writes--;
+    worker_close(client);
+    return;
+  }
+
+  worker_send_write(worker, write);
+}
+
+static void worker_unqueue_write(struct worker_t * worker, struct worker_write_t * write)
+{
+  struct worker_write_t ** curr = &worker->queued_writes;
+  while (*curr && *curr != write) {
+    curr = &(*curr)->next;
+  }
+
+  if (*curr) {
+    *curr = write->next;
+  }
+  write->next = NULL;
+}
+
+static void worker_flush_writes(struct worker_t * worker)
+{
+  while (worker->queued_writes) {
+    struct worker_write_t * write = worker->queued_writes;
+    worker->queued_writes = write->next;
+    write->next = NULL;
+
+    worker_submit_write(worker, write);
+  }
+}
+
+/**
+ * Sends a client's queued output right away instead of waiting for the end
+ * of the loop iteration
+ */
+static void worker_flush_client(struct client_t * client)
+{
+  struct worker_write_t * write = client->queued_write;
+
+  if (write) {
+    worker_unqueue_write(client->worker, write);
+    worker_submit_write(client->worker, write);
+  }
+}
+
+static void worker_write_check(uv_check_t * handle)
+{
+  worker_flush_writes(handle->data);
+}
+
+static void worker_write_prepare(uv_prepare_t * handle)
+{
+  worker_flush_writes(handle->data);
+}
+
+/**
+ * The client's write that is submitted at the end of the current loop
+ * iteration
+ */
+static struct worker_write_t * worker_queued_write(struct client_t * client)
+{
+  struct worker_t * worker = client->worker;
+  struct worker_write_t * write = client->queued_write;
+
+  if (!write) {
+    write = worker_write_get(worker, client);
+    if (!write) {
+      log_append(worker->log, LOG_ERROR, "Unable to allocate write for client #%zu", client->id);
+      return NULL;
+    }
+
+    client->queued_write = write;
+    write->next = worker->queued_writes;
+    worker->queued_writes = write;
+    client->pending_writes++;
+  }
+
+  return write;
+}
+
+/**
+ * Makes room for one more buffer in the write
+ */
+static bool worker_write_reserve(struct worker_write_t * write)
+{
+  if (write->buf_count < write->buf_capacity) {
+    return true;
+  }
+
+  size_t new_capacity = write->buf_capacity ? write->buf_capacity * 2 : 8;
+
+  uv_buf_t * bufs = realloc(write->bufs, sizeof(uv_buf_t) * new_capacity);
+  ASSERT_OR_RETURN_FALSE(bufs);
+  write->bufs = bufs;
+
+  struct worker_write_ref_t * refs = realloc(write->refs, sizeof(struct worker_write_ref_t) * new_capacity);
+  ASSERT_OR_RETURN_FALSE(refs);
+  write->refs = refs;
+
+  write->buf_capacity = new_capacity;
+
+  return true;
+}
+
+/**
+ * Queues the given data to be written to the client at the end of the
+ * current loop iteration. The data is copied so the caller keeps ownership
+ * of the buffer.
+ */
 static bool worker_write_to_network(void * data, uint8_t * buffer, size_t length)
 {
   struct client_t * client = data;
-  client->pending_writes++;
+  struct worker_t * worker = client->worker;
 
-  uv_write_t * req = (uv_write_t *) malloc(sizeof(uv_write_t));
-  uv_buf_t wrbuf = uv_buf_init((char *) buffer, length);
-  req->data = client;
-  int r = uv_write(req, (uv_stream_t *) &client->tcp, &wrbuf, 1, app_write_finished);
-  if (r < 0) {
-    log_append(client->worker->log, LOG_ERROR, "Write client #%zu (%zu octets) failed: %s",
-        client->id, length, uv_err_name(r));
+  if (length == 0) {
+    return true;
+  }
+
+  struct worker_write_t * write = worker_queued_write(client);
+  ASSERT_OR_RETURN_FALSE(write);
+
+  buffer_pool_t * chunks = &worker->write_chunks;
+  uv_buf_t * tail = write->buf_count > 0 ? &write->bufs[write->buf_count - 1] : NULL;
+
+  // buffers passed in by reference aren't the worker's to append to
+  if (tail && !write->refs[write->buf_count - 1].release && tail->len + length <= chunks->buffer_size) {
+    // coalesce with the previous small write
+    memcpy(tail->base + tail->len, buffer, length);
+    tail->len += length;
+  } else {
+    if (!worker_write_reserve(write)) {
+      log_append(worker->log, LOG_ERROR, "Unable to queue write for client #%zu", client->id);
+      return false;
+    }
+
+    char * base;
+    if (length <= chunks->buffer_size) {
+      base = (char *) buffer_pool_get(chunks);
+    } else {
+      base = malloc(length);
+    }
+
+    if (!base) {
+      log_append(worker->log, LOG_ERROR, "Unable to queue write for client #%zu", client->id);
+      return false;
+    }
+
+    memcpy(base, buffer, length);
+    write->refs[write->buf_count].release = NULL;
+    write->refs[write->buf_count].release_data = NULL;
+    write->bufs[write->buf_count++] = uv_buf_init(base, length);
+  }
+
+  write->length += length;
+
+  if (!client->write_paused) {
+    worker_update_write_pressure(client);
+  }
+
+  return true;
+}
+
+/**
+ * Queues the given data to be written to the client at the end of the
+ * current loop iteration without copying it. The buffer is released once
+ * the write has finished, or right away if it can't be queued.
+ */
+static bool worker_write_ref_to_network(struct client_t * client, uint8_t * buffer, size_t length,
+                                        release_cb release, void * release_data)
+{
+  struct worker_t * worker = client->worker;
+
+  struct worker_write_t * write = worker_queued_write(client);
+
+  if (!write || !worker_write_reserve(write)) {
+    log_append(worker->log, LOG_ERROR, "Unable to queue write for client #%zu", client->id);
+    release(release_data);
+    return false;
+  }
+
+  write->refs[write->buf_count].release = release;
+  write->refs[write->buf_count].release_data = release_data;
+  write->bufs[write->buf_count++] = uv_buf_init((char *) buffer, length);
+  write->length += length;
+  worker->write_buffers_referenced++;
+
+  if (!client->write_paused) {
+    worker_update_write_pressure(client);
   }
 
   return true;
@@ -133,16 +842,96 @@ static bool app_write_cb(void * data, uint8_t * buffer, size_t length)
     log_buffer(client->data_log, LOG_TRACE, buffer, length);
   }
 
-  if (client->tls_ctx) {
+  if (length == 0) {
+    return true;
+  }
+
+  if (client->tls_ctx && !client->tls_ctx->ktls_tx) {
+    // the data is encrypted when the queued write is submitted
+    ASSERT_OR_RETURN_FALSE(worker_queued_write(client));
+
     log_append(worker->log, LOG_TRACE, "Passing %zu octets of data from application to TLS handler", length);
-    bool ret = tls_encrypt_data_and_pass_to_network(client->tls_ctx, buffer, length);
-    log_append(worker->log, LOG_TRACE, "Passed %zu octets of data from application to TLS handler", length);
-    return ret;
+    return tls_client_write(client->tls_ctx, buffer, length);
   } else {
     return worker_write_to_network(client, buffer, length);
   }
 }
 
+static bool app_write_ref_cb(void * data, uint8_t * buffer, size_t length, release_cb release,
+                             void * release_data)
+{
+  struct client_t * client = data;
+
+  if (length == 0 || (client->tls_ctx && !client->tls_ctx->ktls_tx)) {
+    // encrypting the data copies it
+    bool success = app_write_cb(data, buffer, length);
+    release(release_data);
+    return success;
+  }
+
+  log_append(client->worker->log, LOG_DEBUG, "Write client #%zu (%zu octets, by reference)", client->id, length);
+  if (log_enabled(client->data_log)) {
+    log_append(client->data_log, LOG_TRACE, "Writing data: (%zd octets)", length);
+    log_buffer(client->data_log, LOG_TRACE, buffer, length);
+  }
+
+  return worker_write_ref_to_network(client, buffer, length, release, release_data);
+}
+
+#ifdef HAVE_SENDFILE
+/**
+ * Queues a file to be sent once everything written before it has been. The
+ * file is released once it has been sent, or right away if it can't be
+ * queued.
+ */
+static bool app_write_file_cb(void * data, int fd, int64_t offset, size_t length, release_cb release,
+                              void * release_data)
+{
+  struct client_t * client = data;
+
+  log_append(client->worker->log, LOG_DEBUG, "Write client #%zu (%zu octets from fd %d)", client->id, length, fd);
+
+  if (length == 0) {
+    release(release_data);
+    return true;
+  }
+
+  struct worker_write_t * write = worker_queued_write(client);
+
+  if (!write) {
+    release(release_data);
+    return false;
+  }
+
+  write->file_fd = fd;
+  write->file_offset = offset;
+  write->file_length = length;
+  write->file_ref.release = release;
+  write->file_ref.release_data = release_data;
+
+  // anything written after the file needs a write of its own
+  worker_flush_client(client);
+
+  return true;
+}
+#endif
+
+/**
+ * Lets responses send files as they are once nothing has to be done to the
+ * octets on their way to the socket - for plaintext clients, or once the
+ * kernel has taken over the encryption
+ */
+static void worker_enable_file_writes(struct client_t * client)
+{
+#ifdef HAVE_SENDFILE
+  if (!client->tls_ctx || client->tls_ctx->ktls_tx) {
+    http_connection_set_file_writer(client->connection, app_write_file_cb);
+  }
+#else
+  UNUSED(client);
+#endif
+}
+
 static void app_close_finished(uv_handle_t * handle)
 {
   struct client_t * client = handle->data;
@@ -164,7 +953,34 @@ static void app_close_finished(uv_handle_t * handle)
   log_append(client->log, LOG_TRACE,
       "Finishing closing connection: %zu", client->id);
 
+  plugin_invoke(client->plugin_invoker, HANDLE_CLIENT_CLOSED);
+
+  timer_wheel_cancel(&worker->timers, &client->idle_timer);
+  timer_wheel_cancel(&worker->timers, &client->header_timer);
+
+  if (client->queued_write) {
+    worker_unqueue_write(worker, client->queued_write);
+    worker_write_release(worker, client->queued_write);
+    client->queued_write = NULL;
+  }
+
+  if (client->file_write) {
+    // the rest of the file is dropped
+    worker_write_release(worker, client->file_write);
+    client->file_write = NULL;
+  }
+
+  while (client->held_writes) {
+    struct worker_write_t * write = client->held_writes;
+    client->held_writes = write->next;
+    worker_write_release(worker, write);
+  }
+
   client_free(client);
+
+  if (worker->stopping) {
+    worker_stop_continue(worker);
+  }
 }
 
 static void uv_cb_shutdown(uv_shutdown_t * shutdown_req, int status)
@@ -183,11 +999,8 @@ static void uv_cb_shutdown(uv_shutdown_t * shutdown_req, int status)
   }
 }
 
-static void worker_close(struct client_t * client)
+static void worker_shutdown(struct client_t * client)
 {
-  uv_read_stop((uv_stream_t *) &client->tcp);
-  log_append(client->log, LOG_TRACE, "Shuting down client: %zu", client->id);
-
   uv_shutdown_t * shutdown_req = &client->shutdown_req;
   shutdown_req->data = client;
   int status = uv_shutdown(shutdown_req, (uv_stream_t *) &client->tcp, uv_cb_shutdown);
@@ -195,90 +1008,330 @@ static void worker_close(struct client_t * client)
     log_append(client->log, LOG_ERROR, "Shutdown failed to initialize, client: %zu: %s",
         client->id, uv_strerror(status));
   }
-}
+}
+
+static void worker_close(struct client_t * client)
+{
+  if (client->shutting_down) {
+    // e.g. the output flushed below couldn't be encrypted
+    return;
+  }
+  client->shutting_down = true;
+
+  uv_read_stop((uv_stream_t *) &client->tcp);
+  log_append(client->log, LOG_TRACE, "Shuting down client: %zu", client->id);
+
+  // the shutdown only waits for writes that libuv already knows about
+  worker_flush_client(client);
+
+  if (client->file_write) {
+    // nor about the file being sent, so the shutdown waits for it here
+    client->shutdown_deferred = true;
+    return;
+  }
+
+  worker_shutdown(client);
+}
+
+static void app_close_cb(void * data)
+{
+  struct client_t * client = data;
+  log_append(client->log, LOG_TRACE, "Closing: %zu", client->id);
+  worker_close(client);
+}
+
+static void worker_parse(struct client_t * client, uint8_t * buffer, size_t length)
+{
+  if (log_enabled(client->data_log)) {
+    log_append(client->data_log, LOG_TRACE, "Reading data: (%zd octets)", length);
+    log_buffer(client->data_log, LOG_TRACE, buffer, length);
+  }
+
+  if (client->tls_ctx && client->tls_ctx->selected_tls_version) {
+    http_connection_set_tls_details(client->connection, client->tls_ctx->selected_tls_version,
+                                    client->tls_ctx->selected_cipher, client->tls_ctx->cipher_key_size_in_bits);
+  }
+
+  if (!client->selected_protocol && client->tls_ctx && client->tls_ctx->selected_protocol) {
+    http_connection_set_protocol(client->connection, client->tls_ctx->selected_protocol);
+    client->selected_protocol = true;
+  }
+
+  log_append(client->log, LOG_DEBUG, "Read client #%zu (%zu octets)", client->id, length);
+
+  http_connection_t * connection = client->connection;
+  http_connection_read(connection, (uint8_t *) buffer, length);
+}
+
+// pass the decrypted data on to the application
+static bool tls_cb_write_to_app(void * data, uint8_t * buf, size_t length)
+{
+  struct client_t * client = data;
+
+  log_append(client->log, LOG_TRACE, "Passing %zu octets of data from TLS handler to application", length);
+
+  // requests that arrive as early data may be replays
+  http_connection_set_early_data(client->connection, client->tls_ctx->early_data);
+  worker_parse(client, (uint8_t *) buf, length);
+  log_append(client->log, LOG_TRACE, "Passed %zu octets of data from TLS handler to application", length);
+
+  return true;
+}
+
+static void worker_notify_eof(struct client_t * client)
+{
+  http_connection_t * connection = client->connection;
+  http_connection_eof(connection);
+}
+
+static void worker_read_from_network(uv_stream_t * uv_client, ssize_t nread, const uv_buf_t * buf)
+{
+  struct client_t * client = uv_client->data;
+  struct worker_t * worker = client->worker;
+
+  if (nread < 0) {
+
+    if (nread != UV_EOF) {
+      log_append(worker->log, LOG_ERROR, "Error reading from network for client %ld: %s",
+          client->id, uv_err_name(nread));
+      uv_close((uv_handle_t *) uv_client, app_close_finished);
+    } else {
+      log_append(worker->log, LOG_DEBUG, "EOF for client: #%ld", client->id);
+      client->eof = true;
+      worker_notify_eof(client);
+    }
+  } else if (client->tls_ctx) {
+
+    tls_client_ctx_t * tls_client_ctx = client->tls_ctx;
+
+    log_append(worker->log, LOG_TRACE, "Passing %zu octets of data from network to TLS handler",
+        nread);
+
+    if (!tls_decrypt_data_and_pass_to_app(tls_client_ctx, (uint8_t *) buf->base, nread)) {
+      worker_close(client);
+    }
+
+    log_append(worker->log, LOG_TRACE, "Passed %zu octets of data from network to TLS handler", nread);
+
+  } else {
+
+    worker_parse(client, (uint8_t *) buf->base, nread);
+
+  }
+
+  if (nread > 0) {
+    worker_update_memory_pressure(client);
+    worker_update_timeouts(client);
+    worker_try_ktls(client);
+  }
+
+  // the read has been fully handled - anything that needed to outlive it
+  // has been copied by now
+  buffer_pool_put(&worker->read_buffers, (uint8_t *) buf->base);
+}
+
+/**
+ * Everything the client is holding on to: the connection's buffers, output
+ * that hasn't been sent yet and anything held by TLS or plugins
+ */
+static size_t worker_client_memory_used(struct client_t * client)
+{
+  size_t used = http_connection_memory_used(client->connection);
+
+  used += uv_stream_get_write_queue_size((uv_stream_t *) &client->tcp) + worker_unsent_length(client);
+
+  if (client->tls_ctx) {
+    used += tls_client_memory_used(client->tls_ctx);
+  }
+
+  return used + client->plugin_octets;
+}
+
+/**
+ * Sheds load from a client that is holding too much memory. While it is over
+ * its budget (or the worker is over its own) new streams are refused and
+ * plugins are paused. If it isn't taking its output either, reading stops -
+ * anything read would only add to that output. A client far over its budget
+ * is disconnected.
+ */
+static void worker_update_memory_pressure(struct client_t * client)
+{
+  struct worker_t * worker = client->worker;
+  size_t limit = worker->config->connection_memory_limit;
+
+  if (client->connection->closed || uv_is_closing((uv_handle_t *) &client->tcp)) {
+    return;
+  }
+
+  client->memory_used = worker_client_memory_used(client);
+
+  if (limit > 0 && client->memory_used > limit * WORKER_MEMORY_SHED_FACTOR) {
+    log_append(client->log, LOG_WARN, "Client #%zu is holding %zu octets, disconnecting",
+        client->id, client->memory_used);
+    worker->clients_shed++;
+    http_connection_shed(client->connection);
+    return;
+  }
+
+  bool limited = (limit > 0 && client->memory_used > limit) || worker->memory_over_limit;
+
+  if (limited != client->memory_limited) {
+    log_append(client->log, LOG_DEBUG, "Client #%zu is %s its memory budget: %zu octets",
+        client->id, limited ? "over" : "back under", client->memory_used);
+    client->memory_limited = limited;
+    http_connection_set_refuse_streams(client->connection, limited);
+
+    if (limited) {
+      plugin_invoke(client->plugin_invoker, HANDLE_WRITE_PAUSE);
+    } else if (!client->write_paused) {
+      plugin_invoke(client->plugin_invoker, HANDLE_WRITE_RESUME);
+    }
+  }
+
+  bool stop_reading = limited && client->write_paused && !client->eof;
+
+  if (stop_reading != client->reading_stopped) {
+    log_append(client->log, LOG_DEBUG, "%s reading from client #%zu",
+        stop_reading ? "Stopped" : "Resumed", client->id);
+    client->reading_stopped = stop_reading;
+
+    if (stop_reading) {
+      uv_read_stop((uv_stream_t *) &client->tcp);
+    } else {
+      uv_read_start((uv_stream_t *) &client->tcp, alloc_buffer, worker_read_from_network);
+    }
+  }
+}
+
+static void worker_reload_ocsp(uv_timer_t * timer)
+{
+  struct worker_t * worker = timer->data;
+
+  tls_server_reload_ocsp_staples(worker->tls_ctx);
+}
+
+static void worker_check_memory(uv_timer_t * timer)
+{
+  struct worker_t * worker = timer->data;
+  size_t limit = worker->config->worker_memory_limit;
+
+  size_t used = 0;
+  struct client_t * heaviest = NULL;
+
+  struct client_t * client = worker->open_clients;
+  while (client) {
+    if (!client->connection->closed) {
+      client->memory_used = worker_client_memory_used(client);
+      used += client->memory_used;
+
+      if (!heaviest || client->memory_used > heaviest->memory_used) {
+        heaviest = client;
+      }
+    }
+    client = client->next;
+  }
+
+  bool was_over_limit = worker->memory_over_limit;
+  worker->memory_used = used;
+  worker->memory_over_limit = limit > 0 && used > limit;
+  if (used > worker->memory_peak) {
+    worker->memory_peak = used;
+  }
+
+  if (worker->memory_over_limit != was_over_limit) {
+    log_append(worker->log, worker->memory_over_limit ? LOG_WARN : LOG_INFO,
+        "Worker is %s its memory budget: %zu octets", worker->memory_over_limit ? "over" : "back under", used);
+  }
+
+  if (was_over_limit && worker->memory_over_limit && heaviest) {
+    // refusing new work wasn't enough - drop the biggest consumer
+    log_append(worker->log, LOG_WARN, "Disconnecting client #%zu holding %zu octets",
+        heaviest->id, heaviest->memory_used);
+    worker->clients_shed++;
+    http_connection_shed(heaviest->connection);
+  }
 
-static void app_close_cb(void * data)
-{
-  struct client_t * client = data;
-  log_append(client->log, LOG_TRACE, "Closing: %zu", client->id);
-  worker_close(client);
+  client = worker->open_clients;
+  while (client) {
+    worker_update_memory_pressure(client);
+    client = client->next;
+  }
 }
 
-static void worker_parse(struct client_t * client, uint8_t * buffer, size_t length)
+/**
+ * Closes connections that have nothing in progress. The connection is shut
+ * down gracefully first and dropped if that doesn't finish in time.
+ */
+static void worker_client_idle(timer_wheel_timer_t * timer)
 {
-  if (log_enabled(client->data_log)) {
-    log_append(client->data_log, LOG_TRACE, "Reading data: (%zd octets)", length);
-    log_buffer(client->data_log, LOG_TRACE, buffer, length);
+  struct client_t * client = timer->data;
+  struct worker_t * worker = client->worker;
+
+  if (client->connection->closed || uv_is_closing((uv_handle_t *) &client->tcp)) {
+    return;
   }
 
-  if (client->tls_ctx && client->tls_ctx->selected_tls_version) {
-    http_connection_set_tls_details(client->connection, client->tls_ctx->selected_tls_version,
-                                    client->tls_ctx->selected_cipher, client->tls_ctx->cipher_key_size_in_bits);
+  if (client->timed_out) {
+    log_append(client->log, LOG_DEBUG, "Client #%zu did not shut down in time", client->id);
+    worker_close(client);
+    return;
   }
 
-  if (!client->selected_protocol && client->tls_ctx && client->tls_ctx->selected_protocol) {
-    http_connection_set_protocol(client->connection, client->tls_ctx->selected_protocol);
-    client->selected_protocol = true;
+  if (client->pending_writes > 0 || http_connection_active_streams(client->connection) > 0) {
+    timer_wheel_add(&worker->timers, timer, worker_ticks(worker->config->idle_timeout));
+    return;
   }
 
-  log_append(client->log, LOG_DEBUG, "Read client #%zu (%zu octets)", client->id, length);
+  log_append(client->log, LOG_DEBUG, "Client #%zu has been idle for %" PRIu64 "ms",
+      client->id, worker->config->idle_timeout);
+  client->timed_out = true;
+  http_connection_shutdown(client->connection);
 
-  http_connection_t * connection = client->connection;
-  http_connection_read(connection, (uint8_t *) buffer, length);
+  if (!client->connection->closed) {
+    timer_wheel_add(&worker->timers, timer, worker_ticks(worker->config->idle_timeout));
+  }
 }
 
-// pass the decrypted data on to the application
-static bool tls_cb_write_to_app(void * data, uint8_t * buf, size_t length)
+/**
+ * Drops clients that take too long to send a request's headers (or to finish
+ * the TLS handshake) - whether they send nothing more or trickle it in
+ */
+static void worker_client_header_timeout(timer_wheel_timer_t * timer)
 {
-  struct client_t * client = data;
-
-  log_append(client->log, LOG_TRACE, "Passing %zu octets of data from TLS handler to application", length);
-  worker_parse(client, (uint8_t *) buf, length);
-  log_append(client->log, LOG_TRACE, "Passed %zu octets of data from TLS handler to application", length);
+  struct client_t * client = timer->data;
 
-  return true;
-}
+  if (client->connection->closed || uv_is_closing((uv_handle_t *) &client->tcp)) {
+    return;
+  }
 
-static void worker_notify_eof(struct client_t * client)
-{
-  http_connection_t * connection = client->connection;
-  http_connection_eof(connection);
+  log_append(client->log, LOG_WARN, "Client #%zu did not send a complete request in %" PRIu64 "ms",
+      client->id, client->worker->config->header_timeout);
+  client->timed_out = true;
+  worker_close(client);
 }
 
-static void worker_read_from_network(uv_stream_t * uv_client, ssize_t nread, const uv_buf_t * buf)
+static void worker_update_timeouts(struct client_t * client)
 {
-  struct client_t * client = uv_client->data;
   struct worker_t * worker = client->worker;
+  struct server_config_t * config = worker->config;
 
-  if (nread < 0) {
-
-    if (nread != UV_EOF) {
-      log_append(worker->log, LOG_ERROR, "Error reading from network for client %ld: %s",
-          client->id, uv_err_name(nread));
-      uv_close((uv_handle_t *) uv_client, app_close_finished);
-    } else {
-      log_append(worker->log, LOG_DEBUG, "EOF for client: #%ld", client->id);
-      client->eof = true;
-      worker_notify_eof(client);
-    }
-    free(buf->base);
-  } else if (client->tls_ctx) {
+  if (client->timed_out || client->connection->closed || uv_is_closing((uv_handle_t *) &client->tcp)) {
+    return;
+  }
 
-    tls_client_ctx_t * tls_client_ctx = client->tls_ctx;
+  if (config->idle_timeout) {
+    timer_wheel_add(&worker->timers, &client->idle_timer, worker_ticks(config->idle_timeout));
+  }
 
-    log_append(worker->log, LOG_TRACE, "Passing %zu octets of data from network to TLS handler",
-        nread);
+  if (config->header_timeout) {
+    bool pending = http_connection_input_pending(client->connection) ||
+                   (client->tls_ctx && !client->tls_ctx->handshake_complete);
 
-    if (!tls_decrypt_data_and_pass_to_app(tls_client_ctx, (uint8_t *) buf->base, nread)) {
-      worker_close(client);
+    if (!pending) {
+      timer_wheel_cancel(&worker->timers, &client->header_timer);
+    } else if (!timer_wheel_timer_active(&client->header_timer)) {
+      timer_wheel_add(&worker->timers, &client->header_timer, worker_ticks(config->header_timeout));
     }
-
-    log_append(worker->log, LOG_TRACE, "Passed %zu octets of data from network to TLS handler", nread);
-
-  } else {
-
-    worker_parse(client, (uint8_t *) buf->base, nread);
-
   }
 }
 
@@ -292,8 +1345,12 @@ static void worker_assign_client_details(struct client_t * client, size_t index)
     abort();
   }
   if (curr->use_tls) {
-    client->tls_ctx = tls_client_init(client->worker->tls_ctx, client, worker_write_to_network,
-                                      tls_cb_write_to_app);
+    client->tls_ctx = tls_client_init(client->worker->tls_ctx, &client->worker->read_buffers, client,
+                                      worker_write_to_network, tls_cb_write_to_app);
+
+    if (client->tls_ctx && client->worker->config->tls_async_handshakes) {
+      tls_client_enable_async_handshake(client->tls_ctx, &client->worker->loop, worker_tls_handshake_finished);
+    }
   } else {
     client->tls_ctx = NULL;
   }
@@ -304,27 +1361,12 @@ static void worker_assign_client_details(struct client_t * client, size_t index)
       curr->use_tls ? "https" : "http", curr->hostname, curr->port);
 }
 
-static void worker_on_new_connection(uv_stream_t * pipe_s, ssize_t nread, const uv_buf_t * buf)
+/**
+ * Accepts a pending connection from the given stream - either the pipe from
+ * the server process or one of the worker's own listeners.
+ */
+static void worker_accept_client(struct worker_t * worker, uv_stream_t * server_stream, size_t index)
 {
-  uv_pipe_t * pipe = (uv_pipe_t *) pipe_s;
-  struct worker_t * worker = pipe->data;
-
-  if (nread < 0) {
-    if (nread != UV_EOF) {
-      log_append(worker->log, LOG_ERROR, "Error reading file descriptor from pipe: %s", uv_err_name(nread));
-    }
-    uv_close((uv_handle_t *) pipe_s, NULL);
-    return;
-  }
-
-  if (!uv_pipe_pending_count(pipe)) {
-    log_append(worker->log, LOG_ERROR, "No pending file descriptors to read");
-    return;
-  }
-
-  uv_handle_type pending = uv_pipe_pending_type(pipe);
-  assert(pending == UV_TCP);
-
   struct client_t * client = malloc(sizeof(struct client_t));
   if (!client) {
     log_append(worker->log, LOG_ERROR, "Could not malloc client");
@@ -336,6 +1378,9 @@ static void worker_on_new_connection(uv_stream_t * pipe_s, ssize_t nread, const
     return;
   }
 
+  timer_wheel_timer_init(&client->idle_timer, worker_client_idle, client);
+  timer_wheel_timer_init(&client->header_timer, worker_client_header_timeout, client);
+
   client->prev = NULL;
   if (worker->open_clients) {
     worker->open_clients->prev = client;
@@ -347,26 +1392,146 @@ static void worker_on_new_connection(uv_stream_t * pipe_s, ssize_t nread, const
       &worker->config->hpack_log, worker->config->h2_protocol_version_string,
       worker->config->h2c_protocol_version_string, client->plugin_invoker,
       app_write_cb, app_close_cb);
+  http_connection_set_timeouts(client->connection, &worker->timers,
+      worker_ticks(worker->config->header_timeout), worker_ticks(worker->config->stream_timeout));
+  http_connection_set_ref_writer(client->connection, app_write_ref_cb);
 
   uv_tcp_init(&worker->loop, &client->tcp);
   uv_tcp_nodelay(&client->tcp, true);
   client->tcp.data = client;
 
-  if (uv_accept(pipe_s, (uv_stream_t *) &client->tcp) == 0) {
-
-    size_t index = (size_t) *buf->base;
+  if (uv_accept(server_stream, (uv_stream_t *) &client->tcp) == 0) {
 
     worker_assign_client_details(client, index);
+    worker_enable_file_writes(client);
 
     log_append(worker->log, LOG_DEBUG, "Accepted fd %d\n", client->tcp.io_watcher.fd);
     uv_read_start((uv_stream_t *) &client->tcp, alloc_buffer, worker_read_from_network);
+    worker_update_timeouts(client);
   } else {
     uv_close((uv_handle_t *) &client->tcp, app_close_finished);
   }
+}
+
+static void worker_on_new_connection(uv_stream_t * pipe_s, ssize_t nread, const uv_buf_t * buf)
+{
+  uv_pipe_t * pipe = (uv_pipe_t *) pipe_s;
+  struct worker_t * worker = pipe->data;
+
+  if (nread < 0) {
+    if (nread != UV_EOF) {
+      log_append(worker->log, LOG_ERROR, "Error reading file descriptor from pipe: %s", uv_err_name(nread));
+    }
+    uv_close((uv_handle_t *) pipe_s, worker_queue_closed);
+    return;
+  }
+
+  if (!uv_pipe_pending_count(pipe)) {
+    log_append(worker->log, LOG_ERROR, "No pending file descriptors to read");
+    free(buf->base);
+    return;
+  }
+
+  // the server passes connections in batches, each file descriptor is
+  // accompanied by the index of the address that accepted it
+  for (ssize_t i = 0; i < nread; i++) {
+    if (!uv_pipe_pending_count(pipe)) {
+      log_append(worker->log, LOG_ERROR, "No pending file descriptor for address index #%zd", i);
+      break;
+    }
+
+    uv_handle_type pending = uv_pipe_pending_type(pipe);
+    assert(pending == UV_TCP);
+
+    size_t index = (uint8_t) buf->base[i];
+    worker_accept_client(worker, pipe_s, index);
+  }
 
   free(buf->base);
 }
 
+static void worker_on_listener_connection(uv_stream_t * server_stream, int status)
+{
+  struct worker_listener_t * listener = server_stream->data;
+  struct worker_t * worker = listener->worker;
+
+  if (status < 0) {
+    log_append(worker->log, LOG_ERROR, "Error getting new connection: %s", uv_err_name(status));
+    return;
+  }
+
+  worker_accept_client(worker, server_stream, listener->address->index);
+}
+
+/**
+ * Binds a SO_REUSEPORT socket for each configured address so that the kernel
+ * distributes new connections across the workers directly.
+ */
+static bool worker_listen(struct worker_t * worker)
+{
+  size_t index = 0;
+  struct listen_address_t * curr = worker->config->address_list;
+  while (curr) {
+    curr->index = index;
+
+    struct sockaddr_in bind_addr;
+    int r;
+    if ((r = uv_ip4_addr(curr->hostname, curr->port, &bind_addr))) {
+      log_append(worker->log, LOG_FATAL, "Initializing bind on address %s://%s:%ld failed: %s",
+          curr->use_tls ? "https" : "http", curr->hostname, curr->port, uv_err_name(r));
+      return false;
+    }
+
+    // SO_REUSEPORT has to be set before the socket is bound, so the socket
+    // is created here instead of by libuv
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+      log_append(worker->log, LOG_FATAL, "Creating SO_REUSEPORT socket for %s://%s:%ld failed: %s",
+          curr->use_tls ? "https" : "http", curr->hostname, curr->port, strerror(errno));
+      if (fd >= 0) {
+        close(fd);
+      }
+      return false;
+    }
+
+    struct worker_listener_t * listener = malloc(sizeof(struct worker_listener_t));
+    if (!listener) {
+      close(fd);
+      return false;
+    }
+    listener->worker = worker;
+    listener->address = curr;
+    listener->next = worker->listeners;
+    worker->listeners = listener;
+
+    uv_tcp_t * tcp = &listener->tcp;
+    uv_tcp_init(&worker->loop, tcp);
+    tcp->data = listener;
+    worker->active_listeners++;
+
+    if ((r = uv_tcp_open(tcp, fd))) {
+      close(fd);
+    } else if (!(r = uv_tcp_bind(tcp, (const struct sockaddr *) &bind_addr, 0))) {
+      r = uv_listen((uv_stream_t *) tcp, LISTEN_BACKLOG, worker_on_listener_connection);
+    }
+
+    if (r) {
+      log_append(worker->log, LOG_FATAL, "Listening on %s://%s:%ld failed: %s",
+          curr->use_tls ? "https" : "http", curr->hostname, curr->port, uv_err_name(r));
+      return false;
+    }
+
+    log_append(worker->log, LOG_INFO, "Worker %d listening on %s://%s:%ld", getpid(),
+        curr->use_tls ? "https" : "http", curr->hostname, curr->port);
+
+    curr = curr->next;
+    index++;
+  }
+
+  return true;
+}
+
 bool worker_use_tls(struct server_config_t * config)
 {
   bool use_tls = false;
@@ -381,14 +1546,101 @@ bool worker_use_tls(struct server_config_t * config)
   return use_tls;
 }
 
-bool worker_init(struct worker_t * worker, struct server_config_t * config)
+static tls_server_ctx_t * worker_tls_server_init(struct server_config_t * config)
+{
+  tls_init(config->h2_protocol_version_string);
+
+  tls_server_ctx_t * tls_ctx = tls_server_init(&config->tls_log, config->private_key_path,
+                                               config->certificate_path);
+  ASSERT_OR_RETURN_NULL(tls_ctx);
+
+  for (struct tls_certificate_config_t * cert = config->tls_certificates; cert; cert = cert->next) {
+    if (!tls_server_add_certificate(tls_ctx, cert->hostname, cert->private_key_path, cert->certificate_path)) {
+      tls_server_free(tls_ctx);
+      return NULL;
+    }
+  }
+
+  if (config->tls_ocsp_stapling) {
+    // stapling carries on for the others if one can't be set up
+    tls_server_add_ocsp_staple(tls_ctx, config->certificate_path);
+
+    for (struct tls_certificate_config_t * cert = config->tls_certificates; cert; cert = cert->next) {
+      tls_server_add_ocsp_staple(tls_ctx, cert->certificate_path);
+    }
+  }
+
+  tls_server_set_record_sizing(tls_ctx, config->tls_small_record_size, config->tls_record_boost_threshold,
+                               config->tls_record_idle_timeout);
+
+  if (config->ktls) {
+    tls_server_enable_ktls(tls_ctx);
+  }
+
+  // the server process passes the session cache shared by every worker -
+  // without it, the descriptor belongs to something else
+  int cache_fd = config->tls_session_cache_inherited ? TLS_SESSION_CACHE_FD : -1;
+  tls_session_cache_t * cache = tls_session_cache_init(cache_fd, config->tls_session_cache_size);
+
+  if (!cache) {
+    log_append(&config->worker_log, LOG_WARN, "Unable to set up the TLS session cache");
+  } else {
+    tls_server_enable_resumption(tls_ctx, cache, config->tls_session_timeout / 1000,
+                                 config->tls_ticket_key_lifetime / 1000, config->tls_session_tickets);
+
+    // early data is only sent with resumed sessions
+    if (config->tls_max_early_data > 0) {
+      tls_server_enable_early_data(tls_ctx, config->tls_max_early_data);
+    }
+  }
+
+  return tls_ctx;
+}
+
+static uv_once_t worker_static_init_once = UV_ONCE_INIT;
+
+static void worker_static_init(void)
 {
   h2_static_init();
+}
+
+bool worker_init(struct worker_t * worker, struct server_config_t * config, size_t index,
+                 tls_server_ctx_t * tls_ctx)
+{
+  uv_once(&worker_static_init_once, worker_static_init);
 
   worker->stopping = false;
   worker->config = config;
+  worker->index = index;
+  worker->log = &config->worker_log;
+  worker->data_log = &config->data_log;
+  worker->tls_ctx = NULL;
+  worker->owns_tls_ctx = false;
+  worker->active_queue = false;
   worker->plugins = NULL;
   worker->open_clients = NULL;
+  worker->listeners = NULL;
+  worker->active_listeners = 0;
+  worker->active_load_report_timer = false;
+  worker->load_report_pending = false;
+  worker->active_memory_check_timer = false;
+  worker->memory_used = 0;
+  worker->memory_peak = 0;
+  worker->memory_over_limit = false;
+  worker->clients_shed = 0;
+  worker->active_timer_tick = false;
+  worker->active_ocsp_reload_timer = false;
+
+  buffer_pool_init(&worker->read_buffers, WORKER_READ_BUFFER_SIZE, WORKER_READ_BUFFER_MAX_IDLE);
+
+  worker->active_write_flush = false;
+  worker->queued_writes = NULL;
+  worker->idle_writes = NULL;
+  worker->idle_write_count = 0;
+  worker->writes_submitted = 0;
+  worker->write_buffers_submitted = 0;
+  worker->write_buffers_referenced = 0;
+  buffer_pool_init(&worker->write_chunks, WORKER_WRITE_CHUNK_SIZE, WORKER_WRITE_CHUNK_MAX_IDLE);
 
   struct plugin_config_t * plugin_config = config->plugin_configs;
   struct plugin_list_t * last = NULL;
@@ -421,6 +1673,17 @@ bool worker_init(struct worker_t * worker, struct server_config_t * config)
   }
   worker->loop.data = worker;
 
+  // these don't keep the loop alive on their own
+  uv_check_init(&worker->loop, &worker->write_check);
+  worker->write_check.data = worker;
+  uv_check_start(&worker->write_check, worker_write_check);
+  uv_unref((uv_handle_t *) &worker->write_check);
+  uv_prepare_init(&worker->loop, &worker->write_prepare);
+  worker->write_prepare.data = worker;
+  uv_prepare_start(&worker->write_prepare, worker_write_prepare);
+  uv_unref((uv_handle_t *) &worker->write_prepare);
+  worker->active_write_flush = true;
+
   worker->active_handlers = 0;
   uv_signal_init(&worker->loop, &worker->sigpipe_handler);
   worker->sigpipe_handler.data = worker;
@@ -434,24 +1697,49 @@ bool worker_init(struct worker_t * worker, struct server_config_t * config)
   worker->sigterm_handler.data = worker;
   worker->active_handlers++;
 
-  uv_pipe_init(&worker->loop, &worker->queue, 1);
-  uv_pipe_open(&worker->queue, 0);
-  worker->queue.data = worker;
-  uv_read_start((uv_stream_t *) &worker->queue, alloc_pipe_read_buffer, worker_on_new_connection);
-  worker->active_queue = true;
+  // there is only one pipe from the server process
+  if (index == 0) {
+    uv_pipe_init(&worker->loop, &worker->queue, 1);
+    uv_pipe_open(&worker->queue, 0);
+    worker->queue.data = worker;
+    uv_read_start((uv_stream_t *) &worker->queue, alloc_pipe_read_buffer, worker_on_new_connection);
+    worker->active_queue = true;
+  }
 
-  worker->assigned_reads = 0;
+  if (!config->reuse_port && worker->active_queue) {
+    // connections are dispatched by the server process based on these reports
+    uv_timer_init(&worker->loop, &worker->load_report_timer);
+    worker->load_report_timer.data = worker;
+    worker->active_load_report_timer = true;
+  }
 
-  worker->log = &config->worker_log;
-  worker->data_log = &config->data_log;
+  timer_wheel_init(&worker->timers, uv_now(&worker->loop) / WORKER_TIMER_TICK);
+  uv_timer_init(&worker->loop, &worker->timer_tick);
+  worker->timer_tick.data = worker;
+  worker->active_timer_tick = true;
 
-  if (worker_use_tls(config)) {
-    tls_init(config->h2_protocol_version_string);
+  uv_timer_init(&worker->loop, &worker->memory_check_timer);
+  worker->memory_check_timer.data = worker;
+  worker->active_memory_check_timer = true;
+
+  worker->assigned_reads = 0;
 
-    worker->tls_ctx = tls_server_init(&config->tls_log, config->private_key_path, config->certificate_path);
+  if (tls_ctx) {
+    worker->tls_ctx = tls_ctx;
+  } else if (worker_use_tls(config)) {
+    worker->tls_ctx = worker_tls_server_init(config);
     ASSERT_OR_RETURN_FALSE(worker->tls_ctx);
-  } else {
-    worker->tls_ctx = NULL;
+    worker->owns_tls_ctx = true;
+  }
+
+  if (worker->tls_ctx && config->tls_ocsp_stapling && index == 0) {
+    uv_timer_init(&worker->loop, &worker->ocsp_reload_timer);
+    worker->ocsp_reload_timer.data = worker;
+    worker->active_ocsp_reload_timer = true;
+  }
+
+  if (config->reuse_port && !worker_listen(worker)) {
+    return false;
   }
 
   return true;
@@ -470,6 +1758,26 @@ int worker_run(struct worker_t * worker)
   uv_signal_start(&worker->sigint_handler, worker_sigint_handler, SIGINT);
   uv_signal_start(&worker->sigterm_handler, worker_sigterm_handler, SIGTERM);
 
+  if (worker->active_load_report_timer) {
+    worker->load_report_due = uv_now(&worker->loop) + WORKER_LOAD_REPORT_INTERVAL;
+    uv_timer_start(&worker->load_report_timer, worker_report_load, WORKER_LOAD_REPORT_INTERVAL,
+                   WORKER_LOAD_REPORT_INTERVAL);
+  }
+
+  if (worker->active_timer_tick) {
+    uv_timer_start(&worker->timer_tick, worker_timer_tick, WORKER_TIMER_TICK, WORKER_TIMER_TICK);
+  }
+
+  if (worker->active_memory_check_timer) {
+    uv_timer_start(&worker->memory_check_timer, worker_check_memory, WORKER_MEMORY_CHECK_INTERVAL,
+                   WORKER_MEMORY_CHECK_INTERVAL);
+  }
+
+  if (worker->active_ocsp_reload_timer) {
+    uv_timer_start(&worker->ocsp_reload_timer, worker_reload_ocsp, WORKER_OCSP_RELOAD_INTERVAL,
+                   WORKER_OCSP_RELOAD_INTERVAL);
+  }
+
   log_append(worker->log, LOG_INFO, "Worker running...");
 
   int ret = uv_run(&worker->loop, UV_RUN_DEFAULT);
@@ -491,8 +1799,36 @@ void worker_stop(struct worker_t * worker)
   uv_close((uv_handle_t *) &worker->sigint_handler, handler_closed);
   uv_close((uv_handle_t *) &worker->sigterm_handler, handler_closed);
 
-  uv_read_stop((uv_stream_t *) &worker->queue);
-  uv_close((uv_handle_t *) &worker->queue, worker_queue_closed);
+  if (worker->active_queue && !uv_is_closing((uv_handle_t *) &worker->queue)) {
+    uv_read_stop((uv_stream_t *) &worker->queue);
+    uv_close((uv_handle_t *) &worker->queue, worker_queue_closed);
+  }
+
+  if (worker->active_load_report_timer) {
+    uv_timer_stop(&worker->load_report_timer);
+    uv_close((uv_handle_t *) &worker->load_report_timer, worker_load_report_timer_closed);
+  }
+
+  if (worker->active_timer_tick) {
+    uv_timer_stop(&worker->timer_tick);
+    uv_close((uv_handle_t *) &worker->timer_tick, worker_timer_tick_closed);
+  }
+
+  if (worker->active_memory_check_timer) {
+    uv_timer_stop(&worker->memory_check_timer);
+    uv_close((uv_handle_t *) &worker->memory_check_timer, worker_memory_check_timer_closed);
+  }
+
+  if (worker->active_ocsp_reload_timer) {
+    uv_timer_stop(&worker->ocsp_reload_timer);
+    uv_close((uv_handle_t *) &worker->ocsp_reload_timer, worker_ocsp_reload_timer_closed);
+  }
+
+  struct worker_listener_t * listener = worker->listeners;
+  while (listener) {
+    uv_close((uv_handle_t *) &listener->tcp, worker_listener_closed);
+    listener = listener->next;
+  }
 
   struct client_t * client = worker->open_clients;
   while (client) {
@@ -513,10 +1849,134 @@ void worker_free(struct worker_t * worker)
     free(prev);
   }
 
-  if (worker->tls_ctx && worker_use_tls(worker->config)) {
+  if (worker->tls_ctx && worker->owns_tls_ctx) {
     tls_server_free(worker->tls_ctx);
   }
 
+  while (worker->listeners) {
+    struct worker_listener_t * listener = worker->listeners;
+    worker->listeners = listener->next;
+    free(listener);
+  }
+
+  buffer_pool_t * read_buffers = &worker->read_buffers;
+  log_append(worker->log, LOG_DEBUG, "Read buffers: %zu reused, %zu allocated, at most %zu in use",
+      read_buffers->hits, read_buffers->misses, read_buffers->high_water_mark);
+  buffer_pool_free(read_buffers);
+
+  while (worker->queued_writes) {
+    struct worker_write_t * write = worker->queued_writes;
+    worker->queued_writes = write->next;
+    worker_write_release(worker, write);
+  }
+
+  while (worker->idle_writes) {
+    struct worker_write_t * write = worker->idle_writes;
+    worker->idle_writes = write->next;
+    free(write->bufs);
+    free(write->refs);
+    free(write);
+  }
+
+  log_append(worker->log, LOG_DEBUG, "Writes: %zu buffers sent in %zu writes, %zu sent without copying",
+      worker->write_buffers_submitted, worker->writes_submitted, worker->write_buffers_referenced);
+  buffer_pool_free(&worker->write_chunks);
+
+  timer_wheel_free(&worker->timers);
+
+  log_append(worker->log, LOG_DEBUG, "Memory: at most %zu octets held by clients, %zu clients disconnected",
+      worker->memory_peak, worker->clients_shed);
+
   uv_loop_close(&worker->loop);
 }
 
+
+static void worker_pin_thread(struct worker_t * worker)
+{
+#ifdef __linux__
+  uv_cpu_info_t * cpu_infos;
+  int count;
+  if (uv_cpu_info(&cpu_infos, &count) < 0) {
+    return;
+  }
+  uv_free_cpu_info(cpu_infos, count);
+
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(worker->index % count, &cpu_set);
+
+  int r = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+  if (r) {
+    log_append(worker->log, LOG_WARN, "Unable to pin worker thread %zu to cpu: %s",
+        worker->index, strerror(r));
+  }
+#else
+  UNUSED(worker);
+#endif
+}
+
+static void worker_thread_run(void * arg)
+{
+  struct worker_t * worker = arg;
+
+  worker_pin_thread(worker);
+
+  worker_run(worker);
+}
+
+bool worker_run_threads(struct server_config_t * config)
+{
+  size_t num_threads = config->worker_threads;
+
+  // one TLS context serves every thread
+  tls_server_ctx_t * tls_ctx = NULL;
+  if (worker_use_tls(config)) {
+    tls_ctx = worker_tls_server_init(config);
+    ASSERT_OR_RETURN_FALSE(tls_ctx);
+  }
+
+  struct worker_t * workers = malloc(sizeof(struct worker_t) * num_threads);
+  uv_thread_t * threads = malloc(sizeof(uv_thread_t) * num_threads);
+  bool success = workers && threads;
+
+  // the workers are initialized on this thread so that plugin and listener
+  // setup happens in order
+  size_t initialized = 0;
+  while (success && initialized < num_threads) {
+    success = worker_init(&workers[initialized], config, initialized, tls_ctx);
+    initialized++;
+  }
+
+  size_t started = 0;
+  while (success && started < num_threads) {
+    if (uv_thread_create(&threads[started], worker_thread_run, &workers[started])) {
+      log_append(&config->worker_log, LOG_FATAL, "Unable to start worker thread %zu", started);
+      success = false;
+    } else {
+      started++;
+    }
+  }
+
+  if (!success && started > 0) {
+    // the running workers' loops can't be touched from this thread, let
+    // their signal handlers shut them down
+    uv_kill(getpid(), SIGTERM);
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    uv_thread_join(&threads[i]);
+  }
+
+  for (size_t i = 0; i < initialized; i++) {
+    worker_free(&workers[i]);
+  }
+
+  free(workers);
+  free(threads);
+
+  if (tls_ctx) {
+    tls_server_free(tls_ctx);
+  }
+
+  return success;
+}
@@ -8,6 +8,8 @@
 #include "util/log.h"
 #include "util/blocking_queue.h"
 #include "util/atomic_int.h"
+#include "util/buffer_pool.h"
+#include "util/timer_wheel.h"
 
 #include "http/http.h"
 
@@ -20,10 +22,144 @@
 
 struct plugin_list_t;
 
+struct worker_t;
+
+/**
+ * How often a worker reports its load to the server process
+ */
+#define WORKER_LOAD_REPORT_INTERVAL 100 // ms
+
+/**
+ * Size of the buffers that client sockets are read into and how many unused
+ * ones the worker holds on to. Reads are handled synchronously so only a few
+ * buffers are in use at any one time.
+ */
+#define WORKER_READ_BUFFER_SIZE 0x10000 // 64KiB
+#define WORKER_READ_BUFFER_MAX_IDLE 16
+
+/**
+ * Small writes to a client are copied into chunks of this size so that
+ * consecutive frames end up in the same buffer. Larger writes get a buffer
+ * of their own.
+ */
+#define WORKER_WRITE_CHUNK_SIZE 0x4000 // 16KiB
+#define WORKER_WRITE_CHUNK_MAX_IDLE 64
+// how many finished write requests are kept for reuse
+#define WORKER_WRITE_REQ_MAX_IDLE 64
+
+/**
+ * The most of a file sent with one sendfile call. The socket is polled
+ * between calls so that one client's download doesn't hold up the loop.
+ */
+#define WORKER_SENDFILE_CHUNK_SIZE 0x100000 // 1MiB
+
+/**
+ * When a client's unsent output grows past the high watermark, h2 stops
+ * sending DATA frames and plugins are asked to pause. Both resume once it
+ * drains below the low watermark.
+ */
+#define WORKER_WRITE_HIGH_WATERMARK 0x100000 // 1MiB
+#define WORKER_WRITE_LOW_WATERMARK 0x40000 // 256KiB
+
+/**
+ * How often the memory held by each client is totalled and checked against
+ * the connection and worker limits
+ */
+#define WORKER_MEMORY_CHECK_INTERVAL 100 // ms
+
+/**
+ * How often the cached OCSP responses are checked for ones the server
+ * process has fetched since
+ */
+#define WORKER_OCSP_RELOAD_INTERVAL 60000 // ms
+
+/**
+ * A client holding this many times the connection limit is sent a GOAWAY
+ * (ENHANCE_YOUR_CALM) and disconnected
+ */
+#define WORKER_MEMORY_SHED_FACTOR 2
+
+/**
+ * The length of one tick of the worker's timer wheel. Timeouts are rounded
+ * up to a whole number of ticks.
+ */
+#define WORKER_TIMER_TICK 100 // ms
+
+/**
+ * Sent periodically from each worker to the server process over the worker's
+ * pipe so that new connections can go to the least loaded worker
+ */
+struct worker_load_report_t {
+  uint32_t open_clients;
+  uint32_t pending_writes;
+  uint32_t active_streams;
+  // how late the report timer fired - a busy loop falls behind
+  uint32_t loop_lag;
+};
+
+/**
+ * A buffer in a write that was passed in by reference. Its owner gets it back
+ * once the write is done with it.
+ */
+struct worker_write_ref_t {
+  release_cb release;
+  void * release_data;
+};
+
+/**
+ * Waits for a client's socket to take more of a file. libuv allows only one
+ * handle per descriptor, so this polls a duplicate of the socket.
+ */
+struct worker_file_poll_t {
+  uv_poll_t poll;
+  uv_os_sock_t fd;
+  struct worker_write_t * write;
+};
+
+/**
+ * Everything written to a client during one loop iteration. The buffers are
+ * sent with a single uv_write before the loop blocks for I/O again.
+ */
+struct worker_write_t {
+  uv_write_t req;
+  struct client_t * client;
+
+  uv_buf_t * bufs;
+  // one for each of bufs - release is NULL for the worker's own chunks
+  struct worker_write_ref_t * refs;
+  size_t buf_count;
+  size_t buf_capacity;
+  size_t length;
+
+  // sent with sendfile once the buffers have been written. Nothing written
+  // to the client after the file joins this write.
+  int file_fd;
+  int64_t file_offset;
+  size_t file_length;
+  struct worker_write_ref_t file_ref;
+  struct worker_file_poll_t * file_poll;
+
+  // the next queued write, or the next idle write when pooled
+  struct worker_write_t * next;
+};
+
+/**
+ * A listening socket owned by a worker when running with SO_REUSEPORT
+ */
+struct worker_listener_t {
+  uv_tcp_t tcp;
+  struct worker_t * worker;
+  struct listen_address_t * address;
+  struct worker_listener_t * next;
+};
+
 struct worker_t {
 
   struct server_config_t * config;
 
+  // the worker's position among the worker threads in this process
+  size_t index;
+
   struct log_context_t * log;
   struct log_context_t * data_log;
 
@@ -32,9 +168,52 @@ struct worker_t {
 
   uv_loop_t loop;
 
+  buffer_pool_t read_buffers;
+
+  // client output queued during the current loop iteration is flushed
+  // after polling for I/O, and again before the next poll for anything
+  // queued later in the iteration
+  uv_check_t write_check;
+  uv_prepare_t write_prepare;
+  bool active_write_flush;
+  struct worker_write_t * queued_writes;
+  struct worker_write_t * idle_writes;
+  size_t idle_write_count;
+  buffer_pool_t write_chunks;
+  size_t writes_submitted;
+  size_t write_buffers_submitted;
+  size_t write_buffers_referenced;
+
   uv_pipe_t queue;
   bool active_queue;
 
+  struct worker_listener_t * listeners;
+  size_t active_listeners;
+
+  uv_timer_t load_report_timer;
+  bool active_load_report_timer;
+  uint64_t load_report_due;
+  uv_write_t load_report_req;
+  struct worker_load_report_t load_report;
+  bool load_report_pending;
+
+  uv_timer_t memory_check_timer;
+  bool active_memory_check_timer;
+  // everything held by the worker's clients as of the last check
+  size_t memory_used;
+  size_t memory_peak;
+  bool memory_over_limit;
+  size_t clients_shed;
+
+  // only one thread reloads the OCSP responses shared by all of them
+  uv_timer_t ocsp_reload_timer;
+  bool active_ocsp_reload_timer;
+
+  // connection and stream timeouts - one libuv timer drives all of them
+  timer_wheel_t timers;
+  uv_timer_t timer_tick;
+  bool active_timer_tick;
+
   uv_signal_t sigpipe_handler;
   uv_signal_t sigint_handler;
   uv_signal_t sigterm_handler;
@@ -43,6 +222,8 @@ struct worker_t {
   struct plugin_list_t * plugins;
 
   tls_server_ctx_t * tls_ctx;
+  // false when the TLS context is shared with other worker threads
+  bool owns_tls_ctx;
 
   struct client_t * open_clients;
 
@@ -69,7 +250,13 @@ struct http_write_req_data_t {
   uv_write_t req;
 };
 
-bool worker_init(struct worker_t * worker, struct server_config_t * config);
+/**
+ * Initializes a worker. Only the worker with index 0 reads connections from
+ * the server process. If tls_ctx is NULL and TLS is needed, the worker creates
+ * its own TLS context.
+ */
+bool worker_init(struct worker_t * worker, struct server_config_t * config, size_t index,
+                 tls_server_ctx_t * tls_ctx);
 
 int worker_run(struct worker_t * worker);
 
@@ -77,4 +264,15 @@ void worker_stop(struct worker_t * worker);
 
 void worker_free(struct worker_t * worker);
 
+/**
+ * Whether any of the configured listeners use TLS
+ */
+bool worker_use_tls(struct server_config_t * config);
+
+/**
+ * Runs config->worker_threads workers in this process, each with its own
+ * event loop on its own thread. Returns once every worker has stopped.
+ */
+bool worker_run_threads(struct server_config_t * config);
+
 #endif
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Compares the size of the server's handshake flight with and without
+# certificate compression (RFC 8879), e.g. against a local server:
+#
+#   ./test/handshake_bytes.sh 127.0.0.1:8443 example.com
+#
+# Needs an openssl s_client (3.2 or later) that supports compressed
+# certificates.
+set -e
+
+CONNECT=${1:-127.0.0.1:8443}
+SERVERNAME=${2:-localhost}
+OPENSSL=${OPENSSL:-openssl}
+# 10 segments of 1460 octets - the usual initial congestion window
+INITCWND=${INITCWND:-14600}
+
+if ! $OPENSSL s_client -help 2>&1 | grep -q no_rx_cert_comp; then
+  echo "$($OPENSSL version) doesn't support certificate compression" >&2
+  exit 1
+fi
+
+# prints the number of octets read during the handshake
+handshake_bytes() {
+  echo | $OPENSSL s_client -connect "$CONNECT" -servername "$SERVERNAME" -tls1_3 -no_ticket "$@" 2>/dev/null |
+    sed -n 's/^SSL handshake has read \([0-9]*\) bytes.*/\1/p'
+}
+
+compressed=$(handshake_bytes)
+uncompressed=$(handshake_bytes -no_rx_cert_comp)
+
+if [ -z "$compressed" ] || [ -z "$uncompressed" ]; then
+  echo "Unable to complete a handshake with $CONNECT" >&2
+  exit 1
+fi
+
+for result in "compressed $compressed" "uncompressed $uncompressed"; do
+  set -- $result
+  if [ "$2" -gt "$INITCWND" ]; then
+    fits="exceeds"
+  else
+    fits="fits in"
+  fi
+  echo "$1: $2 octets read during the handshake ($fits the $INITCWND octet initial window)"
+done
+
+echo "saved: $((uncompressed - compressed)) octets"
@@ -76,6 +76,18 @@ class TestNghttp < Test::Unit::TestCase
     assert_match "NO_ERROR", response_str
   end
 
+  def test_nghttp2_get_assets_with_idle_stream_dependencies
+   uri = "#{$server.https_files_uri}/gophertiles.html"
+
+    # --dep-idle groups the assets below idle streams set up with PRIORITY
+    # frames, like browsers do
+    response_str = `nghttp #{uri} --get-assets --dep-idle -n -v`
+    assert_equal 0, $?
+    assert_match "PRIORITY", response_str
+    assert_match "NO_ERROR", response_str
+    assert_no_match(/RST_STREAM/, response_str)
+  end
+
   private
 
   def get(uri, options = {})
@@ -0,0 +1,131 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+
+#include "tls_bench_client.h"
+
+static bool tls_bench_client_from_server(void * data, uint8_t * buf, size_t length)
+{
+  tls_bench_client_t * client = data;
+
+  client->octets_from_server += length;
+
+  if (client->discard) {
+    return true;
+  }
+
+  return BIO_write(client->from_server, buf, length) == (int) length;
+}
+
+tls_server_ctx_t * tls_bench_server_init(struct log_context_t * log, const char * key_file, const char * cert_file)
+{
+  if (!tls_init("h2")) {
+    fprintf(stderr, "Unable to initialize openssl\n");
+    return NULL;
+  }
+
+  tls_server_ctx_t * server_ctx = tls_server_init(log, key_file, cert_file);
+
+  if (!server_ctx) {
+    fprintf(stderr, "Unable to read %s and %s\n", key_file, cert_file);
+    ERR_print_errors_fp(stderr);
+  }
+
+  return server_ctx;
+}
+
+bool tls_bench_client_init(tls_bench_client_t * client, tls_server_ctx_t * server_ctx, buffer_pool_t * read_buffers,
+                           tls_write_to_app_cb write_to_app)
+{
+  client->ssl_ctx = NULL;
+  client->ssl = NULL;
+  client->from_server = NULL;
+  client->to_server = NULL;
+  client->discard = false;
+  client->octets_from_server = 0;
+
+  client->server = tls_client_init(server_ctx, read_buffers, client, tls_bench_client_from_server, write_to_app);
+
+  if (!client->server) {
+    return false;
+  }
+
+  client->ssl_ctx = SSL_CTX_new(TLS_client_method());
+
+  if (!client->ssl_ctx) {
+    return false;
+  }
+
+  // AES-GCM with 128 bit keys, as most browsers pick
+  SSL_CTX_set_cipher_list(client->ssl_ctx, "ECDHE-RSA-AES128-GCM-SHA256");
+  SSL_CTX_set_ciphersuites(client->ssl_ctx, "TLS_AES_128_GCM_SHA256");
+
+  client->ssl = SSL_new(client->ssl_ctx);
+  client->from_server = BIO_new(BIO_s_mem());
+  client->to_server = BIO_new(BIO_s_mem());
+
+  if (!client->ssl || !client->from_server || !client->to_server) {
+    return false;
+  }
+
+  SSL_set_bio(client->ssl, client->from_server, client->to_server);
+  SSL_set_connect_state(client->ssl);
+
+  return true;
+}
+
+bool tls_bench_client_send(tls_bench_client_t * client)
+{
+  uint8_t buf[16384];
+  int length;
+
+  while ((length = BIO_read(client->to_server, buf, sizeof buf)) > 0) {
+    if (!tls_decrypt_data_and_pass_to_app(client->server, buf, length)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool tls_bench_client_handshake(tls_bench_client_t * client)
+{
+  // a full handshake takes two round trips at most
+  for (size_t i = 0; i < 4; i++) {
+    SSL_do_handshake(client->ssl);
+
+    if (!tls_bench_client_send(client)) {
+      break;
+    }
+
+    if (SSL_is_init_finished(client->ssl) && client->server->handshake_complete) {
+      return true;
+    }
+  }
+
+  fprintf(stderr, "Unable to complete the handshake\n");
+  ERR_print_errors_fp(stderr);
+
+  return false;
+}
+
+void tls_bench_client_free(tls_bench_client_t * client)
+{
+  if (client->server) {
+    tls_client_free(client->server);
+  }
+
+  if (client->ssl) {
+    // frees the BIOs too
+    SSL_free(client->ssl);
+  } else {
+    BIO_free(client->from_server);
+    BIO_free(client->to_server);
+  }
+
+  SSL_CTX_free(client->ssl_ctx);
+}
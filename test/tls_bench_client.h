@@ -0,0 +1,63 @@
+#ifndef TLS_BENCH_CLIENT_H
+#define TLS_BENCH_CLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <openssl/ssl.h>
+
+#include "tls.h"
+
+/**
+ * An openssl client connected to the server's side of a connection through
+ * memory BIOs, so that the TLS code can be measured without sockets or a
+ * worker
+ */
+typedef struct {
+
+  SSL_CTX * ssl_ctx;
+  SSL * ssl;
+
+  // ciphertext written by the server, read by the client
+  BIO * from_server;
+  // ciphertext written by the client, passed on to the server
+  BIO * to_server;
+
+  tls_client_ctx_t * server;
+
+  // the server's output is counted and dropped instead of being read by the
+  // client
+  bool discard;
+  size_t octets_from_server;
+
+} tls_bench_client_t;
+
+/**
+ * Reads a key and certificate, e.g. created with:
+ *
+ *   openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj /CN=localhost \
+ *     -keyout key.pem -out cert.pem
+ */
+tls_server_ctx_t * tls_bench_server_init(struct log_context_t * log, const char * key_file, const char * cert_file);
+
+/**
+ * The server's decrypted data goes to write_to_app, with the client as its
+ * data
+ */
+bool tls_bench_client_init(tls_bench_client_t * client, tls_server_ctx_t * server_ctx, buffer_pool_t * read_buffers,
+                           tls_write_to_app_cb write_to_app);
+
+/**
+ * Passes whatever the client has written on to the server
+ */
+bool tls_bench_client_send(tls_bench_client_t * client);
+
+/**
+ * Runs the handshake on both sides, for handshakes that don't run on a
+ * thread pool
+ */
+bool tls_bench_client_handshake(tls_bench_client_t * client);
+
+void tls_bench_client_free(tls_bench_client_t * client);
+
+#endif
@@ -0,0 +1,269 @@
+/**
+ * Measures how much a storm of full handshakes holds up the rest of the loop.
+ * In-memory clients start a handshake every few milliseconds while a 1ms
+ * timer stands in for the work of established streams, and the intervals
+ * between its callbacks are reported - with the server's handshake steps run
+ * on the loop (sync) and on the thread pool (async), e.g.:
+ *
+ *   make tls_handshake_bench
+ *   taskset -c 0 ./bin/tls_handshake_bench key.pem cert.pem [handshakes] [arrival ms]
+ *
+ * The key should be RSA, as the signatures are what hold the loop up.
+ */
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "util/util.h"
+#include "util/log.h"
+#include "util/buffer_pool.h"
+#include "tls.h"
+#include "tls_bench_client.h"
+
+// the same as the worker's read buffers
+#define READ_BUFFER_SIZE 0x10000
+#define READ_BUFFER_MAX_IDLE 16
+
+#define DEFAULT_HANDSHAKES 500
+#define DEFAULT_ARRIVAL_MS 2
+
+// milliseconds
+#define TICK_INTERVAL 1
+
+typedef struct {
+
+  uv_loop_t loop;
+  uv_timer_t arrival_timer;
+  uv_timer_t tick_timer;
+
+  tls_server_ctx_t * server_ctx;
+  buffer_pool_t * read_buffers;
+  bool async;
+
+  tls_bench_client_t * clients;
+  size_t handshakes;
+  size_t started;
+  size_t finished;
+  size_t failed;
+
+  // nanoseconds between tick timer callbacks
+  uint64_t last_tick;
+  uint64_t * intervals;
+  size_t interval_count;
+  size_t interval_capacity;
+
+} storm_t;
+
+static bool ignore_app_data(void * data, uint8_t * buf, size_t length)
+{
+  UNUSED(data);
+  UNUSED(buf);
+  UNUSED(length);
+
+  return true;
+}
+
+static void storm_handshake_done(storm_t * storm, bool success)
+{
+  storm->finished++;
+
+  if (!success) {
+    storm->failed++;
+  }
+
+  if (storm->finished == storm->handshakes) {
+    uv_timer_stop(&storm->tick_timer);
+  }
+}
+
+/**
+ * Runs the client's side of the handshake until it has finished or has to
+ * wait for a server step on the thread pool
+ */
+static void storm_advance(storm_t * storm, tls_bench_client_t * client)
+{
+  // a full handshake takes two round trips at most
+  for (size_t i = 0; i < 4; i++) {
+    SSL_do_handshake(client->ssl);
+
+    if (!tls_bench_client_send(client)) {
+      storm_handshake_done(storm, false);
+      return;
+    }
+
+    if (client->server->handshake_in_progress) {
+      return;
+    }
+
+    if (SSL_is_init_finished(client->ssl) && client->server->handshake_complete) {
+      storm_handshake_done(storm, true);
+      return;
+    }
+  }
+
+  storm_handshake_done(storm, false);
+}
+
+static void storm_handshake_step_finished(void * data, bool success)
+{
+  tls_bench_client_t * client = data;
+  storm_t * storm = client->server->loop->data;
+
+  if (!success) {
+    storm_handshake_done(storm, false);
+    return;
+  }
+
+  storm_advance(storm, client);
+}
+
+static void storm_arrival(uv_timer_t * timer)
+{
+  storm_t * storm = timer->data;
+  tls_bench_client_t * client = &storm->clients[storm->started++];
+
+  if (storm->started == storm->handshakes) {
+    uv_timer_stop(timer);
+  }
+
+  if (!tls_bench_client_init(client, storm->server_ctx, storm->read_buffers, ignore_app_data)) {
+    storm_handshake_done(storm, false);
+    return;
+  }
+
+  if (storm->async) {
+    tls_client_enable_async_handshake(client->server, &storm->loop, storm_handshake_step_finished);
+  }
+
+  storm_advance(storm, client);
+}
+
+static void storm_tick(uv_timer_t * timer)
+{
+  storm_t * storm = timer->data;
+  uint64_t now = uv_hrtime();
+
+  if (storm->interval_count < storm->interval_capacity) {
+    storm->intervals[storm->interval_count++] = now - storm->last_tick;
+  }
+
+  storm->last_tick = now;
+}
+
+static int compare_intervals(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static bool storm_run(storm_t * storm, uint64_t arrival_ms)
+{
+  storm->started = 0;
+  storm->finished = 0;
+  storm->failed = 0;
+  storm->interval_count = 0;
+
+  uv_loop_init(&storm->loop);
+  storm->loop.data = storm;
+
+  uv_timer_init(&storm->loop, &storm->arrival_timer);
+  storm->arrival_timer.data = storm;
+  uv_timer_init(&storm->loop, &storm->tick_timer);
+  storm->tick_timer.data = storm;
+
+  uv_update_time(&storm->loop);
+  storm->last_tick = uv_hrtime();
+  uv_timer_start(&storm->tick_timer, storm_tick, TICK_INTERVAL, TICK_INTERVAL);
+  uv_timer_start(&storm->arrival_timer, storm_arrival, arrival_ms, arrival_ms);
+
+  uv_run(&storm->loop, UV_RUN_DEFAULT);
+
+  // the handshakes have finished, so nothing is left on the thread pool
+  for (size_t i = 0; i < storm->started; i++) {
+    tls_bench_client_free(&storm->clients[i]);
+  }
+
+  uv_close((uv_handle_t *) &storm->arrival_timer, NULL);
+  uv_close((uv_handle_t *) &storm->tick_timer, NULL);
+  uv_run(&storm->loop, UV_RUN_DEFAULT);
+  uv_loop_close(&storm->loop);
+
+  if (storm->interval_count == 0) {
+    fprintf(stderr, "The timer never ran\n");
+    return false;
+  }
+
+  qsort(storm->intervals, storm->interval_count, sizeof(uint64_t), compare_intervals);
+
+  uint64_t p50 = storm->intervals[storm->interval_count / 2];
+  uint64_t p99 = storm->intervals[storm->interval_count * 99 / 100];
+  uint64_t max = storm->intervals[storm->interval_count - 1];
+
+  printf("  %-5s: %zu failed, p50 timer interval %.1fms, p99 %.1fms, max %.1fms\n", storm->async ? "async" : "sync",
+         storm->failed, p50 / 1e6, p99 / 1e6, max / 1e6);
+
+  return storm->failed == 0;
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <key file> <cert file> [handshakes] [arrival ms]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  size_t handshakes = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_HANDSHAKES;
+  uint64_t arrival_ms = argc > 4 ? strtoull(argv[4], NULL, 10) : DEFAULT_ARRIVAL_MS;
+
+  if (handshakes == 0 || arrival_ms == 0) {
+    fprintf(stderr, "Both the handshakes and their interval must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  struct log_context_t log;
+  log_context_init(&log, "tls_handshake_bench", stderr, LOG_ERROR, true);
+
+  tls_server_ctx_t * server_ctx = tls_bench_server_init(&log, argv[1], argv[2]);
+
+  if (!server_ctx) {
+    return EXIT_FAILURE;
+  }
+
+  buffer_pool_t read_buffers;
+  buffer_pool_init(&read_buffers, READ_BUFFER_SIZE, READ_BUFFER_MAX_IDLE);
+
+  storm_t storm;
+  storm.server_ctx = server_ctx;
+  storm.read_buffers = &read_buffers;
+  storm.handshakes = handshakes;
+  storm.clients = calloc(handshakes, sizeof(tls_bench_client_t));
+  // ticks keep coming for a while after the last arrival
+  storm.interval_capacity = (handshakes * arrival_ms + 1000) * 4 / TICK_INTERVAL;
+  storm.intervals = malloc(storm.interval_capacity * sizeof(uint64_t));
+
+  if (!storm.clients || !storm.intervals) {
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu handshakes arriving every %" PRIu64 "ms, %dms timer\n", handshakes, arrival_ms, TICK_INTERVAL);
+
+  storm.async = false;
+  bool success = storm_run(&storm, arrival_ms);
+  storm.async = true;
+  success = storm_run(&storm, arrival_ms) && success;
+
+  free(storm.clients);
+  free(storm.intervals);
+  buffer_pool_free(&read_buffers);
+  tls_server_free(server_ctx);
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,150 @@
+/**
+ * Measures the allocations made on the TLS read paths. An in-memory client
+ * sends small records, and the server decrypts each one and echoes it back,
+ * e.g.:
+ *
+ *   make tls_read_bench
+ *   ./bin/tls_read_bench key.pem cert.pem [round trips] [record size]
+ *
+ * Allocations are counted by wrapping malloc at link time, so only prism's
+ * own are counted - not openssl's.
+ */
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "util/log.h"
+#include "util/buffer_pool.h"
+#include "tls.h"
+#include "tls_bench_client.h"
+
+// the same as the worker's read buffers
+#define READ_BUFFER_SIZE 0x10000
+#define READ_BUFFER_MAX_IDLE 16
+
+#define DEFAULT_ROUND_TRIPS 20000
+#define DEFAULT_RECORD_SIZE 50
+
+static size_t allocations;
+static size_t allocated_octets;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+  allocations++;
+  allocated_octets += size;
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size)
+{
+  allocations++;
+  allocated_octets += count * size;
+  return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+  allocations++;
+  allocated_octets += size;
+  return __real_realloc(ptr, size);
+}
+
+static bool echo(void * data, uint8_t * buf, size_t length)
+{
+  tls_bench_client_t * client = data;
+
+  return tls_encrypt_data_and_pass_to_network(client->server, buf, length);
+}
+
+static double cpu_ms(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+  return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <key file> <cert file> [round trips] [record size]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  size_t round_trips = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_ROUND_TRIPS;
+  size_t record_size = argc > 4 ? strtoul(argv[4], NULL, 10) : DEFAULT_RECORD_SIZE;
+
+  struct log_context_t log;
+  log_context_init(&log, "tls_read_bench", stderr, LOG_ERROR, true);
+
+  tls_server_ctx_t * server_ctx = tls_bench_server_init(&log, argv[1], argv[2]);
+
+  if (!server_ctx) {
+    return EXIT_FAILURE;
+  }
+
+  buffer_pool_t read_buffers;
+  buffer_pool_init(&read_buffers, READ_BUFFER_SIZE, READ_BUFFER_MAX_IDLE);
+
+  tls_bench_client_t client;
+
+  if (!tls_bench_client_init(&client, server_ctx, &read_buffers, echo) || !tls_bench_client_handshake(&client)) {
+    return EXIT_FAILURE;
+  }
+
+  uint8_t * record = malloc(record_size);
+  uint8_t * echoed = malloc(record_size);
+  memset(record, 'x', record_size);
+
+  // only the round trips are counted, not the handshake
+  allocations = 0;
+  allocated_octets = 0;
+  double start = cpu_ms();
+
+  for (size_t i = 0; i < round_trips; i++) {
+    if (SSL_write(client.ssl, record, record_size) != (int) record_size || !tls_bench_client_send(&client)) {
+      fprintf(stderr, "Round trip %zu: unable to send\n", i);
+      return EXIT_FAILURE;
+    }
+
+    size_t received = 0;
+
+    while (received < record_size) {
+      int length = SSL_read(client.ssl, echoed + received, record_size - received);
+
+      if (length <= 0) {
+        fprintf(stderr, "Round trip %zu: nothing echoed\n", i);
+        return EXIT_FAILURE;
+      }
+
+      received += length;
+    }
+  }
+
+  double cpu = cpu_ms() - start;
+  size_t counted = allocations;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%zu round trips of %zu octet records\n", round_trips, record_size);
+  printf("  allocations: %zu (%.1f MiB requested)\n", counted, allocated_octets / 1048576.0);
+  printf("  cpu: %.0f ms\n", cpu);
+  printf("  max rss: %.1f MiB\n", usage.ru_maxrss / 1024.0);
+
+  free(record);
+  free(echoed);
+  tls_bench_client_free(&client);
+  buffer_pool_free(&read_buffers);
+  tls_server_free(server_ctx);
+
+  return EXIT_SUCCESS;
+}
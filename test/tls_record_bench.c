@@ -0,0 +1,174 @@
+/**
+ * Compares encrypting every buffer the http layer flushes on its own (as
+ * app_write_cb used to) with collecting a loop iteration's output with
+ * tls_client_write and encrypting it once with tls_client_flush, e.g.:
+ *
+ *   make tls_record_bench
+ *   ./bin/tls_record_bench key.pem cert.pem
+ *
+ * The write patterns stand in for an h2 download, pipelined http/1.1
+ * responses and several small h2 streams. Full size records are used
+ * throughout, and the server's output is counted rather than decrypted.
+ */
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util/util.h"
+#include "util/log.h"
+#include "util/buffer_pool.h"
+#include "tls.h"
+#include "tls_bench_client.h"
+
+// the same as the worker's read buffers
+#define READ_BUFFER_SIZE 0x10000
+#define READ_BUFFER_MAX_IDLE 16
+
+#define MAX_WRITES 128
+
+/**
+ * The writes the http layer makes in one loop iteration
+ */
+typedef struct {
+
+  const char * name;
+  size_t lengths[MAX_WRITES];
+  size_t count;
+  size_t iterations;
+
+} write_pattern_t;
+
+static bool ignore_app_data(void * data, uint8_t * buf, size_t length)
+{
+  UNUSED(data);
+  UNUSED(buf);
+  UNUSED(length);
+
+  return true;
+}
+
+static double cpu_ms(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+  return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/**
+ * Writes each length in turn, count times, with headers and bodies alternating
+ */
+static void pattern_add(write_pattern_t * pattern, size_t count, size_t header_length, size_t body_length)
+{
+  for (size_t i = 0; i < count && pattern->count + 2 <= MAX_WRITES; i++) {
+    pattern->lengths[pattern->count++] = header_length;
+    pattern->lengths[pattern->count++] = body_length;
+  }
+}
+
+static bool run(tls_bench_client_t * client, tls_server_ctx_t * server_ctx, uint8_t * payload,
+                write_pattern_t * pattern, bool batched)
+{
+  size_t records_before = server_ctx->records_written;
+  size_t octets_before = server_ctx->record_octets_written;
+  size_t wire_before = client->octets_from_server;
+  double start = cpu_ms();
+
+  for (size_t i = 0; i < pattern->iterations; i++) {
+    for (size_t j = 0; j < pattern->count; j++) {
+      bool success = batched ? tls_client_write(client->server, payload, pattern->lengths[j]) :
+                     tls_encrypt_data_and_pass_to_network(client->server, payload, pattern->lengths[j]);
+
+      if (!success) {
+        fprintf(stderr, "%s: unable to encrypt\n", pattern->name);
+        return false;
+      }
+    }
+
+    if (batched && !tls_client_flush(client->server)) {
+      fprintf(stderr, "%s: unable to flush\n", pattern->name);
+      return false;
+    }
+  }
+
+  double cpu = cpu_ms() - start;
+  size_t records = server_ctx->records_written - records_before;
+  size_t octets = server_ctx->record_octets_written - octets_before;
+  size_t wire = client->octets_from_server - wire_before;
+
+  printf("  %-26s %-9s  records %6.1f  octets/record %7.1f  overhead %5.2f%%  cpu/MiB %5.2f ms\n", pattern->name,
+         batched ? "batched" : "per-write", (double) records / pattern->iterations, (double) octets / records,
+         100.0 * (wire - octets) / octets, cpu / (octets / 1048576.0));
+
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <key file> <cert file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct log_context_t log;
+  log_context_init(&log, "tls_record_bench", stderr, LOG_ERROR, true);
+
+  tls_server_ctx_t * server_ctx = tls_bench_server_init(&log, argv[1], argv[2]);
+
+  if (!server_ctx) {
+    return EXIT_FAILURE;
+  }
+
+  // dynamic record sizing would only muddy the comparison
+  tls_server_set_record_sizing(server_ctx, 0, 0, 0);
+
+  buffer_pool_t read_buffers;
+  buffer_pool_init(&read_buffers, READ_BUFFER_SIZE, READ_BUFFER_MAX_IDLE);
+
+  tls_bench_client_t client;
+
+  if (!tls_bench_client_init(&client, server_ctx, &read_buffers, ignore_app_data) ||
+      !tls_bench_client_handshake(&client)) {
+    return EXIT_FAILURE;
+  }
+
+  client.discard = true;
+
+  write_pattern_t patterns[3] = {
+    // 1MiB in 16KiB DATA frames - each frame header is flushed from h2's
+    // buffer and then the payload is written
+    { .name = "h2 1MiB download", .iterations = 400 },
+    // 32 small responses, each written as headers and then a body
+    { .name = "h1 32 pipelined responses", .iterations = 20000 },
+    // 16 streams, each a HEADERS frame and 1KiB of DATA
+    { .name = "h2 16 streams x 1KiB", .iterations = 20000 },
+  };
+  pattern_add(&patterns[0], 64, 9, 16384);
+  pattern_add(&patterns[1], 32, 180, 320);
+  pattern_add(&patterns[2], 16, 9 + 40, 9 + 1024);
+
+  uint8_t * payload = malloc(16384);
+
+  if (!payload) {
+    return EXIT_FAILURE;
+  }
+
+  memset(payload, 'x', 16384);
+
+  bool success = true;
+
+  for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]) && success; i++) {
+    success = run(&client, server_ctx, payload, &patterns[i], false) &&
+              run(&client, server_ctx, payload, &patterns[i], true);
+  }
+
+  free(payload);
+  tls_bench_client_free(&client);
+  buffer_pool_free(&read_buffers);
+  tls_server_free(server_ctx);
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}